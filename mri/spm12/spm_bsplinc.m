@@ -1,16 +1,25 @@
 function varargout = spm_bsplinc(varargin)
 % Return volume of B-spline coefficients - a compiled routine
-% FORMAT c = spm_bsplinc(V,d)
+% FORMAT c = spm_bsplinc(V,d,cls)
 %   V - a structure of image volume information (from spm_vol) - or a
 %       double precision floating point array.
 %   d(1:3) - degree of B-spline (from 0 to 7) along different dimensions
 %       d(4:6) - 1/0 to indicate wrapping along the dimensions
+%   cls - class of the returned coefficients: 'double' (default) or
+%       'single'
 %   c - returned volume of B-spline coefficients
 %
 % This function deconvolves B-splines from volume V, returning
 % coefficients, c.  These coefficients are then passed to spm_bsplins
 % in order to sample the data using B-spline interpolation.
 %
+% Each 1D deconvolution is done in double precision.  Requesting
+% 'single' coefficients halves the memory needed to keep them, but the
+% volume deconvolved along the first two dimensions is then also stored
+% in single precision before the third dimension is done.  Compared with
+% rounding double precision coefficients to single, this roughly doubles
+% the worst case error (and increases the RMS error by about 40%).
+%
 %_______________________________________________________________________
 %
 % References:
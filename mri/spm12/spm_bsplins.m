@@ -1,7 +1,10 @@
 function varargout = spm_bsplins(varargin)
 % Sample a volume using B-spline interpolation - a compiled routine
 % FORMAT [f,dfx,dfy,dfz] = spm_bsplins(c,x,y,z,d)
-%   c - volume of B-spline coefficients (from spm_bsplinc)
+%   c - volume of B-spline coefficients (from spm_bsplinc), either
+%       double or single precision.  This may also be a 4D array of
+%       coefficients from several volumes of the same dimensions, which
+%       are all sampled at the same points.
 %   x,y,z - co-ordinates of sampled points
 %       d(1:3) - degree of B-spline (from 0 to 7) along different dimensions
 %                - these must be same as used by spm_bsplinc
@@ -9,8 +12,18 @@ function varargout = spm_bsplins(varargin)
 %   f - sampled data
 %   dfx,dfy,dfz - sampled first derivatives
 %
+% When c is 4D, f (and dfx,dfy,dfz) have an extra dimension for the
+% volumes, so that sampling N points from c(:,:,:,1:M) gives an NxM
+% array.  The B-spline weights are computed once for each point and
+% used for all the volumes, which is faster than sampling each volume
+% separately, but gives identical results.  For example:
+%   c = cat(4,spm_bsplinc(V(1),d),spm_bsplinc(V(2),d));
+%   f = spm_bsplins(c,x,y,z,d);
+%
 % This function takes B-spline basis coefficients from spm_bsplinc,
 % and re-convolves them with B-splines centred at the new sample points.
+% Single precision coefficients are accumulated in double precision, and
+% the sampled data are always returned as double.
 %
 % Note that nearest neighbour interpolation is used instead of 0th
 % degree B-splines, and the derivatives of trilinear interpolation are
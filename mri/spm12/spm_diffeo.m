@@ -37,7 +37,8 @@ function varargout = spm_diffeo(varargin)
 %
 % Convert a velocity field to a momentum field by u = A*v, where
 % A is the large sparse matrix encoding some form of regularisation.
-% v and m are single precision floating point.
+% v and m are single precision floating point, or both uint16 half
+% precision (see 'pack16').
 %
 %_______________________________________________________________________
 %
@@ -55,6 +56,12 @@ function varargout = spm_diffeo(varargin)
 % v = inv(A)*g
 % g and v are both single precision floating point.
 %
+% With circulant boundary conditions, the equations are instead solved
+% exactly by Fourier methods (as in spm_shoot_greens), in which case the
+% last two parameters are ignored.  The Fourier transform of the
+% differential operator is computed by the first call, and kept for
+% later calls with the same dimensions and regularisation settings.
+%
 %_______________________________________________________________________
 %
 % FORMAT v = spm_diffeo('fmg',H, g, param)
@@ -78,15 +85,23 @@ function varargout = spm_diffeo(varargin)
 % v     - the solution
 % H     - parameterisation of 2nd derivatives
 % g     - parameterisation of first derivatives
-% param - 10 parameters (settings)
+% param - 10 or 12 parameters (settings)
 %         - [1][2][3] Voxel sizes
 %         - [4][5][6][7][8] Regularisation settings (see vel2mom).
 %         - [9] Tolerance.  Indicates required degree of accuracy.
 %         - [10] Maximum number of iterations.
+%         - [11] Preconditioner (optional)
+%                0 - none (default)
+%                1 - inverse of the 3x3 blocks on the diagonal of A+H
+%                2 - one V-cycle of the Full Multigrid solver
+%         - [12] Number of relaxation iterations per grid of the
+%                V-cycle (optional).
 %
 % This is for solving a set of equations using a conjugate gradient
-% solver. This method is less efficient than the Full Multigrid, and
-% is included for illustrative purposes.
+% solver. Without a preconditioner, this method is less efficient than
+% the Full Multigrid.  With the multigrid preconditioner, it usually
+% needs only a few iterations to reach tolerances that would require
+% many Full Multigrid cycles.
 % v = inv(A+H)*g
 % H, g and v are all single precision floating point.
 %
@@ -106,7 +121,14 @@ function varargout = spm_diffeo(varargin)
 % y3     - deformation field field n1*n2*n3*3.
 %
 % Composition of two deformations y3 = y1(y2)
-% y1, y2 and y3 are single precision floating point.
+% y1, y2 and y3 are single precision floating point, or all uint16 half
+% precision displacements (see 'pack16').  For the latter, the
+% displacements of y1 are interpolated, so there is no need to unwrap
+% the result.  With Neumann boundaries, points that y2 maps outside the
+% field of view of y1 are treated as by the single precision version.
+% However, that version is discontinuous where y2 points more than a
+% voxel outside, so rounding y2 to 16 bits may change the result there
+% by up to a few voxels (see the accuracy figures under 'pack16').
 %
 %
 % FORMAT [y3,J3] = spm_diffeo('comp', y1, y2, J1, J2)
@@ -118,6 +140,16 @@ function varargout = spm_diffeo(varargin)
 % Composition of two deformations, with their Jacobian fields.
 % All fields are single precision floating point.
 %
+% FORMAT spm_diffeo('comp', y1, y2, y3f)
+% y1, y2 - deformation fields, or FLOAT32 file_arrays of size
+%          n1*n2*n3*1*3 containing the deformations
+% y3f    - FLOAT32 file_array of size n1*n2*n3*1*3, to which y1(y2)
+%          is written
+%
+% The result is computed and written a slab of slices of y2 at a time,
+% and only those slices of y1 that the slab needs are read, so the
+% memory needed does not depend on the number of slices.
+%
 %_______________________________________________________________________
 %
 % FORMAT iy = spm_diffeo('invdef',y,d,M1,M2);
@@ -129,6 +161,9 @@ function varargout = spm_diffeo(varargin)
 % M2 - An affine mapping from voxels to mm in the co-ordinate
 %      system of the forward deformation field.
 %
+% y may also be a FLOAT32 file_array of size n1*n2*n3*1*3, which is
+% read a slab of slices at a time.  iy is still held in memory.
+%
 % Inversion of a deformation field.
 %
 % The field is assumed to consist of a piecewise affine transformations,
@@ -204,7 +239,18 @@ function varargout = spm_diffeo(varargin)
 %
 % Sample a function according to a deformation using trilinear interp.
 % f2 = f1(y)
-% f1, f2 and y are single precision floating point.
+% f1, f2 and y are single precision floating point.  Either f1 or y (or
+% both) may instead be uint16 half precision (see 'pack16'), in which
+% case f2 has the same class as f1.
+%
+% FORMAT spm_diffeo('samp', f1, y, f2f)
+% f1  - input image(s), or a FLOAT32 file_array containing them
+% y   - deformation, or a FLOAT32 file_array of size n1*n2*n3*1*3
+% f2f - FLOAT32 file_array of size n1*n2*n3*n4, to which f1(y) is
+%       written
+%
+% As for comp, the memory needed does not depend on the number of
+% slices.
 %
 %_______________________________________________________________________
 %
@@ -215,7 +261,12 @@ function varargout = spm_diffeo(varargin)
 %
 % Push values of a function according to a deformation.  Note that the
 % deformation should be the inverse of the one used with 'samp' or 'bsplins'.
-% f1, f2 and y are single precision floating point.
+% f1, f2 and y are single precision floating point, although f1 and y
+% may instead be uint16 half precision (see 'pack16').
+%
+% f1 and y may also be FLOAT32 file_arrays (for example, of size
+% n1*n2*n3*n4 and n1*n2*n3*1*3), which are read a slab of slices at a
+% time.  f2 is still held in memory.
 %
 %_______________________________________________________________________
 %
@@ -226,7 +277,8 @@ function varargout = spm_diffeo(varargin)
 %
 % Push values of a function according to a deformation, but using
 % circulant boundary conditions.  Data wraps around.
-% f1, f2 and y are single precision floating point.
+% f1, f2 and y are single precision floating point, although f1 and y
+% may instead be uint16 half precision (see 'pack16').
 %
 %_______________________________________________________________________
 %
@@ -274,6 +326,20 @@ function varargout = spm_diffeo(varargin)
 %
 % Compute Jacobian tensors from a deformation.
 %
+% FORMAT J = spm_diffeo('def2jac',y,k)
+% k - Slice number (1..size(y,3))
+% J - Jacobian tensors of slice k of y
+%
+% FORMAT spm_diffeo('def2jac',y,Jf)
+% y  - Deformation field, or a FLOAT32 file_array of size
+%      n1*n2*n3*1*3 containing the deformation
+% Jf - FLOAT32 file_array of size n1*n2*n3*3*3, to which
+%      the Jacobian tensors are written
+%
+% The Jacobians are computed and written a slab of slices at a
+% time, so the memory needed does not depend on the number of
+% slices.
+%
 %_______________________________________________________________________
 %
 % FORMAT J = spm_diffeo('def2det',y)
@@ -282,6 +348,11 @@ function varargout = spm_diffeo(varargin)
 %
 % Compute Jacobian determinants from a deformation.
 %
+% FORMAT j = spm_diffeo('def2det',y,k)
+% FORMAT spm_diffeo('def2det',y,jf)
+% As for def2jac, but for Jacobian determinants, which are written
+% to a FLOAT32 file_array jf of size n1*n2*n3.
+%
 %_______________________________________________________________________
 %
 % FORMAT j = spm_diffeo('det',J)
@@ -368,6 +439,30 @@ function varargout = spm_diffeo(varargin)
 %
 %_______________________________________________________________________
 %
+% FORMAT [V,ll,t] = spm_diffeo('dartel_batch',V,G,f,param)
+% V     - flow fields of N subjects n1*n2*n3*3*N (single precision float)
+% G     - images of N subjects n1*n2*n3*n4*N (single precision float)
+% f     - template n1*n2*n3*n4 (single precision float)
+% param - 10 parameters (settings), as for spm_diffeo('dartel',...)
+% ll    - 3*N matrix of the log-likelihoods etc (as for 'dartel') of
+%         each subject
+% t     - sums over subjects of the images pushed into the space of
+%         the template, followed by the sum of the pushed voxel counts
+%         n1*n2*n3*(n4+1)
+%
+% This performs a single iteration of the Dartel optimisation for each
+% of a number of subjects, which are all matched to the same template.
+% The updated flow field of each subject is then exponentiated, and the
+% subject's images pushed by the resulting deformation.  The results
+% are the same as for calling spm_diffeo('dartel',v,g,f,param),
+% spm_diffeo('Exp',v,[K 1 1]) and spm_diffeo('push',g,y) for each
+% subject in turn, and summing the pushed images (see
+% spm_dartel_template.m).
+% When compiled with OpenMP, subjects are processed in parallel, with
+% each thread needing its own scratch memory.
+%
+%_______________________________________________________________________
+%
 % FORMAT [y,J] = spm_diffeo('Exp', v, param)
 % v - flow field
 % J - Jacobian. Usually a tensor field of Jacobian matrices, but can
@@ -386,6 +481,107 @@ function varargout = spm_diffeo(varargin)
 %
 %_______________________________________________________________________
 %
+% FORMAT h = spm_diffeo('pack16', f)
+% FORMAT h = spm_diffeo('pack16', y, 1)
+% FORMAT f = spm_diffeo('unpack16', h)
+% FORMAT y = spm_diffeo('unpack16', h, 1)
+% f - single precision field (e.g. a velocity field or image).
+% y - single precision deformation field n1*n2*n3*3.
+% h - the same, held in 16 bits, as uint16.
+%
+% Convert fields to and from 16 bit storage, which halves the memory
+% they need.  Deformations (flagged by the second argument) are stored
+% as displacements from the identity, as these are much smaller than
+% the absolute coordinates.  'vel2mom', 'comp', 'samp', 'push' and
+% 'pushc' accept uint16 data as described above, and convert them to
+% single precision as they are used, so the arithmetic itself is still
+% done in single (or double) precision.
+%
+% FORMAT fmt = spm_diffeo('halfformat')
+% FORMAT spm_diffeo('halfformat',fmt)
+% fmt - format of the uint16 data.
+%       0 - IEEE half precision (default).  11 bit significand, so
+%           relative errors of up to 4.9e-4, but values above 65504
+%           become Inf.
+%       1 - bfloat16.  The range of single precision, but an 8 bit
+%           significand, so relative errors of up to 3.9e-3.
+% The format is reset to 0 after a `clear functions' in MATLAB.  The
+% same format should be used for packing and unpacking.
+%
+% Accuracy against the single precision versions, checked with smooth
+% displacements and velocities of up to 4 voxels (37x41x29 voxels), when
+% all the inputs are packed:
+%                             circulant           Neumann
+%                          fp16    bfloat16    fp16    bfloat16
+%   'comp' (voxels)        8.5e-3  6.7e-2      2.0     2.0      (1)
+%     - inside the FOV     3.6e-3  3.1e-2      3.6e-3  3.1e-2   (1)
+%   'samp' (relative)      9.1e-4  8.4e-3      1.7e-1  2.5e-1   (1)
+%     - inside the FOV     5.9e-4  4.2e-3      5.9e-4  4.2e-3   (1)
+%   'push' (relative)      3.1e-4  2.5e-3      3.1e-4  2.5e-3   (2)
+%   'vel2mom' (relative)   6.2e-4  5.8e-3      2.5e-2  2.3e-1   (3)
+% (1) Largest error, over all voxels, or only over those that y2 (for
+%     'comp') or y (for 'samp') maps inside the field of view.  Outside
+%     it, the Neumann figures reflect the discontinuity described under
+%     'comp', rather than any inaccuracy of the packed versions.
+% (2) RMS error.
+% (3) Largest error, relative to the largest value of the result.  The
+%     absolute errors are the same for both boundary conditions, but the
+%     momentum of the smooth test field is 40 times smaller with Neumann
+%     boundaries (without the jumps at the edges of a circulant field).
+% Given the same (packed) inputs, 'samp', 'push', 'pushc' and 'vel2mom'
+% give the same results as unpacking, calling the single precision
+% version and (for 'samp' and 'vel2mom') packing the result.  To repeat
+% such a check on your own data:
+%   u1 = spm_diffeo('vel2mom', v, prm);
+%   u2 = spm_diffeo('unpack16', spm_diffeo('vel2mom', spm_diffeo('pack16', v), prm));
+%   max(abs(u1(:)-u2(:)))/max(abs(u1(:)))
+%
+%_______________________________________________________________________
+%
+% FORMAT [nbytes,nbuf] = spm_diffeo('memory')
+% nbytes - amount of scratch memory (in bytes) held between calls.
+% nbuf   - number of scratch buffers that this is divided into.
+%
+% The scratch space used by 'fmg', 'mom2vel', 'cgs', 'dartel' and 'Exp'
+% is kept after each call, so that it can be reused by later calls with
+% data of the same (or smaller) size.  This also includes the Fourier
+% transform of the differential operator kept by 'mom2vel'.
+%
+%_______________________________________________________________________
+%
+% FORMAT spm_diffeo('telemetry',on)
+% Switch recording of solver telemetry on (1) or off (0).  It is off by
+% default, and after a `clear functions' in MATLAB.
+%
+% FORMAT T = spm_diffeo('telemetry')
+% Return the telemetry of the most recent call.  T is a structure with
+% fields:
+%   time          - wall time of the call (seconds).
+%   grids         - dimensions of each grid of the multigrid hierarchy
+%                   (finest first), one row per grid.
+%   sweeps        - number of relaxation sweeps done on each grid.
+%   relax_time    - time spent relaxing on each grid.
+%   restrict_time - time spent restricting from each grid to the next
+%                   coarser one.
+%   prolong_time  - time spent prolongating from the next coarser grid
+%                   to each grid.
+%   cycles        - one row per V-cycle: [finest grid, time, residual norm].
+%   residuals     - one row per grid visited on the way down a V-cycle:
+%                   [cycle, grid, residual norm].
+%   cg            - residual norm after each conjugate gradient iteration.
+%   objective     - [match regularisation prior] terms of the objective
+%                   function at each 'dartel' iteration.
+% Residual norms are root sum of squares over the whole grid.  The
+% timings are only meaningful for the solvers ('fmg', 'cgs', 'dartel').
+%
+%_______________________________________________________________________
+%
+% FORMAT spm_diffeo('release')
+% Free the scratch memory that is held between calls.  This is also
+% done by a `clear functions' in MATLAB.
+%
+%_______________________________________________________________________
+%
 % Note that the boundary conditions are circulant throughout.
 % Interpolation is trilinear, except for the resize function
 % which uses a 2nd degree B-spline (without first deconvolving).
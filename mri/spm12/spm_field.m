@@ -64,6 +64,28 @@ function varargout = spm_field(varargin)
 % FORMAT spm_field('boundary',b)
 % Set the boundary condition.
 % b - boundary condition (0 or 1, see above). 
+% _______________________________________________________________________
+%
+% FORMAT [nbytes,nbuf] = spm_field('memory')
+% nbytes - amount of scratch memory (in bytes) held between calls.
+% nbuf   - number of scratch buffers that this is divided into.
+%
+% The scratch space used by 'fmg' is kept after each call, so that it
+% can be reused by later calls with data of the same (or smaller) size.
+% _______________________________________________________________________
+%
+% FORMAT spm_field('telemetry',on)
+% Switch recording of solver telemetry on (1) or off (0).
+%
+% FORMAT T = spm_field('telemetry')
+% Return the multigrid telemetry of the most recent call.  See
+% spm_diffeo('telemetry') for the fields of T (cg and objective are
+% always empty here).
+% _______________________________________________________________________
+%
+% FORMAT spm_field('release')
+% Free the scratch memory that is held between calls.  This is also
+% done by a `clear functions' in MATLAB.
 %_______________________________________________________________________
 % Copyright (C) 2012 Wellcome Trust Centre for Neuroimaging
 
@@ -27,11 +27,7 @@
 #include "mex.h"
 #include <stdlib.h>
 #include <math.h>
-#ifdef IMAGE_SINGLE
-#define IMAGE_DTYPE float
-#else
-#define IMAGE_DTYPE double
-#endif
+#include "bsplines.h"
 
 /***************************************************************************************
 Starting periodic boundary condition based on Eq. 2.6 of Unser's 2nd 1993 paper.
@@ -268,6 +264,149 @@ void splinc_mirror(IMAGE_DTYPE c[], int m, double p[], int np)
     }
 }
 
+/***************************************************************************************
+Versions of the above that filter n vectors in lockstep.  The vectors are
+interleaved, so that element i of vector l is c[i*n+l], which allows the
+inner loops over vectors to be vectorised.  Each vector is filtered using
+exactly the same sequence of operations as by splinc_wrap or splinc_mirror.
+    c - original vectors on input, coefficients on output
+    m - length of each vector
+    n - number of vectors (no more than SPLINC_NLINES)
+    p - poles (polynomial roots)
+    np - number of poles
+*/
+static void cc_wrap_n(IMAGE_DTYPE c[], int m, int n, double p, double s[])
+{
+    double pi;
+    int    i, l, m1;
+
+    m1 = ceil(-30/log(fabs(p)));
+    if (m1>m) m1=m;
+
+    pi = p;
+    for (l=0; l<n; l++) s[l] = c[l];
+    for (i=1; i<m1; i++)
+    {
+        IMAGE_DTYPE *ci = c+(m-i)*n;
+        for (l=0; l<n; l++) s[l] += pi*ci[l];
+        pi *= p;
+    }
+    for (l=0; l<n; l++) s[l] = s[l]/(1.0-pi);
+}
+
+static void cc_mirror_n(IMAGE_DTYPE c[], int m, int n, double p, double s[])
+{
+    double pi, p2i, ip;
+    int    i, l, m1;
+
+    m1 = ceil(-30/log(fabs(p)));
+    if (m1 < m)
+    {
+        pi = p;
+        for (l=0; l<n; l++) s[l] = c[l];
+        for (i=1; i<m1; i++)
+        {
+            IMAGE_DTYPE *ci = c+i*n;
+            for (l=0; l<n; l++) s[l] += pi*ci[l];
+            pi *= p;
+        }
+    }
+    else
+    {
+        IMAGE_DTYPE *ce = c+(m-1)*n;
+        pi   = p;
+        ip   = 1.0/p;
+        p2i  = pow(p,m-1.0);
+        for (l=0; l<n; l++) s[l] = c[l] + p2i*ce[l];
+        p2i *= p2i * ip;
+        for (i=1; i<m-1; i++)
+        {
+            IMAGE_DTYPE *ci = c+i*n;
+            for (l=0; l<n; l++) s[l] += (pi+p2i)*ci[l];
+            pi  *= p;
+            p2i *= ip;
+        }
+        for (l=0; l<n; l++) s[l] = s[l]/(1.0-pi*pi);
+    }
+}
+
+static void icc_wrap_n(IMAGE_DTYPE c[], int m, int n, double p, double s[])
+{
+    double pi;
+    int    i, l, m1;
+    IMAGE_DTYPE *ce = c+(m-1)*n;
+
+    m1 = ceil(-30/log(fabs(p)));
+    if (m1>m) m1=m;
+
+    pi = p;
+    for (l=0; l<n; l++) s[l] = pi*ce[l];
+    for (i=0; i<m1-1; i++)
+    {
+        IMAGE_DTYPE *ci = c+i*n;
+        pi  *= p;
+        for (l=0; l<n; l++) s[l] += pi*ci[l];
+    }
+    for (l=0; l<n; l++) s[l] = s[l]/(pi-1.0);
+}
+
+static void icc_mirror_n(IMAGE_DTYPE c[], int m, int n, double p, double s[])
+{
+    int l;
+    IMAGE_DTYPE *ce = c+(m-1)*n, *cf = c+(m-2)*n;
+    for (l=0; l<n; l++) s[l] = (p/(p*p-1.0))*(p*cf[l]+ce[l]);
+}
+
+static void splinc_n(IMAGE_DTYPE c[], int m, int n, double p[], int np,
+    void (*cc)(), void (*icc)())
+{
+    double lambda, s[SPLINC_NLINES];
+    int i, k, l;
+
+    if (m == 1) return;
+
+    /* compute gain and apply it */
+    lambda = gain(p,np);
+    for (i = 0; i < m*n; i++)
+        c[i] *= lambda;
+
+    /* loop over poles */
+    for (k = 0; k < np; k++)
+    {
+        double pp = p[k];
+        IMAGE_DTYPE *cp;
+
+        cc(c, m, n, pp, s);
+        for (l=0; l<n; l++) c[l] = s[l];
+
+        for (i=1; i<m; i++)
+        {
+            cp = c+i*n;
+            for (l=0; l<n; l++) cp[l] += pp*cp[l-n];
+        }
+
+        icc(c, m, n, pp, s);
+        cp = c+(m-1)*n;
+        for (l=0; l<n; l++) cp[l] = s[l];
+
+        for (i=m-2; i>=0; i--)
+        {
+            cp = c+i*n;
+            for (l=0; l<n; l++) cp[l] = pp*(cp[l+n]-cp[l]);
+        }
+    }
+}
+
+void splinc_wrap_n(IMAGE_DTYPE c[], int m, int n, double p[], int np)
+{
+    splinc_n(c, m, n, p, np, cc_wrap_n, icc_wrap_n);
+}
+
+void splinc_mirror_n(IMAGE_DTYPE c[], int m, int n, double p[], int np)
+{
+    splinc_n(c, m, n, p, np, cc_mirror_n, icc_mirror_n);
+}
+
 /***************************************************************************************
 Return roots of B-spline kernels.
      d - degree of B-spline
@@ -448,133 +587,199 @@ static double wt7(double x)
 }
 
 /***************************************************************************************
-Derivatives of different degrees of B-splines
-    x - position relative to origin
-    returns derivative of basis function at x
+Values and derivatives of different degrees of B-splines.  These are computed
+together, so that the piece of the spline is only selected once.
+    x  - position relative to origin
+    dw - derivative of basis function at x
+    returns value of basis function at x
 */
 
-static double dwt2(double x)
+static double wdwt2(double x, double *dw)
 {
+    double y;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
     if (x < 0.5)
-        return(-2*x*s);
+    {
+        *dw = -2*x*s;
+        return(0.75 - x*x);
+    }
     if (x < 1.5)
-        return((x - 1.5)*s);
+    {
+        *dw = (x - 1.5)*s;
+        y   = 1.5 - x;
+        return(0.5*y*y);
+    }
+    *dw = 0.0;
     return(0.0);
 }
 
-static double dwt3(double x)
+static double wdwt3(double x, double *dw)
 {
+    double y;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
-
     if (x < 1.0)
-        return(x*(1.5*x - 2.0)*s);
+    {
+        *dw = x*(1.5*x - 2.0)*s;
+        return(x*x*(x - 2.0)*0.5 + 2.0/3.0);
+    }
     if (x < 2.0)
     {
-        x = x - 2.0;
-        return(-0.5*x*x*s);
+        y   = x - 2.0;
+        *dw = -0.5*y*y*s;
+        y   = 2.0 - x;
+        return(y*y*y*(1.0/6.0));
     }
+    *dw = 0.0;
     return(0.0);
 }
 
-static double dwt4(double x)
+static double wdwt4(double x, double *dw)
 {
+    double y;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
     if (x < 0.5)
     {
-        return((x*(x*x - 5.0/4.0))*s);
+        *dw = (x*(x*x - 5.0/4.0))*s;
+        y   = x*x;
+        return(y*(y*0.25 - 0.625) + 115.0/192.0);
     }
     if (x < 1.5)
-        return((x*(x*(x*(-2.0/3.0) + 2.5) - 5.0/2.0) + 5.0/24.0)*s);
+    {
+        *dw = (x*(x*(x*(-2.0/3.0) + 2.5) - 5.0/2.0) + 5.0/24.0)*s;
+        return(x*(x*(x*(5.0/6.0 - x*(1.0/6.0)) - 1.25) + 5.0/24.0) + 55.0/96.0);
+    }
     if (x < 2.5)
     {
-        x = x*2.0 - 5.0;
-        return((1.0/48.0)*x*x*x*s);
+        y   = x*2.0 - 5.0;
+        *dw = (1.0/48.0)*y*y*y*s;
+        y   = x - 2.5;
+        y  *= y;
+        return(y*y*(1.0/24.0));
     }
+    *dw = 0.0;
     return(0.0);
 }
 
-static double dwt5(double x)
+static double wdwt5(double x, double *dw)
 {
+    double y, z;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
     if (x < 1.0)
-        return((x*(x*(x*(x*(-5.0/12.0) + 1.0)) - 1.0))*s);
+    {
+        *dw = (x*(x*(x*(x*(-5.0/12.0) + 1.0)) - 1.0))*s;
+        y   = x*x;
+        return(y*(y*(0.25 - x*(1.0/12.0)) - 0.5) + 0.55);
+    }
     if (x < 2.0)
-        return((x*(x*(x*(x*(5.0/24.0) - 1.5) + 3.75) - 3.5) + 0.625)*s);
+    {
+        *dw = (x*(x*(x*(x*(5.0/24.0) - 1.5) + 3.75) - 3.5) + 0.625)*s;
+        return(x*(x*(x*(x*(x*(1.0/24.0) - 0.375) + 1.25) - 1.75) + 0.625) + 0.425);
+    }
     if (x < 3.0)
     {
-        x -= 3.0;
-        x *= x;
-        return((-1.0/24.0)*x*x*s);
+        y   = x - 3.0;
+        y  *= y;
+        *dw = (-1.0/24.0)*y*y*s;
+        y   = 3.0 - x;
+        z   = y*y;
+        return(y*z*z*(1.0/120.0));
     }
+    *dw = 0.0;
     return(0.0);
 }
 
-static double dwt6(double x)
+static double wdwt6(double x, double *dw)
 {
-    double y;
+    double y, z;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
     if (x < 0.5)
     {
-        y = x*x;
-        return(x*((7.0/12.0)*y - (1.0/6.0)*y*y - (77.0/96.0))*s);
+        y   = x*x;
+        *dw = x*((7.0/12.0)*y - (1.0/6.0)*y*y - (77.0/96.0))*s;
+        return(y*(y*(7.0/48.0 - y*(1.0/36.0)) - 77.0/192.0) + 5887.0/11520.0);
     }
     if (x < 1.5)
-        return((x*(x*(x*(x*(x*0.125 - 35.0/48.0) + 1.3125) - 35.0/96.0)
-            - 0.7109375) - 7.0/768.0)*s);
+    {
+        *dw = (x*(x*(x*(x*(x*0.125 - 35.0/48.0) + 1.3125) - 35.0/96.0)
+            - 0.7109375) - 7.0/768.0)*s;
+        return(x*(x*(x*(x*(x*(x*(1.0/48.0) - 7.0/48.0) + 0.328125)
+             - 35.0/288.0) - 91.0/256.0) - 7.0/768.0) + 7861.0/15360.0);
+    }
     if (x < 2.5)
-        return((x*(x*(x*(x*(x*(-1.0/20.0) + 7.0/12.0) - 2.625) + 133.0/24.0)
-            - 5.140625) + 1267.0/960.0)*s);
+    {
+        *dw = (x*(x*(x*(x*(x*(-1.0/20.0) + 7.0/12.0) - 2.625) + 133.0/24.0)
+            - 5.140625) + 1267.0/960.0)*s;
+        return(x*(x*(x*(x*(x*(7.0/60.0 - x*(1.0/120.0)) - 0.65625)
+            + 133.0/72.0) - 2.5703125) + 1267.0/960.0) + 1379.0/7680.0);
+    }
     if (x < 3.5)
     {
-        x *= 2.0;
-        x -= 7.0;
-        y = x*x;
-        return((1.0/3840.0)*y*y*x*s);
+        y   = x*2.0;
+        y  -= 7.0;
+        z   = y*y;
+        *dw = (1.0/3840.0)*z*z*y*s;
+        y   = x - 3.5;
+        y  *= y*y;
+        return(y*y*(1.0/720.0));
     }
+    *dw = 0.0;
     return(0.0);
 }
 
-static double dwt7(double x)
+static double wdwt7(double x, double *dw)
 {
-    double y;
+    double y, z;
     int s;
     s = (x>0 ? 1 : -1);
     x = fabs(x);
 
     if (x < 1.0)
     {
-        y = x*x;
-        return(x*(y*(y*(x*(7.0/144.0) - 1.0/6.0) + 4.0/9.0) - 2.0/3.0)*s);
+        y   = x*x;
+        *dw = x*(y*(y*(x*(7.0/144.0) - 1.0/6.0) + 4.0/9.0) - 2.0/3.0)*s;
+        return(y*(y*(y*(x*(1.0/144.0) - 1.0/36.0) + 1.0/9.0) - 1.0/3.0)
+            + 151.0/315.0);
     }
     if (x < 2.0)
-        return((x*(x*(x*(x*(x*(x*(-7.0/240.0) + 3.0/10.0)
-            - 7.0/6.0) + 2.0) - 7.0/6.0) - 1.0/5.0) - 7.0/90.0)*s);
+    {
+        *dw = (x*(x*(x*(x*(x*(x*(-7.0/240.0) + 3.0/10.0)
+            - 7.0/6.0) + 2.0) - 7.0/6.0) - 1.0/5.0) - 7.0/90.0)*s;
+        return(x*(x*(x*(x*(x*(x*(0.05 - x*(1.0/240.0)) - 7.0/30.0) + 0.5)
+            - 7.0/18.0) - 0.1) - 7.0/90.0) + 103.0/210.0);
+    }
     if (x < 3.0)
-        return((x*(x*(x*(x*(x*(x*(7.0/720.0) - 1.0/6.0)
-            + 7.0/6.0) -38.0/9.0) + 49.0/6.0) - 23.0/3.0) + 217.0/90.0)*s);
+    {
+        *dw = (x*(x*(x*(x*(x*(x*(7.0/720.0) - 1.0/6.0)
+            + 7.0/6.0) -38.0/9.0) + 49.0/6.0) - 23.0/3.0) + 217.0/90.0)*s;
+        return(x*(x*(x*(x*(x*(x*(x*(1.0/720.0) - 1.0/36.0) + 7.0/30.0)
+            - 19.0/18.0) + 49.0/18.0) - 23.0/6.0) + 217.0/90.0) - 139.0/630.0);
+    }
     if (x < 4.0)
     {
-        x -= 4;
-        x *= x*x;
-        x *= x;
-        return((-1.0/720.0)*x*s);
+        y   = x - 4;
+        y  *= y*y;
+        y  *= y;
+        *dw = (-1.0/720.0)*y*s;
+        y   = 4.0 - x;
+        z   = y*y*y;
+        return(z*z*y*(1.0/5040.0));
     }
+    *dw = 0.0;
     return(0.0);
 }
 
@@ -632,19 +837,17 @@ static void weights(int d, double x, int *i, double w[])
 
 
 /***************************************************************************************
-Generate derivatives of B-spline basis functions
+Generate B-spline basis functions and their derivatives
     d   - degree of spline
     x   - position relative to centre
     i   - pointer to first voxel position in convolution
     w   - vector of spline values
-
-    Should really combine this function with dwt2 to dwt7 for most
-    efficiency (as for case 0 and case 1).
+    dw  - vector of spline derivatives
 
     Note that 0th and 1st degree B-spline return derivatives of
     nearest neighbour and linear interpolation bases.
 */
-static void dweights(int d, double x, int *i, double w[])
+static void wdweights(int d, double x, int *i, double w[], double dw[])
 {
     int k;
     *i = floor(x-(d-1)*0.5);
@@ -652,34 +855,37 @@ static void dweights(int d, double x, int *i, double w[])
 
     switch (d){
     case 2:
-        for(k=0; k<=2; k++) w[k] = dwt2(x-k);
+        for(k=0; k<=2; k++) w[k] = wdwt2(x-k, &dw[k]);
         break;
     case 3:
-        for(k=0; k<=3; k++) w[k] = dwt3(x-k);
+        for(k=0; k<=3; k++) w[k] = wdwt3(x-k, &dw[k]);
         break;
     case 4:
-        for(k=0; k<=4; k++) w[k] = dwt4(x-k);
+        for(k=0; k<=4; k++) w[k] = wdwt4(x-k, &dw[k]);
         break;
     case 5:
-        for(k=0; k<=5; k++) w[k] = dwt5(x-k);
+        for(k=0; k<=5; k++) w[k] = wdwt5(x-k, &dw[k]);
         break;
     case 6:
-        for(k=0; k<=6; k++) w[k] = dwt6(x-k);
+        for(k=0; k<=6; k++) w[k] = wdwt6(x-k, &dw[k]);
         break;
     case 7:
-        for(k=0; k<=7; k++) w[k] = dwt7(x-k);
+        for(k=0; k<=7; k++) w[k] = wdwt7(x-k, &dw[k]);
         break;
 
     case 1:
-        w[0] = -1.0; /* Not correct at discontinuities */
-        w[1] =  1.0; /* Not correct at discontinuities */
+        w[0]  = 1.0-x;
+        w[1]  = x;
+        dw[0] = -1.0; /* Not correct at discontinuities */
+        dw[1] =  1.0; /* Not correct at discontinuities */
         break;
     case 0:
-        w[0] = 0.0; /* Not correct at discontinuities */
+        w[0]  = 1.0;
+        dw[0] = 0.0; /* Not correct at discontinuities */
         break;
 
     default:
-        for(k=0; k<=7; k++) w[k] = dwt7(x-k);
+        for(k=0; k<=7; k++) w[k] = wdwt7(x-k, &dw[k]);
     }
 }
 
@@ -716,6 +922,61 @@ int wrap(int i, int m)
     return(i % m);
 }
 
+/***************************************************************************************
+Degree specific versions of sample3 and dsample3 (see bsplines_kernel.h), which
+are used when the same degree (2 to 7) is used in all directions.
+*/
+#define COEF_T IMAGE_DTYPE
+#define SUFFIX _d
+#define DEGREE 2
+#include "bsplines_kernel.h"
+#define DEGREE 3
+#include "bsplines_kernel.h"
+#define DEGREE 4
+#include "bsplines_kernel.h"
+#define DEGREE 5
+#include "bsplines_kernel.h"
+#define DEGREE 6
+#include "bsplines_kernel.h"
+#define DEGREE 7
+#include "bsplines_kernel.h"
+#undef SUFFIX
+#undef COEF_T
+
+#define COEF_T float
+#define SUFFIX _f
+#define DEGREE 2
+#include "bsplines_kernel.h"
+#define DEGREE 3
+#include "bsplines_kernel.h"
+#define DEGREE 4
+#include "bsplines_kernel.h"
+#define DEGREE 5
+#include "bsplines_kernel.h"
+#define DEGREE 6
+#include "bsplines_kernel.h"
+#define DEGREE 7
+#include "bsplines_kernel.h"
+#undef SUFFIX
+#undef COEF_T
+
+static double (*sample3_deg[])() = {
+    0, 0, sample3_2_d, sample3_3_d, sample3_4_d, sample3_5_d, sample3_6_d, sample3_7_d};
+static double (*dsample3_deg[])() = {
+    0, 0, dsample3_2_d, dsample3_3_d, dsample3_4_d, dsample3_5_d, dsample3_6_d, dsample3_7_d};
+static double (*sample3f_deg[])() = {
+    0, 0, sample3_2_f, sample3_3_f, sample3_4_f, sample3_5_f, sample3_6_f, sample3_7_f};
+static double (*dsample3f_deg[])() = {
+    0, 0, dsample3_2_f, dsample3_3_f, dsample3_4_f, dsample3_5_f, dsample3_6_f, dsample3_7_f};
+
+/* Degree of the specialised kernel to use, or 0 if there is none */
+static int kernel_degree(int d[])
+{
+    if (d[0]==d[1] && d[0]==d[2] && d[0]>=2 && d[0]<=7)
+        return(d[0]);
+    return(0);
+}
+
 /***************************************************************************************
 Resample a point
     c   - Volume of B-spline coefficients
@@ -735,6 +996,9 @@ IMAGE_DTYPE sample3(IMAGE_DTYPE c[], int m0, int m1, int m2,
     int k;
     IMAGE_DTYPE *cp;
 
+    if ((k=kernel_degree(d)))
+        return((IMAGE_DTYPE)sample3_deg[k](c, m0,m1,m2, (double)x0,(double)x1,(double)x2, bnd));
+
     /* Generate seperable B-spline basis functions */
     weights(d[0], x0, &i0, w0);
     weights(d[1], x1, &i1, w1);
@@ -787,14 +1051,129 @@ IMAGE_DTYPE dsample3(IMAGE_DTYPE c[], int m0, int m1, int m2,
     int k;
     IMAGE_DTYPE *cp;
 
+    if ((k=kernel_degree(d)))
+    {
+        d2 = dsample3_deg[k](c, m0,m1,m2, (double)x0,(double)x1,(double)x2, &g20,&g21,&g22, bnd);
+        *pg0 = g20;
+        *pg1 = g21;
+        *pg2 = g22;
+        return((IMAGE_DTYPE)d2);
+    }
+
+    /* Generate seperable B-spline basis functions */
+    wdweights(d[0], x0, &i0, w0, dw0);
+    wdweights(d[1], x1, &i1, w1, dw1);
+    wdweights(d[2], x2, &i2, w2, dw2);
+
+    /* Create lookups of voxel locations - for coping with edges */
+    for(k=0; k<=d[0]; k++) o0[k] = bnd[0](k+i0, m0);
+    for(k=0; k<=d[1]; k++) o1[k] = bnd[1](k+i1, m1)*m0;
+    for(k=0; k<=d[2]; k++) o2[k] = bnd[2](k+i2, m2)*(m0*m1);
+
+    /* Convolve coefficients with basis functions */
+    g20 = g21 = g22 = d2 = 0.0;
+    for(i2=0; i2<=d[2]; i2++)
+    {
+        g10 = g11 = d1 = 0.0;
+        for(i1=0; i1<=d[1]; i1++)
+        {
+            cp = c+o2[i2]+o1[i1];
+            g00 = d0  = 0.0;
+            for(i0=0; i0<=d[0]; i0++)
+            {
+                d0  += cp[o0[i0]] *  w0[i0];
+                g00 += cp[o0[i0]] * dw0[i0];
+            }
+            d1  += d0  *  w1[i1];
+            g10 += g00 *  w1[i1];
+            g11 += d0  * dw1[i1];
+        }
+        d2  += d1  *  w2[i2];
+        g20 += g10 *  w2[i2];
+        g21 += g11 *  w2[i2];
+        g22 += d1  * dw2[i2];
+    }
+    *pg0 = g20;
+    *pg1 = g21;
+    *pg2 = g22;
+
+    return((IMAGE_DTYPE)d2);
+}
+
+/***************************************************************************************
+Versions of sample3 and dsample3 for single precision coefficients, which are
+accumulated in double precision.  These are used when the coefficients are
+stored as single precision in order to save memory.
+    c   - Volume of B-spline coefficients
+    m0,m1,m2    - dimensions of c
+    x0,x1,x2    - co-ordinate to sample
+    d   - degrees of splines used
+    pg0,pg1,pg2 - gradients
+    returns value of sampled point
+*/
+double sample3f(float c[], int m0, int m1, int m2,
+    double x0, double x1, double x2, int d[],
+    int (*bnd[])())
+{
+    double w0[32], w1[32], w2[32]; /* B-spline weights */
+    int    o0[32], o1[32], o2[32]; /* Offsets */
+    int    i0,     i1,     i2;     /* Initial offsets */
+    double d0,     d1,     d2;     /* Used by seperable convolution */
+    int k;
+    float *cp;
+
+    if ((k=kernel_degree(d)))
+        return(sample3f_deg[k](c, m0,m1,m2, x0,x1,x2, bnd));
+
     /* Generate seperable B-spline basis functions */
     weights(d[0], x0, &i0, w0);
     weights(d[1], x1, &i1, w1);
     weights(d[2], x2, &i2, w2);
 
-    dweights(d[0], x0, &i0, dw0);
-    dweights(d[1], x1, &i1, dw1);
-    dweights(d[2], x2, &i2, dw2);
+    /* Create lookups of voxel locations - for coping with edges */
+    for(k=0; k<=d[0]; k++) o0[k] = bnd[0](k+i0, m0);
+    for(k=0; k<=d[1]; k++) o1[k] = bnd[1](k+i1, m1)*m0;
+    for(k=0; k<=d[2]; k++) o2[k] = bnd[2](k+i2, m2)*(m0*m1);
+
+    /* Convolve coefficients with basis functions */
+    d2 = 0.0;
+    for(i2=0; i2<=d[2]; i2++)
+    {
+        d1 = 0.0;
+        for(i1=0; i1<=d[1]; i1++)
+        {
+            cp = c+o2[i2]+o1[i1];
+            d0 = 0.0;
+            for(i0=0; i0<=d[0]; i0++)
+                d0 += cp[o0[i0]] * w0[i0];
+            d1 += d0 * w1[i1];
+        }
+        d2 += d1 * w2[i2];
+    }
+    return(d2);
+}
+
+double dsample3f(float c[], int m0, int m1, int m2,
+    double x0, double x1, double x2,
+    int d[], double *pg0, double *pg1, double *pg2,
+    int (*bnd[])())
+{
+    double  w0[32],  w1[32],  w2[32]; /* B-spline weights */
+    double dw0[32], dw1[32], dw2[32]; /* B-spline derivatives */
+    int     o0[32],  o1[32],  o2[32]; /* Offsets */
+    int     i0,      i1,      i2;     /* Initial offsets */
+    double  d0,      d1,      d2;     /* Used by seperable convolution */
+    double g00, g10,g11, g20,g21,g22; /* Used for generating gradients */
+    int k;
+    float *cp;
+
+    if ((k=kernel_degree(d)))
+        return(dsample3f_deg[k](c, m0,m1,m2, x0,x1,x2, pg0,pg1,pg2, bnd));
+
+    /* Generate seperable B-spline basis functions */
+    wdweights(d[0], x0, &i0, w0, dw0);
+    wdweights(d[1], x1, &i1, w1, dw1);
+    wdweights(d[2], x2, &i2, w2, dw2);
 
     /* Create lookups of voxel locations - for coping with edges */
     for(k=0; k<=d[0]; k++) o0[k] = bnd[0](k+i0, m0);
@@ -828,6 +1207,184 @@ IMAGE_DTYPE dsample3(IMAGE_DTYPE c[], int m0, int m1, int m2,
     *pg1 = g21;
     *pg2 = g22;
 
-    return((IMAGE_DTYPE)d2);
+    return(d2);
+}
+
+/***************************************************************************************
+Weights and offsets used for sampling a point from a volume of B-spline
+coefficients, which are shared by all volumes when sampling a batch.
+    m0,m1,m2    - dimensions of each volume
+    x0,x1,x2    - co-ordinate to sample
+    d   - degrees of splines used
+    bnd - functions for dealing with edges
+    w0,w1,w2    - B-spline weights
+    dw0,dw1,dw2 - B-spline derivatives (not computed if dw0 is NULL)
+    o0,o1,o2    - offsets
+*/
+static void basis3(int m0, int m1, int m2, double x0, double x1, double x2,
+    int d[], int (*bnd[])(), double w0[], double w1[], double w2[],
+    double dw0[], double dw1[], double dw2[], int o0[], int o1[], int o2[])
+{
+    int i0, i1, i2, k;
+
+    if (dw0)
+    {
+        wdweights(d[0], x0, &i0, w0, dw0);
+        wdweights(d[1], x1, &i1, w1, dw1);
+        wdweights(d[2], x2, &i2, w2, dw2);
+    }
+    else
+    {
+        weights(d[0], x0, &i0, w0);
+        weights(d[1], x1, &i1, w1);
+        weights(d[2], x2, &i2, w2);
+    }
+
+    for(k=0; k<=d[0]; k++) o0[k] = bnd[0](k+i0, m0);
+    for(k=0; k<=d[1]; k++) o1[k] = bnd[1](k+i1, m1)*m0;
+    for(k=0; k<=d[2]; k++) o2[k] = bnd[2](k+i2, m2)*(m0*m1);
+}
+
+/* Convolve double or single precision coefficients with basis functions */
+#define CONV3(c) \
+    d2 = 0.0; \
+    for(i2=0; i2<=d[2]; i2++) \
+    { \
+        d1 = 0.0; \
+        for(i1=0; i1<=d[1]; i1++) \
+        { \
+            cp = c+o2[i2]+o1[i1]; \
+            d0 = 0.0; \
+            for(i0=0; i0<=d[0]; i0++) \
+                d0 += cp[o0[i0]] * w0[i0]; \
+            d1 += d0 * w1[i1]; \
+        } \
+        d2 += d1 * w2[i2]; \
+    }
+
+#define DCONV3(c) \
+    g20 = g21 = g22 = d2 = 0.0; \
+    for(i2=0; i2<=d[2]; i2++) \
+    { \
+        g10 = g11 = d1 = 0.0; \
+        for(i1=0; i1<=d[1]; i1++) \
+        { \
+            cp = c+o2[i2]+o1[i1]; \
+            g00 = d0  = 0.0; \
+            for(i0=0; i0<=d[0]; i0++) \
+            { \
+                d0  += cp[o0[i0]] *  w0[i0]; \
+                g00 += cp[o0[i0]] * dw0[i0]; \
+            } \
+            d1  += d0  *  w1[i1]; \
+            g10 += g00 *  w1[i1]; \
+            g11 += d0  * dw1[i1]; \
+        } \
+        d2  += d1  *  w2[i2]; \
+        g20 += g10 *  w2[i2]; \
+        g21 += g11 *  w2[i2]; \
+        g22 += d1  * dw2[i2]; \
+    }
+
+/***************************************************************************************
+Resample a point from each of a batch of volumes of B-spline coefficients.
+The weights and offsets are computed once and shared by all volumes, and the
+results are identical to those obtained by sampling each volume separately.
+    c   - Volumes of B-spline coefficients (m0*m1*m2*nv)
+    single - non-zero if c is single precision (otherwise double)
+    m0,m1,m2    - dimensions of each volume
+    nv  - number of volumes
+    x0,x1,x2    - co-ordinate to sample
+    d   - degrees of splines used
+    bnd - functions for dealing with edges
+    f   - sampled values, where the value for volume v is f[v*fs]
+    fs  - stride between the values from different volumes
+*/
+void sample3n(void *c, int single, int m0, int m1, int m2, int nv,
+    double x0, double x1, double x2, int d[], int (*bnd[])(),
+    double f[], mwSize fs)
+{
+    double w0[32], w1[32], w2[32]; /* B-spline weights */
+    int    o0[32], o1[32], o2[32]; /* Offsets */
+    int    i0,     i1,     i2;     /* Loop counters */
+    double d0,     d1,     d2;     /* Used by seperable convolution */
+    mwSize v, mm = (mwSize)m0*m1*m2;
+
+    basis3(m0,m1,m2, x0,x1,x2, d, bnd, w0,w1,w2, NULL,NULL,NULL, o0,o1,o2);
+
+    if (single)
+    {
+        float *cp;
+        for(v=0; v<(mwSize)nv; v++)
+        {
+            CONV3(((float *)c+v*mm))
+            f[v*fs] = d2;
+        }
+    }
+    else
+    {
+        double *cp;
+        for(v=0; v<(mwSize)nv; v++)
+        {
+            CONV3(((double *)c+v*mm))
+            f[v*fs] = d2;
+        }
+    }
+}
+
+/***************************************************************************************
+Resample a point and its gradients from each of a batch of volumes of B-spline
+coefficients.
+    c   - Volumes of B-spline coefficients (m0*m1*m2*nv)
+    single - non-zero if c is single precision (otherwise double)
+    m0,m1,m2    - dimensions of each volume
+    nv  - number of volumes
+    x0,x1,x2    - co-ordinate to sample
+    d   - degrees of splines used
+    bnd - functions for dealing with edges
+    f   - sampled values, where the value for volume v is f[v*fs]
+    g0,g1,g2    - gradients, stored in the same way as f
+    fs  - stride between the values from different volumes
+*/
+void dsample3n(void *c, int single, int m0, int m1, int m2, int nv,
+    double x0, double x1, double x2, int d[], int (*bnd[])(),
+    double f[], double g0[], double g1[], double g2[], mwSize fs)
+{
+    double  w0[32],  w1[32],  w2[32]; /* B-spline weights */
+    double dw0[32], dw1[32], dw2[32]; /* B-spline derivatives */
+    int     o0[32],  o1[32],  o2[32]; /* Offsets */
+    int     i0,      i1,      i2;     /* Loop counters */
+    double  d0,      d1,      d2;     /* Used by seperable convolution */
+    double g00, g10,g11, g20,g21,g22; /* Used for generating gradients */
+    mwSize v, mm = (mwSize)m0*m1*m2;
+
+    basis3(m0,m1,m2, x0,x1,x2, d, bnd, w0,w1,w2, dw0,dw1,dw2, o0,o1,o2);
+
+    if (single)
+    {
+        float *cp;
+        for(v=0; v<(mwSize)nv; v++)
+        {
+            DCONV3(((float *)c+v*mm))
+            f[v*fs]  = d2;
+            g0[v*fs] = g20;
+            g1[v*fs] = g21;
+            g2[v*fs] = g22;
+        }
+    }
+    else
+    {
+        double *cp;
+        for(v=0; v<(mwSize)nv; v++)
+        {
+            DCONV3(((double *)c+v*mm))
+            f[v*fs]  = d2;
+            g0[v*fs] = g20;
+            g1[v*fs] = g21;
+            g2[v*fs] = g22;
+        }
+    }
 }
 
+#undef DCONV3
+#undef CONV3
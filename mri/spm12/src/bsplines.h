@@ -8,8 +8,13 @@
 #define IMAGE_DTYPE double
 #endif
  
+/* Maximum number of interleaved vectors filtered by splinc_*_n */
+#define SPLINC_NLINES 8
+
 void splinc_wrap(IMAGE_DTYPE c[], int m, double p[], int np);
 void splinc_mirror(IMAGE_DTYPE c[], int m, double p[], int np);
+void splinc_wrap_n(IMAGE_DTYPE c[], int m, int n, double p[], int np);
+void splinc_mirror_n(IMAGE_DTYPE c[], int m, int n, double p[], int np);
 int get_poles(int d, int *np, double p[]);
 int mirror();
 int wrap();
@@ -19,4 +24,15 @@ IMAGE_DTYPE dsample3(IMAGE_DTYPE c[], int m0, int m1, int m2,
     IMAGE_DTYPE x0, IMAGE_DTYPE x1, IMAGE_DTYPE x2,
     int d[], IMAGE_DTYPE *pg0, IMAGE_DTYPE *pg1, IMAGE_DTYPE *pg2,
     int (*bnd[])());
-
+double sample3f(float c[], int m0, int m1, int m2,
+    double x0, double x1, double x2, int d[], int (*bnd[])());
+double dsample3f(float c[], int m0, int m1, int m2,
+    double x0, double x1, double x2,
+    int d[], double *pg0, double *pg1, double *pg2,
+    int (*bnd[])());
+void sample3n(void *c, int single, int m0, int m1, int m2, int nv,
+    double x0, double x1, double x2, int d[], int (*bnd[])(),
+    double f[], mwSize fs);
+void dsample3n(void *c, int single, int m0, int m1, int m2, int nv,
+    double x0, double x1, double x2, int d[], int (*bnd[])(),
+    double f[], double g0[], double g1[], double g2[], mwSize fs);
@@ -0,0 +1,138 @@
+/*
+ * $Id$
+ * John Ashburner
+ */
+
+/*
+ * Template for degree specific B-spline sampling, which is included by
+ * bsplines.c once for each degree (2 to 7) and coefficient type.  Before
+ * including it, the following must be defined:
+ *  DEGREE    - degree of B-spline (same in all three directions)
+ *  COEF_T    - data type of the coefficients
+ *  SUFFIX    - suffix used to name the generated functions
+ *
+ * This generates (for e.g. DEGREE 3 and SUFFIX _d):
+ *  static double sample3_3_d(c, m0,m1,m2, x0,x1,x2, bnd)
+ *  static double dsample3_3_d(c, m0,m1,m2, x0,x1,x2, pg0,pg1,pg2, bnd)
+ *
+ * The loops have fixed trip counts, so they can be unrolled by the
+ * compiler, and the boundary functions are only called when the
+ * support of the B-spline extends outside the volume.  The arithmetic
+ * is done in exactly the same order as in the generic sample3 and
+ * dsample3, so the results are identical.
+ */
+
+#define BSK_CAT_(a,b,c) a##b##c
+#define BSK_CAT(a,b,c)  BSK_CAT_(a,b,c)
+#define BSK_WT          BSK_CAT(wt,DEGREE,)
+#define BSK_WDWT        BSK_CAT(wdwt,DEGREE,)
+
+/* Offsets of the voxels within the support of the B-spline */
+#define BSK_OFFSETS(o,i,m,s,b) \
+    if ((i)>=0 && (i)+DEGREE<(m)) \
+        for(k=0; k<=DEGREE; k++) o[k] = ((i)+k)*(s); \
+    else \
+        for(k=0; k<=DEGREE; k++) o[k] = (b)(k+(i), (m))*(s);
+
+static double BSK_CAT(sample3_,DEGREE,SUFFIX)(COEF_T c[], int m0, int m1, int m2,
+    double x0, double x1, double x2, int (*bnd[])())
+{
+    double w0[DEGREE+1], w1[DEGREE+1], w2[DEGREE+1]; /* B-spline weights */
+    int    o0[DEGREE+1], o1[DEGREE+1], o2[DEGREE+1]; /* Offsets */
+    int    i0,           i1,           i2;           /* Initial offsets */
+    double d0,           d1,           d2;           /* Used by seperable convolution */
+    int k;
+    COEF_T *cp;
+
+    /* Generate seperable B-spline basis functions */
+    i0 = floor(x0-(DEGREE-1)*0.5); x0 -= i0;
+    i1 = floor(x1-(DEGREE-1)*0.5); x1 -= i1;
+    i2 = floor(x2-(DEGREE-1)*0.5); x2 -= i2;
+    for(k=0; k<=DEGREE; k++) w0[k] = BSK_WT(x0-k);
+    for(k=0; k<=DEGREE; k++) w1[k] = BSK_WT(x1-k);
+    for(k=0; k<=DEGREE; k++) w2[k] = BSK_WT(x2-k);
+
+    /* Create lookups of voxel locations - for coping with edges */
+    BSK_OFFSETS(o0, i0, m0, 1,       bnd[0])
+    BSK_OFFSETS(o1, i1, m1, m0,      bnd[1])
+    BSK_OFFSETS(o2, i2, m2, (m0*m1), bnd[2])
+
+    /* Convolve coefficients with basis functions */
+    d2 = 0.0;
+    for(i2=0; i2<=DEGREE; i2++)
+    {
+        d1 = 0.0;
+        for(i1=0; i1<=DEGREE; i1++)
+        {
+            cp = c+o2[i2]+o1[i1];
+            d0 = 0.0;
+            for(i0=0; i0<=DEGREE; i0++)
+                d0 += cp[o0[i0]] * w0[i0];
+            d1 += d0 * w1[i1];
+        }
+        d2 += d1 * w2[i2];
+    }
+    return(d2);
+}
+
+static double BSK_CAT(dsample3_,DEGREE,SUFFIX)(COEF_T c[], int m0, int m1, int m2,
+    double x0, double x1, double x2, double *pg0, double *pg1, double *pg2,
+    int (*bnd[])())
+{
+    double  w0[DEGREE+1],  w1[DEGREE+1],  w2[DEGREE+1]; /* B-spline weights */
+    double dw0[DEGREE+1], dw1[DEGREE+1], dw2[DEGREE+1]; /* B-spline derivatives */
+    int     o0[DEGREE+1],  o1[DEGREE+1],  o2[DEGREE+1]; /* Offsets */
+    int     i0,            i1,            i2;           /* Initial offsets */
+    double  d0,            d1,            d2;           /* Used by seperable convolution */
+    double g00, g10,g11, g20,g21,g22; /* Used for generating gradients */
+    int k;
+    COEF_T *cp;
+
+    /* Generate seperable B-spline basis functions */
+    i0 = floor(x0-(DEGREE-1)*0.5); x0 -= i0;
+    i1 = floor(x1-(DEGREE-1)*0.5); x1 -= i1;
+    i2 = floor(x2-(DEGREE-1)*0.5); x2 -= i2;
+    for(k=0; k<=DEGREE; k++) w0[k] = BSK_WDWT(x0-k, &dw0[k]);
+    for(k=0; k<=DEGREE; k++) w1[k] = BSK_WDWT(x1-k, &dw1[k]);
+    for(k=0; k<=DEGREE; k++) w2[k] = BSK_WDWT(x2-k, &dw2[k]);
+
+    /* Create lookups of voxel locations - for coping with edges */
+    BSK_OFFSETS(o0, i0, m0, 1,       bnd[0])
+    BSK_OFFSETS(o1, i1, m1, m0,      bnd[1])
+    BSK_OFFSETS(o2, i2, m2, (m0*m1), bnd[2])
+
+    /* Convolve coefficients with basis functions */
+    g20 = g21 = g22 = d2 = 0.0;
+    for(i2=0; i2<=DEGREE; i2++)
+    {
+        g10 = g11 = d1 = 0.0;
+        for(i1=0; i1<=DEGREE; i1++)
+        {
+            cp = c+o2[i2]+o1[i1];
+            g00 = d0  = 0.0;
+            for(i0=0; i0<=DEGREE; i0++)
+            {
+                d0  += cp[o0[i0]] *  w0[i0];
+                g00 += cp[o0[i0]] * dw0[i0];
+            }
+            d1  += d0  *  w1[i1];
+            g10 += g00 *  w1[i1];
+            g11 += d0  * dw1[i1];
+        }
+        d2  += d1  *  w2[i2];
+        g20 += g10 *  w2[i2];
+        g21 += g11 *  w2[i2];
+        g22 += d1  * dw2[i2];
+    }
+    *pg0 = g20;
+    *pg1 = g21;
+    *pg2 = g22;
+    return(d2);
+}
+
+#undef BSK_OFFSETS
+#undef BSK_WDWT
+#undef BSK_WT
+#undef BSK_CAT
+#undef BSK_CAT_
+#undef DEGREE
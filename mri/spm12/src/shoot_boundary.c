@@ -36,3 +36,16 @@ int get_bound()
     return(bound_type);
 }
 
+
+/* When slices k0, k0+st, k0+2*st, ... of a dimension of length m are
+   updated by a red-black (or multi-colour) relaxation with a stencil of
+   radius r, they are independent of each other, except that with circulant
+   boundaries those within r of the end may depend on those at the start.
+   Returns the first of these, which should be updated (in order) after the
+   others. */
+mwSignedIndex bound_tail(mwSignedIndex k0, mwSignedIndex st, mwSignedIndex r, mwSize m)
+{
+    mwSignedIndex e = (bound_type==BOUND_NEUMANN) ? (mwSignedIndex)m : (mwSignedIndex)m-r;
+    if (e<=k0) return(k0);
+    return(k0 + ((e-k0+st-1)/st)*st);
+}
@@ -7,6 +7,7 @@
 extern mwSignedIndex (*bound)();
 extern void set_bound(int t);
 extern int  get_bound();
+extern mwSignedIndex bound_tail(mwSignedIndex k0, mwSignedIndex st, mwSignedIndex r, mwSize m);
 
 #define BOUND(a,b) bound(a,b)
 
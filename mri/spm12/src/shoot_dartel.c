@@ -5,73 +5,26 @@
 #include <math.h>
 #include <stdio.h>
 #include "shoot_optim3d.h"
+#include "shoot_farray.h"
+#include "shoot_half.h"
 #include "shoot_diffeo3d.h"
+#include "shoot_multiscale.h"
+#include "shoot_mat33.h"
 #include "shoot_regularisers.h"
 #include "shoot_boundary.h"
+#include "shoot_scratch.h"
+#include "shoot_telemetry.h"
+#include "spm_openmp.h"
+
+/* Smallest number of voxels for which operations are multithreaded */
+#ifndef PAR_MIN
+#define PAR_MIN 32768
+#endif
 
 extern double   log(double x);
 extern double   exp(double x);
 #define LOG(x) (((x)>0) ? log(x+0.001): -6.9078)
 
-/*
- * In place Cholesky decomposition
- */
-void chol3(mwSize m, float A[])
-{
-    float *p00 = A,     *p11 = A+m,   *p22 = A+m*2,
-          *p01 = A+m*3, *p02 = A+m*4, *p12 = A+m*5;
-    double a00, a11, a22, a01, a02, a12;
-    double s;
-    mwSignedIndex i;
-    for(i=0; i<m; i++)
-    {
-        a00 = *p00+1e-6;
-        a11 = *p11+1e-6;
-        a22 = *p22+1e-6;
-        a01 = *p01;
-        a02 = *p02;
-        a12 = *p12;
-        s        = sqrt(a00);
-        *(p00++) = s;
-        *(p01++) = a01/s;
-        *(p02++) = a02/s;
-        s        = a11 - a01*a01/a00;
-        s        = sqrt(s);
-        *(p11++) = s;
-        s        = (a12 - a01*a02/a00)/s;
-        *(p12++) = s;
-        s        = a22 - a02*a02/a00 - s*s;
-        *(p22++) = sqrt(s);
-        /* printf("%g %g %g  %g %g %g\n", *(p00-1), *(p11-1), *(p22-1), *(p01-1), *(p02-1), *(p12-1)); */
-    } 
-}
-
-/*
- * In place reconstruction from Cholesky decomposition
- */
-void chol3recon(mwSize m, float A[])
-{
-    float *p00 = A,     *p11 = A+m,   *p22 = A+m*2,
-          *p01 = A+m*3, *p02 = A+m*4, *p12 = A+m*5;
-    double a00, a11, a22, a01, a02, a12;
-    mwSignedIndex i;
-    for(i=0; i<m; i++)
-    {
-        a00 = *p00;
-        a11 = *p11;
-        a22 = *p22;
-        a01 = *p01;
-        a02 = *p02;
-        a12 = *p12;
-        *(p00++) = a00*a00+a01*a01+a02*a02;
-        *(p01++) = a00*a01+a01*a11+a02*a12;
-        *(p02++) = a02*a00+a12*a01+a02*a22;
-        *(p11++) = a01*a01+a11*a11+a12*a12;
-        *(p12++) = a01*a02+a11*a12+a12*a22;
-        *(p22++) = a02*a02+a12*a12+a22*a22;
-    }
-}
-
 static mwSignedIndex pow2(int k)
 {
     mwSignedIndex j0, td = 1;
@@ -91,7 +44,8 @@ static void smalldef_jacdet(mwSize dm[], double sc, float v0[], float t0[], floa
     double sc2 = sc/2.0;
     float *v1 = v0+m, *v2 = v1+m;
     
-    for(j2=0; j2<dm[2]; j2++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
         mwSignedIndex j2m1, j2p1;
         j2m1 = bound(j2-1,dm[2]);
@@ -141,91 +95,72 @@ static void smalldef_jacdet(mwSize dm[], double sc, float v0[], float t0[], floa
 }
 
 /*
- * J0 := J0*inv(I+diag(v0)*sc)
+ * J0 := J0*inv(I+diag(v0)*sc) at voxel (j0,j1,j2), where sc2 = sc/2
  */
-static void jac_div_smalldef(mwSize dm[], double sc, float v0[], float J0[])
+static void jac_div_voxel(mwSize dm[], double sc2, float v0[], mwSignedIndex j0, mwSignedIndex j1,
+                          mwSignedIndex j2, float J0[])
 {
-    mwSignedIndex j0, j1, j2;
     mwSignedIndex m = dm[0]*dm[1]*dm[2];
-    double sc2 = sc/2.0;
+    mwSignedIndex o, om1, op1;
     float *v1 = v0+m, *v2 = v1+m;
+    double j00,j01,j02, j10,j11,j12, j20,j21,j22;
+    double t00,t01,t02, t10,t11,t12, t20,t21,t22;
+    double idt;
+
+    om1 = bound(j0-1,dm[0])+dm[0]*(j1+dm[1]*j2);
+    op1 = bound(j0+1,dm[0])+dm[0]*(j1+dm[1]*j2);
+    j00 = (v0[op1]-v0[om1])*sc2 + 1.0;
+    j10 = (v1[op1]-v1[om1])*sc2;
+    j20 = (v2[op1]-v2[om1])*sc2;
+
+    om1 = j0+dm[0]*(bound(j1-1,dm[1])+dm[1]*j2);
+    op1 = j0+dm[0]*(bound(j1+1,dm[1])+dm[1]*j2);
+    j01 = (v0[op1]-v0[om1])*sc2;
+    j11 = (v1[op1]-v1[om1])*sc2 + 1.0;
+    j21 = (v2[op1]-v2[om1])*sc2;
+
+    om1 = j0+dm[0]*(j1+dm[1]*bound(j2-1,dm[2]));
+    op1 = j0+dm[0]*(j1+dm[1]*bound(j2+1,dm[2]));
+    j02 = (v0[op1]-v0[om1])*sc2;
+    j12 = (v1[op1]-v1[om1])*sc2;
+    j22 = (v2[op1]-v2[om1])*sc2 + 1.0;
 
-    for(j2=0; j2<dm[2]; j2++)
-    {
-        mwSignedIndex j2m1, j2p1;
-        j2m1 = bound(j2-1,dm[2]);
-        j2p1 = bound(j2+1,dm[2]);
-
-        for(j1=0; j1<dm[1]; j1++)
-        {
-            mwSignedIndex j1m1, j1p1;
-            j1m1 = bound(j1-1,dm[1]);
-            j1p1 = bound(j1+1,dm[1]);
-
-            for(j0=0; j0<dm[0]; j0++)
-            {
-                mwSignedIndex o, om1, op1;
-                double j00,j01,j02, j10,j11,j12, j20,j21,j22;
-                double t00,t01,t02, t10,t11,t12, t20,t21,t22;
-                double idt;
-
-                om1 = bound(j0-1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                op1 = bound(j0+1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                j00 = (v0[op1]-v0[om1])*sc2 + 1.0;
-                j10 = (v1[op1]-v1[om1])*sc2;
-                j20 = (v2[op1]-v2[om1])*sc2;
-
-                om1 = j0+dm[0]*(j1m1+dm[1]*j2);
-                op1 = j0+dm[0]*(j1p1+dm[1]*j2);
-                j01 = (v0[op1]-v0[om1])*sc2;
-                j11 = (v1[op1]-v1[om1])*sc2 + 1.0;
-                j21 = (v2[op1]-v2[om1])*sc2;
-
-                om1 = j0+dm[0]*(j1+dm[1]*j2m1);
-                op1 = j0+dm[0]*(j1+dm[1]*j2p1);
-                j02 = (v0[op1]-v0[om1])*sc2;
-                j12 = (v1[op1]-v1[om1])*sc2;
-                j22 = (v2[op1]-v2[om1])*sc2 + 1.0;
+    /*
+    syms j00 j01 j02 j10 j11 j12 j20 j21 j22
+    syms d00 d01 d02 d10 d11 d12 d20 d21 d22
+    J1 = [j00 j01 j02; j10 j11 j12; j20 j21 j22];
+    inv(J1)
+    J0 = [d00 d01 d02; d10 d11 d12; d20 d21 d22];
+    J1*J0
+    */
 
-                /*
-                syms j00 j01 j02 j10 j11 j12 j20 j21 j22
-                syms d00 d01 d02 d10 d11 d12 d20 d21 d22
-                J1 = [j00 j01 j02; j10 j11 j12; j20 j21 j22];
-                inv(J1)
-                J0 = [d00 d01 d02; d10 d11 d12; d20 d21 d22];
-                J1*J0
-                */
-
-                t00 = j22*j11-j21*j12;
-                t10 = j12*j20-j10*j22;
-                t20 = j21*j10-j20*j11;
-                t01 = j02*j21-j01*j22;
-                t11 = j00*j22-j20*j02;
-                t21 = j20*j01-j00*j21;
-                t02 = j01*j12-j02*j11;
-                t12 = j10*j02-j00*j12;
-                t22 = j00*j11-j10*j01;
-                idt = 1.0/(j00*t00+j01*t10+j02*t20);
-
-                o   = j0+dm[0]*(j1+dm[1]*j2);
-                j00 = J0[o    ]; j01 = J0[o+m*3]; j02 = J0[o+m*6];
-                j10 = J0[o+m  ]; j11 = J0[o+m*4]; j12 = J0[o+m*7];
-                j20 = J0[o+m*2]; j21 = J0[o+m*5]; j22 = J0[o+m*8];
-
-                J0[o    ] = idt*(j00*t00+j01*t10+j02*t20);
-                J0[o+m  ] = idt*(j10*t00+j11*t10+j12*t20);
-                J0[o+m*2] = idt*(j20*t00+j21*t10+j22*t20);
-
-                J0[o+m*3] = idt*(j00*t01+j01*t11+j02*t21);
-                J0[o+m*4] = idt*(j10*t01+j11*t11+j12*t21);
-                J0[o+m*5] = idt*(j20*t01+j21*t11+j22*t21);
-
-                J0[o+m*6] = idt*(j00*t02+j01*t12+j02*t22);
-                J0[o+m*7] = idt*(j10*t02+j11*t12+j12*t22);
-                J0[o+m*8] = idt*(j20*t02+j21*t12+j22*t22);
-            }
-        }
-    }
+    t00 = j22*j11-j21*j12;
+    t10 = j12*j20-j10*j22;
+    t20 = j21*j10-j20*j11;
+    t01 = j02*j21-j01*j22;
+    t11 = j00*j22-j20*j02;
+    t21 = j20*j01-j00*j21;
+    t02 = j01*j12-j02*j11;
+    t12 = j10*j02-j00*j12;
+    t22 = j00*j11-j10*j01;
+    idt = 1.0/(j00*t00+j01*t10+j02*t20);
+
+    o   = j0+dm[0]*(j1+dm[1]*j2);
+    j00 = J0[o    ]; j01 = J0[o+m*3]; j02 = J0[o+m*6];
+    j10 = J0[o+m  ]; j11 = J0[o+m*4]; j12 = J0[o+m*7];
+    j20 = J0[o+m*2]; j21 = J0[o+m*5]; j22 = J0[o+m*8];
+
+    J0[o    ] = idt*(j00*t00+j01*t10+j02*t20);
+    J0[o+m  ] = idt*(j10*t00+j11*t10+j12*t20);
+    J0[o+m*2] = idt*(j20*t00+j21*t10+j22*t20);
+
+    J0[o+m*3] = idt*(j00*t01+j01*t11+j02*t21);
+    J0[o+m*4] = idt*(j10*t01+j11*t11+j12*t21);
+    J0[o+m*5] = idt*(j20*t01+j21*t11+j22*t21);
+
+    J0[o+m*6] = idt*(j00*t02+j01*t12+j02*t22);
+    J0[o+m*7] = idt*(j10*t02+j11*t12+j12*t22);
+    J0[o+m*8] = idt*(j20*t02+j21*t12+j22*t22);
 }
 
 /*
@@ -233,11 +168,16 @@ static void jac_div_smalldef(mwSize dm[], double sc, float v0[], float J0[])
  */
 void expdef(mwSize dm[], int k, double sc, float v[], float t0[], float t1[], float J0[], float J1[])
 {
-    float *optr;
-    mwSignedIndex m = dm[0]*dm[1]*dm[2];
     int j;
 
-    optr = t0;
+    /* The buffers are swapped after each squaring, so start with the
+       other one if k is odd, and the result ends up in t0 and J0. */
+    if (k&1)
+    {
+        float *tmpp;
+        tmpp = t0; t0   = t1; t1   = tmpp;
+        tmpp = J0; J0   = J1; J1   = tmpp;
+    }
 
     if(J0!=(float *)0)
     {
@@ -260,15 +200,6 @@ void expdef(mwSize dm[], int k, double sc, float v[], float t0[], float t1[], fl
             tmpp = t0; t0   = t1; t1   = tmpp;
         }
     }
-    if (optr != t0)
-    {
-        for(j=0; j<3*m; j++)
-            t1[j] = t0[j];
-
-        if (J0!=(float *)0)
-            for(j=0; j<9*m; j++)
-                J1[j] = J0[j];
-    }
 }
 
 /*
@@ -276,11 +207,16 @@ void expdef(mwSize dm[], int k, double sc, float v[], float t0[], float t1[], fl
  */
 void expdefdet(mwSize dm[], int k, double sc, float v[], float t0[], float t1[], float J0[], float J1[])
 {
-    float *optr;
-    mwSignedIndex m = dm[0]*dm[1]*dm[2];
     int j;
 
-    optr = t0;
+    /* The buffers are swapped after each squaring, so start with the
+       other one if k is odd, and the result ends up in t0 and J0. */
+    if (k&1)
+    {
+        float *tmpp;
+        tmpp = t0; t0   = t1; t1   = tmpp;
+        tmpp = J0; J0   = J1; J1   = tmpp;
+    }
 
     if(J0!=(float *)0)
     {
@@ -303,129 +239,196 @@ void expdefdet(mwSize dm[], int k, double sc, float v[], float t0[], float t1[],
             tmpp = t0; t0   = t1; t1   = tmpp;
         }
     }
-    if (optr != t0)
-    {
-        for(j=0; j<3*m; j++)
-            t1[j] = t0[j];
+}
+
+
+/*
+ * Where the template is sampled by the objective functions below, and how
+ * its gradients are transformed.  Voxel (j0,j1,j2) samples either
+ *     Id + sc*v      (if t0 is NULL), or
+ *     t0 - 1         with the gradients multiplied by J0.
+ * If vj is not NULL, J0 := J0*inv(I+diag(vj)*jsc) is done on the fly (and
+ * J0 updated), rather than by a separate pass through the Jacobians.
+ */
+typedef struct
+{
+    float *v;
+    double sc;
+    float *t0, *J0;
+    float *vj;
+    double jsc;
+} OBJ_WARP;
+
+/* Offsets of the neighbours of voxel (j0,j1,j2) for trilinear
+   interpolation, and the weights (dx1, dx2, dy1, dy2, dz1, dz2) */
+static void objfun_point(mwSize dm[], const OBJ_WARP *w, mwSignedIndex j0, mwSignedIndex j1,
+                         mwSignedIndex j2, mwSignedIndex j, mwSize o[], double wt[])
+{
+    mwSignedIndex m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
+    double x, y, z;
 
-        if (J0!=(float *)0)
-            for(j=0; j<m; j++)
-                J1[j] = J0[j];
+    if (w->t0 == (float *)0)
+    {
+        x    = j0 + w->sc*w->v[j    ];
+        y    = j1 + w->sc*w->v[j+m  ];
+        z    = j2 + w->sc*w->v[j+m*2];
     }
+    else
+    {
+        x    = w->t0[j    ]-1.0;
+        y    = w->t0[j+m  ]-1.0;
+        z    = w->t0[j+m*2]-1.0;
+    }
+    ix   = (mwSignedIndex)floor(x); wt[0]=x-ix; wt[1]=1.0-wt[0];
+    iy   = (mwSignedIndex)floor(y); wt[2]=y-iy; wt[3]=1.0-wt[2];
+    iz   = (mwSignedIndex)floor(z); wt[4]=z-iz; wt[5]=1.0-wt[4];
+    ix   = bound(ix,dm[0]);
+    iy   = bound(iy,dm[1]);
+    iz   = bound(iz,dm[2]);
+    ix1  = bound(ix+1,dm[0]);
+    iy1  = bound(iy+1,dm[1]);
+    iz1  = bound(iz+1,dm[2]);
+
+    o[0] = ix +dm[0]*(iy +dm[1]*iz );
+    o[1] = ix1+dm[0]*(iy +dm[1]*iz );
+    o[2] = ix +dm[0]*(iy1+dm[1]*iz );
+    o[3] = ix1+dm[0]*(iy1+dm[1]*iz );
+    o[4] = ix +dm[0]*(iy +dm[1]*iz1);
+    o[5] = ix1+dm[0]*(iy +dm[1]*iz1);
+    o[6] = ix +dm[0]*(iy1+dm[1]*iz1);
+    o[7] = ix1+dm[0]*(iy1+dm[1]*iz1);
+
+    if (w->vj != (float *)0)
+        jac_div_voxel(dm, w->jsc/2.0, w->vj, j0, j1, j2, w->J0);
 }
 
+/* Gradient (dx0,dy0,dz0) of the template at voxel j, transformed by J0 */
+#define OBJ_GRAD(w,j,m,dx0,dy0,dz0,dx,dy,dz) \
+    if ((w)->J0 != (float *)0) \
+    { \
+        float *J = (w)->J0; \
+        dx = -(J[(j)      ]*(dx0) + J[(j)+  (m)]*(dy0) + J[(j)+2*(m)]*(dz0)); \
+        dy = -(J[(j)+3*(m)]*(dx0) + J[(j)+4*(m)]*(dy0) + J[(j)+5*(m)]*(dz0)); \
+        dz = -(J[(j)+6*(m)]*(dx0) + J[(j)+7*(m)]*(dy0) + J[(j)+8*(m)]*(dz0)); \
+    } \
+    else \
+    { \
+        dx = -(dx0); \
+        dy = -(dy0); \
+        dz = -(dz0); \
+    }
 
-static double smalldef_objfun_mn(mwSize dm[], float f[], float g[], float v[], float jd[], double sc, float b[], float A[])
+/*
+ * Multinomial (categorical) objective function for matching template f
+ * (tissue probabilities, with an implicit background class) to g, along
+ * with the gradients (b) and Hessians (A) with respect to displacements.
+ * Sampling, differentiation and accumulation are done in one sweep.  Each
+ * plane is done by a single thread and has its own partial sum of the
+ * objective function (in sslp, which has dm[2] elements).  These are added
+ * in order at the end, so the results do not depend on the number of
+ * threads.  sslp comes from the caller's scratch, as this may be run on a
+ * worker thread, where mxMalloc can not be used.
+ */
+static double objfun_mn(mwSize dm[], float f[], float g[], const OBJ_WARP *w, float jd[], float b[], float A[],
+                        double sslp[])
 {
-    mwSignedIndex j, j0, j1, j2, m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex j0, j1, j2, m = dm[0]*dm[1]*dm[2];
     double ssl = 0.0;
 
-    j = 0;
-    for(j2=0; j2<dm[2]; j2++)
-        for(j1=0; j1<dm[1]; j1++)
-            for(j0=0; j0<dm[0]; j0++, j++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1, k;
-        double dx1, dx2, dy1, dy2, dz1, dz2;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx[128], dy[128], dz[128], Y[128], T[128], sT = 1.0, sY;
-        double ta11, ta22, ta33, ta12, ta13, ta23;
-        double tb1,  tb2,  tb3, tss;
-        double sk000 = 1.0, sk100 = 1.0, sk010 = 1.0,
-               sk110 = 1.0, sk001 = 1.0, sk101 = 1.0,
-               sk011 = 1.0, sk111 = 1.0;
-        
-        x    = j0 + sc*v[j    ];
-        y    = j1 + sc*v[j+m  ];
-        z    = j2 + sc*v[j+m*2];
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-        sY   = 0.0;
-        
-        for(k=0; k<dm[3]; k++)
-        {
-            T[k]   = g[j + k*m];
-            sT    -= T[k];
-        }
-        if (!mxIsFinite((double)sT))
-        {
-            A[j    ] = 0.0;
-            A[j+m  ] = 0.0;
-            A[j+m*2] = 0.0;
-            A[j+m*3] = 0.0;
-            A[j+m*4] = 0.0;
-            A[j+m*5] = 0.0;
-            b[j    ] = 0.0;
-            b[j+m  ] = 0.0;
-            b[j+m*2] = 0.0;
-        }
-        else
+        double ssl2 = 0.0;
+        for(j1=0; j1<(mwSignedIndex)dm[1]; j1++)
+            for(j0=0; j0<(mwSignedIndex)dm[0]; j0++)
         {
+            mwSignedIndex j = j0+dm[0]*(j1+dm[1]*j2), k;
+            mwSize o[8];
+            double wt[6], dx1, dx2, dy1, dy2, dz1, dz2;
+            double k000, k100, k010, k110, k001, k101, k011, k111;
+            double dx0, dy0, dz0;
+            double dx[128], dy[128], dz[128], Y[128], T[128], sT = 1.0, sY;
+            double ta11, ta22, ta33, ta12, ta13, ta23;
+            double tb1,  tb2,  tb3, tss;
+            double sk000 = 1.0, sk100 = 1.0, sk010 = 1.0,
+                   sk110 = 1.0, sk001 = 1.0, sk101 = 1.0,
+                   sk011 = 1.0, sk111 = 1.0;
+
+            objfun_point(dm, w, j0, j1, j2, j, o, wt);
+            dx1 = wt[0]; dx2 = wt[1];
+            dy1 = wt[2]; dy2 = wt[3];
+            dz1 = wt[4]; dz2 = wt[5];
+            sY  = 0.0;
+
             for(k=0; k<dm[3]; k++)
             {
-                mwSignedIndex km = k*m;
-                k000  = f[ix +dm[0]*(iy +dm[1]*iz ) + km];sk000-=k000;k000=LOG(k000);
-                k100  = f[ix1+dm[0]*(iy +dm[1]*iz ) + km];sk100-=k100;k100=LOG(k100);
-                k010  = f[ix +dm[0]*(iy1+dm[1]*iz ) + km];sk010-=k010;k010=LOG(k010);
-                k110  = f[ix1+dm[0]*(iy1+dm[1]*iz ) + km];sk110-=k110;k110=LOG(k110);
-                k001  = f[ix +dm[0]*(iy +dm[1]*iz1) + km];sk001-=k001;k001=LOG(k001);
-                k101  = f[ix1+dm[0]*(iy +dm[1]*iz1) + km];sk101-=k101;k101=LOG(k101);
-                k011  = f[ix +dm[0]*(iy1+dm[1]*iz1) + km];sk011-=k011;k011=LOG(k011);
-                k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1) + km];sk111-=k111;k111=LOG(k111);
+                T[k]   = g[j + k*m];
+                sT    -= T[k];
+            }
+            if (!mxIsFinite((double)sT))
+            {
+                A[j    ] = 0.0;
+                A[j+m  ] = 0.0;
+                A[j+m*2] = 0.0;
+                A[j+m*3] = 0.0;
+                A[j+m*4] = 0.0;
+                A[j+m*5] = 0.0;
+                b[j    ] = 0.0;
+                b[j+m  ] = 0.0;
+                b[j+m*2] = 0.0;
+                continue;
+            }
+
+            for(k=0; k<=dm[3]; k++)
+            {
+                if (k<dm[3])
+                {
+                    float *fk = f + k*m;
+                    k000  = fk[o[0]];sk000-=k000;k000=LOG(k000);
+                    k100  = fk[o[1]];sk100-=k100;k100=LOG(k100);
+                    k010  = fk[o[2]];sk010-=k010;k010=LOG(k010);
+                    k110  = fk[o[3]];sk110-=k110;k110=LOG(k110);
+                    k001  = fk[o[4]];sk001-=k001;k001=LOG(k001);
+                    k101  = fk[o[5]];sk101-=k101;k101=LOG(k101);
+                    k011  = fk[o[6]];sk011-=k011;k011=LOG(k011);
+                    k111  = fk[o[7]];sk111-=k111;k111=LOG(k111);
+                }
+                else
+                {
+                    /* Background class */
+                    T[k] = sT;
+                    k000 = LOG(sk000);
+                    k001 = LOG(sk001);
+                    k010 = LOG(sk010);
+                    k011 = LOG(sk011);
+                    k100 = LOG(sk100);
+                    k101 = LOG(sk101);
+                    k110 = LOG(sk110);
+                    k111 = LOG(sk111);
+                }
 
                 Y[k]  = exp(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
                           + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1);
                 sY   += Y[k];
 
-                dx[k] = -(((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-                        + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1);
-                dy[k] = -(((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-                        + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1);
-                dz[k] = -(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-                        - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1));
+                dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
+                      + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
+                dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
+                      + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
+                dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
+                      - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
+                OBJ_GRAD(w, j, m, dx0, dy0, dz0, dx[k], dy[k], dz[k])
             }
 
-            k    = dm[3];
-            T[k] = sT;
-            k000 = LOG(sk000);
-            k001 = LOG(sk001);
-            k010 = LOG(sk010);
-            k011 = LOG(sk011);
-            k100 = LOG(sk100);
-            k101 = LOG(sk101);
-            k110 = LOG(sk110);
-            k111 = LOG(sk111);
-
-            Y[k] = exp(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-                     + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1);
-            sY   += Y[k];
-
-            dx[k] = -(((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-                    + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1);
-            dy[k] = -(((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-                    + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1);
-            dz[k] = -(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-                    - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1));
-
             ta11 = ta22 = ta33 = ta12 = ta13 = ta23 = 0.0;
             tb1  = tb2  = tb3  = 0.0;
             tss  = 0.0;
             for(k=0; k<=dm[3]; k++)
             {
-                Y[k] /= sY;
-            }
-            for(k=0; k<=dm[3]; k++)
-            {
-                double wt;
+                double wt1;
                 mwSignedIndex k1;
+                Y[k] /= sY;
                 tss  += log(Y[k])*T[k];
                 tb1  += (Y[k]-T[k])*dx[k];
                 tb2  += (Y[k]-T[k])*dy[k];
@@ -433,21 +436,21 @@ static double smalldef_objfun_mn(mwSize dm[], float f[], float g[], float v[], f
 
                 for(k1=0; k1<k; k1++)
                 {
-                    wt    =  -Y[k]*Y[k1];
-                    ta11 += wt* dx[k]*dx[k1]*2;
-                    ta22 += wt* dy[k]*dy[k1]*2;
-                    ta33 += wt* dz[k]*dz[k1]*2;
-                    ta12 += wt*(dx[k]*dy[k1] + dx[k1]*dy[k]);
-                    ta13 += wt*(dx[k]*dz[k1] + dx[k1]*dz[k]);
-                    ta23 += wt*(dy[k]*dz[k1] + dy[k1]*dz[k]);
+                    wt1   =  -Y[k]*Y[k1];
+                    ta11 += wt1* dx[k]*dx[k1]*2;
+                    ta22 += wt1* dy[k]*dy[k1]*2;
+                    ta33 += wt1* dz[k]*dz[k1]*2;
+                    ta12 += wt1*(dx[k]*dy[k1] + dx[k1]*dy[k]);
+                    ta13 += wt1*(dx[k]*dz[k1] + dx[k1]*dz[k]);
+                    ta23 += wt1*(dy[k]*dz[k1] + dy[k1]*dz[k]);
                 }
-                wt    = Y[k]*(1.0-Y[k]);
-                ta11 += wt*dx[k]*dx[k];
-                ta22 += wt*dy[k]*dy[k];
-                ta33 += wt*dz[k]*dz[k];
-                ta12 += wt*dx[k]*dy[k];
-                ta13 += wt*dx[k]*dz[k];
-                ta23 += wt*dy[k]*dz[k];
+                wt1   = Y[k]*(1.0-Y[k]);
+                ta11 += wt1*dx[k]*dx[k];
+                ta22 += wt1*dy[k]*dy[k];
+                ta33 += wt1*dz[k]*dz[k];
+                ta12 += wt1*dx[k]*dy[k];
+                ta13 += wt1*dx[k]*dz[k];
+                ta23 += wt1*dy[k]*dz[k];
             }
 
             if (jd != (float *)0)
@@ -463,7 +466,7 @@ static double smalldef_objfun_mn(mwSize dm[], float f[], float g[], float v[], f
                 b[j    ]  = tb1*dt;
                 b[j+m  ]  = tb2*dt;
                 b[j+m*2]  = tb3*dt;
-                ssl      -= tss*dt;
+                ssl2     -= tss*dt;
             }
             else
             {
@@ -476,570 +479,176 @@ static double smalldef_objfun_mn(mwSize dm[], float f[], float g[], float v[], f
                 b[j    ] = tb1;
                 b[j+m  ] = tb2;
                 b[j+m*2] = tb3;
-                ssl     -= tss;
+                ssl2    -= tss;
             }
         }
+        sslp[j2] = ssl2;
     }
+
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
+        ssl += sslp[j2];
     return(ssl);
 }
 
-static double smalldef_objfun2(mwSize dm[], float f[], float g[], float v[], float jd[], double sc, float b[], float A[])
+/*
+ * Sum of squares objective function, with its gradients and Hessians, for
+ * matching f to g.  If there is more than one volume, they are treated as
+ * tissue probabilities, with an implicit background class.  Done in the
+ * same way as objfun_mn.
+ */
+static double objfun_ss(mwSize dm[], float f[], float g[], const OBJ_WARP *w, float jd[], float b[], float A[],
+                        double sslp[])
 {
-    mwSignedIndex j, j0, j1, j2, m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex j0, j1, j2, m = dm[0]*dm[1]*dm[2];
     double ssl = 0.0;
 
-    j = 0;
-    for(j2=0; j2<dm[2]; j2++)
-        for(j1=0; j1<dm[1]; j1++)
-            for(j0=0; j0<dm[0]; j0++, j++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1, k;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx1, dx2, dy1, dy2, dz1, dz2;
-        double d, dx, dy, dz, sd, sdx, sdy, sdz, ss;
-        
-        x    = j0 + sc*v[j    ];
-        y    = j1 + sc*v[j+m  ];
-        z    = j2 + sc*v[j+m*2];
-        
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-
-        A[j    ] = 0.0;
-        A[j+m  ] = 0.0;
-        A[j+m*2] = 0.0;
-        A[j+m*3] = 0.0;
-        A[j+m*4] = 0.0;
-        A[j+m*5] = 0.0;
-
-        b[j    ] = 0.0;
-        b[j+m  ] = 0.0;
-        b[j+m*2] = 0.0;
-
-        ss  = 0.0;
-        sd  = 0.0;
-        sdx = 0.0;
-        sdy = 0.0;
-        sdz = 0.0;
-
-        for(k=0; k<dm[3]; k++)
-        {
-            mwSignedIndex km = k*m;
-            k000  = f[ix +dm[0]*(iy +dm[1]*iz ) + km];
-            k100  = f[ix1+dm[0]*(iy +dm[1]*iz ) + km];
-            k010  = f[ix +dm[0]*(iy1+dm[1]*iz ) + km];
-            k110  = f[ix1+dm[0]*(iy1+dm[1]*iz ) + km];
-            k001  = f[ix +dm[0]*(iy +dm[1]*iz1) + km];
-            k101  = f[ix1+dm[0]*(iy +dm[1]*iz1) + km];
-            k011  = f[ix +dm[0]*(iy1+dm[1]*iz1) + km];
-            k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1) + km];
-
-            d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-                  + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j+km];
-
-            dx    = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-                  + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
-            dy    = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-                  + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
-            dz    = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-                  - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
-
-            sd  -= d;
-            sdx -= dx;
-            sdy -= dy;
-            sdz -= dz;
-
-            A[j    ] += dx*dx;
-            A[j+m  ] += dy*dy;
-            A[j+m*2] += dz*dz;
-            A[j+m*3] += dx*dy;
-            A[j+m*4] += dx*dz;
-            A[j+m*5] += dy*dz;
-
-            b[j    ] -= dx*d;
-            b[j+m  ] -= dy*d;
-            b[j+m*2] -= dz*d;
-
-            ss += d*d;
-        }
-        A[j    ] += sdx*sdx;
-        A[j+m  ] += sdy*sdy;
-        A[j+m*2] += sdz*sdz;
-        A[j+m*3] += sdx*sdy;
-        A[j+m*4] += sdx*sdz;
-        A[j+m*5] += sdy*sdz;
-
-        b[j    ] -= sdx*sd;
-        b[j+m  ] -= sdy*sd;
-        b[j+m*2] -= sdz*sd;
-
-        ss += sd*sd;
-        
-        if (jd != (float *)0)
+        double ssl2 = 0.0;
+        for(j1=0; j1<(mwSignedIndex)dm[1]; j1++)
+            for(j0=0; j0<(mwSignedIndex)dm[0]; j0++)
         {
-            double dt = jd[j];
-            if (dt<0.0) dt = 0.0;
-            A[j    ] *=dt;
-            A[j+m  ] *=dt;
-            A[j+m*2] *=dt;
-            A[j+m*3] *=dt;
-            A[j+m*4] *=dt;
-            A[j+m*5] *=dt;
-            b[j    ] *=dt;
-            b[j+m  ] *=dt;
-            b[j+m*2] *=dt;
-            ss       *=dt;
-        }
-        ssl += ss;
-    }
-    return(0.5*ssl);
-}
+            mwSignedIndex j = j0+dm[0]*(j1+dm[1]*j2), k;
+            mwSize o[8];
+            double wt[6], dx1, dx2, dy1, dy2, dz1, dz2;
+            double k000, k100, k010, k110, k001, k101, k011, k111;
+            double dx0, dy0, dz0, d, dx, dy, dz, dt = 1.0;
 
-static double smalldef_objfun(mwSize dm[], float f[], float g[], float v[], float jd[], double sc, float b[], float A[])
-{
-    mwSignedIndex j,j0,j1,j2, m = dm[0]*dm[1]*dm[2];
-    double ssl = 0.0;
-
-    if (dm[3]>1)
-    {
-        return(smalldef_objfun2(dm, f, g, v, jd, sc, b, A));
-    }
-
-    j = 0;
-    for(j2=0; j2<dm[2]; j2++)
-        for(j1=0; j1<dm[1]; j1++)
-            for(j0=0; j0<dm[0]; j0++, j++)
-    {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx1, dx2, dy1, dy2, dz1, dz2;
-        double d, dx, dy, dz, dt = 1.0;
-        
-        x    = j0 + sc*v[j    ];
-        y    = j1 + sc*v[j+m  ];
-        z    = j2 + sc*v[j+m*2];
-
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-        
-        k000  = f[ix +dm[0]*(iy +dm[1]*iz )];
-        k100  = f[ix1+dm[0]*(iy +dm[1]*iz )];
-        k010  = f[ix +dm[0]*(iy1+dm[1]*iz )];
-        k110  = f[ix1+dm[0]*(iy1+dm[1]*iz )];
-        k001  = f[ix +dm[0]*(iy +dm[1]*iz1)];
-        k101  = f[ix1+dm[0]*(iy +dm[1]*iz1)];
-        k011  = f[ix +dm[0]*(iy1+dm[1]*iz1)];
-        k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1)];
-        
-        d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-              + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j];
-        dx    = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-              + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
-        dy    = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-              + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
-        dz    = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-              - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
-        
-        if (jd != (float *)0)
-        {
-            dt = jd[j];
-            if (dt<0.0) dt = 0.0;
-        }
-        A[j    ] = dx*dx*dt;
-        A[j+m  ] = dy*dy*dt;
-        A[j+m*2] = dz*dz*dt;
-        A[j+m*3] = dx*dy*dt;
-        A[j+m*4] = dx*dz*dt;
-        A[j+m*5] = dy*dz*dt;
-        
-        b[j    ] = -dx*d*dt;
-        b[j+m  ] = -dy*d*dt;
-        b[j+m*2] = -dz*d*dt;
-        
-        ssl += d*d*dt;
-    }
-    return(0.5*ssl);
-}
+            objfun_point(dm, w, j0, j1, j2, j, o, wt);
+            dx1 = wt[0]; dx2 = wt[1];
+            dy1 = wt[2]; dy2 = wt[3];
+            dz1 = wt[4]; dz2 = wt[5];
 
-static double initialise_objfun_mn(mwSize dm[], float f[], float g[], float t0[], float J0[], float jd[], float b[], float A[])
-{
-    mwSignedIndex j, m = dm[0]*dm[1]*dm[2];
-    double ssl = 0.0;
- 
-    for(j=0; j<m; j++)
-    {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1, k;
-        double dx1, dx2, dy1, dy2, dz1, dz2;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx0, dy0, dz0;
-        double dx[128], dy[128], dz[128], Y[128], T[128], sT = 1.0, sY;
-        double ta11, ta22, ta33, ta12, ta13, ta23;
-        double tb1,  tb2,  tb3, tss;
-        double sk000 = 1.0, sk100 = 1.0, sk010 = 1.0,
-               sk110 = 1.0, sk001 = 1.0, sk101 = 1.0,
-               sk011 = 1.0, sk111 = 1.0;
-
-        x    = t0[j    ]-1.0;
-        y    = t0[j+m  ]-1.0;
-        z    = t0[j+m*2]-1.0;
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-        sY   = 0.0;
-        
-        for(k=0; k<dm[3]; k++)
-        {
-            T[k]   = g[j + k*m];
-            sT    -= T[k];
-        }
-        if (!mxIsFinite((double)sT))
-        {
-            A[j    ] = 0.0;
-            A[j+m  ] = 0.0;
-            A[j+m*2] = 0.0;
-            A[j+m*3] = 0.0;
-            A[j+m*4] = 0.0;
-            A[j+m*5] = 0.0;
-            b[j    ] = 0.0;
-            b[j+m  ] = 0.0;
-            b[j+m*2] = 0.0;
-        }
-        else
-        {
-            for(k=0; k<dm[3]; k++)
+            if (jd != (float *)0)
             {
-                mwSignedIndex km = k*m;
-                k000  = f[ix +dm[0]*(iy +dm[1]*iz ) + km];sk000-=k000;k000=LOG(k000);
-                k100  = f[ix1+dm[0]*(iy +dm[1]*iz ) + km];sk100-=k100;k100=LOG(k100);
-                k010  = f[ix +dm[0]*(iy1+dm[1]*iz ) + km];sk010-=k010;k010=LOG(k010);
-                k110  = f[ix1+dm[0]*(iy1+dm[1]*iz ) + km];sk110-=k110;k110=LOG(k110);
-                k001  = f[ix +dm[0]*(iy +dm[1]*iz1) + km];sk001-=k001;k001=LOG(k001);
-                k101  = f[ix1+dm[0]*(iy +dm[1]*iz1) + km];sk101-=k101;k101=LOG(k101);
-                k011  = f[ix +dm[0]*(iy1+dm[1]*iz1) + km];sk011-=k011;k011=LOG(k011);
-                k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1) + km];sk111-=k111;k111=LOG(k111);
+                dt = jd[j];
+                if (dt<0.0) dt = 0.0;
+            }
 
-                Y[k]  = exp(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-                          + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1);
-                sY   += Y[k];
-            
+            if (dm[3]==1)
+            {
+                k000  = f[o[0]];
+                k100  = f[o[1]];
+                k010  = f[o[2]];
+                k110  = f[o[3]];
+                k001  = f[o[4]];
+                k101  = f[o[5]];
+                k011  = f[o[6]];
+                k111  = f[o[7]];
+
+                d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
+                      + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j];
                 dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
                       + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
                 dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
                       + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
                 dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
                       - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
+                OBJ_GRAD(w, j, m, dx0, dy0, dz0, dx, dy, dz)
 
-                dx[k] = -(J0[j    ]*dx0 + J0[j+  m]*dy0 + J0[j+2*m]*dz0);
-                dy[k] = -(J0[j+3*m]*dx0 + J0[j+4*m]*dy0 + J0[j+5*m]*dz0);
-                dz[k] = -(J0[j+6*m]*dx0 + J0[j+7*m]*dy0 + J0[j+8*m]*dz0);
-            }
+                A[j    ] = dx*dx*dt;
+                A[j+m  ] = dy*dy*dt;
+                A[j+m*2] = dz*dz*dt;
+                A[j+m*3] = dx*dy*dt;
+                A[j+m*4] = dx*dz*dt;
+                A[j+m*5] = dy*dz*dt;
 
-            k    = dm[3];
-            T[k] = sT;
-
-            k000 = LOG(sk000);
-            k001 = LOG(sk001);
-            k010 = LOG(sk010);
-            k011 = LOG(sk011);
-            k100 = LOG(sk100);
-            k101 = LOG(sk101);
-            k110 = LOG(sk110);
-            k111 = LOG(sk111);
-
-            Y[k]  = exp(((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-                      + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1);
-            sY   += Y[k];
-            
-            dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-                  + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
-            dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-                  + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
-            dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-                  - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
-
-            dx[k] = -(J0[j    ]*dx0 + J0[j+  m]*dy0 + J0[j+2*m]*dz0);
-            dy[k] = -(J0[j+3*m]*dx0 + J0[j+4*m]*dy0 + J0[j+5*m]*dz0);
-            dz[k] = -(J0[j+6*m]*dx0 + J0[j+7*m]*dy0 + J0[j+8*m]*dz0);
+                b[j    ] = dx*d*dt;
+                b[j+m  ] = dy*d*dt;
+                b[j+m*2] = dz*d*dt;
 
-            ta11 = ta22 = ta33 = ta12 = ta13 = ta23 = 0.0;
-            tb1  = tb2  = tb3  = 0.0;
-            tss  = 0.0;
-            for(k=0; k<=dm[3]; k++)
-            {
-                double wt;
-                mwSignedIndex k1;
-                Y[k] /= sY;
-                tss  += log(Y[k])*T[k];
-                tb1  += (Y[k]-T[k])*dx[k];
-                tb2  += (Y[k]-T[k])*dy[k];
-                tb3  += (Y[k]-T[k])*dz[k];
-
-                for(k1=0; k1<k; k1++)
-                {
-                    wt    =  -Y[k]*Y[k1];
-                    ta11 += wt* dx[k]*dx[k1]*2;
-                    ta22 += wt* dy[k]*dy[k1]*2;
-                    ta33 += wt* dz[k]*dz[k1]*2;
-                    ta12 += wt*(dx[k]*dy[k1] + dx[k1]*dy[k]);
-                    ta13 += wt*(dx[k]*dz[k1] + dx[k1]*dz[k]);
-                    ta23 += wt*(dy[k]*dz[k1] + dy[k1]*dz[k]);
-                }
-                wt    = Y[k]*(1.0-Y[k]);
-                ta11 += wt*dx[k]*dx[k];
-                ta22 += wt*dy[k]*dy[k];
-                ta33 += wt*dz[k]*dz[k];
-                ta12 += wt*dx[k]*dy[k];
-                ta13 += wt*dx[k]*dz[k];
-                ta23 += wt*dy[k]*dz[k];
-            }
-            if (jd != (float *)0)
-            {
-                double dt = jd[j];
-                if (dt<0.0) dt = 0.0;
-                A[j    ]  = ta11*dt;
-                A[j+m  ]  = ta22*dt;
-                A[j+m*2]  = ta33*dt;
-                A[j+m*3]  = ta12*dt;
-                A[j+m*4]  = ta13*dt;
-                A[j+m*5]  = ta23*dt;
-                b[j    ]  = tb1*dt;
-                b[j+m  ]  = tb2*dt;
-                b[j+m*2]  = tb3*dt;
-                ssl      -= tss*dt;
+                ssl2 += d*d*dt;
             }
             else
             {
-                A[j    ] = ta11;
-                A[j+m  ] = ta22;
-                A[j+m*2] = ta33;
-                A[j+m*3] = ta12;
-                A[j+m*4] = ta13;
-                A[j+m*5] = ta23;
-                b[j    ] = tb1;
-                b[j+m  ] = tb2;
-                b[j+m*2] = tb3;
-                ssl     -= tss;
-            }
-        }
-    }
-    return(ssl);
-}
-
-static double initialise_objfun2(mwSize dm[], float f[], float g[], float t0[], float J0[], float jd[], float b[], float A[])
-{
-    mwSignedIndex j, m = dm[0]*dm[1]*dm[2];
-    double ssl = 0.0;
-    
-    for(j=0; j<m; j++)
-    {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1, k;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx0, dx1, dx2, dy0, dy1, dy2, dz0, dz1, dz2;
-        double d, dx, dy, dz;
-        double sd, sdx, sdy, sdz, ss;
-
-        x    = t0[j    ]-1.0;
-        y    = t0[j+m  ]-1.0;
-        z    = t0[j+m*2]-1.0;
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-
-        A[j    ] = 0.0;
-        A[j+m  ] = 0.0;
-        A[j+m*2] = 0.0;
-        A[j+m*3] = 0.0;
-        A[j+m*4] = 0.0;
-        A[j+m*5] = 0.0;
-
-        b[j    ] = 0.0;
-        b[j+m  ] = 0.0;
-        b[j+m*2] = 0.0;
-
-        ss  = 0.0;
-        sd  = 0.0;
-        sdx = 0.0;
-        sdy = 0.0;
-        sdz = 0.0;
-
-        for(k=0; k<dm[3]; k++)
-        {
-            mwSignedIndex km = k*m;
-            k000  = f[ix +dm[0]*(iy +dm[1]*iz ) + km];
-            k100  = f[ix1+dm[0]*(iy +dm[1]*iz ) + km];
-            k010  = f[ix +dm[0]*(iy1+dm[1]*iz ) + km];
-            k110  = f[ix1+dm[0]*(iy1+dm[1]*iz ) + km];
-            k001  = f[ix +dm[0]*(iy +dm[1]*iz1) + km];
-            k101  = f[ix1+dm[0]*(iy +dm[1]*iz1) + km];
-            k011  = f[ix +dm[0]*(iy1+dm[1]*iz1) + km];
-            k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1) + km];
-
-            d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-                  + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j+km];
-
-            dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-                  + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
-            dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-                  + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
-            dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-                  - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
-
-            dx   = -(J0[j    ]*dx0 + J0[j+  m]*dy0 + J0[j+2*m]*dz0);
-            dy   = -(J0[j+3*m]*dx0 + J0[j+4*m]*dy0 + J0[j+5*m]*dz0);
-            dz   = -(J0[j+6*m]*dx0 + J0[j+7*m]*dy0 + J0[j+8*m]*dz0);
-            sd  -= d;
-            sdx -= dx;
-            sdy -= dy;
-            sdz -= dz;
-
-            A[j    ] += dx*dx;
-            A[j+m  ] += dy*dy;
-            A[j+m*2] += dz*dz;
-            A[j+m*3] += dx*dy;
-            A[j+m*4] += dx*dz;
-            A[j+m*5] += dy*dz;
-
-            b[j    ] += dx*d;
-            b[j+m  ] += dy*d;
-            b[j+m*2] += dz*d;
-
-            ss       += d*d;
-        }
-        A[j    ] += sdx*sdx;
-        A[j+m  ] += sdy*sdy;
-        A[j+m*2] += sdz*sdz;
-        A[j+m*3] += sdx*sdy;
-        A[j+m*4] += sdx*sdz;
-        A[j+m*5] += sdy*sdz;
-
-        b[j    ] += sdx*sd;
-        b[j+m  ] += sdy*sd;
-        b[j+m*2] += sdz*sd;
-
-        ss       += sd*sd;
-        
-        if (jd != (float *)0)
-        {
-            double dt = jd[j];
-            if (dt<0.0) dt = 0.0;
-            A[j    ] *=dt;
-            A[j+m  ] *=dt;
-            A[j+m*2] *=dt;
-            A[j+m*3] *=dt;
-            A[j+m*4] *=dt;
-            A[j+m*5] *=dt;
-            b[j    ] *=dt;
-            b[j+m  ] *=dt;
-            b[j+m*2] *=dt;
-            ss       *=dt;
-        }
-        ssl += ss;
-    }
-    return(0.5*ssl);
-}
+                double sd = 0.0, sdx = 0.0, sdy = 0.0, sdz = 0.0, ss = 0.0;
 
-static double initialise_objfun(mwSize dm[], float f[], float g[], float t0[], float J0[], float jd[], float b[], float A[])
-{
-    mwSignedIndex j, m = dm[0]*dm[1]*dm[2];
-    double ssl = 0.0, dt = 1.0;
+                A[j    ] = 0.0;
+                A[j+m  ] = 0.0;
+                A[j+m*2] = 0.0;
+                A[j+m*3] = 0.0;
+                A[j+m*4] = 0.0;
+                A[j+m*5] = 0.0;
 
-    if (dm[3]>1)
-    {
-        return(initialise_objfun2(dm, f, g, t0, J0, jd, b, A));
-    }
+                b[j    ] = 0.0;
+                b[j+m  ] = 0.0;
+                b[j+m*2] = 0.0;
 
-    for(j=0; j<m; j++)
-    {
-        double x, y, z;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx0, dx1, dx2, dy0, dy1, dy2, dz0, dz1, dz2;
-        double d, dx, dy, dz;
-
-        x    = t0[j    ]-1.0;
-        y    = t0[j+m  ]-1.0;
-        z    = t0[j+m*2]-1.0;
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix,dm[0]);
-        iy   = bound(iy,dm[1]);
-        iz   = bound(iz,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
-
-        k000  = f[ix +dm[0]*(iy +dm[1]*iz )];
-        k100  = f[ix1+dm[0]*(iy +dm[1]*iz )];
-        k010  = f[ix +dm[0]*(iy1+dm[1]*iz )];
-        k110  = f[ix1+dm[0]*(iy1+dm[1]*iz )];
-        k001  = f[ix +dm[0]*(iy +dm[1]*iz1)];
-        k101  = f[ix1+dm[0]*(iy +dm[1]*iz1)];
-        k011  = f[ix +dm[0]*(iy1+dm[1]*iz1)];
-        k111  = f[ix1+dm[0]*(iy1+dm[1]*iz1)];
-
-        d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-              + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j];
-        dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
-              + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
-        dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
-              + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
-        dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
-              - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
-
-        dx   = -(J0[j    ]*dx0 + J0[j+  m]*dy0 + J0[j+2*m]*dz0);
-        dy   = -(J0[j+3*m]*dx0 + J0[j+4*m]*dy0 + J0[j+5*m]*dz0);
-        dz   = -(J0[j+6*m]*dx0 + J0[j+7*m]*dy0 + J0[j+8*m]*dz0);
-
-        if (jd != (float *)0)
-        {
-            dt = jd[j];
-            if (dt<0.0) dt = 0.0;
-        }
+                for(k=0; k<dm[3]; k++)
+                {
+                    float *fk = f + k*m;
+                    k000  = fk[o[0]];
+                    k100  = fk[o[1]];
+                    k010  = fk[o[2]];
+                    k110  = fk[o[3]];
+                    k001  = fk[o[4]];
+                    k101  = fk[o[5]];
+                    k011  = fk[o[6]];
+                    k111  = fk[o[7]];
+
+                    d     = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
+                          + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 - g[j+k*m];
+                    dx0   = ((k000     - k100    )*dy2 + (k010     - k110    )*dy1)*dz2
+                          + ((k001     - k101    )*dy2 + (k011     - k111    )*dy1)*dz1;
+                    dy0   = ((k000*dx2 + k100*dx1)     - (k010*dx2 + k110*dx1)    )*dz2
+                          + ((k001*dx2 + k101*dx1)     - (k011*dx2 + k111*dx1)    )*dz1;
+                    dz0   = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)
+                          - ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1);
+                    OBJ_GRAD(w, j, m, dx0, dy0, dz0, dx, dy, dz)
+
+                    sd  -= d;
+                    sdx -= dx;
+                    sdy -= dy;
+                    sdz -= dz;
+
+                    A[j    ] += dx*dx;
+                    A[j+m  ] += dy*dy;
+                    A[j+m*2] += dz*dz;
+                    A[j+m*3] += dx*dy;
+                    A[j+m*4] += dx*dz;
+                    A[j+m*5] += dy*dz;
+
+                    b[j    ] += dx*d;
+                    b[j+m  ] += dy*d;
+                    b[j+m*2] += dz*d;
+
+                    ss += d*d;
+                }
+                A[j    ] += sdx*sdx;
+                A[j+m  ] += sdy*sdy;
+                A[j+m*2] += sdz*sdz;
+                A[j+m*3] += sdx*sdy;
+                A[j+m*4] += sdx*sdz;
+                A[j+m*5] += sdy*sdz;
 
-        A[j    ] = dx*dx*dt;
-        A[j+m  ] = dy*dy*dt;
-        A[j+m*2] = dz*dz*dt;
-        A[j+m*3] = dx*dy*dt;
-        A[j+m*4] = dx*dz*dt;
-        A[j+m*5] = dy*dz*dt;
+                b[j    ] += sdx*sd;
+                b[j+m  ] += sdy*sd;
+                b[j+m*2] += sdz*sd;
 
-        b[j    ] = dx*d*dt;
-        b[j+m  ] = dy*d*dt;
-        b[j+m*2] = dz*d*dt;
+                ss += sd*sd;
 
-        ssl += d*d*dt;
+                if (jd != (float *)0)
+                {
+                    A[j    ] *=dt;
+                    A[j+m  ] *=dt;
+                    A[j+m*2] *=dt;
+                    A[j+m*3] *=dt;
+                    A[j+m*4] *=dt;
+                    A[j+m*5] *=dt;
+                    b[j    ] *=dt;
+                    b[j+m  ] *=dt;
+                    b[j+m*2] *=dt;
+                    ss       *=dt;
+                }
+                ssl2 += ss;
+            }
+        }
+        sslp[j2] = ssl2;
     }
+
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
+        ssl += sslp[j2];
     return(0.5*ssl);
 }
 
@@ -1059,69 +668,46 @@ static void squaring(mwSize dm[], int k, int save_transf, float b[], float A[],
         chol3(m, A);
 #endif
 
-        for(j=0; j<m; j++)
+        /* Blocks of J'*b and J'*A*J, where b and A are sampled at the
+           transformed points */
+        #pragma omp parallel for schedule(static) if(m>=PAR_MIN)
+        for(j=0; j<m; j+=MAT33_BLOCK)
         {
-            double x, y, z;
-            double j00, j01, j02, j10, j11, j12, j20, j21, j22, dt;
-            double a00, a11, a22, a01, a02, a12;
-            double b0, b1, b2, tmp0, tmp1, tmp2;
-            double as[6], bs[3];
-
-            /*
-            syms j00 j01 j02 j10 j11 j12 j20 j21 j22
-            syms a00 a11 a22 a01 a02 a12
-            syms b0 b1 b2
-            J = [j00 j01 j02; j10 j11 j12; j20 j21 j22];
-            A = [a00 a01 a02; a01 a11 a12; a02 a12 a22];
-            b = [b0; b1; b2];
-            J.'*b
-            J.'*A*J
-            */
-
-            x   = t0[j    ]-1.0;
-            y   = t0[j+m  ]-1.0;
-            z   = t0[j+m*2]-1.0;
-
-            j00 = J0[j    ]; j01 = J0[j+m*3]; j02 = J0[j+m*6];
-            j10 = J0[j+m  ]; j11 = J0[j+m*4]; j12 = J0[j+m*7];
-            j20 = J0[j+m*2]; j21 = J0[j+m*5]; j22 = J0[j+m*8];
-
-            dt  = j00*(j11*j22-j12*j21)+j10*(j02*j21-j01*j22)+j20*(j01*j12-j02*j11);
-
-            /* J'*b */
-            sampn(dm, b, 3, m, x, y, z, bs);
-            b0 = bs[0];
-            b1 = bs[1];
-            b2 = bs[2];
-
-            buf1[j    ] = dt*(b0*j00+b1*j10+b2*j20);
-            buf1[j+m  ] = dt*(b0*j01+b1*j11+b2*j21);
-            buf1[j+m*2] = dt*(b0*j02+b1*j12+b2*j22);
-
-            /* J'*A*J */
-            sampn(dm, A, 6, m, x, y, z, as);
-            a00 = as[0];
-            a11 = as[1];
-            a22 = as[2];
-            a01 = as[3];
-            a02 = as[4];
-            a12 = as[5];
-
-            /* rearranged for speed */
-            tmp0        = j00*a00+j10*a01+j20*a02;
-            tmp1        = j00*a01+j10*a11+j20*a12;
-            tmp2        = j00*a02+j10*a12+j20*a22;
-            buf2[j    ] = dt*(tmp0*j00+tmp1*j10+tmp2*j20);
-            buf2[j+m*3] = dt*(tmp0*j01+tmp1*j11+tmp2*j21);
-            buf2[j+m*4] = dt*(tmp0*j02+tmp1*j12+tmp2*j22);
-
-            tmp0        = j01*a00+j11*a01+j21*a02;
-            tmp1        = j01*a01+j11*a11+j21*a12;
-            tmp2        = j01*a02+j11*a12+j21*a22;
-            buf2[j+m  ] = dt*(tmp0*j01+tmp1*j11+tmp2*j21);
-            buf2[j+m*5] = dt*(tmp0*j02+tmp1*j12+tmp2*j22);
-
-            buf2[j+m*2] = dt*((j02*a00+j12*a01+j22*a02)*j02+(j02*a01+j12*a11+j22*a12)*j12+(j02*a02+j12*a12+j22*a22)*j22);
+            double J[9][MAT33_BLOCK], as[6][MAT33_BLOCK], bs[3][MAT33_BLOCK];
+            mwSignedIndex p, l, nb = (m-j<MAT33_BLOCK) ? m-j : MAT33_BLOCK;
+
+            for(p=0; p<nb; p++)
+            {
+                double x, y, z, s[6];
+                x   = t0[j+p    ]-1.0;
+                y   = t0[j+p+m  ]-1.0;
+                z   = t0[j+p+m*2]-1.0;
+                sampn(dm, b, 3, m, x, y, z, s);
+                for(l=0; l<3; l++) bs[l][p] = s[l];
+                sampn(dm, A, 6, m, x, y, z, s);
+                for(l=0; l<6; l++) as[l][p] = s[l];
+            }
+            for(l=0; l<9; l++)
+                for(p=0; p<nb; p++)
+                    J[l][p] = J0[j+p+m*l];
+            if (nb<MAT33_BLOCK)
+            {
+                eye33_blk(nb, J);
+                for(p=nb; p<MAT33_BLOCK; p++)
+                {
+                    for(l=0; l<3; l++) bs[l][p] = 0.0;
+                    for(l=0; l<6; l++) as[l][p] = 0.0;
+                }
+            }
+
+            jtaj33_blk(J, as, bs);
+
+            for(l=0; l<3; l++)
+                for(p=0; p<nb; p++)
+                    buf1[j+p+m*l] = bs[l][p];
+            for(l=0; l<6; l++)
+                for(p=0; p<nb; p++)
+                    buf2[j+p+m*l] = as[l][p];
         }
 
 #ifdef CHOL
@@ -1129,7 +715,9 @@ static void squaring(mwSize dm[], int k, int save_transf, float b[], float A[],
         chol3recon(m, buf2);
 #endif
 
+        #pragma omp parallel for schedule(static) if(m>=PAR_MIN)
         for(j=0; j<m*3; j++) b[j] += buf1[j];
+        #pragma omp parallel for schedule(static) if(m>=PAR_MIN)
         for(j=0; j<m*6; j++) A[j] += buf2[j];
         if (save_transf || (i<k-1))
         {
@@ -1148,7 +736,10 @@ static void squaring(mwSize dm[], int k, int save_transf, float b[], float A[],
     }
 }
 
-mwSize iteration_scratchsize(mwSize dm[], int code, int k)
+/* Scratch for iteration, in floats.  The per-plane sums of the objective
+   function (dm[2] doubles) go at the end, at an even offset, so they are
+   aligned if the scratch is. */
+static mwSize iteration_floats(mwSize dm[], int code, int k)
 {
     mwSignedIndex m1, m2;
     mwSignedIndex m = dm[0]*dm[1]*dm[2];
@@ -1156,22 +747,20 @@ mwSize iteration_scratchsize(mwSize dm[], int code, int k)
     {
         m1 = 30*m;
         if (code==1) m1 += 9*m;
-        m2 = 9*m+fmg3_scratchsize(dm,1);
-        if (m1>m2)
-            return(m1);
-        else
-            return(m2);
     }
     else
     {
         m1 = 9*m;
         if (code==1) m1 += 6*m;
-        m2 = 9*m + fmg3_scratchsize(dm,1);
-        if (m1>m2)
-            return(m1);
-        else
-            return(m2);
     }
+    m2 = 9*m + fmg3_scratchsize(dm,1);
+    if (m2>m1) m1 = m2;
+    return(2*((m1+1)/2));
+}
+
+mwSize iteration_scratchsize(mwSize dm[], int code, int k)
+{
+    return(iteration_floats(dm, code, k) + 2*dm[2]);
 }
 
 void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
@@ -1181,9 +770,11 @@ void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
     float *sbuf;
     float *b, *A;
     double ssl, ssp, sc;
-    static double param[] = {1.0,1.0,1.0,0.0,0.0,0.0,0.0,0.0};
+    double param[] = {1.0,1.0,1.0,0.0,0.0,0.0,0.0,0.0};
     mwSignedIndex m = dm[0]*dm[1]*dm[2];
     mwSignedIndex j;
+    OBJ_WARP w;
+    double *sslp = (double *)(buf + iteration_floats(dm, code, k));
 
     /*
         Allocate memory.
@@ -1204,20 +795,25 @@ void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
 
         sc = 1.0/pow2(k);
         expdef(dm, k, 1.0, v, t0, t1, J0, J1);
-        jac_div_smalldef(dm, sc, v, J0);
+        w.v   = (float *)0;
+        w.sc  = 0.0;
+        w.t0  = t0;
+        w.J0  = J0;
+        w.vj  = v;
+        w.jsc = sc;
         if (code==2)
-            ssl = initialise_objfun_mn(dm, f, g, t0, J0, jd, b, A);
+            ssl = objfun_mn(dm, f, g, &w, jd, b, A, sslp);
         else
-            ssl = initialise_objfun(dm, f, g, t0, J0, jd, b, A);
+            ssl = objfun_ss(dm, f, g, &w, jd, b, A, sslp);
         smalldef_jac(dm, -sc, v, t0, J0);
         squaring(dm, k, code==1, b, A, t0, t1, J0, J1);
         if (code==1)
         {
             float *b1, *A1;
-            A1   = buf + 30*m;
-            b1   = buf + 36*m;
-            jac_div_smalldef(dm, -sc, v, J0);
-            ssl += initialise_objfun(dm, g, f, t0, J0, (float *)0, b1, A1);
+            A1    = buf + 30*m;
+            b1    = buf + 36*m;
+            w.jsc = -sc;
+            ssl  += objfun_ss(dm, g, f, &w, (float *)0, b1, A1, sslp);
             smalldef_jac(dm, sc, v, t0, J0);
             squaring(dm, k, 0, b1, A1, t0, t1, J0, J1);
             for(j=0; j<m*3; j++) b[j] -= b1[j];
@@ -1226,17 +822,24 @@ void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
     }
     else
     {
-        sc  = 1.0;
+        sc    = 1.0;
+        w.v   = v;
+        w.sc  = 1.0;
+        w.t0  = (float *)0;
+        w.J0  = (float *)0;
+        w.vj  = (float *)0;
+        w.jsc = 0.0;
         if (code==2)
-            ssl = smalldef_objfun_mn(dm, f, g, v, jd, 1.0, b, A);
+            ssl = objfun_mn(dm, f, g, &w, jd, b, A, sslp);
         else
-            ssl = smalldef_objfun(dm, f, g, v, jd, 1.0, b, A);
+            ssl = objfun_ss(dm, f, g, &w, jd, b, A, sslp);
         if (code==1)
         {
             float *b1, *A1;
             A1   = buf + 6*m;
             b1   = buf + 12*m;
-            ssl += smalldef_objfun(dm, g, f, v, (float *)0, -1.0, b1, A1);
+            w.sc = -1.0;
+            ssl += objfun_ss(dm, g, f, &w, (float *)0, b1, A1, sslp);
             for(j=0; j<m*3; j++) b[j] -= b1[j];
             for(j=0; j<m*6; j++) A[j] += A1[j];
         }
@@ -1260,6 +863,7 @@ void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
     ll[0] = ssl;
     ll[1] = ssp*0.5;
     ll[2] = norm(m*3,b);
+    if (tele_active()) tele_objective(ll);
 
     for(j=0; j<m*6; j++) A[j] *= sc;
 
@@ -1278,6 +882,25 @@ void iteration(mwSize dm[], int k, float v[], float g[], float f[], float jd[],
     for(j=0; j<m*3; j++) ov[j] = v[j] - sbuf[j];
 }
 
+static void get_params(const mxArray *prm, double param[], double *lmreg0, int *cycles, int *its, int *k, int *code)
+{
+    mwSize n = mxGetNumberOfElements(prm);
+    double *p = mxGetPr(prm);
+    if (n >10)
+        mexErrMsgTxt("Fourth argument should contain param1, param2, param3, param4, param5, LMreg, ncycles, nits, nsamps and code.");
+    if (n >=1) param[3] = p[0];
+    if (n >=2) param[4] = p[1];
+    if (n >=3) param[5] = p[2];
+    if (n >=4) param[6] = p[3];
+    if (n >=5) param[7] = p[4];
+
+    if (n >=6) *lmreg0 = p[5];
+    if (n >=7) *cycles = p[6];
+    if (n >=8) *its    = p[7];
+    if (n >=9) *k      = p[8];
+    if (n >=10) *code  = p[9];
+}
+
 void dartel_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[])
 {
     int        i, k=10, cycles=4, its=2, code=0;
@@ -1335,19 +958,7 @@ void dartel_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray
             mexErrMsgTxt("Incompatible 3rd dimension.");
         jd = (float *)mxGetPr(prhs[4]);
     }
-    if (mxGetNumberOfElements(prhs[3]) >10)
-        mexErrMsgTxt("Fourth argument should contain param1, param2, param3, param4, param5, LMreg, ncycles, nits, nsamps and code.");
-    if (mxGetNumberOfElements(prhs[3]) >=1) param[3] = mxGetPr(prhs[3])[0];
-    if (mxGetNumberOfElements(prhs[3]) >=2) param[4] = mxGetPr(prhs[3])[1];
-    if (mxGetNumberOfElements(prhs[3]) >=3) param[5] = mxGetPr(prhs[3])[2];
-    if (mxGetNumberOfElements(prhs[3]) >=4) param[6] = mxGetPr(prhs[3])[3];
-    if (mxGetNumberOfElements(prhs[3]) >=5) param[7] = mxGetPr(prhs[3])[4];
-
-    if (mxGetNumberOfElements(prhs[3]) >=6) lmreg0 = mxGetPr(prhs[3])[5];
-    if (mxGetNumberOfElements(prhs[3]) >=7) cycles = mxGetPr(prhs[3])[6];
-    if (mxGetNumberOfElements(prhs[3]) >=8) its    = mxGetPr(prhs[3])[7];
-    if (mxGetNumberOfElements(prhs[3]) >=9) k      = mxGetPr(prhs[3])[8];
-    if (mxGetNumberOfElements(prhs[3]) >=10) code  = mxGetPr(prhs[3])[9];
+    get_params(prhs[3], param, &lmreg0, &cycles, &its, &k, &code);
 
     plhs[0] = mxCreateNumericArray(4,dm, mxSINGLE_CLASS, mxREAL);
     plhs[1] = mxCreateNumericArray(2,nll, mxDOUBLE_CLASS, mxREAL);
@@ -1358,7 +969,7 @@ void dartel_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray
     ov      = (float *)mxGetPr(plhs[0]);
     ll      = (double*)mxGetPr(plhs[1]);
 
-    scratch = (float *)mxCalloc(iteration_scratchsize((mwSize *)dm, code,k),sizeof(float));
+    scratch = scratch_get(iteration_scratchsize((mwSize *)dm, code,k));
 
     dm[3] = 1;
     if (mxGetNumberOfDimensions(prhs[1])>=4)
@@ -1367,7 +978,135 @@ void dartel_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray
     /* set_bound(0); */
     iteration(dm, k, v, g, f, jd, param, lmreg0, cycles, its, code,
               ov, ll, scratch);
-    mxFree((void *)scratch);
+    scratch_put(scratch);
+}
+
+/*
+ * Dartel iterations for a number of subjects, which are all matched to the
+ * same template (see spm_dartel_template.m).  Once the velocity of a
+ * subject has been updated, its images are pushed into the space of the
+ * template by the resulting deformation, and these are summed over
+ * subjects, along with the pushed voxel counts.
+ *
+ * Subjects are processed in rounds of one per thread, and each thread has
+ * its own scratch memory.  The pushed images of a round are added in to
+ * the sums in order of subject, so the results do not depend on the number
+ * of threads.
+ */
+void dartel_batch_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[])
+{
+    int        i, k=10, cycles=4, its=2, code=0;
+    mwSize     dm[5], dmt[4], nd, n, nc, m, nt, s0, bsz, wsz, npo;
+    double     lmreg0=0.0, *ll;
+    float      *v, *g, *f, *ov, *t, *scratch;
+    double     param[] = {1.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+    mwSize     nll[2];
+
+    if (nrhs!=4 || nlhs>3)
+        mexErrMsgTxt("Incorrect usage");
+
+    for(i=0; i<3; i++)
+        if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) || mxIsSparse(prhs[i]) || !mxIsSingle(prhs[i]))
+            mexErrMsgTxt("Data must be numeric, real, full and single");
+
+    if (!mxIsNumeric(prhs[3]) || mxIsComplex(prhs[3]) || mxIsSparse(prhs[3]) || !mxIsDouble(prhs[3]))
+            mexErrMsgTxt("Data must be numeric, real, full and double");
+
+    nd = mxGetNumberOfDimensions(prhs[0]);
+    if (nd!=4 && nd!=5) mexErrMsgTxt("Wrong number of dimensions.");
+    dm[0] = mxGetDimensions(prhs[0])[0];
+    dm[1] = mxGetDimensions(prhs[0])[1];
+    dm[2] = mxGetDimensions(prhs[0])[2];
+    dm[3] = mxGetDimensions(prhs[0])[3];
+    dm[4] = (nd==5) ? mxGetDimensions(prhs[0])[4] : 1;
+
+    if (dm[3]!=3)
+        mexErrMsgTxt("4th dimension of 1st arg must be 3.");
+
+    if (mxGetNumberOfDimensions(prhs[2])>4) mexErrMsgTxt("Wrong number of dimensions.");
+    if (mxGetDimensions(prhs[2])[0] != dm[0])
+        mexErrMsgTxt("Incompatible 1st dimension.");
+    if (mxGetDimensions(prhs[2])[1] != dm[1])
+        mexErrMsgTxt("Incompatible 2nd dimension.");
+    if (mxGetNumberOfDimensions(prhs[2])>=3 && mxGetDimensions(prhs[2])[2] != dm[2])
+        mexErrMsgTxt("Incompatible 3rd dimension.");
+
+    m  = dm[0]*dm[1]*dm[2];
+    n  = dm[4];
+    nc = mxGetNumberOfElements(prhs[2])/m;
+
+    if (mxGetNumberOfDimensions(prhs[1])>5) mexErrMsgTxt("Wrong number of dimensions.");
+    if (mxGetDimensions(prhs[1])[0] != dm[0])
+        mexErrMsgTxt("Incompatible 1st dimension.");
+    if (mxGetDimensions(prhs[1])[1] != dm[1])
+        mexErrMsgTxt("Incompatible 2nd dimension.");
+    if (mxGetNumberOfElements(prhs[1]) != m*nc*n)
+        mexErrMsgTxt("Incompatible number of images.");
+
+    get_params(prhs[3], param, &lmreg0, &cycles, &its, &k, &code);
+
+    dmt[0]  = dm[0];
+    dmt[1]  = dm[1];
+    dmt[2]  = dm[2];
+    dmt[3]  = nc+1;
+    nll[0]  = 3;
+    nll[1]  = n;
+    plhs[0] = mxCreateNumericArray(nd,mxGetDimensions(prhs[0]), mxSINGLE_CLASS, mxREAL);
+    plhs[1] = mxCreateNumericArray(2,nll, mxDOUBLE_CLASS, mxREAL);
+    plhs[2] = mxCreateNumericArray(4,dmt, mxSINGLE_CLASS, mxREAL);
+
+    v       = (float *)mxGetPr(prhs[0]);
+    g       = (float *)mxGetPr(prhs[1]);
+    f       = (float *)mxGetPr(prhs[2]);
+    ov      = (float *)mxGetPr(plhs[0]);
+    ll      = (double*)mxGetPr(plhs[1]);
+    t       = (float *)mxGetPr(plhs[2]);
+
+    /* Per thread: workspace for the multiscale operators (doubles),
+       pushed images and counts, then the scratch used by iteration
+       (which is later reused for the deformation). */
+    nt  = omp_get_max_threads();
+    if (nt>n) nt = n;
+    wsz = multiscale_workspace_size(dm);
+    npo = 2*(((nc+1)*m+1)/2);
+    bsz = 2*wsz + npo + iteration_scratchsize(dm,code,k);
+    scratch = scratch_get(nt*bsz);
+
+    dm[3] = nc;
+    for(s0=0; s0<n; s0+=nt)
+    {
+        mwSignedIndex r, j, nr = (n-s0<nt) ? n-s0 : nt;
+
+        #pragma omp parallel for schedule(static,1) if(nr>1)
+        for(r=0; r<nr; r++)
+        {
+            mwSize s    = s0+r;
+            float *buf  = scratch + r*bsz;
+            float *po   = buf + 2*wsz;
+            float *ibuf = po + npo;
+            mwSignedIndex j1;
+
+            multiscale_workspace((double *)buf, wsz);
+            iteration(dm, k, v+s*3*m, g+s*nc*m, f, (float *)0, param, lmreg0, cycles, its, code,
+                      ov+s*3*m, ll+s*3, ibuf);
+            multiscale_workspace((double *)0, 0);
+
+            expdef(dm, k, 1.0, ov+s*3*m, ibuf, ibuf+3*m, (float *)0, (float *)0);
+            unwrap(dm, ibuf);
+            for(j1=0; j1<(nc+1)*m; j1++) po[j1] = 0.0f;
+            push(dm, m, nc, ibuf, g+s*nc*m, po, po+nc*m);
+        }
+
+        #pragma omp parallel for schedule(static) private(r) if((nc+1)*m>=PAR_MIN)
+        for(j=0; j<(mwSignedIndex)((nc+1)*m); j++)
+        {
+            float tj = t[j];
+            for(r=0; r<nr; r++)
+                tj += scratch[r*bsz+2*wsz+j];
+            t[j] = tj;
+        }
+    }
+    scratch_put(scratch);
 }
 
 void exp_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[])
@@ -1403,7 +1142,7 @@ void exp_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *p
 
     plhs[0] = mxCreateNumericArray(nd,dm, mxSINGLE_CLASS, mxREAL);
     t       = (float *)mxGetPr(plhs[0]);
-    t1      = mxCalloc(dm[0]*dm[1]*dm[2]*3,sizeof(float));
+    t1      = scratch_get(dm[0]*dm[1]*dm[2]*3);
 
     /* set_bound(0); */
 
@@ -1424,19 +1163,19 @@ void exp_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *p
             dmj[4]  = 3;
             plhs[1] = mxCreateNumericArray(5,dmj, mxSINGLE_CLASS, mxREAL);
             J       = (float *)mxGetPr(plhs[1]);
-            J1      = mxCalloc(dm[0]*dm[1]*dm[2]*3*3,sizeof(float));
+            J1      = scratch_get(dm[0]*dm[1]*dm[2]*3*3);
             expdef((mwSize *)dm, k, sc, v, t, t1, J, J1);
         }
         else
         {
             plhs[1] = mxCreateNumericArray(3,dmj, mxSINGLE_CLASS, mxREAL);
             J       = (float *)mxGetPr(plhs[1]);
-            J1      = mxCalloc(dm[0]*dm[1]*dm[2],sizeof(float));
+            J1      = scratch_get(dm[0]*dm[1]*dm[2]);
             expdefdet((mwSize *)dm, k, sc, v, t, t1, J, J1);
         }
-        mxFree((void *)J1);
+        scratch_put(J1);
     }
     unwrap((mwSize *)dm, t);
-    mxFree((void *)t1);
+    scratch_put(t1);
 }
 
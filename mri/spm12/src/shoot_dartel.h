@@ -1,5 +1,6 @@
 /* $Id: shoot_dartel.h 4875 2012-08-30 20:04:30Z john $ */
 /* (c) John Ashburner (2011) */
 void dartel_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[]);
+void dartel_batch_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[]);
 void exp_mexFunction(mwSize nlhs, mxArray *plhs[], mwSize nrhs, const mxArray *prhs[]);
 
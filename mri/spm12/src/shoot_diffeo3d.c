@@ -5,8 +5,23 @@
 #include <math.h>
 #include <stdio.h>
 #include "shoot_optim3d.h"
+#include "shoot_mat33.h"
 #include "shoot_expm3.h"
 #include "shoot_boundary.h"
+#include "shoot_farray.h"
+#include "shoot_half.h"
+#include "spm_openmp.h"
+
+/* Smallest number of voxels for which operations are multithreaded */
+#ifndef PAR_MIN
+#define PAR_MIN 32768
+#endif
+
+/* Approximate size of the buffers used by def2jac_stream and the other
+   out-of-core functions */
+#ifndef STREAM_BYTES
+#define STREAM_BYTES (32*1024*1024)
+#endif
 
 extern double   log(double x);
 extern double   exp(double x);
@@ -15,13 +30,43 @@ extern double   exp(double x);
 /*
  * Lie Bracket
  * C = [A,B]
+ *
+ * Rows are split into an interior, where the neighbours along the first
+ * dimension are simply o-1 and o+1 (so the loop can be vectorised), and a
+ * boundary shell of the first and last voxels, where bound() is needed.
+ * Neighbouring rows and planes are looked up once per row.  Planes are
+ * done in parallel.
  */
+#define BRACKET_VOXEL(o,opi,omi,opj,omj,opk,omk) \
+{ \
+    double j00, j01, j02,  j10, j11, j12,  j20, j21, j22; \
+    double tx, ty, tz,  cx1, cy1, cz1,  cx2, cy2, cz2; \
+    tx  = Ax[o]; ty = Ay[o]; tz = Az[o]; \
+    j00 = (Bx[opi]-Bx[omi])/2.0; j01 = (By[opi]-By[omi])/2.0; j02 = (Bz[opi]-Bz[omi])/2.0; \
+    j10 = (Bx[opj]-Bx[omj])/2.0; j11 = (By[opj]-By[omj])/2.0; j12 = (Bz[opj]-Bz[omj])/2.0; \
+    j20 = (Bx[opk]-Bx[omk])/2.0; j21 = (By[opk]-By[omk])/2.0; j22 = (Bz[opk]-Bz[omk])/2.0; \
+    cx1 = tx*j00+ty*j10+tz*j20; \
+    cy1 = tx*j01+ty*j11+tz*j21; \
+    cz1 = tx*j02+ty*j12+tz*j22; \
+    tx  = Bx[o]; ty = By[o]; tz = Bz[o]; \
+    j00 = (Ax[opi]-Ax[omi])/2.0; j01 = (Ay[opi]-Ay[omi])/2.0; j02 = (Az[opi]-Az[omi])/2.0; \
+    j10 = (Ax[opj]-Ax[omj])/2.0; j11 = (Ay[opj]-Ay[omj])/2.0; j12 = (Az[opj]-Az[omj])/2.0; \
+    j20 = (Ax[opk]-Ax[omk])/2.0; j21 = (Ay[opk]-Ay[omk])/2.0; j22 = (Az[opk]-Az[omk])/2.0; \
+    cx2 = tx*j00+ty*j10+tz*j20; \
+    cy2 = tx*j01+ty*j11+tz*j21; \
+    cz2 = tx*j02+ty*j12+tz*j22; \
+    Cx[o] = cx2-cx1; \
+    Cy[o] = cy2-cy1; \
+    Cz[o] = cz2-cz1; \
+}
+
 void bracket(mwSize dm[], float *A, float *B, float *C)
 {
     float *Ax, *Ay, *Az;
     float *Bx, *By, *Bz;
     float *Cx, *Cy, *Cz;
-    mwSize i, j, k, mm = dm[0]*dm[1]*dm[2];
+    mwSize mm = dm[0]*dm[1]*dm[2];
+    mwSignedIndex n0 = dm[0], i, j, k;
 
     Ax = A;
     Ay = A + mm;
@@ -35,91 +80,229 @@ void bracket(mwSize dm[], float *A, float *B, float *C)
     Cy = C + mm;
     Cz = C + mm*2;
 
-    for(k=0; k<dm[2]; k++)
+    #pragma omp parallel for schedule(static) private(i,j) if(mm>=PAR_MIN)
+    for(k=0; k<(mwSignedIndex)dm[2]; k++)
     {
-        for(j=0; j<dm[1]; j++)
+        for(j=0; j<(mwSignedIndex)dm[1]; j++)
         {
-            mwSize o1, oi1, opj1, omj1, opk1, omk1;
-            o1   = dm[0]*(j+dm[1]*k);
-            oi1  = dm[0]*(j+dm[1]*k);
-            opj1 = dm[0]*(bound(j+1,dm[1])+dm[1]*k);
-            omj1 = dm[0]*(bound(j-1,dm[1])+dm[1]*k);
-            opk1 = dm[0]*(j+dm[1]*bound(k+1,dm[2]));
-            omk1 = dm[0]*(j+dm[1]*bound(k-1,dm[2]));
+            mwSignedIndex o1, dpj, dmj, dpk, dmk;
+            o1  = n0*(j+dm[1]*k);
+            dpj = n0*(bound(j+1,dm[1])+dm[1]*k) - o1;
+            dmj = n0*(bound(j-1,dm[1])+dm[1]*k) - o1;
+            dpk = n0*(j+dm[1]*bound(k+1,dm[2])) - o1;
+            dmk = n0*(j+dm[1]*bound(k-1,dm[2])) - o1;
+
+            /* Interior of the row */
+            #pragma omp simd
+            for(i=o1+1; i<o1+n0-1; i++)
+                BRACKET_VOXEL(i, i+1, i-1, i+dpj, i+dmj, i+dpk, i+dmk)
+
+            /* Boundary shell */
+            for(i=0; i<n0; i+=(n0>1) ? n0-1 : 1)
+            {
+                mwSignedIndex o = o1+i, opi = o1+bound(i+1,n0), omi = o1+bound(i-1,n0);
+                BRACKET_VOXEL(o, opi, omi, o+dpj, o+dmj, o+dpk, o+dmk)
+            }
+        }
+    }
+}
 
-            for(i=0; i<dm[0]; i++)
+/*
+ * Offsets of the eight neighbours used for trilinear interpolation at
+ * (ix,iy,iz) to (ix+1,iy+1,iz+1), in the order o000, o100, o010, o110,
+ * o001, o101, o011, o111.  The boundary function only needs to be called
+ * when some of them are outside the volume.  If there is a plane map (pm),
+ * only some of the planes are held, and plane iz is at position pm[iz].
+ */
+static void corners(mwSize dm[], mwSignedIndex ix, mwSignedIndex iy, mwSignedIndex iz,
+                    const mwSignedIndex pm[], mwSize o[])
+{
+    mwSignedIndex ix1, iy1, iz1;
+    mwSize tmpz, tmpy;
+
+    if (ix>=0 && ix<(mwSignedIndex)dm[0]-1 &&
+        iy>=0 && iy<(mwSignedIndex)dm[1]-1 &&
+        iz>=0 && iz<(mwSignedIndex)dm[2]-1)
+    {
+        ix1  = ix+1;
+        iy1  = iy+1;
+        iz1  = iz+1;
+    }
+    else
+    {
+        ix   = bound(ix  ,dm[0]);
+        iy   = bound(iy  ,dm[1]);
+        iz   = bound(iz  ,dm[2]);
+        ix1  = bound(ix+1,dm[0]);
+        iy1  = bound(iy+1,dm[1]);
+        iz1  = bound(iz+1,dm[2]);
+    }
+    if (pm)
+    {
+        iz  = pm[iz];
+        iz1 = pm[iz1];
+    }
+
+    tmpz  = dm[1]*iz;
+    tmpy  = dm[0]*(iy + tmpz);
+    o[0]  = ix +tmpy;
+    o[1]  = ix1+tmpy;
+    tmpy  = dm[0]*(iy1 + tmpz);
+    o[2]  = ix +tmpy;
+    o[3]  = ix1+tmpy;
+    tmpz  = dm[1]*iz1;
+    tmpy  = dm[0]*(iy + tmpz);
+    o[4]  = ix +tmpy;
+    o[5]  = ix1+tmpy;
+    tmpy  = dm[0]*(iy1 + tmpz);
+    o[6]  = ix +tmpy;
+    o[7]  = ix1+tmpy;
+}
+
+/*
+ * Trilinear interpolation is done for blocks of SAMP_BLOCK points at a
+ * time.  The floors and weights of all points in a block are computed in
+ * one loop, and the interpolation of each volume in another, which the
+ * compiler can vectorise.  The arithmetic is the same as for samp and
+ * sampn, so the results are identical.
+ */
+#define SAMP_BLOCK 8
+
+typedef struct
+{
+    mwSize o[SAMP_BLOCK][8];
+    double dx1[SAMP_BLOCK], dx2[SAMP_BLOCK];
+    double dy1[SAMP_BLOCK], dy2[SAMP_BLOCK];
+    double dz1[SAMP_BLOCK], dz2[SAMP_BLOCK];
+} SAMP_BLK;
+
+/* Weights and offsets for np (<=SAMP_BLOCK) points, whose coordinates
+   (starting at 1) are in px, py and pz.  pm is a plane map (see corners),
+   or NULL. */
+static void samp_block(mwSize dm[], mwSize np, float px[], float py[], float pz[],
+                       const mwSignedIndex pm[], SAMP_BLK *s)
+{
+    mwSignedIndex ix[SAMP_BLOCK], iy[SAMP_BLOCK], iz[SAMP_BLOCK];
+    mwSize p;
+
+    for(p=0; p<np; p++)
+    {
+        double x, y, z;
+        x         = px[p]-1.0;
+        y         = py[p]-1.0;
+        z         = pz[p]-1.0;
+        ix[p]     = (mwSignedIndex)floor(x); s->dx1[p] = x-ix[p]; s->dx2[p] = 1.0-s->dx1[p];
+        iy[p]     = (mwSignedIndex)floor(y); s->dy1[p] = y-iy[p]; s->dy2[p] = 1.0-s->dy1[p];
+        iz[p]     = (mwSignedIndex)floor(z); s->dz1[p] = z-iz[p]; s->dz2[p] = 1.0-s->dz1[p];
+    }
+    for(p=0; p<np; p++)
+        corners(dm, ix[p], iy[p], iz[p], pm, s->o[p]);
+}
+
+#define SAMP_INTERP(f,s,p) \
+   ((((f)[(s)->o[p][0]]*(s)->dx2[p] + (f)[(s)->o[p][1]]*(s)->dx1[p])*(s)->dy2[p]  \
+   + ((f)[(s)->o[p][2]]*(s)->dx2[p] + (f)[(s)->o[p][3]]*(s)->dx1[p])*(s)->dy1[p])*(s)->dz2[p] \
+  + (((f)[(s)->o[p][4]]*(s)->dx2[p] + (f)[(s)->o[p][5]]*(s)->dx1[p])*(s)->dy2[p]  \
+   + ((f)[(s)->o[p][6]]*(s)->dx2[p] + (f)[(s)->o[p][7]]*(s)->dx1[p])*(s)->dy1[p])*(s)->dz1[p])
+
+/*
+ * Sample n volumes f, whose elements are mmf apart, at the np points
+ * (px,py,pz), giving v (np*n).  If pm is not NULL, f only holds the planes
+ * given by the plane map (see corners).
+ */
+static void samp_pts(mwSize dm[], float f[], mwSize mmf, const mwSignedIndex pm[], mwSize n,
+                     mwSize np, float px[], float py[], float pz[], float v[])
+{
+    mwSignedIndex i0;
+
+    #pragma omp parallel for schedule(static) if(np>=PAR_MIN)
+    for(i0=0; i0<(mwSignedIndex)np; i0+=SAMP_BLOCK)
+    {
+        SAMP_BLK s;
+        mwSize j, p, nb = (np-i0<SAMP_BLOCK) ? np-i0 : SAMP_BLOCK;
+
+        samp_block(dm, nb, px+i0, py+i0, pz+i0, pm, &s);
+        for(j=0; j<n; j++)
+        {
+            float *fj = f+mmf*j, *vj = v+np*j+i0;
+            for(p=0; p<nb; p++)
+                vj[p] = SAMP_INTERP(fj, &s, p);
+        }
+    }
+}
+
+/*
+ * Sample n volumes f (each dm[0]*dm[1]*dm[2]) at the np points of the
+ * deformation def (np*3), giving v (np*n).
+ */
+void sampn_def(mwSize dm[], float f[], mwSize n, mwSize np, float def[], float v[])
+{
+    samp_pts(dm, f, dm[0]*dm[1]*dm[2], (mwSignedIndex *)0, n, np, def, def+np, def+np*2, v);
+}
+
+#define SAMP_INTERP_H(f,l,s,p) \
+   ((((l)[(f)[(s)->o[p][0]]]*(s)->dx2[p] + (l)[(f)[(s)->o[p][1]]]*(s)->dx1[p])*(s)->dy2[p]  \
+   + ((l)[(f)[(s)->o[p][2]]]*(s)->dx2[p] + (l)[(f)[(s)->o[p][3]]]*(s)->dx1[p])*(s)->dy1[p])*(s)->dz2[p] \
+  + (((l)[(f)[(s)->o[p][4]]]*(s)->dx2[p] + (l)[(f)[(s)->o[p][5]]]*(s)->dx1[p])*(s)->dy2[p]  \
+   + ((l)[(f)[(s)->o[p][6]]]*(s)->dx2[p] + (l)[(f)[(s)->o[p][7]]]*(s)->dx1[p])*(s)->dy1[p])*(s)->dz1[p])
+
+/*
+ * As sampn_def, but where any of the volumes, the deformation and the
+ * output may be held in half precision (fh, dh and vh, which are used
+ * instead of f, def and v if they are not NULL).  The deformation is
+ * defined on a grid of dimensions dmy, and if held in half precision,
+ * contains displacements from the identity.
+ */
+void sampn_def_half(mwSize dm[], float f[], HALF fh[], mwSize n, mwSize dmy[],
+                    float def[], HALF dh[], float v[], HALF vh[])
+{
+    const float *lut = half_lut();
+    mwSize mm = dm[0]*dm[1]*dm[2], np = dmy[0]*dmy[1]*dmy[2];
+    mwSignedIndex i0;
+
+    #pragma omp parallel for schedule(static) if(np>=PAR_MIN)
+    for(i0=0; i0<(mwSignedIndex)np; i0+=SAMP_BLOCK)
+    {
+        SAMP_BLK s;
+        float px[SAMP_BLOCK], py[SAMP_BLOCK], pz[SAMP_BLOCK];
+        mwSize j, p, nb = (np-i0<SAMP_BLOCK) ? np-i0 : SAMP_BLOCK;
+
+        if (dh)
+        {
+            half_decode_def(dmy, i0, nb, dh, lut, px, py, pz);
+            samp_block(dm, nb, px, py, pz, (mwSignedIndex *)0, &s);
+        }
+        else
+            samp_block(dm, nb, def+i0, def+np+i0, def+np*2+i0, (mwSignedIndex *)0, &s);
+
+        for(j=0; j<n; j++)
+        {
+            for(p=0; p<nb; p++)
             {
-                mwSize o, opi, omi, opj, omj, opk, omk;
-                double j00, j01, j02,  j10, j11, j12,  j20, j21, j22;
-                double tx, ty, tz,  cx1, cy1, cz1,  cx2, cy2, cz2;
-
-                o   = i+o1;
-                opi = bound(i+1,dm[0])+oi1;
-                omi = bound(i-1,dm[0])+oi1;
-                opj = i+opj1;
-                omj = i+omj1;
-                opk = i+opk1;
-                omk = i+omk1;
-
-                tx = Ax[o];
-                ty = Ay[o];
-                tz = Az[o];
-
-                j00 = (Bx[opi]-Bx[omi])/2.0;
-                j01 = (By[opi]-By[omi])/2.0;
-                j02 = (Bz[opi]-Bz[omi])/2.0;
-
-                j10 = (Bx[opj]-Bx[omj])/2.0;
-                j11 = (By[opj]-By[omj])/2.0;
-                j12 = (Bz[opj]-Bz[omj])/2.0;
-
-                j20 = (Bx[opk]-Bx[omk])/2.0;
-                j21 = (By[opk]-By[omk])/2.0;
-                j22 = (Bz[opk]-Bz[omk])/2.0;
-
-                cx1 = tx*j00+ty*j10+tz*j20;
-                cy1 = tx*j01+ty*j11+tz*j21;
-                cz1 = tx*j02+ty*j12+tz*j22;
-
-                tx = Bx[o];
-                ty = By[o];
-                tz = Bz[o];
-
-                j00 = (Ax[opi]-Ax[omi])/2.0;
-                j01 = (Ay[opi]-Ay[omi])/2.0;
-                j02 = (Az[opi]-Az[omi])/2.0;
-
-                j10 = (Ax[opj]-Ax[omj])/2.0;
-                j11 = (Ay[opj]-Ay[omj])/2.0;
-                j12 = (Az[opj]-Az[omj])/2.0;
-
-                j20 = (Ax[opk]-Ax[omk])/2.0;
-                j21 = (Ay[opk]-Ay[omk])/2.0;
-                j22 = (Az[opk]-Az[omk])/2.0;
-
-                cx2 = tx*j00+ty*j10+tz*j20;
-                cy2 = tx*j01+ty*j11+tz*j21;
-                cz2 = tx*j02+ty*j12+tz*j22;
-
-                Cx[o] = cx2-cx1;
-                Cy[o] = cy2-cy1;
-                Cz[o] = cz2-cz1;
+                float t = fh ? SAMP_INTERP_H(fh+mm*j, lut, &s, p) : SAMP_INTERP(f+mm*j, &s, p);
+                if (vh)
+                    vh[np*j+i0+p] = float2half(t);
+                else
+                    v[np*j+i0+p]  = t;
             }
         }
     }
 }
 
 /*
- * Composition operations, possibly along with Jacobian matrices
+ * Composition operations, possibly along with Jacobian matrices.
+ * The components of B (and JB) are mmb elements apart, and if pm is not
+ * NULL, only the planes given by the plane map are held (see corners).
  */
 static void composition_stuff(mwSize dm[], mwSize mm,
                               float *B, float *JB, float *A, float *JA,
-                              float *C, float *JC, int flag)
+                              float *C, float *JC, int flag,
+                              mwSize mmb, const mwSignedIndex pm[])
 {
     float *Ax, *Ay, *Az, *JA00, *JA01, *JA02,  *JA10, *JA11, *JA12,  *JA20, *JA21, *JA22;
     float *Bx, *By, *Bz, *JB00, *JB01, *JB02,  *JB10, *JB11, *JB12,  *JB20, *JB21, *JB22;
     float *Cx, *Cy, *Cz, *JC00, *JC01, *JC02,  *JC10, *JC11, *JC12,  *JC20, *JC21, *JC22;
-    mwSize i, mmb = dm[0]*dm[1]*dm[2];
+    mwSignedIndex i0;
 
     /* Does not yet work properly if dimensions of A and B are not identical.
        Still need to figure out why not. */
@@ -149,170 +332,155 @@ static void composition_stuff(mwSize dm[], mwSize mm,
         JC20 = JC+mm*6; JC21 = JC+mm*7; JC22 = JC+mm*8;
     }
 
-    for(i=0; i<mm; i++)
+    /* Each point is independent of the others */
+    #pragma omp parallel for schedule(static) if(mm>=PAR_MIN)
+    for(i0=0; i0<(mwSignedIndex)mm; i0+=SAMP_BLOCK)
     {
-        double x, y, z;
-        double k000, k100, k010, k110, k001, k101, k011, k111;
-        double dx1, dx2, dy1, dy2, dz1, dz2;
-        mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-        mwSize o000, o100, o010, o110, o001, o101, o011, o111;
-        mwSize tmpz, tmpy, n;
-
-        x    = Ax[i]-1.0;
-        y    = Ay[i]-1.0;
-        z    = Az[i]-1.0;
-        ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
-        iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-        iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-        ix   = bound(ix  ,dm[0]);
-        iy   = bound(iy  ,dm[1]);
-        iz   = bound(iz  ,dm[2]);
-        ix1  = bound(ix+1,dm[0]);
-        iy1  = bound(iy+1,dm[1]);
-        iz1  = bound(iz+1,dm[2]);
+        SAMP_BLK s;
+        mwSize p, nb = (mm-i0<SAMP_BLOCK) ? mm-i0 : SAMP_BLOCK;
 
-        tmpz  = dm[1]*iz;
-        tmpy  = dm[0]*(iy + tmpz);
-        o000  = ix +tmpy;
-        o100  = ix1+tmpy;
-        tmpy  = dm[0]*(iy1 + tmpz);
-        o010  = ix +tmpy;
-        o110  = ix1+tmpy;
-        tmpz  = dm[1]*iz1;
-        tmpy  = dm[0]*(iy + tmpz);
-        o001  = ix +tmpy;
-        o101  = ix1+tmpy;
-        tmpy  = dm[0]*(iy1 + tmpz);
-        o011  = ix +tmpy;
-        o111  = ix1+tmpy;
-
-        k000  = Bx[o000]-1.0;
-        k100  = Bx[o100]-1.0;
-        k010  = Bx[o010]-1.0;
-        k110  = Bx[o110]-1.0;
-        k001  = Bx[o001]-1.0;
-        k101  = Bx[o101]-1.0;
-        k011  = Bx[o011]-1.0;
-        k111  = Bx[o111]-1.0;
-
-        n     = dm[0];
-        k100 -= floor((k100-k000)/n+0.5)*n;
-        k010 -= floor((k010-k000)/n+0.5)*n;
-        k110 -= floor((k110-k000)/n+0.5)*n;
-        k001 -= floor((k001-k000)/n+0.5)*n;
-        k101 -= floor((k101-k000)/n+0.5)*n;
-        k011 -= floor((k011-k000)/n+0.5)*n;
-        k111 -= floor((k111-k000)/n+0.5)*n;
-        Cx[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-              + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
-
-        k000  = By[o000]-1.0;
-        k100  = By[o100]-1.0;
-        k010  = By[o010]-1.0;
-        k110  = By[o110]-1.0;
-        k001  = By[o001]-1.0;
-        k101  = By[o101]-1.0;
-        k011  = By[o011]-1.0;
-        k111  = By[o111]-1.0;
-
-        n     = dm[1];
-        k100 -= floor((k100-k000)/n+0.5)*n;
-        k010 -= floor((k010-k000)/n+0.5)*n;
-        k110 -= floor((k110-k000)/n+0.5)*n;
-        k001 -= floor((k001-k000)/n+0.5)*n;
-        k101 -= floor((k101-k000)/n+0.5)*n;
-        k011 -= floor((k011-k000)/n+0.5)*n;
-        k111 -= floor((k111-k000)/n+0.5)*n;
-        Cy[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-              + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
-
-        k000  = Bz[o000]-1.0;
-        k100  = Bz[o100]-1.0;
-        k010  = Bz[o010]-1.0;
-        k110  = Bz[o110]-1.0;
-        k001  = Bz[o001]-1.0;
-        k101  = Bz[o101]-1.0;
-        k011  = Bz[o011]-1.0;
-        k111  = Bz[o111]-1.0;
-
-        n     = dm[2];
-        k100 -= floor((k100-k000)/n+0.5)*n;
-        k010 -= floor((k010-k000)/n+0.5)*n;
-        k110 -= floor((k110-k000)/n+0.5)*n;
-        k001 -= floor((k001-k000)/n+0.5)*n;
-        k101 -= floor((k101-k000)/n+0.5)*n;
-        k011 -= floor((k011-k000)/n+0.5)*n;
-        k111 -= floor((k111-k000)/n+0.5)*n;
-        Cz[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
-              + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
-
-        if (JC)
+        samp_block(dm, nb, Ax+i0, Ay+i0, Az+i0, pm, &s);
+        for(p=0; p<nb; p++)
         {
-            if (flag==0)
-            {
-                float *ptr;
-                double ja0, ja1, ja2;
-                double jb[3][3];
-
-                ptr      = JB00;
-                jb[0][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-                ptr      = JB10;
-                jb[1][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-                ptr      = JB20;
-                jb[2][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-
-                ptr      = JB01;
-                jb[0][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-                ptr      = JB11;
-                jb[1][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-                ptr      = JB21;
-                jb[2][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-
-                ptr      = JB02;
-                jb[0][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-
-                ptr      = JB12;
-                jb[1][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-
-                ptr      = JB22;
-                jb[2][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
-                         + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
-
-                ja0     = JA00[i];
-                ja1     = JA01[i];
-                ja2     = JA02[i];
-                JC00[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
-                JC01[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
-                JC02[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
-
-                ja0     = JA10[i];
-                ja1     = JA11[i];
-                ja2     = JA12[i];
-                JC10[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
-                JC11[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
-                JC12[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
-
-                ja0     = JA20[i];
-                ja1     = JA21[i];
-                ja2     = JA22[i];
-                JC20[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
-                JC21[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
-                JC22[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
-            }
-            else
+            double k000, k100, k010, k110, k001, k101, k011, k111;
+            double dx1, dx2, dy1, dy2, dz1, dz2;
+            mwSize o000, o100, o010, o110, o001, o101, o011, o111;
+            mwSize i = i0+p, n;
+
+            dx1  = s.dx1[p]; dx2 = s.dx2[p];
+            dy1  = s.dy1[p]; dy2 = s.dy2[p];
+            dz1  = s.dz1[p]; dz2 = s.dz2[p];
+            o000 = s.o[p][0]; o100 = s.o[p][1]; o010 = s.o[p][2]; o110 = s.o[p][3];
+            o001 = s.o[p][4]; o101 = s.o[p][5]; o011 = s.o[p][6]; o111 = s.o[p][7];
+
+            k000  = Bx[o000]-1.0;
+            k100  = Bx[o100]-1.0;
+            k010  = Bx[o010]-1.0;
+            k110  = Bx[o110]-1.0;
+            k001  = Bx[o001]-1.0;
+            k101  = Bx[o101]-1.0;
+            k011  = Bx[o011]-1.0;
+            k111  = Bx[o111]-1.0;
+
+            n     = dm[0];
+            k100 -= floor((k100-k000)/n+0.5)*n;
+            k010 -= floor((k010-k000)/n+0.5)*n;
+            k110 -= floor((k110-k000)/n+0.5)*n;
+            k001 -= floor((k001-k000)/n+0.5)*n;
+            k101 -= floor((k101-k000)/n+0.5)*n;
+            k011 -= floor((k011-k000)/n+0.5)*n;
+            k111 -= floor((k111-k000)/n+0.5)*n;
+            Cx[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
+                  + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
+
+            k000  = By[o000]-1.0;
+            k100  = By[o100]-1.0;
+            k010  = By[o010]-1.0;
+            k110  = By[o110]-1.0;
+            k001  = By[o001]-1.0;
+            k101  = By[o101]-1.0;
+            k011  = By[o011]-1.0;
+            k111  = By[o111]-1.0;
+
+            n     = dm[1];
+            k100 -= floor((k100-k000)/n+0.5)*n;
+            k010 -= floor((k010-k000)/n+0.5)*n;
+            k110 -= floor((k110-k000)/n+0.5)*n;
+            k001 -= floor((k001-k000)/n+0.5)*n;
+            k101 -= floor((k101-k000)/n+0.5)*n;
+            k011 -= floor((k011-k000)/n+0.5)*n;
+            k111 -= floor((k111-k000)/n+0.5)*n;
+            Cy[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
+                  + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
+
+            k000  = Bz[o000]-1.0;
+            k100  = Bz[o100]-1.0;
+            k010  = Bz[o010]-1.0;
+            k110  = Bz[o110]-1.0;
+            k001  = Bz[o001]-1.0;
+            k101  = Bz[o101]-1.0;
+            k011  = Bz[o011]-1.0;
+            k111  = Bz[o111]-1.0;
+
+            n     = dm[2];
+            k100 -= floor((k100-k000)/n+0.5)*n;
+            k010 -= floor((k010-k000)/n+0.5)*n;
+            k110 -= floor((k110-k000)/n+0.5)*n;
+            k001 -= floor((k001-k000)/n+0.5)*n;
+            k101 -= floor((k101-k000)/n+0.5)*n;
+            k011 -= floor((k011-k000)/n+0.5)*n;
+            k111 -= floor((k111-k000)/n+0.5)*n;
+            Cz[i] = ((k000*dx2 + k100*dx1)*dy2 + (k010*dx2 + k110*dx1)*dy1)*dz2
+                  + ((k001*dx2 + k101*dx1)*dy2 + (k011*dx2 + k111*dx1)*dy1)*dz1 + 1.0;
+
+            if (JC)
             {
-                double jb;
-                jb    = ((JB[o000]*dx2 + JB[o100]*dx1)*dy2 + (JB[o010]*dx2 + JB[o110]*dx1)*dy1)*dz2
-                      + ((JB[o001]*dx2 + JB[o101]*dx1)*dy2 + (JB[o011]*dx2 + JB[o111]*dx1)*dy1)*dz1;
-                JC[i] = jb * JA[i];
+                if (flag==0)
+                {
+                    float *ptr;
+                    double ja0, ja1, ja2;
+                    double jb[3][3];
+
+                    ptr      = JB00;
+                    jb[0][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+                    ptr      = JB10;
+                    jb[1][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+                    ptr      = JB20;
+                    jb[2][0] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+
+                    ptr      = JB01;
+                    jb[0][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+                    ptr      = JB11;
+                    jb[1][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+                    ptr      = JB21;
+                    jb[2][1] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+
+                    ptr      = JB02;
+                    jb[0][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+
+                    ptr      = JB12;
+                    jb[1][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+
+                    ptr      = JB22;
+                    jb[2][2] = ((ptr[o000]*dx2 + ptr[o100]*dx1)*dy2 + (ptr[o010]*dx2 + ptr[o110]*dx1)*dy1)*dz2
+                             + ((ptr[o001]*dx2 + ptr[o101]*dx1)*dy2 + (ptr[o011]*dx2 + ptr[o111]*dx1)*dy1)*dz1;
+
+                    ja0     = JA00[i];
+                    ja1     = JA01[i];
+                    ja2     = JA02[i];
+                    JC00[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
+                    JC01[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
+                    JC02[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
+
+                    ja0     = JA10[i];
+                    ja1     = JA11[i];
+                    ja2     = JA12[i];
+                    JC10[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
+                    JC11[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
+                    JC12[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
+
+                    ja0     = JA20[i];
+                    ja1     = JA21[i];
+                    ja2     = JA22[i];
+                    JC20[i] = jb[0][0]*ja0 + jb[1][0]*ja1 + jb[2][0]*ja2;
+                    JC21[i] = jb[0][1]*ja0 + jb[1][1]*ja1 + jb[2][1]*ja2;
+                    JC22[i] = jb[0][2]*ja0 + jb[1][2]*ja1 + jb[2][2]*ja2;
+                }
+                else
+                {
+                    double jb;
+                    jb    = ((JB[o000]*dx2 + JB[o100]*dx1)*dy2 + (JB[o010]*dx2 + JB[o110]*dx1)*dy1)*dz2
+                          + ((JB[o001]*dx2 + JB[o101]*dx1)*dy2 + (JB[o011]*dx2 + JB[o111]*dx1)*dy1)*dz1;
+                    JC[i] = jb * JA[i];
+                }
             }
         }
     }
@@ -324,7 +492,7 @@ static void composition_stuff(mwSize dm[], mwSize mm,
  */
 void composition(mwSize dm[], mwSize mm, float *B, float *A, float *C)
 {
-    composition_stuff(dm, mm, B, 0, A, 0, C, 0,0);
+    composition_stuff(dm, mm, B, 0, A, 0, C, 0,0, dm[0]*dm[1]*dm[2], (mwSignedIndex *)0);
 }
 
 /*
@@ -334,7 +502,7 @@ void composition(mwSize dm[], mwSize mm, float *B, float *A, float *C)
  */
 void composition_jacobian(mwSize dm[], mwSize mm, float *B, float *JB, float *A, float *JA, float *C, float *JC)
 {
-    composition_stuff(dm, mm, B, JB, A, JA, C, JC, 0);
+    composition_stuff(dm, mm, B, JB, A, JA, C, JC, 0, dm[0]*dm[1]*dm[2], (mwSignedIndex *)0);
 }
 
 /*
@@ -344,63 +512,127 @@ void composition_jacobian(mwSize dm[], mwSize mm, float *B, float *JB, float *A,
  */
 void composition_jacdet(mwSize dm[], mwSize mm, float *B, float *JB, float *A, float *JA, float *C, float *JC)
 {
-    composition_stuff(dm, mm, B, JB, A, JA, C, JC, 1);
+    composition_stuff(dm, mm, B, JB, A, JA, C, JC, 1, dm[0]*dm[1]*dm[2], (mwSignedIndex *)0);
 }
 
-static void def2jac_wrap(mwSize dm[], float *Y, float *J, mwSignedIndex s, int code)
+/*
+ * For the np points of a block starting at voxel i0 of a grid of
+ * dimensions dma, the displacements (da) that, added to the interpolated
+ * displacements of B, give the same result as composition with Neumann
+ * boundaries.  Along dimensions where a point (px,py,pz) lies within the
+ * field of view of B, this is just its displacement.  Along the others,
+ * composition interpolates the coordinates of the voxels that the
+ * boundary condition maps the corners to, so da is the interpolation of
+ * these coordinates (from the offsets in s), minus those of the voxel.
+ */
+static void bound_disp(mwSize dm[], mwSize dma[], mwSize i0, mwSize np,
+                       float px[], float py[], float pz[], const SAMP_BLK *s,
+                       double da[3][SAMP_BLOCK])
 {
-    mwSignedIndex i, j, k, k0, k2, mm;
-
-    if (s>=0 && s<dm[2])
+    mwSize p, d01 = dm[0]*dm[1];
+    for(p=0; p<np; p++)
     {
-        k0 = s;
-        k2 = s+1;
+        const mwSize *o = s->o[p];
+        mwSize i = i0+p;
+        double x = floor(px[p]-1.0), y = floor(py[p]-1.0), z = floor(pz[p]-1.0);
+
+        if (x<0.0 || x>=(double)dm[0]-1.0)
+            da[0][p] = (double)(o[0]%dm[0])*s->dx2[p] + (double)(o[1]%dm[0])*s->dx1[p]
+                     - (double)(i%dma[0]);
+        if (y<0.0 || y>=(double)dm[1]-1.0)
+            da[1][p] = (double)((o[0]/dm[0])%dm[1])*s->dy2[p] + (double)((o[2]/dm[0])%dm[1])*s->dy1[p]
+                     - (double)((i/dma[0])%dma[1]);
+        if (z<0.0 || z>=(double)dm[2]-1.0)
+            da[2][p] = (double)(o[0]/d01)*s->dz2[p] + (double)(o[4]/d01)*s->dz1[p]
+                     - (double)(i/(dma[0]*dma[1]));
     }
-    else
+}
+
+/*
+ * Composition of deformations held as half precision displacements
+ * C(Id) = B(A(Id)), where A and C are defined on a grid of dimensions dma.
+ * The displacement of C is that of A, plus that of B interpolated at A.
+ * Unlike for composition, where the absolute coordinates of B are
+ * interpolated (and then unwrapped), this needs no special treatment of
+ * circulant boundaries.  With Neumann boundaries, the displacement of A
+ * is replaced by bound_disp where A points outside the field of view of
+ * B, so that the result is the same as that of composition.
+ */
+void composition_half(mwSize dm[], HALF *B, mwSize dma[], HALF *A, HALF *C)
+{
+    const float *lut = half_lut();
+    mwSize mmb = dm[0]*dm[1]*dm[2], mm = dma[0]*dma[1]*dma[2];
+    int neumann = (get_bound()==BOUND_NEUMANN);
+    mwSignedIndex i0;
+
+    #pragma omp parallel for schedule(static) if(mm>=PAR_MIN)
+    for(i0=0; i0<(mwSignedIndex)mm; i0+=SAMP_BLOCK)
     {
-        k0 = 0;
-        k2 = dm[2];
+        SAMP_BLK s;
+        float px[SAMP_BLOCK], py[SAMP_BLOCK], pz[SAMP_BLOCK];
+        double da[3][SAMP_BLOCK];
+        mwSize c, p, nb = (mm-i0<SAMP_BLOCK) ? mm-i0 : SAMP_BLOCK;
+
+        half_decode_def(dma, i0, nb, A, lut, px, py, pz);
+        samp_block(dm, nb, px, py, pz, (mwSignedIndex *)0, &s);
+        for(c=0; c<3; c++)
+        {
+            HALF *Ac = A+mm*c+i0;
+            for(p=0; p<nb; p++)
+                da[c][p] = lut[Ac[p]];
+        }
+        if (neumann)
+            bound_disp(dm, dma, i0, nb, px, py, pz, &s, da);
+        for(c=0; c<3; c++)
+        {
+            HALF *Bc = B+mmb*c, *Cc = C+mm*c+i0;
+            for(p=0; p<nb; p++)
+                Cc[p] = float2half((float)(da[c][p] + SAMP_INTERP_H(Bc, lut, &s, p)));
+        }
     }
+}
 
-    mm = dm[0]*dm[1]*(k2-k0);
+/*
+ * Jacobian tensors (code!=0) or their determinants (code==0) for plane k
+ * of a deformation.  y[c][0], y[c][1] and y[c][2] point to planes k-1, k
+ * and k+1 (after applying the boundary condition) of component c, so only
+ * the neighbouring planes are needed.  Element q of the Jacobians is
+ * written to J + q*mm.
+ */
+void def2jac_plane(mwSize dm[], float *y[3][3], mwSignedIndex k, float J[], mwSize mm, int code)
+{
+    mwSignedIndex i, j;
+    float *y1 = y[0][1], *y2 = y[1][1], *y3 = y[2][1];
 
-    for(k=k0; k<k2; k++)
+    if (get_bound()==BOUND_CIRCULANT)
     {
-        mwSignedIndex km, kp;
-        km = (bound(k-1,dm[2])-k)*dm[1]*dm[0];
-        kp = (bound(k+1,dm[2])-k)*dm[1]*dm[0];
-
         for(j=0; j<dm[1]; j++)
         {
-            mwSignedIndex jm, jp;
-            float *y1, *y2, *y3, *dp;
+            mwSignedIndex jm, jp, o = dm[0]*j;
+            float *dp = J + o;
             jm = (bound(j-1,dm[1])-j)*dm[0];
             jp = (bound(j+1,dm[1])-j)*dm[0];
-            y1 = Y + dm[0]*(j+dm[1]*k);
-            y2 = Y + dm[0]*(j+dm[1]*(k+dm[2]));
-            y3 = Y + dm[0]*(j+dm[1]*(k+dm[2]*2));
-            dp = J + dm[0]*(j+dm[1]*k);
 
             for(i=0; i<dm[0]; i++)
             {
-                mwSignedIndex im, ip;
+                mwSignedIndex im, ip, io = i+o;
                 double j11, j12, j13, j21, j22, j23, j31, j32, j33;
                 im = bound(i-1,dm[0])-i;
                 ip = bound(i+1,dm[0])-i;
 
-                j11 = (y1[i+ip]-y1[i+im])/dm[0]; j11 = 0.5*(j11 - floor(j11+0.5))*dm[0];
-                j21 = (y2[i+ip]-y2[i+im])/dm[0]; j21 = 0.5*(j21 - floor(j21+0.5))*dm[0];
-                j31 = (y3[i+ip]-y3[i+im])/dm[0]; j31 = 0.5*(j31 - floor(j31+0.5))*dm[0];
+                j11 = (y1[io+ip]-y1[io+im])/dm[0]; j11 = 0.5*(j11 - floor(j11+0.5))*dm[0];
+                j21 = (y2[io+ip]-y2[io+im])/dm[0]; j21 = 0.5*(j21 - floor(j21+0.5))*dm[0];
+                j31 = (y3[io+ip]-y3[io+im])/dm[0]; j31 = 0.5*(j31 - floor(j31+0.5))*dm[0];
 
-                j12 = (y1[i+jp]-y1[i+jm])/dm[1]; j12 = 0.5*(j12 - floor(j12+0.5))*dm[1];
-                j22 = (y2[i+jp]-y2[i+jm])/dm[1]; j22 = 0.5*(j22 - floor(j22+0.5))*dm[1];
-                j32 = (y3[i+jp]-y3[i+jm])/dm[1]; j32 = 0.5*(j32 - floor(j32+0.5))*dm[1];
+                j12 = (y1[io+jp]-y1[io+jm])/dm[1]; j12 = 0.5*(j12 - floor(j12+0.5))*dm[1];
+                j22 = (y2[io+jp]-y2[io+jm])/dm[1]; j22 = 0.5*(j22 - floor(j22+0.5))*dm[1];
+                j32 = (y3[io+jp]-y3[io+jm])/dm[1]; j32 = 0.5*(j32 - floor(j32+0.5))*dm[1];
 
                 if (dm[2]>1)
                 {
-                    j13 = (y1[i+kp]-y1[i+km])/dm[2]; j13 = 0.5*(j13 - floor(j13+0.5))*dm[2];
-                    j23 = (y2[i+kp]-y2[i+km])/dm[2]; j23 = 0.5*(j23 - floor(j23+0.5))*dm[2];
-                    j33 = (y3[i+kp]-y3[i+km])/dm[2]; j33 = 0.5*(j33 - floor(j33+0.5))*dm[2];
+                    j13 = (y[0][2][io]-y[0][0][io])/dm[2]; j13 = 0.5*(j13 - floor(j13+0.5))*dm[2];
+                    j23 = (y[1][2][io]-y[1][0][io])/dm[2]; j23 = 0.5*(j23 - floor(j23+0.5))*dm[2];
+                    j33 = (y[2][2][io]-y[2][0][io])/dm[2]; j33 = 0.5*(j33 - floor(j33+0.5))*dm[2];
                 }
                 else
                 {
@@ -422,38 +654,16 @@ static void def2jac_wrap(mwSize dm[], float *Y, float *J, mwSignedIndex s, int c
             }
         }
     }
-}
-
-static void def2jac_neuman(mwSize dm[], float *Y, float *J, mwSignedIndex s, int code)
-{
-    mwSignedIndex k, k0, k2, mm;
-
-    if (s>=0 && s<dm[2])
-    {
-        k0 = s;
-        k2 = s;
-    }
     else
     {
-        k0 = 0;
-        k2 = dm[2];
-    }
-    mm = dm[0]*dm[1]*(k2-k0);
-
-    for(k=k0; k<k2; k++)
-    {
-        mwSignedIndex j;
         for(j=0; j<dm[1]; j++)
         {
-            mwSignedIndex i;
-            float *y1, *y2, *y3, *dp;
-            y1 = Y + dm[0]*(j+dm[1]*k);
-            y2 = Y + dm[0]*(j+dm[1]*(k+dm[2]));
-            y3 = Y + dm[0]*(j+dm[1]*(k+dm[2]*2));
-            dp = J + dm[0]*(j+dm[1]*k);
+            mwSignedIndex o = dm[0]*j;
+            float *dp = J + o;
 
             for(i=0; i<dm[0]; i++)
             {
+                mwSignedIndex io = i+o;
                 double j11, j12, j13, j21, j22, j23, j31, j32, j33;
 
                 if ((i==0) || (i==dm[0]-1))
@@ -464,9 +674,9 @@ static void def2jac_neuman(mwSize dm[], float *Y, float *J, mwSignedIndex s, int
                 }
                 else
                 {
-                    j11 = (y1[i+1]-y1[i-1])*0.5;
-                    j21 = (y2[i+1]-y2[i-1])*0.5;
-                    j31 = (y3[i+1]-y3[i-1])*0.5;
+                    j11 = (y1[io+1]-y1[io-1])*0.5;
+                    j21 = (y2[io+1]-y2[io-1])*0.5;
+                    j31 = (y3[io+1]-y3[io-1])*0.5;
                 }
 
                 if ((j==0) || (j==dm[1]-1))
@@ -477,7 +687,7 @@ static void def2jac_neuman(mwSize dm[], float *Y, float *J, mwSignedIndex s, int
                 }
                 else
                 {
-                    mwSignedIndex op = i+dm[0], om = i-dm[0];
+                    mwSignedIndex op = io+dm[0], om = io-dm[0];
                     j12 = (y1[op]-y1[om])*0.5;
                     j22 = (y2[op]-y2[om])*0.5;
                     j32 = (y3[op]-y3[om])*0.5;
@@ -491,10 +701,9 @@ static void def2jac_neuman(mwSize dm[], float *Y, float *J, mwSignedIndex s, int
                 }
                 else
                 {
-                    mwSignedIndex op = i+dm[0]*dm[1], om = i-dm[0]*dm[1];
-                    j13 = (y1[op]-y1[om])*0.5; 
-                    j23 = (y2[op]-y2[om])*0.5;
-                    j33 = (y3[op]-y3[om])*0.5;
+                    j13 = (y[0][2][io]-y[0][0][io])*0.5;
+                    j23 = (y[1][2][io]-y[1][0][io])*0.5;
+                    j33 = (y[2][2][io]-y[2][0][io])*0.5;
                 }
 
                 if (!code)
@@ -512,20 +721,121 @@ static void def2jac_neuman(mwSize dm[], float *Y, float *J, mwSignedIndex s, int
     }
 }
 
-void def2det(mwSize dm[], float *Y, float *J, mwSignedIndex s)
+/* Pointers to planes k-1, k and k+1 of each component of Y */
+static void def2jac_ptrs(mwSize dm[], float *Y, mwSignedIndex k, float *y[3][3])
+{
+    mwSignedIndex m = dm[0]*dm[1], c, d;
+    for(c=0; c<3; c++)
+        for(d=0; d<3; d++)
+            y[c][d] = Y + m*(bound(k+d-1,dm[2]) + dm[2]*c);
+}
+
+/*
+ * Jacobians or determinants of the whole of Y (s<0), or of plane s only.
+ * Planes are independent, so they are shared among threads.
+ */
+static void def2jac_vol(mwSize dm[], float *Y, float *J, mwSignedIndex s, int code)
 {
-    if (get_bound())
-        def2jac_neuman(dm, Y, J, s, 0);
+    mwSignedIndex k, k0, k2, m = dm[0]*dm[1], mm;
+
+    if (s>=0 && s<dm[2])
+    {
+        k0 = s;
+        k2 = s+1;
+    }
     else
-        def2jac_wrap(dm, Y, J, s, 0);
+    {
+        k0 = 0;
+        k2 = dm[2];
+    }
+    mm = m*(k2-k0);
+
+    #pragma omp parallel for schedule(static) if(mm>=PAR_MIN)
+    for(k=k0; k<k2; k++)
+    {
+        float *y[3][3];
+        def2jac_ptrs(dm, Y, k, y);
+        def2jac_plane(dm, y, k, J + m*(k-k0), mm, code);
+    }
+}
+
+void def2det(mwSize dm[], float *Y, float *J, mwSignedIndex s)
+{
+    def2jac_vol(dm, Y, J, s, 0);
 }
 
 void def2jac(mwSize dm[], float *Y, float *J, mwSignedIndex s)
 {
-    if (get_bound())
-        def2jac_neuman(dm, Y, J, s, 1);
-    else
-        def2jac_wrap(dm, Y, J, s, 1);
+    def2jac_vol(dm, Y, J, s, 1);
+}
+
+/* Number of planes (each of m voxels and nc components) per slab */
+static mwSignedIndex stream_planes(mwSize m, mwSize nc, mwSize nz)
+{
+    mwSignedIndex ns = (mwSignedIndex)(STREAM_BYTES/(sizeof(float)*(double)m*nc));
+    if (ns<omp_get_max_threads()) ns = omp_get_max_threads();
+    if (ns>(mwSignedIndex)nz) ns = nz;
+    if (ns<1) ns = 1;
+    return(ns);
+}
+
+/*
+ * Jacobians (code!=0) or determinants (code==0) of a deformation, written
+ * to the file_array fo a slab of planes at a time.  The deformation is
+ * either Y, or (if Y is NULL) read from the file_array fy along with one
+ * plane either side of each slab.  Memory use depends on the size of the
+ * planes, rather than on the size of the volume.  Returns non-zero if
+ * reading or writing fails.
+ */
+int def2jac_stream(mwSize dm[], float *Y, FARRAY *fy, FARRAY *fo, int code)
+{
+    mwSignedIndex m = dm[0]*dm[1], nc = code ? 9 : 1, ns, z0;
+    float *yb = NULL, *jb;
+    int st = 0;
+
+    ns = stream_planes(m, nc+(Y ? 0 : 3), dm[2]);
+
+    jb = (float *)mxMalloc(sizeof(float)*m*nc*ns);
+    if (Y==NULL)
+        yb = (float *)mxMalloc(sizeof(float)*m*3*(ns+2));
+
+    for(z0=0; z0<dm[2] && !st; z0+=ns)
+    {
+        mwSignedIndex nz = (ns<dm[2]-z0) ? ns : dm[2]-z0, k, q;
+
+        if (Y==NULL)
+        {
+            /* Planes z0-1 to z0+nz of each component */
+            for(q=0; q<3 && !st; q++)
+                for(k=0; k<nz+2 && !st; k++)
+                    st = farray_read(fy, m*(bound(z0+k-1,dm[2]) + dm[2]*q), m,
+                                     yb + m*(k + (ns+2)*q));
+            if (st) break;
+        }
+
+        #pragma omp parallel for schedule(static) if(m*nz>=PAR_MIN)
+        for(k=0; k<nz; k++)
+        {
+            float *y[3][3];
+            if (Y==NULL)
+            {
+                mwSignedIndex c, d;
+                for(c=0; c<3; c++)
+                    for(d=0; d<3; d++)
+                        y[c][d] = yb + m*(k+d + (ns+2)*c);
+            }
+            else
+                def2jac_ptrs(dm, Y, z0+k, y);
+            def2jac_plane(dm, y, z0+k, jb + m*k, m*ns, code);
+        }
+
+        for(q=0; q<nc && !st; q++)
+            st = farray_write(fo, m*(z0 + dm[2]*q), m*nz, jb + m*ns*q);
+    }
+
+    if (yb!=NULL) mxFree(yb);
+    mxFree(jb);
+    return(st);
 }
 
 /*
@@ -534,38 +844,17 @@ void def2jac(mwSize dm[], float *Y, float *J, mwSignedIndex s)
  */
 double samp(mwSize dm[], float f[], double x, double y, double z)
 {
-    mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-    mwSize o000, o100, o010, o110, o001, o101, o011, o111;
-    mwSize tmpz, tmpy;
+    mwSignedIndex ix, iy, iz;
+    mwSize o[8];
     double dx1, dx2, dy1, dy2, dz1, dz2;
 
     ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
     iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
     iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-    ix   = bound(ix  ,dm[0]);
-    iy   = bound(iy  ,dm[1]);
-    iz   = bound(iz  ,dm[2]);
-    ix1  = bound(ix+1,dm[0]);
-    iy1  = bound(iy+1,dm[1]);
-    iz1  = bound(iz+1,dm[2]);
+    corners(dm, ix, iy, iz, (mwSignedIndex *)0, o);
 
-    tmpz  = dm[1]*iz;
-    tmpy  = dm[0]*(iy + tmpz);
-    o000  = ix +tmpy;
-    o100  = ix1+tmpy;
-    tmpy  = dm[0]*(iy1 + tmpz);
-    o010  = ix +tmpy;
-    o110  = ix1+tmpy;
-    tmpz  = dm[1]*iz1;
-    tmpy  = dm[0]*(iy + tmpz);
-    o001  = ix +tmpy;
-    o101  = ix1+tmpy;
-    tmpy  = dm[0]*(iy1 + tmpz);
-    o011  = ix +tmpy;
-    o111  = ix1+tmpy;
-
-    return( ((f[o000]*dx2 + f[o100]*dx1)*dy2 + (f[o010]*dx2 + f[o110]*dx1)*dy1)*dz2
-          + ((f[o001]*dx2 + f[o101]*dx1)*dy2 + (f[o011]*dx2 + f[o111]*dx1)*dy1)*dz1 );
+    return( ((f[o[0]]*dx2 + f[o[1]]*dx1)*dy2 + (f[o[2]]*dx2 + f[o[3]]*dx1)*dy1)*dz2
+          + ((f[o[4]]*dx2 + f[o[5]]*dx1)*dy2 + (f[o[6]]*dx2 + f[o[7]]*dx1)*dy1)*dz1 );
 }
 
 /* Sample n points
@@ -574,40 +863,19 @@ double samp(mwSize dm[], float f[], double x, double y, double z)
  */
 void sampn(mwSize dm[], float f[], mwSize n, mwSize mm, double x, double y, double z, double v[])
 {
-    mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-    mwSize j, o000, o100, o010, o110, o001, o101, o011, o111;
-    mwSize tmpz, tmpy;
+    mwSignedIndex ix, iy, iz;
+    mwSize j, o[8];
     double dx1, dx2, dy1, dy2, dz1, dz2;
 
     ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
     iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
     iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
-    ix   = bound(ix  ,dm[0]);
-    iy   = bound(iy  ,dm[1]);
-    iz   = bound(iz  ,dm[2]);
-    ix1  = bound(ix+1,dm[0]);
-    iy1  = bound(iy+1,dm[1]);
-    iz1  = bound(iz+1,dm[2]);
-
-    tmpz  = dm[1]*iz;
-    tmpy  = dm[0]*(iy + tmpz);
-    o000  = ix +tmpy;
-    o100  = ix1+tmpy;
-    tmpy  = dm[0]*(iy1 + tmpz);
-    o010  = ix +tmpy;
-    o110  = ix1+tmpy;
-    tmpz  = dm[1]*iz1;
-    tmpy  = dm[0]*(iy + tmpz);
-    o001  = ix +tmpy;
-    o101  = ix1+tmpy;
-    tmpy  = dm[0]*(iy1 + tmpz);
-    o011  = ix +tmpy;
-    o111  = ix1+tmpy;
+    corners(dm, ix, iy, iz, (mwSignedIndex *)0, o);
 
     for(j=0; j<n; j++, f += mm)
     {
-        v[j] = ((f[o000]*dx2 + f[o100]*dx1)*dy2 + (f[o010]*dx2 + f[o110]*dx1)*dy1)*dz2
-             + ((f[o001]*dx2 + f[o101]*dx1)*dy2 + (f[o011]*dx2 + f[o111]*dx1)*dy1)*dz1;
+        v[j] = ((f[o[0]]*dx2 + f[o[1]]*dx1)*dy2 + (f[o[2]]*dx2 + f[o[3]]*dx1)*dy1)*dz2
+             + ((f[o[4]]*dx2 + f[o[5]]*dx1)*dy2 + (f[o[6]]*dx2 + f[o[7]]*dx1)*dy1)*dz1;
     }
 }
 
@@ -616,8 +884,27 @@ void sampn(mwSize dm[], float f[], mwSize n, mwSize mm, double x, double y, doub
  * another according to the inverse of the deformation.
  * Note that the result is a noisy version of a Jacobian "modulated"
  * image.
+ *
+ * Each point is added into up to eight voxels of the output, so the
+ * points can not simply be shared among threads.  Instead, the output is
+ * divided into slabs of planes, and each slab is updated by one thread,
+ * which goes through all the points in order, but only adds in to the
+ * voxels within its slab.  Every output voxel therefore receives the same
+ * contributions in the same order as when done serially, so the results
+ * do not depend on the number of threads.
  */
-void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[])
+
+static int push_slabs(mwSize m, mwSize nz)
+{
+    int nt = omp_get_max_threads();
+    if (m<PAR_MIN || omp_in_parallel()) nt = 1;
+    if (nt>nz) nt = nz;
+    return(nt);
+}
+
+/* Push the contributions to planes z0 to z1-1 */
+static void push_slab(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[],
+                      mwSignedIndex z0, mwSignedIndex z1)
 {
     mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
     mwSize   i, j, mm, tmpz, tmpy;
@@ -645,9 +932,16 @@ void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
                 /* A faster function fo voxels that are safely inside the FOV */
                 mwSize o000, o100, o010, o110, o001, o101, o011, o111;
                 float w000, w100, w010, w110, w001, w101, w011, w111;
+                int in0, in1;
+
+                iz   = (mwSignedIndex)floor(z);
+                in0  = (iz  >=z0 && iz  <z1);
+                in1  = (iz+1>=z0 && iz+1<z1);
+                if (!in0 && !in1) continue;
+
                 ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
                 iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-                iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
+                dz1=z-iz; dz2=1.0-dz1;
 
                 /* Weights for trilinear interpolation */
                 w000 = dx2*dy2*dz2;
@@ -684,27 +978,39 @@ void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
                     /* Increment the images themselves */
                     float *pj = po+mm*j;
                     float  f  = pf[i+j*m];
-                    pj[o000] += f*w000;
-                    pj[o100] += f*w100;
-                    pj[o010] += f*w010;
-                    pj[o110] += f*w110;
-                    pj[o001] += f*w001;
-                    pj[o101] += f*w101;
-                    pj[o011] += f*w011;
-                    pj[o111] += f*w111;
+                    if (in0)
+                    {
+                        pj[o000] += f*w000;
+                        pj[o100] += f*w100;
+                        pj[o010] += f*w010;
+                        pj[o110] += f*w110;
+                    }
+                    if (in1)
+                    {
+                        pj[o001] += f*w001;
+                        pj[o101] += f*w101;
+                        pj[o011] += f*w011;
+                        pj[o111] += f*w111;
+                    }
                 }
 
                 if (so!=(float *)0)
                 {
                     /* Increment an image containing the number of voxels added */
-                    so[o000] += w000;
-                    so[o100] += w100;
-                    so[o010] += w010;
-                    so[o110] += w110;
-                    so[o001] += w001;
-                    so[o101] += w101;
-                    so[o011] += w011;
-                    so[o111] += w111;
+                    if (in0)
+                    {
+                        so[o000] += w000;
+                        so[o100] += w100;
+                        so[o010] += w010;
+                        so[o110] += w110;
+                    }
+                    if (in1)
+                    {
+                        so[o001] += w001;
+                        so[o101] += w101;
+                        so[o011] += w011;
+                        so[o111] += w111;
+                    }
                 }
             }
             else if ((x>=-1) && (x<dm[0]) && (y>=-1) && (y<dm[1]) && (z>=-1) && (z<dm[2]))
@@ -719,7 +1025,7 @@ void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
                 ix1  = ix+1;
                 iy1  = iy+1;
                 iz1  = iz+1;
-                if (iz>=0)
+                if (iz>=0 && iz>=z0 && iz<z1)
                 {
                     tmpz  = dm[1]*iz;
                     if (iy>=0)
@@ -755,7 +1061,7 @@ void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
                         }
                     }
                 }
-                if (iz1<dm[2])
+                if (iz1<dm[2] && iz1>=z0 && iz1<z1)
                 {
                     tmpz  = dm[1]*iz1;
                     if (iy>=0)
@@ -809,8 +1115,17 @@ void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
     }
 }
 
+void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[])
+{
+    mwSignedIndex t, nt = push_slabs(m, dm[2]);
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+        push_slab(dm, m, n, def, pf, po, so, (t*dm[2])/nt, ((t+1)*dm[2])/nt);
+}
+
 /* Same as above, but with circulant boundary conditions */
-void pushc(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[])
+static void pushc_slab(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[],
+                       mwSignedIndex z0, mwSignedIndex z1)
 {
     mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
     mwSize i, j, mm, tmpz, tmpy;
@@ -830,14 +1145,22 @@ void pushc(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
         {
             mwSize o000, o100, o010, o110, o001, o101, o011, o111;
             float w000, w100, w010, w110, w001, w101, w011, w111;
+            int in0, in1;
 
-            x    = px[i]-1.0; /* Subtract 1 because of MATLAB indexing */
+            z    = pz[i]-1.0; /* Subtract 1 because of MATLAB indexing */
+            iz   = (mwSignedIndex)floor(z);
+            iz1  = bound(iz, dm[2]);
+            in0  = (iz1>=z0 && iz1<z1);
+            iz1  = bound(iz1+1, dm[2]);
+            in1  = (iz1>=z0 && iz1<z1);
+            if (!in0 && !in1) continue;
+
+            x    = px[i]-1.0;
             y    = py[i]-1.0;
-            z    = pz[i]-1.0;
 
             ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
             iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
-            iz   = (mwSignedIndex)floor(z); dz1=z-iz; dz2=1.0-dz1;
+            dz1=z-iz; dz2=1.0-dz1;
 
             /* Weights for trilinear interpolation */
             w000 = dx2*dy2*dz2;
@@ -877,40 +1200,120 @@ void pushc(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[],
                 /* Increment the images themselves */
                 float *pj = po+mm*j;
                 float  f  = pf[i+j*m];
-                pj[o000] += f*w000;
-                pj[o100] += f*w100;
-                pj[o010] += f*w010;
-                pj[o110] += f*w110;
-                pj[o001] += f*w001;
-                pj[o101] += f*w101;
-                pj[o011] += f*w011;
-                pj[o111] += f*w111;
+                if (in0)
+                {
+                    pj[o000] += f*w000;
+                    pj[o100] += f*w100;
+                    pj[o010] += f*w010;
+                    pj[o110] += f*w110;
+                }
+                if (in1)
+                {
+                    pj[o001] += f*w001;
+                    pj[o101] += f*w101;
+                    pj[o011] += f*w011;
+                    pj[o111] += f*w111;
+                }
             }
 
             if (so!=(float *)0)
             {
                 /* Increment an image containing the number of voxels added */
-                so[o000] += w000;
-                so[o100] += w100;
-                so[o010] += w010;
-                so[o110] += w110;
-                so[o001] += w001;
-                so[o101] += w101;
-                so[o011] += w011;
-                so[o111] += w111;
+                if (in0)
+                {
+                    so[o000] += w000;
+                    so[o100] += w100;
+                    so[o010] += w010;
+                    so[o110] += w110;
+                }
+                if (in1)
+                {
+                    so[o001] += w001;
+                    so[o101] += w101;
+                    so[o011] += w011;
+                    so[o111] += w111;
+                }
+            }
+        }
+    }
+}
+
+void pushc(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[])
+{
+    mwSignedIndex t, nt = push_slabs(m, dm[2]);
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+        pushc_slab(dm, m, n, def, pf, po, so, (t*dm[2])/nt, ((t+1)*dm[2])/nt);
+}
+
+/*
+ * push (or pushc if circ is non-zero) where the deformation and/or the
+ * data to push are held in half precision (dh and fh, which are used
+ * instead of def and pf if they are not NULL).  The points are those of a
+ * grid of dimensions dmy, and half precision deformations contain the
+ * displacements from the identity.  Each thread converts a chunk of points
+ * at a time to single precision, which it pushes into its own slab of the
+ * output, so the results are identical to those of push or pushc on the
+ * converted data.
+ */
+void push_half(mwSize dm[], mwSize dmy[], mwSize n, float def[], HALF dh[], float pf[], HALF fh[],
+               float po[], float so[], int circ)
+{
+    const float *lut = half_lut();
+    mwSize m = dmy[0]*dmy[1]*dmy[2], nc;
+    mwSignedIndex t, nt = push_slabs(m, dm[2]);
+    float *buf;
+
+    nc = (mwSize)(HALF_BYTES/(nt*(3.0+n)*sizeof(float)));
+    if (nc<SAMP_BLOCK) nc = SAMP_BLOCK;
+    if (nc>m) nc = m;
+    buf = (float *)mxMalloc(sizeof(float)*nt*(3+n)*nc);
+
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+    {
+        float *b = buf + t*(3+n)*nc;
+        mwSize i0, j;
+        for(i0=0; i0<m; i0+=nc)
+        {
+            mwSize nb = (m-i0<nc) ? m-i0 : nc, i;
+            float *pb = b+3*nb;
+
+            if (dh)
+                half_decode_def(dmy, i0, nb, dh, lut, b, b+nb, b+2*nb);
+            else
+                for(i=0; i<nb; i++)
+                {
+                    b[i]      = def[i0+i];
+                    b[i+nb]   = def[i0+i+m];
+                    b[i+2*nb] = def[i0+i+2*m];
+                }
+            for(j=0; j<n; j++)
+            {
+                if (fh)
+                    half_decode(fh+m*j+i0, nb, lut, pb+nb*j);
+                else
+                    for(i=0; i<nb; i++)
+                        pb[nb*j+i] = pf[m*j+i0+i];
             }
+
+            if (circ)
+                pushc_slab(dm, nb, n, b, pb, po, so, (t*dm[2])/nt, ((t+1)*dm[2])/nt);
+            else
+                push_slab(dm, nb, n, b, pb, po, so, (t*dm[2])/nt, ((t+1)*dm[2])/nt);
         }
     }
+    mxFree(buf);
 }
 
 /* Similar to above, except with a multiplication by the inverse of the Jacobians.
    This is used for geodesic shooting */
-void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[], float po[])
+static void pushc_grads_slab(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[], float po[],
+                             mwSignedIndex z0, mwSignedIndex z1)
 {
-    mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
-    mwSize i2, i, mo, my;
+    mwSize i2, mo, my;
     float *px, *py, *pz;
-    float *pj11, *pj12, *pj13, *pj21, *pj22, *pj23, *pj31, *pj32, *pj33;
+    int circ = (get_bound()==0);
 
     my = dm[0]*dm[1]*dm[2];
     px = def;
@@ -918,20 +1321,7 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
     pz = def+my*2;
     mo = dmo[0]*dmo[1]*dmo[2];
 
-    if (J!=(float *)0)
-    {
-        pj11 = J;
-        pj21 = J+my;
-        pj31 = J+my*2;
-        pj12 = J+my*3;
-        pj22 = J+my*4;
-        pj32 = J+my*5;
-        pj13 = J+my*6;
-        pj23 = J+my*7;
-        pj33 = J+my*8;
-    }
-
-    for(i2=0, i=0; i2<dm[2]; i2++)
+    for(i2=0; i2<dm[2]; i2++)
     {
         mwSize i1;
         mwSignedIndex i2m, i2p;
@@ -941,60 +1331,79 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
 
         for(i1=0; i1<dm[1]; i1++)
         {
-            mwSize i0;
+            mwSize ib;
             mwSignedIndex i1m, i1p;
 
             i1m = (bound(i1-1,dm[1])-i1)*dm[0];
             i1p = (bound(i1+1,dm[1])-i1)*dm[0];
 
-            for(i0=0; i0<dm[0]; i0++, i++, px++, py++, pz++)
+            /* Voxels of the row are dealt with in blocks, so that the
+               Jacobians can be inverted by a vectorised kernel */
+            for(ib=0; ib<dm[0]; ib+=MAT33_BLOCK)
             {
-                if (mxIsFinite(pf[i]))
+                float  jb[9][MAT33_BLOCK], fb[3][MAT33_BLOCK], rb[3][MAT33_BLOCK];
+                int    in[MAT33_BLOCK], any = 0;
+                mwSize p, l, nb = (dm[0]-ib<MAT33_BLOCK) ? dm[0]-ib : MAT33_BLOCK;
+                mwSize i = ib + dm[0]*(i1 + dm[1]*i2);
+
+                for(p=0; p<nb; p++)
                 {
-                    mwSize j, tmpz, tmpy;
-                    mwSize o000, o100, o010, o110, o001, o101, o011, o111;
-                    float  w000, w100, w010, w110, w001, w101, w011, w111;
+                    mwSize i0 = ib+p, ip = i+p;
                     float j11, j12, j13, j21, j22, j23, j31, j32, j33;
-                    float ij11, ij12, ij13, ij21, ij22, ij23, ij31, ij32, ij33, dj;
-                    float f1, f2, f3;
-                    double x, y, z;
-                    double rf[3];
-                    double dx1, dx2, dy1, dy2, dz1, dz2;
 
-                    x    = *px-1.0; /* Subtract 1 because of MATLAB indexing */
-                    y    = *py-1.0;
-                    z    = *pz-1.0;
+                    /* Whether the voxel contributes to this slab (bit 0 for
+                       plane iz, and bit 1 for plane iz+1) */
+                    in[p] = 0;
+                    if (mxIsFinite(pf[ip]))
+                    {
+                        mwSignedIndex iz, iz1;
+                        double z;
+                        z    = pz[ip]-1.0; /* Subtract 1 because of MATLAB indexing */
+                        iz   = (mwSignedIndex)floor(z);
+                        iz1  = bound(iz, dmo[2]);
+                        if (iz1>=z0 && iz1<z1) in[p] |= 1;
+                        iz1  = bound(iz1+1, dmo[2]);
+                        if (iz1>=z0 && iz1<z1) in[p] |= 2;
+                        any |= in[p];
+                    }
 
-                    if (J!=(float *)0)
+                    if (!in[p])
+                    {
+                        j11 = 1.0; j12 = 0.0; j13 = 0.0;
+                        j21 = 0.0; j22 = 1.0; j23 = 0.0;
+                        j31 = 0.0; j32 = 0.0; j33 = 1.0;
+                    }
+                    else if (J!=(float *)0)
                     {
                         /* If Jacobians are passed, use them */
-                        j11  = pj11[i]; j12  = pj12[i]; j13  = pj13[i];
-                        j21  = pj21[i]; j22  = pj22[i]; j23  = pj23[i];
-                        j31  = pj31[i]; j32  = pj32[i]; j33  = pj33[i];
+                        j11  = J[ip     ]; j12  = J[ip+my*3]; j13  = J[ip+my*6];
+                        j21  = J[ip+my  ]; j22  = J[ip+my*4]; j23  = J[ip+my*7];
+                        j31  = J[ip+my*2]; j32  = J[ip+my*5]; j33  = J[ip+my*8];
                     }
                     else
                     {
                         /* Otherwise compute Jacobians from deformation */
-                        if (get_bound()==0)
+                        float *qx = px+ip, *qy = py+ip, *qz = pz+ip;
+                        if (circ)
                         {
                             /* Circulant boundary */
                             mwSignedIndex i0m, i0p;
                             i0m = bound(i0-1,dm[0])-i0;
                             i0p = bound(i0+1,dm[0])-i0;
 
-                            j11 = (px[i0p]-px[i0m])/dm[0]; j11 = 0.5*(j11 - floor(j11+0.5))*dm[0];
-                            j21 = (py[i0p]-py[i0m])/dm[0]; j21 = 0.5*(j21 - floor(j21+0.5))*dm[0];
-                            j31 = (pz[i0p]-pz[i0m])/dm[0]; j31 = 0.5*(j31 - floor(j31+0.5))*dm[0];
+                            j11 = (qx[i0p]-qx[i0m])/dm[0]; j11 = 0.5*(j11 - floor(j11+0.5))*dm[0];
+                            j21 = (qy[i0p]-qy[i0m])/dm[0]; j21 = 0.5*(j21 - floor(j21+0.5))*dm[0];
+                            j31 = (qz[i0p]-qz[i0m])/dm[0]; j31 = 0.5*(j31 - floor(j31+0.5))*dm[0];
 
-                            j12 = (px[i1p]-px[i1m])/dm[1]; j12 = 0.5*(j12 - floor(j12+0.5))*dm[1];
-                            j22 = (py[i1p]-py[i1m])/dm[1]; j22 = 0.5*(j22 - floor(j22+0.5))*dm[1];
-                            j32 = (pz[i1p]-pz[i1m])/dm[1]; j32 = 0.5*(j32 - floor(j32+0.5))*dm[1];
+                            j12 = (qx[i1p]-qx[i1m])/dm[1]; j12 = 0.5*(j12 - floor(j12+0.5))*dm[1];
+                            j22 = (qy[i1p]-qy[i1m])/dm[1]; j22 = 0.5*(j22 - floor(j22+0.5))*dm[1];
+                            j32 = (qz[i1p]-qz[i1m])/dm[1]; j32 = 0.5*(j32 - floor(j32+0.5))*dm[1];
 
                             if (dm[2]>1)
                             {
-                                j13 = (px[i2p]-px[i2m])/dm[2]; j13 = 0.5*(j13 - floor(j13+0.5))*dm[2];
-                                j23 = (py[i2p]-py[i2m])/dm[2]; j23 = 0.5*(j23 - floor(j23+0.5))*dm[2];
-                                j33 = (pz[i2p]-pz[i2m])/dm[2]; j33 = 0.5*(j33 - floor(j33+0.5))*dm[2];
+                                j13 = (qx[i2p]-qx[i2m])/dm[2]; j13 = 0.5*(j13 - floor(j13+0.5))*dm[2];
+                                j23 = (qy[i2p]-qy[i2m])/dm[2]; j23 = 0.5*(j23 - floor(j23+0.5))*dm[2];
+                                j33 = (qz[i2p]-qz[i2m])/dm[2]; j33 = 0.5*(j33 - floor(j33+0.5))*dm[2];
                             }
                             else
                             {
@@ -1014,9 +1423,9 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
                             }
                             else
                             {
-                                j11 = (px[1]-px[-1])*0.5;
-                                j21 = (py[1]-py[-1])*0.5;
-                                j31 = (pz[1]-pz[-1])*0.5;
+                                j11 = (qx[1]-qx[-1])*0.5;
+                                j21 = (qy[1]-qy[-1])*0.5;
+                                j31 = (qz[1]-qz[-1])*0.5;
                             }
 
                             if ((i1==0) || (i1==dm[1]-1))
@@ -1027,9 +1436,9 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
                             }
                             else
                             {
-                                j12 = (px[dm[0]]-px[-dm[0]])*0.5;
-                                j22 = (py[dm[0]]-py[-dm[0]])*0.5;
-                                j32 = (pz[dm[0]]-pz[-dm[0]])*0.5;
+                                j12 = (qx[dm[0]]-qx[-dm[0]])*0.5;
+                                j22 = (qy[dm[0]]-qy[-dm[0]])*0.5;
+                                j32 = (qz[dm[0]]-qz[-dm[0]])*0.5;
                             }
 
                             if ((i2==0) || (i2==dm[2]-1))
@@ -1041,37 +1450,44 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
                             else
                             {
                                 mwSignedIndex op = dm[0]*dm[1];
-                                j13 = (px[op]-px[-op])*0.5;
-                                j23 = (py[op]-py[-op])*0.5;
-                                j33 = (pz[op]-pz[-op])*0.5;
+                                j13 = (qx[op]-qx[-op])*0.5;
+                                j23 = (qy[op]-qy[-op])*0.5;
+                                j33 = (qz[op]-qz[-op])*0.5;
                             }
                         }
                     }
+                    jb[0][p] = j11; jb[3][p] = j12; jb[6][p] = j13;
+                    jb[1][p] = j21; jb[4][p] = j22; jb[7][p] = j23;
+                    jb[2][p] = j31; jb[5][p] = j32; jb[8][p] = j33;
+                    for(l=0; l<3; l++)
+                        fb[l][p] = in[p] ? pf[ip+my*l] : 0.0f;
+                }
+                if (!any) continue;
+                if (nb<MAT33_BLOCK)
+                {
+                    eye33f_blk(nb, jb);
+                    for(l=0; l<3; l++)
+                        for(p=nb; p<MAT33_BLOCK; p++)
+                            fb[l][p] = 0.0f;
+                }
+
+                /* Gradients rotated by the inverse Jacobians */
+                invt33_blk(jb, fb, rb);
+
+                for(p=0; p<nb; p++)
+                {
+                    mwSignedIndex ix, iy, iz, ix1, iy1, iz1;
+                    mwSize j, tmpz, tmpy, ip = i+p;
+                    mwSize o000, o100, o010, o110, o001, o101, o011, o111;
+                    float  w000, w100, w010, w110, w001, w101, w011, w111;
+                    double x, y, z;
+                    double dx1, dx2, dy1, dy2, dz1, dz2;
 
-                    ij11 = j22*j33-j23*j32;
-                    ij12 = j13*j32-j12*j33;
-                    ij13 = j12*j23-j13*j22;
-                    dj   = j11*ij11 + j21*ij12 + j31*ij13;
-                    /* dj   = (dj*0.99+0.01); */
-                    dj   = 1.0/dj;
-
-                    ij11*= dj;
-                    ij12*= dj;
-                    ij13*= dj;
-                    ij21 = (j23*j31-j21*j33)*dj;
-                    ij22 = (j11*j33-j13*j31)*dj;
-                    ij23 = (j13*j21-j11*j23)*dj;
-                    ij31 = (j21*j32-j22*j31)*dj;
-                    ij32 = (j12*j31-j11*j32)*dj;
-                    ij33 = (j11*j22-j12*j21)*dj;
-
-                    f1 = pf[i];
-                    f2 = pf[i+my];
-                    f3 = pf[i+my*2];
-
-                    rf[0] = ij11*f1 + ij21*f2 + ij31*f3;
-                    rf[1] = ij12*f1 + ij22*f2 + ij32*f3;
-                    rf[2] = ij13*f1 + ij23*f2 + ij33*f3;
+                    if (!in[p]) continue;
+
+                    x    = px[ip]-1.0;
+                    y    = py[ip]-1.0;
+                    z    = pz[ip]-1.0;
 
                     ix   = (mwSignedIndex)floor(x); dx1=x-ix; dx2=1.0-dx1;
                     iy   = (mwSignedIndex)floor(y); dy1=y-iy; dy2=1.0-dy1;
@@ -1114,15 +1530,21 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
                     {
                         /* Increment the images themselves */
                         float *pj = po+mo*j;
-                        float  f  = rf[j];
-                        pj[o000] += f*w000;
-                        pj[o100] += f*w100;
-                        pj[o010] += f*w010;
-                        pj[o110] += f*w110;
-                        pj[o001] += f*w001;
-                        pj[o101] += f*w101;
-                        pj[o011] += f*w011;
-                        pj[o111] += f*w111;
+                        float  f  = rb[j][p];
+                        if (in[p]&1)
+                        {
+                            pj[o000] += f*w000;
+                            pj[o100] += f*w100;
+                            pj[o010] += f*w010;
+                            pj[o110] += f*w110;
+                        }
+                        if (in[p]&2)
+                        {
+                            pj[o001] += f*w001;
+                            pj[o101] += f*w101;
+                            pj[o011] += f*w011;
+                            pj[o111] += f*w111;
+                        }
                     }
                 }
             }
@@ -1130,26 +1552,36 @@ void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[],
     }
 }
 
+void pushc_grads(mwSize dmo[], mwSize dm[], float def[], float J[], float pf[], float po[])
+{
+    mwSignedIndex t, nt = push_slabs(dm[0]*dm[1]*dm[2], dmo[2]);
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+        pushc_grads_slab(dmo, dm, def, J, pf, po, (t*dmo[2])/nt, ((t+1)*dmo[2])/nt);
+}
+
 
 /*
  * t0 = Id + v0*sc
  */
 void smalldef(mwSize dm[], double sc, float v0[], float t0[])
 {
-    mwSize j0, j1, j2;
+    mwSignedIndex j0, j1, j2;
     mwSize m = dm[0]*dm[1]*dm[2];
     float *v1 = v0+m, *v2 = v1+m;
     float *t1 = t0+m, *t2 = t1+m;
 
-    for(j2=0; j2<dm[2]; j2++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
-        for(j1=0; j1<dm[1]; j1++)
+        for(j1=0; j1<(mwSignedIndex)dm[1]; j1++)
         {
-            for(j0=0; j0<dm[0]; j0++)
+            mwSize o = dm[0]*(j1+dm[1]*j2);
+            for(j0=0; j0<(mwSignedIndex)dm[0]; j0++, o++)
             {
-                *(t0++) = (j0+1) + *(v0++)*sc;
-                *(t1++) = (j1+1) + *(v1++)*sc;
-                *(t2++) = (j2+1) + *(v2++)*sc;
+                t0[o] = (j0+1) + v0[o]*sc;
+                t1[o] = (j1+1) + v1[o]*sc;
+                t2[o] = (j2+1) + v2[o]*sc;
             }
         }
     }
@@ -1161,12 +1593,13 @@ void smalldef(mwSize dm[], double sc, float v0[], float t0[])
  */
 void smalldef_jac(mwSize dm[], double sc, float v0[], float t0[], float J0[])
 {
-    mwSize j0, j1, j2;
+    mwSignedIndex j0, j1, j2;
     mwSize m = dm[0]*dm[1]*dm[2];
     double sc2 = sc/2.0;
     float *v1 = v0+m, *v2 = v1+m;
 
-    for(j2=0; j2<dm[2]; j2++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
         mwSize j2m1, j2p1;
         j2m1 = bound(j2-1,dm[2]);
@@ -1252,13 +1685,13 @@ void smalldef_jac(mwSize dm[], double sc, float v0[], float t0[], float J0[])
  */
 void smalldef_jac1(mwSize dm[], double sc, float v0[], float t0[], float J0[])
 {
-    mwSize j0, j1, j2;
+    mwSignedIndex j0, j1, j2;
     mwSize m = dm[0]*dm[1]*dm[2];
     double sc2 = sc/2.0;
     float  *v1 = v0+m, *v2 = v1+m;
-    float  A[9], E[9];
 
-    for(j2=0; j2<dm[2]; j2++)
+    #pragma omp parallel for schedule(static) private(j0,j1) if(m>=PAR_MIN)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
         mwSize j2m1, j2p1;
         j2m1 = bound(j2-1,dm[2]);
@@ -1273,6 +1706,7 @@ void smalldef_jac1(mwSize dm[], double sc, float v0[], float t0[], float J0[])
             for(j0=0; j0<dm[0]; j0++)
             {
                 mwSize o, om1, op1;
+                float  A[9], E[9];
                 o         = j0+dm[0]*(j1+dm[1]*j2);
                 t0[o    ] = (j0+1) + v0[o]*sc;
                 t0[o+m  ] = (j1+1) + v1[o]*sc;
@@ -1313,88 +1747,104 @@ void smalldef_jac1(mwSize dm[], double sc, float v0[], float t0[], float J0[])
     }
 }
 
-void divergence(mwSize dm[], float v0[], float dv[])
+/*
+ * Twice the divergence along row j1 of plane j2.  As for bracket, the
+ * interior of the row is vectorised, and bound() is only used for the
+ * first and last voxels.
+ */
+static void div_row(mwSize dm[], float v0[], mwSignedIndex j1, mwSignedIndex j2, double div[])
 {
-    mwSize j0, j1, j2;
     mwSize m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex n0 = dm[0], j0, o1, dpj, dmj, dpk, dmk;
     float *v1 = v0+m, *v2 = v1+m;
-    double div;
 
-    for(j2=0; j2<dm[2]; j2++)
+    o1  = n0*(j1+dm[1]*j2);
+    dpj = n0*(bound(j1+1,dm[1])+dm[1]*j2) - o1;
+    dmj = n0*(bound(j1-1,dm[1])+dm[1]*j2) - o1;
+    dpk = n0*(j1+dm[1]*bound(j2+1,dm[2])) - o1;
+    dmk = n0*(j1+dm[1]*bound(j2-1,dm[2])) - o1;
+    v0 += o1;
+    v1 += o1;
+    v2 += o1;
+
+    #pragma omp simd
+    for(j0=1; j0<n0-1; j0++)
     {
-        mwSize j2m1, j2p1;
-        j2m1 = bound(j2-1,dm[2]);
-        j2p1 = bound(j2+1,dm[2]);
-
-        for(j1=0; j1<dm[1]; j1++)
-        {
-            mwSize j1m1, j1p1;
-            j1m1 = bound(j1-1,dm[1]);
-            j1p1 = bound(j1+1,dm[1]);
-
-            for(j0=0; j0<dm[0]; j0++)
-            {
-                mwSize om1, op1;
-
-                om1 = bound(j0-1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                op1 = bound(j0+1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                div = v0[op1]-v0[om1];
+        double d;
+        d       = v0[j0+1]-v0[j0-1];
+        d      += v1[j0+dpj]-v1[j0+dmj];
+        d      += v2[j0+dpk]-v2[j0+dmk];
+        div[j0] = d;
+    }
 
-                om1 = j0+dm[0]*(j1m1+dm[1]*j2);
-                op1 = j0+dm[0]*(j1p1+dm[1]*j2);
-                div+= v1[op1]-v1[om1];
+    for(j0=0; j0<n0; j0+=(n0>1) ? n0-1 : 1)
+    {
+        double d;
+        d       = v0[bound(j0+1,n0)]-v0[bound(j0-1,n0)];
+        d      += v1[j0+dpj]-v1[j0+dmj];
+        d      += v2[j0+dpk]-v2[j0+dmk];
+        div[j0] = d;
+    }
+}
 
-                om1 = j0+dm[0]*(j1+dm[1]*j2m1);
-                op1 = j0+dm[0]*(j1+dm[1]*j2p1);
-                div+= v2[op1]-v2[om1];
+void divergence(mwSize dm[], float v0[], float dv[])
+{
+    mwSize m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex j1, j2;
+    int nt = (m>=PAR_MIN) ? omp_get_max_threads() : 1;
+    double *buf = (double *)mxMalloc(sizeof(double)*nt*dm[0]);
 
-                dv[j0+dm[0]*(j1+dm[1]*j2)] = 0.5*div;
-            }
+    #pragma omp parallel for schedule(static) private(j1) num_threads(nt) if(nt>1)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
+    {
+        double *div = buf + omp_get_thread_num()*dm[0];
+        for(j1=0; j1<(mwSignedIndex)dm[1]; j1++)
+        {
+            float *d = dv + dm[0]*(j1+dm[1]*j2);
+            mwSignedIndex j0;
+            div_row(dm, v0, j1, j2, div);
+            #pragma omp simd
+            for(j0=0; j0<(mwSignedIndex)dm[0]; j0++)
+                d[j0] = 0.5*div[j0];
         }
     }
+    mxFree(buf);
 }
 
-/* Minimum and maximum of the divergence */
+/* Minimum and maximum of the divergence.  Each plane has its own minimum
+   and maximum, which are combined at the end. */
 void minmax_div(mwSize dm[], float v0[], double mnmx[])
 {
-    mwSize  j0, j1, j2;
-    mwSize  m = dm[0]*dm[1]*dm[2];
-    float  *v1 = v0+m, *v2 = v1+m;
-    double div, maxdiv = -1e32, mindiv = 1e32;
-
-    for(j2=0; j2<dm[2]; j2++)
+    mwSize m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex j1, j2;
+    int nt = (m>=PAR_MIN) ? omp_get_max_threads() : 1;
+    double *buf = (double *)mxMalloc(sizeof(double)*(nt*dm[0]+2*dm[2]));
+    double *mn = buf + nt*dm[0], *mx = mn + dm[2];
+    double maxdiv = -1e32, mindiv = 1e32;
+
+    #pragma omp parallel for schedule(static) private(j1) num_threads(nt) if(nt>1)
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
     {
-        mwSize j2m1, j2p1;
-        j2m1 = bound(j2-1,dm[2]);
-        j2p1 = bound(j2+1,dm[2]);
-
-        for(j1=0; j1<dm[1]; j1++)
+        double *div = buf + omp_get_thread_num()*dm[0], mn2 = 1e32, mx2 = -1e32;
+        for(j1=0; j1<(mwSignedIndex)dm[1]; j1++)
         {
-            mwSize j1m1, j1p1;
-            j1m1 = bound(j1-1,dm[1]);
-            j1p1 = bound(j1+1,dm[1]);
-
-            for(j0=0; j0<dm[0]; j0++)
+            mwSignedIndex j0;
+            div_row(dm, v0, j1, j2, div);
+            for(j0=0; j0<(mwSignedIndex)dm[0]; j0++)
             {
-                mwSize om1, op1;
-
-                om1 = bound(j0-1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                op1 = bound(j0+1,dm[0])+dm[0]*(j1+dm[1]*j2);
-                div = v0[op1]-v0[om1];
-
-                om1 = j0+dm[0]*(j1m1+dm[1]*j2);
-                op1 = j0+dm[0]*(j1p1+dm[1]*j2);
-                div+= v1[op1]-v1[om1];
-
-                om1 = j0+dm[0]*(j1+dm[1]*j2m1);
-                op1 = j0+dm[0]*(j1+dm[1]*j2p1);
-                div+= v2[op1]-v2[om1];
-
-                if (div<mindiv) mindiv = div;
-                if (div>maxdiv) maxdiv = div;
+                if (div[j0]<mn2) mn2 = div[j0];
+                if (div[j0]>mx2) mx2 = div[j0];
             }
         }
+        mn[j2] = mn2;
+        mx[j2] = mx2;
+    }
+    for(j2=0; j2<(mwSignedIndex)dm[2]; j2++)
+    {
+        if (mn[j2]<mindiv) mindiv = mn[j2];
+        if (mx[j2]>maxdiv) maxdiv = mx[j2];
     }
+    mxFree(buf);
     mnmx[0] = 0.5*mindiv;
     mnmx[1] = 0.5*maxdiv;
 }
@@ -1405,15 +1855,63 @@ void minmax_div(mwSize dm[], float v0[], double mnmx[])
 void determinant(mwSize dm[], float J0[], float d[])
 {
     mwSize m = dm[0]*dm[1]*dm[2];
-    mwSize j;
-    double j00, j01, j02, j10, j11, j12, j20, j21, j22;
+    mwSignedIndex t, nt = (m>=PAR_MIN) ? omp_get_max_threads() : 1;
+
+    /* One chunk of voxels per thread, within which the loop is vectorised */
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+    {
+        mwSignedIndex j, j0 = (t*m)/nt, j1 = ((t+1)*m)/nt;
+        #pragma omp simd
+        for(j=j0; j<j1; j++)
+        {
+            double j00, j01, j02, j10, j11, j12, j20, j21, j22;
+            j00  = J0[j    ]; j01 = J0[j+m*3]; j02 = J0[j+m*6];
+            j10  = J0[j+m  ]; j11 = J0[j+m*4]; j12 = J0[j+m*7];
+            j20  = J0[j+m*2]; j21 = J0[j+m*5]; j22 = J0[j+m*8];
+            d[j] = j00*(j11*j22-j12*j21)+j10*(j02*j21-j01*j22)+j20*(j01*j12-j02*j11);
+        }
+    }
+}
+
+/*
+ * Unwrap one plane (d0*d1 voxels) of a deformation into a volume of
+ * dimensions dm, where the components of the plane are px, py and pz.
+ * The z component depends on the previous plane (prev, which has already
+ * been unwrapped, or NULL for the first plane), whereas the x and y
+ * components only depend on other voxels within the plane.
+ */
+static void unwrap_plane(mwSize dm[], mwSize d0, mwSize d1, float px[], float py[], float pz[], float prev[])
+{
+    mwSignedIndex i0, i1, m = d0*d1;
 
-    for(j=0; j<m; j++)
+    if (prev == (float *)0)
     {
-        j00  = J0[j    ]; j01 = J0[j+m*3]; j02 = J0[j+m*6];
-        j10  = J0[j+m  ]; j11 = J0[j+m*4]; j12 = J0[j+m*7];
-        j20  = J0[j+m*2]; j21 = J0[j+m*5]; j22 = J0[j+m*8];
-        d[j] = j00*(j11*j22-j12*j21)+j10*(j02*j21-j01*j22)+j20*(j01*j12-j02*j11);
+        for(i1=0; i1<m; i1++)
+            pz[i1] = pz[i1]-floor(pz[i1]/dm[2]+0.5)*dm[2];
+    }
+    else
+    {
+        for(i1=0; i1<m; i1++)
+            pz[i1] = pz[i1]-floor((pz[i1]-prev[i1])/dm[2]+0.5)*dm[2];
+    }
+
+    for(i0=0; i0<d0; i0++)
+        py[i0] = py[i0]-floor(py[i0]/dm[1]+0.5)*dm[1];
+    for(i1=1; i1<d1; i1++)
+    {
+        float *pt1 = py + i1*d0;
+        for(i0=0; i0<d0; i0++)
+            pt1[i0] = pt1[i0]-floor((pt1[i0]-pt1[i0-d0])/dm[1]+0.5)*dm[1];
+    }
+
+    for(i1=0; i1<m; i1+=d0)
+        px[i1] = px[i1]-floor(px[i1]/dm[0]+0.5)*dm[0];
+    for(i0=1; i0<d0; i0++)
+    {
+        float *pt1 = px + i0;
+        for(i1=0; i1<m; i1+=d0)
+            pt1[i1] = pt1[i1]-floor((pt1[i1]-pt1[i1-1])/dm[0]+0.5)*dm[0];
     }
 }
 
@@ -1424,74 +1922,235 @@ void determinant(mwSize dm[], float J0[], float d[])
  */
 void unwrap(mwSize dm[], float f[])
 {
-    mwSignedIndex i0, i1, i2;
+    mwSignedIndex i2;
+    mwSize m = dm[0]*dm[1], mm = m*dm[2];
 
    if (get_bound())
       return;
 
     for(i2=0; i2<dm[2]; i2++)
     {
-        float *pt = f + (i2+2*dm[2])*dm[0]*dm[1];
-        if (i2==0)
+        float *pt = f + i2*m;
+        unwrap_plane(dm, dm[0], dm[1], pt, pt+mm, pt+2*mm, (i2==0) ? (float *)0 : pt+2*mm-m);
+    }
+}
+
+
+/*
+ * Out-of-core versions of samp, comp and push, for fields that are held
+ * in file_arrays (see also def2jac_stream).  The points (the deformation
+ * for samp and comp, and the deformation and the data for push) are read a
+ * slab of planes at a time, and each slab is processed in parallel before
+ * the results are written.  If the volume that is sampled is also in a
+ * file, only the planes of it that are needed by the points of the slab
+ * are read.  These are the planes spanned by the slab, along with a halo
+ * that depends on how far the deformation moves things.  The positions of
+ * the planes in the buffer are given by a plane map (see corners).  Each
+ * of these gives identical results to the in-memory version.
+ */
+
+/* Planes z0 to z0+nz-1 of the nc volumes of a field of dimensions dm,
+   which is either F or in the file_array fa, are put in buf (with the
+   volumes one after the other).  Returns non-zero if reading fails. */
+static int read_slab(mwSize dm[], float *F, FARRAY *fa, mwSize nc, mwSignedIndex z0, mwSignedIndex nz,
+                     float buf[])
+{
+    mwSize m = dm[0]*dm[1], np = m*nz, j, i;
+    int st = 0;
+    for(j=0; j<nc && !st; j++)
+    {
+        if (F)
         {
-            for(i1=0; i1<dm[1]*dm[0]; i1++)
-                pt[i1] = pt[i1]-floor(pt[i1]/dm[2]+0.5)*dm[2];
+            float *f = F + m*(z0 + dm[2]*j);
+            for(i=0; i<np; i++) buf[np*j+i] = f[i];
         }
         else
-        {
-            for(i1=0; i1<dm[1]*dm[0]; i1++)
-                pt[i1] = pt[i1]-floor((pt[i1]-pt[i1-dm[0]*dm[1]])/dm[2]+0.5)*dm[2];
-        }
+            st = farray_read(fa, m*(z0 + dm[2]*j), np, buf + np*j);
     }
+    return(st);
+}
+
+/* Plane map for sampling a volume of dimensions dm at points whose z
+   coordinates are pz.  The planes are worked out in the same way as by
+   samp_block and corners, and the number of them is returned. */
+static mwSignedIndex plane_map(mwSize dm[], mwSize np, float pz[], mwSignedIndex pm[])
+{
+    mwSignedIndex k, nk = 0;
+    mwSize i;
 
-    for(i1=0; i1<dm[1]; i1++)
+    for(k=0; k<(mwSignedIndex)dm[2]; k++) pm[k] = -1;
+    for(i=0; i<np; i++)
     {
-        float *pt = f + (i1+dm[2]*dm[1])*dm[0];
-        if (i1==0)
+        mwSignedIndex iz = bound((mwSignedIndex)floor(pz[i]-1.0), dm[2]);
+        pm[iz] = 0;
+        pm[bound(iz+1, dm[2])] = 0;
+    }
+    for(k=0; k<(mwSignedIndex)dm[2]; k++)
+        if (pm[k]==0) pm[k] = nk++;
+    return(nk);
+}
+
+/* Read the planes of the nc volumes of fa that are in the plane map (nk
+   of them) into buf.  Runs of consecutive planes are read together.
+   Returns non-zero if reading fails. */
+static int read_planes(FARRAY *fa, mwSize nc, mwSignedIndex pm[], mwSignedIndex nk, float buf[])
+{
+    mwSize m = fa->dim[0]*fa->dim[1], j;
+    mwSignedIndex nz = fa->dim[2], k, k1;
+    int st = 0;
+
+    for(j=0; j<nc && !st; j++)
+    {
+        for(k=0; k<nz && !st; k=k1)
         {
-            for(i2=0; i2<dm[2]; i2++)
-            {
-                float *pt1 = pt+i2*dm[0]*dm[1];
-                for(i0=0; i0<dm[0]; i0++)
-                {
-                    pt1[i0] = pt1[i0]-floor(pt1[i0]/dm[1]+0.5)*dm[1];
-                }
-            }
+            for(k1=k+1; pm[k]>=0 && k1<nz && pm[k1]>=0; k1++);
+            if (pm[k]>=0)
+                st = farray_read(fa, m*(k + nz*j), m*(k1-k), buf + m*(pm[k] + nk*j));
         }
-        else
+    }
+    return(st);
+}
+
+/* Buffer big enough for n floats, where the current one (*buf) has room
+   for *nbuf of them */
+static float *grow_buffer(float **buf, mwSize *nbuf, mwSize n)
+{
+    if (n>*nbuf)
+    {
+        if (*buf) mxFree(*buf);
+        *buf  = (float *)mxMalloc(sizeof(float)*n);
+        *nbuf = n;
+    }
+    return(*buf);
+}
+
+/*
+ * Sample the n volumes of a field of dimensions dmf (either F or in the
+ * file_array ff) at the deformation of dimensions dmy (Y or fy), and
+ * write the results to the file_array fo.  Returns non-zero if reading or
+ * writing fails.
+ */
+int samp_stream(mwSize dmf[], float *F, FARRAY *ff, mwSize n, mwSize dmy[], float *Y, FARRAY *fy, FARRAY *fo)
+{
+    mwSize m = dmy[0]*dmy[1], mf = dmf[0]*dmf[1], nfb = 0;
+    mwSignedIndex ns, z0, *pm = (mwSignedIndex *)0;
+    float *yb, *wb, *fb = (float *)0;
+    int st = 0;
+
+    ns = stream_planes(m, 3+n, dmy[2]);
+    yb = (float *)mxMalloc(sizeof(float)*m*ns*(3+n));
+    wb = yb + m*ns*3;
+    if (F==NULL)
+        pm = (mwSignedIndex *)mxMalloc(sizeof(mwSignedIndex)*dmf[2]);
+
+    for(z0=0; z0<dmy[2] && !st; z0+=ns)
+    {
+        mwSignedIndex nz = (ns<dmy[2]-z0) ? ns : dmy[2]-z0;
+        mwSize np = m*nz, mmf = mf*dmf[2], j;
+        float *f = F;
+
+        if ((st = read_slab(dmy, Y, fy, 3, z0, nz, yb))) break;
+        if (F==NULL)
         {
-            for(i2=0; i2<dm[2]; i2++)
-            {
-                float *pt1 = pt+i2*dm[0]*dm[1];
-                for(i0=0; i0<dm[0]; i0++)
-                {
-                    pt1[i0] = pt1[i0]-floor((pt1[i0]-pt1[i0-dm[0]])/dm[1]+0.5)*dm[1];
-                }
-            }
+            mwSignedIndex nk = plane_map(dmf, np, yb+2*np, pm);
+            f   = grow_buffer(&fb, &nfb, mf*nk*n);
+            mmf = mf*nk;
+            if ((st = read_planes(ff, n, pm, nk, f))) break;
         }
+
+        samp_pts(dmf, f, mmf, pm, n, np, yb, yb+np, yb+2*np, wb);
+
+        for(j=0; j<n && !st; j++)
+            st = farray_write(fo, m*(z0 + dmy[2]*j), np, wb + np*j);
     }
 
-    for(i0=0; i0<dm[0]; i0++)
+    if (fb) mxFree(fb);
+    if (pm) mxFree(pm);
+    mxFree(yb);
+    return(st);
+}
+
+/*
+ * Composition C(Id) = B(A(Id)), where B (of dimensions dm) is either B or
+ * in the file_array fb, A (of dimensions dma) is either A or in fa, and C
+ * is written to the file_array fc.  C is unwrapped as by comp.  Returns
+ * non-zero if reading or writing fails.
+ */
+int comp_stream(mwSize dm[], float *B, FARRAY *fb, mwSize dma[], float *A, FARRAY *fa, FARRAY *fc)
+{
+    mwSize m = dma[0]*dma[1], mb = dm[0]*dm[1], nbb = 0;
+    mwSignedIndex ns, z0, *pm = (mwSignedIndex *)0;
+    float *ab, *cb, *prev, *bb = (float *)0;
+    int st = 0;
+
+    ns   = stream_planes(m, 6, dma[2]);
+    ab   = (float *)mxMalloc(sizeof(float)*m*(ns*6+1));
+    cb   = ab + m*ns*3;
+    prev = cb + m*ns*3;
+    if (B==NULL)
+        pm = (mwSignedIndex *)mxMalloc(sizeof(mwSignedIndex)*dm[2]);
+
+    for(z0=0; z0<dma[2] && !st; z0+=ns)
     {
-        float *pt = f+i0;
-        if (i0==0)
+        mwSignedIndex nz = (ns<dma[2]-z0) ? ns : dma[2]-z0, k;
+        mwSize np = m*nz, j;
+
+        if ((st = read_slab(dma, A, fa, 3, z0, nz, ab))) break;
+        if (B==NULL)
         {
-            for(i2=0; i2<dm[2]; i2++)
-            {
-                float *pt1 = pt + i2*dm[0]*dm[1];
-                for(i1=0; i1<dm[0]*dm[1]; i1+=dm[0])
-                    pt1[i1] = pt1[i1]-floor(pt1[i1]/dm[0]+0.5)*dm[0];
-            }
+            mwSignedIndex nk = plane_map(dm, np, ab+2*np, pm);
+            float *b = grow_buffer(&bb, &nbb, mb*nk*3);
+            if ((st = read_planes(fb, 3, pm, nk, b))) break;
+            composition_stuff(dm, np, b, 0, ab, 0, cb, 0, 0, mb*nk, pm);
         }
         else
+            composition_stuff(dm, np, B, 0, ab, 0, cb, 0, 0, mb*dm[2], (mwSignedIndex *)0);
+
+        if (!get_bound())
         {
-            for(i2=0; i2<dm[2]; i2++)
-            {
-                float *pt1 = pt + i2*dm[0]*dm[1];
-                for(i1=0; i1<dm[0]*dm[1]; i1+=dm[0])
-                    pt1[i1] = pt1[i1]-floor((pt1[i1]-pt1[i1-1])/dm[0]+0.5)*dm[0];
-            }
+            for(k=0; k<nz; k++)
+                unwrap_plane(dm, dma[0], dma[1], cb+m*k, cb+np+m*k, cb+np*2+m*k,
+                             (k>0) ? cb+np*2+m*(k-1) : ((z0>0) ? prev : (float *)0));
+            for(j=0; j<m; j++)
+                prev[j] = cb[np*2+m*(nz-1)+j];
         }
+
+        for(j=0; j<3 && !st; j++)
+            st = farray_write(fc, m*(z0 + dma[2]*j), np, cb + np*j);
     }
+
+    if (bb) mxFree(bb);
+    if (pm) mxFree(pm);
+    mxFree(ab);
+    return(st);
 }
 
+/*
+ * push, where the deformation (dimensions dmy) is either Y or in the
+ * file_array fy, and the n volumes of data to push are either F or in ff.
+ * The points are pushed a slab at a time into po and so (dimensions dm),
+ * which are held in memory.  Returns non-zero if reading fails.
+ */
+int push_stream(mwSize dm[], mwSize dmy[], mwSize n, float *Y, FARRAY *fy, float *F, FARRAY *ff,
+                float po[], float so[])
+{
+    mwSize m = dmy[0]*dmy[1];
+    mwSignedIndex ns, z0;
+    float *buf;
+    int st = 0;
+
+    ns  = stream_planes(m, 3+n, dmy[2]);
+    buf = (float *)mxMalloc(sizeof(float)*m*ns*(3+n));
+
+    for(z0=0; z0<dmy[2] && !st; z0+=ns)
+    {
+        mwSignedIndex nz = (ns<dmy[2]-z0) ? ns : dmy[2]-z0;
+        mwSize np = m*nz;
+
+        st = read_slab(dmy, Y, fy, 3, z0, nz, buf);
+        if (!st) st = read_slab(dmy, F, ff, n, z0, nz, buf+np*3);
+        if (!st) push(dm, np, n, buf, buf+np*3, po, so);
+    }
+    mxFree(buf);
+    return(st);
+}
@@ -12,14 +12,27 @@ extern void smalldef_jac(mwSize dm[], double sc, float v0[], float t0[], float J
 extern void smalldef_jac1(mwSize dm[], double sc, float v[], float t[], float J[]);
 extern double samp(mwSize dm[], float f[], double x, double y, double z);
 extern void sampn(mwSize dm[], float f[], mwSize n, mwSize mm, double x, double y, double z, double v[]);
+extern void sampn_def(mwSize dm[], float f[], mwSize n, mwSize np, float def[], float v[]);
+extern void sampn_def_half(mwSize dm[], float f[], HALF fh[], mwSize n, mwSize dmy[],
+                           float def[], HALF dh[], float v[], HALF vh[]);
+extern void composition_half(mwSize dm[], HALF *B, mwSize dma[], HALF *A, HALF *C);
 extern void unwrap(mwSize dm[], float f[]);
 extern void bracket(mwSize dm[], float *A, float *B, float *C);
 extern void push(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[]);
 extern void pushc(mwSize dm[], mwSize m, mwSize n, float def[], float pf[], float po[], float so[]);
+extern void push_half(mwSize dm[], mwSize dmy[], mwSize n, float def[], HALF dh[], float pf[], HALF fh[],
+                      float po[], float so[], int circ);
 extern void pushc_grads(mwSize dmo[], mwSize dmy[], float def[], float J[], float pf[], float po[]);
 extern void determinant(mwSize dm[], float J0[], float d[]);
 extern void minmax_div(mwSize dm[], float v0[], double mnmx[]);
 extern void divergence(mwSize dm[], float v0[], float dv[]);
 extern void def2det(mwSize dm[], float *Y, float *J, mwSignedIndex s);
 extern void def2jac(mwSize dm[], float *Y, float *J, mwSignedIndex s);
+extern void def2jac_plane(mwSize dm[], float *y[3][3], mwSignedIndex k, float J[], mwSize mm, int code);
+extern int  def2jac_stream(mwSize dm[], float *Y, FARRAY *fy, FARRAY *fo, int code);
+extern int  samp_stream(mwSize dmf[], float *F, FARRAY *ff, mwSize n, mwSize dmy[], float *Y, FARRAY *fy, FARRAY *fo);
+extern int  comp_stream(mwSize dm[], float *B, FARRAY *fb, mwSize dma[], float *A, FARRAY *fa, FARRAY *fc);
+extern int  push_stream(mwSize dm[], mwSize dmy[], mwSize n, float *Y, FARRAY *fy, float *F, FARRAY *ff,
+                        float po[], float so[]);
 extern void invdef(mwSize dim_y[3], float y[], mwSize dim_iy[3], float iy[], double M1[4][3], double M2[4][3]);
+extern int  invdef_stream(mwSize dim_y[3], FARRAY *fy, mwSize dim_iy[3], float iy[], double M1[4][3], double M2[4][3]);
@@ -0,0 +1,166 @@
+/* $Id$ */
+
+/*
+ * Reading and writing single precision data described by file_array
+ * objects, so that fields that are too big to be held in memory can be
+ * processed a few planes at a time.  Elements are addressed by their
+ * (zero based) index into the array, with the volumes one after the other.
+ * Only FLOAT32 data are handled, but the byte order and the scalefactor
+ * and intercept of the file_array are respected.
+ */
+
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include "mex.h"
+#ifdef SPM_WIN32
+#if defined _FILE_OFFSET_BITS && _FILE_OFFSET_BITS == 64
+#if defined _MSC_VER
+#define off_t __int64
+#define fseeko _fseeki64
+#else
+#define off_t off64_t
+#define fseeko fseeko64
+#endif
+#endif
+#endif
+#include "shoot_farray.h"
+
+#define DTYPE_FLOAT32 16
+
+static double getscalar(const mxArray *ptr, const char nam[], double def)
+{
+    char s[256];
+    mxArray *arr = mxGetField(ptr,0,nam);
+    if (arr == (mxArray *)0)
+    {
+        (void)sprintf(s,"'%s' field is missing.", nam);
+        mexErrMsgTxt(s);
+    }
+    if (mxGetNumberOfElements(arr)==0) return(def);
+    if (!mxIsDouble(arr) || mxGetNumberOfElements(arr)!=1)
+    {
+        (void)sprintf(s,"'%s' field should be a double precision scalar.", nam);
+        mexErrMsgTxt(s);
+    }
+    return(mxGetPr(arr)[0]);
+}
+
+/*
+ * Fill in fa from a file_array (or a struct with the same fields).
+ * The file is not opened.
+ */
+void farray_init(const mxArray *ptr, FARRAY *fa)
+{
+    mxArray *arr, *sobj = (mxArray *)0;
+    double *pr;
+    mwSize i, nd, buflen;
+
+    if (mxIsClass(ptr,"file_array"))
+    {
+        (void)mexCallMATLAB(1,&sobj,1,(mxArray **)&ptr,"struct");
+        ptr = sobj;
+    }
+    if (!mxIsStruct(ptr)) mexErrMsgTxt("Not a file_array.");
+    if (mxGetNumberOfElements(ptr)!=1) mexErrMsgTxt("Can only use simple file_array objects.");
+
+    if ((int)getscalar(ptr,"dtype",0.0) != DTYPE_FLOAT32)
+        mexErrMsgTxt("Only FLOAT32 file_arrays can be used.");
+#ifdef SPM_BIGENDIAN
+    fa->swap  = (getscalar(ptr,"be",0.0)==0.0);
+#else
+    fa->swap  = (getscalar(ptr,"be",0.0)!=0.0);
+#endif
+    fa->off   = getscalar(ptr,"offset",0.0);
+    fa->slope = getscalar(ptr,"scl_slope",1.0);
+    fa->inter = getscalar(ptr,"scl_inter",0.0);
+    if (fa->slope==0.0) fa->slope = 1.0;
+
+    arr = mxGetField(ptr,0,"dim");
+    if (arr == (mxArray *)0 || !mxIsDouble(arr)) mexErrMsgTxt("Bad 'dim' field.");
+    pr = mxGetPr(arr);
+    nd = mxGetNumberOfElements(arr);
+    for(i=0; i<3; i++)
+        fa->dim[i] = (i<nd) ? (mwSize)pr[i] : 1;
+    for(i=3, fa->n=1; i<nd; i++)
+        fa->n *= (mwSize)pr[i];
+
+    fa->ro = 0;
+    arr = mxGetField(ptr,0,"permission");
+    if (arr != (mxArray *)0 && mxIsChar(arr))
+    {
+        char perm[3];
+        if (!mxGetString(arr,perm,3) && perm[0]=='r' && perm[1]=='o') fa->ro = 1;
+    }
+
+    arr = mxGetField(ptr,0,"fname");
+    if (arr == (mxArray *)0 || !mxIsChar(arr)) mexErrMsgTxt("Bad 'fname' field.");
+    buflen    = mxGetNumberOfElements(arr)+1;
+    fa->fname = (char *)mxCalloc(buflen,sizeof(char));
+    if (mxGetString(arr,fa->fname,buflen)) mexErrMsgTxt("Cant get 'fname'.");
+    fa->fp    = (FILE *)0;
+
+    if (sobj != (mxArray *)0) mxDestroyArray(sobj);
+}
+
+/* Open the file for reading (wr==0) or writing.  Returns non-zero on failure. */
+int farray_open(FARRAY *fa, int wr)
+{
+    if (wr)
+    {
+        if (fa->ro) return(1);
+        fa->fp = fopen(fa->fname,"rb+");
+        if (fa->fp == (FILE *)0)
+            fa->fp = fopen(fa->fname,"wb");
+    }
+    else
+        fa->fp = fopen(fa->fname,"rb");
+    return(fa->fp == (FILE *)0);
+}
+
+void farray_close(FARRAY *fa)
+{
+    if (fa->fp != (FILE *)0) (void)fclose(fa->fp);
+    fa->fp = (FILE *)0;
+    if (fa->fname != (char *)0) mxFree(fa->fname);
+    fa->fname = (char *)0;
+}
+
+static void swap32(mwSize n, float buf[])
+{
+    unsigned char *p = (unsigned char *)buf, *pe = p + 4*n, t;
+    for(; p<pe; p+=4)
+    {
+        t = p[0]; p[0] = p[3]; p[3] = t;
+        t = p[1]; p[1] = p[2]; p[2] = t;
+    }
+}
+
+/* Read elements o to o+n-1.  Returns non-zero on failure. */
+int farray_read(FARRAY *fa, mwSize o, mwSize n, float buf[])
+{
+    mwSize i;
+    if (fseeko(fa->fp, (off_t)fa->off + (off_t)o*sizeof(float), SEEK_SET) == -1) return(1);
+    if (fread(buf, sizeof(float), n, fa->fp) != n) return(1);
+    if (fa->swap) swap32(n, buf);
+    if (fa->slope!=1.0 || fa->inter!=0.0)
+        for(i=0; i<n; i++)
+            buf[i] = (float)(buf[i]*fa->slope + fa->inter);
+    return(0);
+}
+
+/* Write elements o to o+n-1.  The contents of buf are destroyed.
+   Returns non-zero on failure. */
+int farray_write(FARRAY *fa, mwSize o, mwSize n, float buf[])
+{
+    mwSize i;
+    if (fa->slope!=1.0 || fa->inter!=0.0)
+        for(i=0; i<n; i++)
+            buf[i] = (float)((buf[i] - fa->inter)/fa->slope);
+    if (fa->swap) swap32(n, buf);
+    if (fseeko(fa->fp, (off_t)fa->off + (off_t)o*sizeof(float), SEEK_SET) == -1) return(1);
+    if (fwrite(buf, sizeof(float), n, fa->fp) != n) return(1);
+    return(0);
+}
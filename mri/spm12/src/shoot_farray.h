@@ -0,0 +1,21 @@
+/* $Id$ */
+
+/* Single precision data in a file, as described by a file_array
+   (stdio.h must be included first) */
+typedef struct
+{
+    FILE  *fp;
+    char  *fname;
+    mwSize dim[3];   /* Dimensions of each volume */
+    mwSize n;        /* Number of volumes */
+    double off;      /* Offset into file (bytes) */
+    double slope, inter;
+    int    swap;     /* Byte order differs from the machine's */
+    int    ro;       /* Read-only */
+} FARRAY;
+
+extern void farray_init(const mxArray *ptr, FARRAY *fa);
+extern int  farray_open(FARRAY *fa, int wr);
+extern void farray_close(FARRAY *fa);
+extern int  farray_read(FARRAY *fa, mwSize o, mwSize n, float buf[]);
+extern int  farray_write(FARRAY *fa, mwSize o, mwSize n, float buf[]);
@@ -0,0 +1,425 @@
+/* $Id$ */
+
+/*
+ * Inverse of the differential operator (mom2vel) for circulant boundary
+ * conditions, by Fourier methods (see also spm_shoot_greens.m).
+ *
+ * With circulant boundaries, the operator L of vel2mom is a convolution with
+ * the stencil generated by kernel(), so it is diagonalised by the DFT.  The
+ * transform of the stencil is real, because the operator is symmetric, and
+ * gives a scalar (or a symmetric 3x3 matrix for linear elasticity) for each
+ * frequency.  These are inverted once, and kept for as long as the same
+ * dimensions and regularisation parameters are used, so each solve only
+ * needs the forward and inverse transforms of the momentum, and a multiply.
+ *
+ * The transforms are real-to-complex along the first dimension (done for
+ * two lines at a time, as the real and imaginary parts of a complex FFT),
+ * so only frequencies 0..n0/2 are stored along it.  The FFTs are mixed
+ * radix, and work for any length, although lengths with large prime factors
+ * are slow.
+ *
+ * The cached values are freed by greens_release, which the exit handler of
+ * the MEX file must call (this module does not register one, as a MEX file
+ * can only have one).
+ */
+
+#include "mex.h"
+#include <math.h>
+#include <string.h>
+#include "shoot_boundary.h"
+#include "shoot_regularisers.h"
+#include "shoot_scratch.h"
+#include "shoot_greens.h"
+#include "spm_openmp.h"
+
+#define MAXFACTORS 64
+
+typedef struct
+{
+    mwSize n;
+    int nf, f[MAXFACTORS];  /* Prime factors of n */
+    double *w;              /* exp(-2*pi*i*k/n), for k=0..n-1 (re,im pairs) */
+} FFT_PLAN;
+
+typedef struct
+{
+    mwSize dm[3];
+    double param[8];
+    mwSize nh;              /* dm[0]/2+1 */
+    int ne;                 /* 1 (scalar) or 6 (symmetric 3x3) values per frequency */
+    float *g;               /* Inverse of the transformed operator */
+    FFT_PLAN p[3];
+    mwSize nmax;            /* Largest dimension */
+    int nt;                 /* Number of threads that work is big enough for */
+    double *work;           /* 6*nmax doubles for each thread */
+} GREENS;
+
+static GREENS gr;
+
+static void *persistent(mwSize n)
+{
+    void *p = mxMalloc(n);
+    mexMakeMemoryPersistent(p);
+    return(p);
+}
+
+static void plan_init(FFT_PLAN *p, mwSize n)
+{
+    mwSize k, r = n, q;
+    double a = -2.0*3.14159265358979323846/n;
+
+    p->n  = n;
+    p->nf = 0;
+    for(q=2; r>1; )
+    {
+        if (r%q==0)
+        {
+            p->f[p->nf++] = (int)q;
+            r /= q;
+        }
+        else
+            q = (q==2) ? 3 : q+2;
+    }
+    p->w = (double *)persistent(2*n*sizeof(double));
+    for(k=0; k<n; k++)
+    {
+        p->w[2*k  ] = cos(a*k);
+        p->w[2*k+1] = sin(a*k);
+    }
+}
+
+/* Mixed radix (decimation in time) FFT of n points of x (stride s), into y.
+   The sign of the exponent is positive if inv is set.  t must have room for
+   as many complex values as the largest factor. */
+static void fft_rec(const FFT_PLAN *p, int lev, mwSize n, const double x[], mwSize s,
+                    double y[], double t[], int inv)
+{
+    mwSize m, k, ws;
+    int r, q, u;
+    double sg = inv ? -1.0 : 1.0;
+
+    if (n==1)
+    {
+        y[0] = x[0];
+        y[1] = x[1];
+        return;
+    }
+    r  = p->f[lev];
+    m  = n/r;
+    ws = p->n/n;
+    for(q=0; q<r; q++)
+        fft_rec(p, lev+1, m, x+2*q*s, s*r, y+2*q*m, t, inv);
+
+    if (r==2)
+    {
+        for(k=0; k<m; k++)
+        {
+            double *a = y+2*k, *b = y+2*(k+m);
+            double wr = p->w[2*k*ws], wi = sg*p->w[2*k*ws+1];
+            double br = b[0]*wr - b[1]*wi, bi = b[0]*wi + b[1]*wr;
+            b[0] = a[0] - br; b[1] = a[1] - bi;
+            a[0] = a[0] + br; a[1] = a[1] + bi;
+        }
+        return;
+    }
+
+    /* Odd factors, using W^(q*u) and W^((r-q)*u) being complex conjugates */
+    for(k=0; k<m; k++)
+    {
+        for(q=0; q<r; q++)
+        {
+            double *a = y+2*(q*m+k);
+            mwSize  o = 2*q*k*ws;
+            double wr = p->w[o], wi = sg*p->w[o+1];
+            t[2*q  ] = a[0]*wr - a[1]*wi;
+            t[2*q+1] = a[0]*wi + a[1]*wr;
+        }
+        for(u=0; u<r; u++)
+        {
+            double sr = t[0], si = t[1];
+            mwSize j = 0, nr = p->n/r;
+            for(q=1; q<=r/2; q++)
+            {
+                double *a = t+2*q, *b = t+2*(r-q), wr, wi;
+                j += u; if (j>=(mwSize)r) j -= r;
+                wr  = p->w[2*j*nr];
+                wi  = sg*p->w[2*j*nr+1];
+                sr += (a[0]+b[0])*wr - (a[1]-b[1])*wi;
+                si += (a[1]+b[1])*wr + (a[0]-b[0])*wi;
+            }
+            y[2*(u*m+k)  ] = sr;
+            y[2*(u*m+k)+1] = si;
+        }
+    }
+}
+
+/* Real-to-complex transforms along the first dimension of nl lines of a,
+   giving nh complex values for each line in c */
+static void fft_dim0(const GREENS *h, mwSize nl, float a[], float c[])
+{
+    mwSize n = h->dm[0], nh = h->nh;
+    mwSignedIndex l2;
+
+    #pragma omp parallel for schedule(static) if(nl*n>=GREENS_PAR_MIN)
+    for(l2=0; l2<(mwSignedIndex)((nl+1)/2); l2++)
+    {
+        double *x = h->work + 6*h->nmax*omp_get_thread_num(), *y = x + 2*n, *t = y + 2*n;
+        mwSize l = 2*l2, k;
+        float *a0 = a + l*n, *a1 = a0 + n, *c0 = c + 2*l*nh, *c1 = c0 + 2*nh;
+        int two = (l+1<nl);
+
+        for(k=0; k<n; k++)
+        {
+            x[2*k  ] = a0[k];
+            x[2*k+1] = two ? a1[k] : 0.0;
+        }
+        fft_rec(&h->p[0], 0, n, x, 1, y, t, 0);
+        for(k=0; k<nh; k++)
+        {
+            mwSize kn = (n-k)%n;
+            double zr = y[2*k], zi = y[2*k+1], cr = y[2*kn], ci = -y[2*kn+1];
+            c0[2*k  ] = (float)(0.5*(zr+cr));
+            c0[2*k+1] = (float)(0.5*(zi+ci));
+            if (two)
+            {
+                c1[2*k  ] = (float)( 0.5*(zi-ci));
+                c1[2*k+1] = (float)(-0.5*(zr-cr));
+            }
+        }
+    }
+}
+
+/* Inverse of fft_dim0 (not normalised) */
+static void ifft_dim0(const GREENS *h, mwSize nl, float c[], float a[])
+{
+    mwSize n = h->dm[0], nh = h->nh;
+    mwSignedIndex l2;
+
+    #pragma omp parallel for schedule(static) if(nl*n>=GREENS_PAR_MIN)
+    for(l2=0; l2<(mwSignedIndex)((nl+1)/2); l2++)
+    {
+        double *x = h->work + 6*h->nmax*omp_get_thread_num(), *y = x + 2*n, *t = y + 2*n;
+        mwSize l = 2*l2, k;
+        float *a0 = a + l*n, *a1 = a0 + n, *c0 = c + 2*l*nh, *c1 = c0 + 2*nh;
+        int two = (l+1<nl);
+
+        /* x = A + i*B, where A and B are Hermitian */
+        for(k=0; k<n; k++)
+        {
+            double ar, ai, br = 0.0, bi = 0.0;
+            if (k<nh)
+            {
+                ar = c0[2*k]; ai = c0[2*k+1];
+                if (two) { br = c1[2*k]; bi = c1[2*k+1]; }
+            }
+            else
+            {
+                ar = c0[2*(n-k)]; ai = -c0[2*(n-k)+1];
+                if (two) { br = c1[2*(n-k)]; bi = -c1[2*(n-k)+1]; }
+            }
+            x[2*k  ] = ar - bi;
+            x[2*k+1] = ai + br;
+        }
+        fft_rec(&h->p[0], 0, n, x, 1, y, t, 1);
+        for(k=0; k<n; k++)
+        {
+            a0[k] = (float)y[2*k];
+            if (two) a1[k] = (float)y[2*k+1];
+        }
+    }
+}
+
+/* Complex transforms of nc volumes of half spectra along dimension d */
+static void fft_dimd(const GREENS *h, int d, mwSize nc, float c[], int inv)
+{
+    mwSize n = h->dm[d], s, nb, no;
+    mwSignedIndex l;
+
+    if (n==1) return;
+    if (d==1)
+    {
+        s  = h->nh;             /* stride along dimension */
+        no = h->nh;             /* lines within a block */
+        nb = h->dm[2]*nc;       /* blocks */
+    }
+    else
+    {
+        s  = h->nh*h->dm[1];
+        no = h->nh*h->dm[1];
+        nb = nc;
+    }
+
+    #pragma omp parallel for schedule(static) if(nb*no*n>=GREENS_PAR_MIN)
+    for(l=0; l<(mwSignedIndex)(nb*no); l++)
+    {
+        double *x = h->work + 6*h->nmax*omp_get_thread_num(), *y = x + 2*n, *t = y + 2*n;
+        float *cp = c + 2*((l/no)*no*n + l%no);
+        mwSize k;
+
+        for(k=0; k<n; k++)
+        {
+            x[2*k  ] = cp[2*k*s  ];
+            x[2*k+1] = cp[2*k*s+1];
+        }
+        fft_rec(&h->p[d], 0, n, x, 1, y, t, inv);
+        for(k=0; k<n; k++)
+        {
+            cp[2*k*s  ] = (float)y[2*k  ];
+            cp[2*k*s+1] = (float)y[2*k+1];
+        }
+    }
+}
+
+static void fft_fwd(const GREENS *h, mwSize nc, float a[], float c[])
+{
+    fft_dim0(h, nc*h->dm[1]*h->dm[2], a, c);
+    fft_dimd(h, 1, nc, c, 0);
+    fft_dimd(h, 2, nc, c, 0);
+}
+
+static void fft_inv(const GREENS *h, mwSize nc, float c[], float a[])
+{
+    fft_dimd(h, 2, nc, c, 1);
+    fft_dimd(h, 1, nc, c, 1);
+    ifft_dim0(h, nc*h->dm[1]*h->dm[2], c, a);
+}
+
+/* Free the cached eigenvalues and FFT tables.  Also called on exit. */
+void greens_release(void)
+{
+    int d;
+    if (gr.g) mxFree((void *)gr.g);
+    for(d=0; d<3; d++)
+        if (gr.p[d].w) mxFree((void *)gr.p[d].w);
+    if (gr.work) mxFree((void *)gr.work);
+    memset((void *)&gr, 0, sizeof(gr));
+}
+
+/* Size (bytes) of the cached eigenvalues and FFT tables */
+double greens_bytes(void)
+{
+    if (!gr.g) return(0.0);
+    return((double)gr.nh*gr.dm[1]*gr.dm[2]*gr.ne*sizeof(float)
+         + 2.0*(gr.dm[0]+gr.dm[1]+gr.dm[2])*sizeof(double)
+         + 6.0*gr.nmax*gr.nt*sizeof(double));
+}
+
+/* Set up the FFT tables and the inverse of the transformed operator */
+static void greens_init(mwSize dm[], double param[])
+{
+    mwSize m = dm[0]*dm[1]*dm[2], nh = dm[0]/2+1, mh = nh*dm[1]*dm[2], q;
+    int d, ne, bnd = get_bound();
+    float *f, *c;
+
+    greens_release();
+    for(d=0; d<3; d++) gr.dm[d] = dm[d];
+    for(d=0; d<8; d++) gr.param[d] = param[d];
+    gr.nh = nh;
+    for(d=0; d<3; d++) plan_init(&gr.p[d], dm[d]);
+
+    gr.nmax = (dm[0]>dm[1]) ? dm[0] : dm[1];
+    gr.nmax = (gr.nmax>dm[2]) ? gr.nmax : dm[2];
+    gr.nt   = omp_get_max_threads();
+    gr.work = (double *)persistent(6*gr.nmax*gr.nt*sizeof(double));
+
+    /* Transform the stencil of the operator */
+    ne = (param[6]==0 && param[7]==0) ? 1 : 9;
+    f  = scratch_get(m*ne);
+    c  = scratch_get(2*mh*ne);
+    set_bound(BOUND_CIRCULANT);
+    kernel(dm, param, f);
+    set_bound(bnd);
+    fft_fwd(&gr, ne, f, c);
+
+    if (ne==1)
+    {
+        gr.ne = 1;
+        gr.g  = (float *)persistent(mh*sizeof(float));
+        for(q=0; q<mh; q++)
+        {
+            double a = c[2*q];
+            gr.g[q] = (a==0.0) ? 0.0f : (float)(1.0/(a*m));
+        }
+    }
+    else
+    {
+        float *g;
+        gr.ne = 6;
+        gr.g  = g = (float *)persistent(6*mh*sizeof(float));
+        for(q=0; q<mh; q++)
+        {
+            double a00 = c[2*q], a11 = c[2*(q+mh*4)], a22 = c[2*(q+mh*8)];
+            double a01 = c[2*(q+mh*3)], a02 = c[2*(q+mh*6)], a12 = c[2*(q+mh*7)];
+            double dt, idt;
+            dt  = a00*(a11*a22-a12*a12) + a01*(a12*a02-a01*a22) + a02*(a01*a12-a11*a02);
+            idt = (dt==0.0) ? 0.0 : 1.0/(dt*m);
+            g[q     ] = (float)((a11*a22-a12*a12)*idt);
+            g[q+mh  ] = (float)((a00*a22-a02*a02)*idt);
+            g[q+mh*2] = (float)((a00*a11-a01*a01)*idt);
+            g[q+mh*3] = (float)((a02*a12-a01*a22)*idt);
+            g[q+mh*4] = (float)((a01*a12-a02*a11)*idt);
+            g[q+mh*5] = (float)((a01*a02-a00*a12)*idt);
+        }
+    }
+    if (param[3]==0)
+        for(d=0; d<gr.ne; d++)
+            gr.g[d*mh] = 0.0f;
+
+    scratch_put(c);
+    scratch_put(f);
+}
+
+/*
+ * v = inv(L) u, for circulant boundary conditions.  The parameters are as
+ * for vel2mom.  If there is no absolute displacement penalty (param[3]==0),
+ * the mean of v is zero.
+ */
+void greens_mom2vel(mwSize dm[], double param[], float u[], float v[])
+{
+    mwSize mh;
+    int d, same;
+    float *c, *cx, *cy, *cz, *g;
+
+    same = (gr.g!=0 && gr.nt>=omp_get_max_threads());
+    for(d=0; d<3; d++) same = same && (gr.dm[d]==dm[d]);
+    for(d=0; d<8; d++) same = same && (gr.param[d]==param[d]);
+    if (!same) greens_init(dm, param);
+
+    mh = gr.nh*dm[1]*dm[2];
+    c  = scratch_get(6*mh);
+    cx = c; cy = c+2*mh; cz = c+4*mh;
+    g  = gr.g;
+
+    fft_fwd(&gr, 3, u, c);
+
+    if (gr.ne==1)
+    {
+        double s0 = param[0]*param[0], s1 = param[1]*param[1], s2 = param[2]*param[2];
+        mwSignedIndex i;
+        #pragma omp parallel for schedule(static) if(mh>=GREENS_PAR_MIN)
+        for(i=0; i<(mwSignedIndex)mh; i++)
+        {
+            double gi = g[i];
+            cx[2*i] = (float)(cx[2*i]*gi*s0); cx[2*i+1] = (float)(cx[2*i+1]*gi*s0);
+            cy[2*i] = (float)(cy[2*i]*gi*s1); cy[2*i+1] = (float)(cy[2*i+1]*gi*s1);
+            cz[2*i] = (float)(cz[2*i]*gi*s2); cz[2*i+1] = (float)(cz[2*i+1]*gi*s2);
+        }
+    }
+    else
+    {
+        mwSignedIndex i;
+        #pragma omp parallel for schedule(static) if(mh>=GREENS_PAR_MIN)
+        for(i=0; i<(mwSignedIndex)mh; i++)
+        {
+            double g00 = g[i], g11 = g[i+mh], g22 = g[i+mh*2];
+            double g01 = g[i+mh*3], g02 = g[i+mh*4], g12 = g[i+mh*5];
+            double xr = cx[2*i], xi = cx[2*i+1], yr = cy[2*i], yi = cy[2*i+1], zr = cz[2*i], zi = cz[2*i+1];
+            cx[2*i] = (float)(g00*xr + g01*yr + g02*zr); cx[2*i+1] = (float)(g00*xi + g01*yi + g02*zi);
+            cy[2*i] = (float)(g01*xr + g11*yr + g12*zr); cy[2*i+1] = (float)(g01*xi + g11*yi + g12*zi);
+            cz[2*i] = (float)(g02*xr + g12*yr + g22*zr); cz[2*i+1] = (float)(g02*xi + g12*yi + g22*zi);
+        }
+    }
+
+    fft_inv(&gr, 3, c, v);
+    scratch_put(c);
+}
@@ -0,0 +1,10 @@
+/* $Id$ */
+
+/* Smallest number of values for which the transforms are multithreaded */
+#ifndef GREENS_PAR_MIN
+#define GREENS_PAR_MIN 32768
+#endif
+
+extern void   greens_mom2vel(mwSize dm[], double param[], float u[], float v[]);
+extern void   greens_release(void);
+extern double greens_bytes(void);
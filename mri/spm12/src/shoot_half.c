@@ -0,0 +1,241 @@
+/* $Id$ */
+
+/*
+ * Storage of fields in 16 bits, either as IEEE half precision (fp16) or as
+ * bfloat16 (the top half of a single precision number).  The data are held
+ * in uint16 arrays, and converted to single precision as they are used, so
+ * all the arithmetic is still done in single (or double) precision.
+ * Decoding uses a lookup table (256KB), and encoding rounds to nearest
+ * (ties to even).
+ *
+ * fp16 has an 11 bit significand (relative accuracy about 5e-4), but only
+ * goes up to 65504, whereas bfloat16 has the range of single precision but
+ * only an 8 bit significand (relative accuracy about 4e-3).  Deformations
+ * are therefore stored as displacements from the identity transform, which
+ * are usually a few voxels at most, rather than as absolute coordinates,
+ * which would lose accuracy towards the far end of the volume.
+ */
+
+#include "mex.h"
+#include <math.h>
+#include "shoot_half.h"
+#include "shoot_boundary.h"
+#include "shoot_regularisers.h"
+#include "spm_openmp.h"
+
+static int   half_type = HALF_FP16;
+static float lut[2][65536];
+static int   lut_done[2] = {0, 0};
+
+typedef union
+{
+    float        f;
+    unsigned int u;
+} FLOAT_BITS;
+
+void set_half(int t)
+{
+    if (t!=HALF_FP16 && t!=HALF_BF16)
+        mexErrMsgTxt("Undefined half precision format.");
+    half_type = t;
+}
+
+int get_half()
+{
+    return(half_type);
+}
+
+static float fp16_to_float(HALF h)
+{
+    FLOAT_BITS v;
+    unsigned int s = ((unsigned int)h&0x8000)<<16, e = (h>>10)&0x1f, m = h&0x3ff;
+
+    if (e==0)
+    {
+        /* Zero or subnormal */
+        v.f = (float)ldexp((double)m, -24);
+        v.u |= s;
+    }
+    else if (e==31)
+        v.u = s | 0x7f800000 | (m<<13);
+    else
+        v.u = s | ((e+112)<<23) | (m<<13);
+    return(v.f);
+}
+
+/* Table for decoding data in the current format.  Must not be called
+   from within a parallel region. */
+const float *half_lut()
+{
+    if (!lut_done[half_type])
+    {
+        unsigned int h;
+        for(h=0; h<65536; h++)
+        {
+            if (half_type==HALF_FP16)
+                lut[0][h] = fp16_to_float((HALF)h);
+            else
+            {
+                FLOAT_BITS v;
+                v.u       = h<<16;
+                lut[1][h] = v.f;
+            }
+        }
+        lut_done[half_type] = 1;
+    }
+    return(lut[half_type]);
+}
+
+HALF float2half(float x)
+{
+    FLOAT_BITS v;
+    unsigned int u, s;
+
+    v.f = x;
+    u   = v.u;
+    if (half_type==HALF_BF16)
+    {
+        if ((u&0x7fffffff)>0x7f800000)
+            return((HALF)((u>>16)|0x40)); /* Keep NaNs as NaNs */
+        return((HALF)((u + 0x7fff + ((u>>16)&1))>>16));
+    }
+
+    s  = (u>>16)&0x8000;
+    u &= 0x7fffffff;
+    if (u>=0x7f800000)               /* Inf or NaN */
+        return((HALF)(s | 0x7c00 | ((u>0x7f800000) ? 0x200 : 0)));
+    if (u>=0x477ff000)               /* Rounds to more than 65504 */
+        return((HALF)(s | 0x7c00));
+    if (u<0x38800000)                /* Subnormal in half precision */
+    {
+        unsigned int e = u>>23, m, r, sh, rem;
+        if (e<102) return((HALF)s);
+        m   = (u&0x7fffff) | 0x800000;
+        sh  = 126-e;
+        r   = m>>sh;
+        rem = m&((1u<<sh)-1);
+        if (rem>(1u<<(sh-1)) || (rem==(1u<<(sh-1)) && (r&1))) r++;
+        return((HALF)(s | r));
+    }
+    u -= 0x38000000;
+    return((HALF)(s | ((u + 0xfff + ((u>>13)&1))>>13)));
+}
+
+void half_decode(const HALF h[], mwSize n, const float lut[], float f[])
+{
+    mwSize i;
+    for(i=0; i<n; i++)
+        f[i] = lut[h[i]];
+}
+
+void half_encode(const float f[], mwSize n, HALF h[])
+{
+    mwSize i;
+    for(i=0; i<n; i++)
+        h[i] = float2half(f[i]);
+}
+
+/*
+ * Deformation (in voxels, starting at 1) at the n points from linear index
+ * i0 of a grid of dimensions dm, whose displacements are stored in h (with
+ * the three components dm[0]*dm[1]*dm[2] elements apart).
+ */
+void half_decode_def(mwSize dm[], mwSize i0, mwSize n, const HALF h[], const float lut[],
+                     float px[], float py[], float pz[])
+{
+    mwSize mm = dm[0]*dm[1]*dm[2], i, ix, iy, iz;
+    const HALF *hx = h+i0, *hy = h+mm+i0, *hz = h+2*mm+i0;
+
+    ix = i0%dm[0];
+    iy = (i0/dm[0])%dm[1];
+    iz = i0/(dm[0]*dm[1]);
+    for(i=0; i<n; i++)
+    {
+        px[i] = (float)(ix+1) + lut[hx[i]];
+        py[i] = (float)(iy+1) + lut[hy[i]];
+        pz[i] = (float)(iz+1) + lut[hz[i]];
+        if (++ix==dm[0])
+        {
+            ix = 0;
+            if (++iy==dm[1])
+            {
+                iy = 0;
+                iz++;
+            }
+        }
+    }
+}
+
+/* The reverse of half_decode_def */
+void half_encode_def(mwSize dm[], mwSize i0, mwSize n, const float px[], const float py[],
+                     const float pz[], HALF h[])
+{
+    mwSize mm = dm[0]*dm[1]*dm[2], i, ix, iy, iz;
+    HALF *hx = h+i0, *hy = h+mm+i0, *hz = h+2*mm+i0;
+
+    ix = i0%dm[0];
+    iy = (i0/dm[0])%dm[1];
+    iz = i0/(dm[0]*dm[1]);
+    for(i=0; i<n; i++)
+    {
+        hx[i] = float2half(px[i] - (float)(ix+1));
+        hy[i] = float2half(py[i] - (float)(iy+1));
+        hz[i] = float2half(pz[i] - (float)(iz+1));
+        if (++ix==dm[0])
+        {
+            ix = 0;
+            if (++iy==dm[1])
+            {
+                iy = 0;
+                iz++;
+            }
+        }
+    }
+}
+
+/*
+ * vel2mom for half precision velocities and momenta.  The planes are done
+ * in slabs, which are decoded along with two planes either side (whatever
+ * the regulariser) into a buffer that is treated as a small volume by
+ * vel2mom.  The planes in the middle of the slab do not see the ends of
+ * this volume, so the results are identical to those of vel2mom on the
+ * decoded velocities.  Slabs are done in parallel.
+ */
+void vel2mom_half(mwSize dm[], HALF f[], double s[], HALF g[])
+{
+    const float *tab = half_lut();
+    mwSize mp = dm[0]*dm[1], mm = mp*dm[2];
+    mwSignedIndex ns, nsl, sl;
+    int nt = omp_get_max_threads();
+    float *buf;
+
+    if (nt>(int)dm[2]) nt = dm[2];
+    ns = (mwSignedIndex)(HALF_BYTES/(nt*6.0*sizeof(float)*mp)) - 4;
+    if (ns<4) ns = 4;
+    if (ns>((mwSignedIndex)dm[2]+nt-1)/nt) ns = ((mwSignedIndex)dm[2]+nt-1)/nt;
+    nsl = ((mwSignedIndex)dm[2]+ns-1)/ns;
+    if (nsl<nt) nt = (int)nsl;
+    buf = (float *)mxMalloc(sizeof(float)*nt*6*(ns+4)*mp);
+
+    #pragma omp parallel for schedule(static) num_threads(nt) if(nt>1)
+    for(sl=0; sl<nsl; sl++)
+    {
+        mwSignedIndex k0 = sl*ns, nk = (ns<(mwSignedIndex)dm[2]-k0) ? ns : (mwSignedIndex)dm[2]-k0, b;
+        mwSize dmb[3], c;
+        float *fb = buf + omp_get_thread_num()*6*(ns+4)*mp, *gb;
+
+        dmb[0] = dm[0];
+        dmb[1] = dm[1];
+        dmb[2] = nk+4;
+        gb     = fb + 3*(nk+4)*mp;
+        for(c=0; c<3; c++)
+            for(b=0; b<nk+4; b++)
+                half_decode(f + c*mm + bound(k0+b-2,dm[2])*mp, mp, tab, fb + (c*(nk+4)+b)*mp);
+
+        vel2mom(dmb, fb, s, gb);
+
+        for(c=0; c<3; c++)
+            half_encode(gb + (c*(nk+4)+2)*mp, nk*mp, g + c*mm + k0*mp);
+    }
+    mxFree(buf);
+}
@@ -0,0 +1,25 @@
+/* $Id$ */
+
+/* Formats for storing fields in 16 bits */
+#define HALF_FP16 0   /* IEEE 754 binary16 */
+#define HALF_BF16 1   /* bfloat16 */
+
+/* Approximate total size of the single precision buffers that the half
+   precision versions of the kernels convert their data into */
+#ifndef HALF_BYTES
+#define HALF_BYTES (16*1024*1024)
+#endif
+
+typedef unsigned short HALF;
+
+extern void  set_half(int t);
+extern int   get_half();
+extern const float *half_lut();
+extern HALF  float2half(float x);
+extern void  half_decode(const HALF h[], mwSize n, const float lut[], float f[]);
+extern void  half_encode(const float f[], mwSize n, HALF h[]);
+extern void  half_decode_def(mwSize dm[], mwSize i0, mwSize n, const HALF h[], const float lut[],
+                             float px[], float py[], float pz[]);
+extern void  half_encode_def(mwSize dm[], mwSize i0, mwSize n, const float px[], const float py[],
+                             const float pz[], HALF h[]);
+extern void  vel2mom_half(mwSize dm[], HALF f[], double s[], HALF g[]);
@@ -15,11 +15,24 @@
 */
 
 #include <math.h>
+#include <stdio.h>
 #include "mex.h"
+#include "shoot_farray.h"
+#include "spm_openmp.h"
 
 #define MAXV 16384
 #define REAL double
 
+/* Smallest number of cubes for which the inversion is multithreaded */
+#ifndef PAR_MIN
+#define PAR_MIN 32768
+#endif
+
+/* Approximate size of the buffer used by invdef_stream */
+#ifndef STREAM_BYTES
+#define STREAM_BYTES (32*1024*1024)
+#endif
+
 static void invertX(REAL X[4][3], REAL IX[4][4])
 /* X is a matrix containing the co-ordinates of the four vertices of a tetrahedron.
    IX = inv([X ; 1 1 1 1]);  */
@@ -166,32 +179,36 @@ static void invertM(REAL M[4][3], REAL IM[4][3])
     "Image Registration using a Symmetric Prior - in Three-Dimensions".
     Human Brain Mapping 9(4):212-225. */
 
-static void scan_line(REAL lin[2], int y, int z, int *n, int vox[][3], int maxv)
+static void scan_line(REAL lin[2], int y, int z, int *n, int vox[][3], int maxv, int lim[3][2])
 {
-    REAL p[2], t;
-    int x, xe;
+    REAL p[2], t, xs, xe;
+    int x;
 
     /* sort p into ascending order of x */
     p[0] = lin[0]; p[1] = lin[1];
     if (p[1]<p[0]) {t = p[1]; p[1] = p[0]; p[0] = t;}
 
-    /* find voxels where x is integer */
-    for(x=ceil(p[0]), xe=floor(p[1]); x<=xe; x++)
+    /* find voxels where x is integer (and within lim) */
+    xs = ceil(p[0]);  if (xs<lim[0][0]) xs = lim[0][0];
+    xe = floor(p[1]); if (xe>lim[0][1]) xe = lim[0][1];
+    if (!(xs<=xe)) return;
+    for(x=(int)xs; x<=(int)xe; x++)
     {
-        if ((*n)>=maxv-1)
-            mexErrMsgTxt("Too many voxels inside a tetrahedron");
-        vox[*n][0] = x;
-        vox[*n][1] = y;
-        vox[*n][2] = z;
+        if ((*n)<maxv)
+        {
+            vox[*n][0] = x;
+            vox[*n][1] = y;
+            vox[*n][2] = z;
+        }
         (*n)++;
     }
 }
 
-static void scan_triangle(REAL tri[][2], int z, int *n, int vox[][3], int maxv)
+static void scan_triangle(REAL tri[][2], int z, int *n, int vox[][3], int maxv, int lim[3][2])
 {
     REAL *p[3], *t, lin[2];
-    REAL x1, x2, y1, y2;
-    int y, ye, i;
+    REAL x1, x2, y1, y2, ys, ye;
+    int y, i;
 
     /* sort p into ascending order of y */
     p[0] = tri[0]; p[1] = tri[1]; p[2] = tri[2];
@@ -200,7 +217,9 @@ static void scan_triangle(REAL tri[][2], int z, int *n, int vox[][3], int maxv)
     if (p[1][1]<p[0][1]) {t = p[1]; p[1] = p[0]; p[0] = t;}
 
     /* find lower lines cutting triangle where y is integer */
-    for(y=ceil(p[0][1]), ye=floor(p[1][1]); y<=ye; y++)
+    ys = ceil(p[0][1]);  if (ys<lim[1][0]) ys = lim[1][0];
+    ye = floor(p[1][1]); if (ye>lim[1][1]) ye = lim[1][1];
+    if (ys<=ye) for(y=(int)ys; y<=(int)ye; y++)
     {
         x1 = p[0][0]; y1 = p[0][1];
         for(i=0; i<2; i++)
@@ -211,11 +230,13 @@ static void scan_triangle(REAL tri[][2], int z, int *n, int vox[][3], int maxv)
             else
                 lin[i] = (x1*(y2-y)+x2*(y-y1))/(y2-y1);
         }
-        scan_line(lin,y,z, n,vox,maxv);
+        scan_line(lin,y,z, n,vox,maxv,lim);
     }
 
     /* find upper lines cutting triangle where y is integer */
-    for(y=ceil(p[1][1]), ye=floor(p[2][1]); y<=ye; y++)
+    ys = ceil(p[1][1]);  if (ys<lim[1][0]) ys = lim[1][0];
+    ye = floor(p[2][1]); if (ye>lim[1][1]) ye = lim[1][1];
+    if (ys<=ye) for(y=(int)ys; y<=(int)ye; y++)
     {
         x2 = p[2][0]; y2 = p[2][1];
         for(i=0; i<2; i++)
@@ -226,20 +247,22 @@ static void scan_triangle(REAL tri[][2], int z, int *n, int vox[][3], int maxv)
             else
                 lin[i] = (x1*(y2-y)+x2*(y-y1))/(y2-y1);
         }
-        scan_line(lin,y,z, n,vox,maxv);
+        scan_line(lin,y,z, n,vox,maxv,lim);
     }
 }
 
 
-static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv)
+static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv, int lim[3][2])
 /* Y are the vertices of the tetrahedron.  n are the number of located
    integer co-ordinates, vox are the co-ordinates found and maxv are the
-   maximum number of co-ordinates allowed. */
+   maximum number of co-ordinates allowed.  Only co-ordinates from lim[d][0]
+   to lim[d][1] (in each direction d) are located.  If there are more than
+   maxv of them, n is set to the number found, but only maxv are stored. */
 {
     REAL *p[4], *t;
     REAL tri[4][2];
-    REAL x1, x2, y1, y2, z1, z2;
-    int z, ze, i;
+    REAL x1, x2, y1, y2, z1, z2, zs, ze;
+    int z, i;
 
     *n = 0;
 
@@ -253,7 +276,9 @@ static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv)
     if (p[1][2]<p[0][2]) {t = p[1]; p[1] = p[0]; p[0] = t;}
 
     /* find lower triangles that intersect tetrahedron where z is integer */
-    for(z=ceil(p[0][2]), ze=floor(p[1][2]); z<=ze; z++)
+    zs = ceil(p[0][2]);  if (zs<lim[2][0]) zs = lim[2][0];
+    ze = floor(p[1][2]); if (ze>lim[2][1]) ze = lim[2][1];
+    if (zs<=ze) for(z=(int)zs; z<=(int)ze; z++)
     {
         x1 = p[0][0]; y1 = p[0][1]; z1 = p[0][2];
         for(i=0; i<3; i++)
@@ -271,12 +296,14 @@ static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv)
                 tri[i][1] = (y1*t2+y2*t1)/t;
             }
         }
-        scan_triangle(tri,z, n,vox,maxv);
+        scan_triangle(tri,z, n,vox,maxv,lim);
     }
 
     /* find quadrilaterals that intersect tetrahedron where z is integer */
     /* each quadrilateral divided into two triangles */
-    for(z=ceil(p[1][2]), ze=floor(p[2][2]); z<=ze; z++)
+    zs = ceil(p[1][2]);  if (zs<lim[2][0]) zs = lim[2][0];
+    ze = floor(p[2][2]); if (ze>lim[2][1]) ze = lim[2][1];
+    if (zs<=ze) for(z=(int)zs; z<=(int)ze; z++)
     {
         static int ii[] = {0,1,1,0}, jj[] = {3,3,2,2};
 
@@ -296,14 +323,16 @@ static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv)
                 tri[i][1] = (y1*t2+y2*t1)/t;
             }
         }
-        scan_triangle(tri,z, n,vox,maxv);
+        scan_triangle(tri,z, n,vox,maxv,lim);
         tri[1][0] = tri[3][0];
         tri[1][1] = tri[3][1];
-        scan_triangle(tri,z, n,vox,maxv);
+        scan_triangle(tri,z, n,vox,maxv,lim);
     }
 
     /* find upper triangles that intersect tetrahedron where z is integer */
-    for(z=ceil(p[2][2]), ze=floor(p[3][2]); z<=ze; z++)
+    zs = ceil(p[2][2]);  if (zs<lim[2][0]) zs = lim[2][0];
+    ze = floor(p[3][2]); if (ze>lim[2][1]) ze = lim[2][1];
+    if (zs<=ze) for(z=(int)zs; z<=(int)ze; z++)
     {
         x2 = p[3][0]; y2 = p[3][1]; z2 = p[3][2];
         for(i=0; i<3; i++)
@@ -321,7 +350,7 @@ static void scan_tetrahedron(REAL Y[4][3], int *n, int vox[][3], int maxv)
                 tri[i][1] = (y1*t2+y2*t1)/t;
             }
         }
-        scan_triangle(tri,z, n,vox,maxv);
+        scan_triangle(tri,z, n,vox,maxv,lim);
     }
 }
 
@@ -361,13 +390,20 @@ static void setup_consts(mwSize dim[3])
         }
 }
 
-/* Compute the inverse deformation field within a single cube */
-static void invert_it(int x0, int x1, int x2, float *y0, float *y1, float *y2,
-    mwSize dim_iy[3], float *iy0, float *iy1, float *iy2, REAL M1[4][3], REAL M2[4][3], int pass)
+/* Compute the inverse deformation field within a single cube, for the
+   voxels in planes z0 to z1 of the output.  Returns 0 if a tetrahedron
+   contains too many voxels. */
+static int invert_it(int x0, int x1, int x2, float *y0, float *y1, float *y2,
+    mwSize dim_iy[3], float *iy0, float *iy1, float *iy2, REAL M1[4][3], REAL M2[4][3], int pass,
+    int z0, int z1)
 {
-    int i, j, k, vox[MAXV][3], nvox;
+    int i, j, k, vox[MAXV][3], nvox, lim[3][2];
     REAL Y0[4][3], Y[4][3], M[4][3], IM[4][3];
 
+    lim[0][0] = 1;  lim[0][1] = (int)dim_iy[0];
+    lim[1][0] = 1;  lim[1][1] = (int)dim_iy[1];
+    lim[2][0] = z0; lim[2][1] = z1;
+
     /* Determine tetrahedral arrangement */
     k = (x0%2)==((x1%2)==(x2%2));
     if (pass==1) k = !k;
@@ -389,7 +425,8 @@ static void invert_it(int x0, int x1, int x2, float *y0, float *y1, float *y2,
         if (mxIsFinite(M[0][0])) /* Prevent from bombing out when NaNs are encountered */
         {
             /* Find integer co-ordinates within tetrahedron */
-            scan_tetrahedron(Y, &nvox, vox, MAXV);
+            scan_tetrahedron(Y, &nvox, vox, MAXV, lim);
+            if (nvox>=MAXV) return(0);
 
             if (nvox>0)
             {
@@ -436,6 +473,7 @@ static void invert_it(int x0, int x1, int x2, float *y0, float *y1, float *y2,
             }
         }
     }
+    return(1);
 }
 
 
@@ -448,11 +486,174 @@ static void setnan(float *dat, mwSize n)
     for (j=0; j<n; j++) dat[j] = NaN;
 }
 
+/* Cubes (numbered as in invdef) that may contain voxels of each slab of
+   the output.  The cubes for slab s are c[n[s]] to c[n[s+1]-1], in
+   increasing order. */
+typedef struct
+{
+    int ns;
+    int *z;             /* First plane of each slab (ns+1 of them) */
+    mwSignedIndex *n;
+    mwSignedIndex *c;
+} SLAB_BINS;
+
+static void bin_cubes(mwSize dim_y[3], float *y0, float *y1, float *y2,
+                      mwSize dim_iy[3], REAL M1[4][3], int ns, SLAB_BINS *b)
+{
+    mwSignedIndex nc = (dim_y[0]-1)*(dim_y[1]-1)*(dim_y[2]-1), c;
+    int *zr, *slab, s, z, nz = (int)dim_iy[2];
+
+    b->ns = ns;
+    b->z  = (int *)mxMalloc((ns+1)*sizeof(int));
+    b->n  = (mwSignedIndex *)mxCalloc(ns+1,sizeof(mwSignedIndex));
+    zr    = (int *)mxMalloc(2*nc*sizeof(int));
+    slab  = (int *)mxMalloc((nz+2)*sizeof(int));
+
+    for(s=0; s<=ns; s++)
+        b->z[s] = 1 + (int)(((mwSignedIndex)s*nz)/ns);
+    for(s=0; s<ns; s++)
+        for(z=b->z[s]; z<b->z[s+1]; z++)
+            slab[z] = s;
+
+    /* Range of slabs for each cube, from the z co-ordinates (in output voxels)
+       of the finite vertices, with a margin in case of rounding differences */
+    #pragma omp parallel for schedule(static)
+    for(c=0; c<nc; c++)
+    {
+        mwSignedIndex x0 = 1 + c%(dim_y[0]-1), x1 = 1 + (c/(dim_y[0]-1))%(dim_y[1]-1), x2 = 1 + c/((dim_y[0]-1)*(dim_y[1]-1));
+        mwSignedIndex o  = x0 + dim_y[0]*(x1 + x2*dim_y[1]);
+        REAL zmin = 0.0, zmax = 0.0, zs, ze;
+        int i, nf = 0;
+
+        for(i=0; i<8; i++)
+        {
+            mwSignedIndex oi = o + (i&1) + dim_y[0]*(((i>>1)&1) + dim_y[1]*(i>>2));
+            REAL zi = M1[0][2]*y0[oi] + M1[1][2]*y1[oi] + M1[2][2]*y2[oi] + M1[3][2];
+            if (mxIsNaN(zi)) continue;
+            if (nf==0 || zi<zmin) zmin = zi;
+            if (nf==0 || zi>zmax) zmax = zi;
+            nf++;
+        }
+        zs = ceil(zmin)-1.0; if (zs<1.0) zs = 1.0;
+        ze = floor(zmax)+1.0; if (ze>nz) ze = nz;
+        if (nf<4 || zs>ze)
+        {
+            zr[2*c] = 1; zr[2*c+1] = 0;
+        }
+        else
+        {
+            zr[2*c  ] = slab[(int)zs];
+            zr[2*c+1] = slab[(int)ze];
+        }
+    }
+
+    for(c=0; c<nc; c++)
+        for(s=zr[2*c]; s<=zr[2*c+1]; s++)
+            b->n[s+1]++;
+    for(s=0; s<ns; s++)
+        b->n[s+1] += b->n[s];
+    b->c = (mwSignedIndex *)mxMalloc((b->n[ns]+1)*sizeof(mwSignedIndex));
+    {
+        mwSignedIndex *k = (mwSignedIndex *)mxMalloc(ns*sizeof(mwSignedIndex));
+        for(s=0; s<ns; s++) k[s] = b->n[s];
+        for(c=0; c<nc; c++)
+            for(s=zr[2*c]; s<=zr[2*c+1]; s++)
+                b->c[k[s]++] = c;
+        mxFree((void *)k);
+    }
+    mxFree((void *)slab);
+    mxFree((void *)zr);
+}
+
+/*
+ * Invert the cubes of a block of planes of a deformation, for passes p0 to
+ * p1.  The block has dimensions dim_y, and its first plane is plane z0+1 of
+ * the whole deformation.  y0, y1 and y2 are the components of the block,
+ * shifted so that its first voxel is at [1 1 1].  Returns 0 if a
+ * tetrahedron contains too many voxels.
+ */
+static int invdef_block(mwSize dim_y[3], float *y0, float *y1, float *y2, mwSignedIndex z0,
+                        mwSize dim_iy[3], float *iy0, float *iy1, float *iy2,
+                        REAL M1[4][3], REAL M2[4][3], int p0, int p1)
+{
+    mwSignedIndex nc = (dim_y[0]-1)*(dim_y[1]-1)*(dim_y[2]-1);
+    int pass, ns, ok = 1;
+
+    /* With multiple threads, the output is divided into slabs of planes, and
+       each thread deals with the cubes that may contain voxels of its slab
+       (in the same order as below), and only inserts those voxels.  Each
+       voxel is therefore updated in the same order, whatever the number of
+       threads. */
+    ns = 4*omp_get_max_threads();
+    if (ns>dim_iy[2]) ns = (int)dim_iy[2];
+    if (nc<PAR_MIN || omp_get_max_threads()==1) ns = 1;
+
+    if (ns==1)
+    {
+        mwSignedIndex x2, x1, x0;
+
+        /* Two passes because there are two possible tetrahedral arrangements */
+        for (pass=p0; pass<=p1 && ok; pass++)
+        {
+            /* Loop over all cubes in the deformation field. */
+            for(x2=1; x2<dim_y[2] && ok; x2++)
+            {
+                for(x1=1; x1<dim_y[1] && ok; x1++)
+                {
+                    for(x0=1; x0<dim_y[0] && ok; x0++)
+                    {
+                        mwSignedIndex o = x0 + dim_y[0]*(x1 + x2*dim_y[1]);
+                        ok = invert_it(x0, x1, x2+z0, y0+o, y1+o, y2+o, dim_iy, iy0, iy1, iy2, M1, M2, pass,
+                                       1, (int)dim_iy[2]);
+                    }
+                }
+            }
+        }
+    }
+    else
+    {
+        SLAB_BINS b;
+        int *okb;
+        bin_cubes(dim_y, y0, y1, y2, dim_iy, M1, ns, &b);
+
+        /* One flag per bin, so that a thread only ever reads its own, and
+           they are combined once the threads have finished. */
+        okb = (int *)mxMalloc(ns*sizeof(int));
+
+        for (pass=p0; pass<=p1 && ok; pass++)
+        {
+            int s;
+            #pragma omp parallel for schedule(dynamic,1)
+            for(s=0; s<ns; s++)
+            {
+                mwSignedIndex i;
+                okb[s] = 1;
+                for(i=b.n[s]; i<b.n[s+1] && okb[s]; i++)
+                {
+                    mwSignedIndex c = b.c[i], x0, x1, x2, o;
+                    x0 = 1 + c%(dim_y[0]-1);
+                    x1 = 1 + (c/(dim_y[0]-1))%(dim_y[1]-1);
+                    x2 = 1 + c/((dim_y[0]-1)*(dim_y[1]-1));
+                    o  = x0 + dim_y[0]*(x1 + x2*dim_y[1]);
+                    if (!invert_it(x0, x1, x2+z0, y0+o, y1+o, y2+o, dim_iy, iy0, iy1, iy2, M1, M2, pass,
+                                   b.z[s], b.z[s+1]-1))
+                        okb[s] = 0;
+                }
+            }
+            for(s=0; s<ns; s++)
+                ok = ok && okb[s];
+        }
+        mxFree((void *)okb);
+        mxFree((void *)b.c);
+        mxFree((void *)b.n);
+        mxFree((void *)b.z);
+    }
+    return(ok);
+}
+
 void invdef(mwSize dim_y[3],  float  y0[],
                    mwSize dim_iy[3], float iy0[],  REAL M1[4][3],  REAL M2[4][3])
 {
-    mwIndex x2, x1, x0;
-    int pass;
     float *y1=0, *y2=0, *iy1=0, *iy2=0;
 
     setup_consts(dim_y);
@@ -468,21 +669,57 @@ void invdef(mwSize dim_y[3],  float  y0[],
     iy1  = iy0+dim_iy[0]*dim_iy[1]*dim_iy[2];
     iy2  = iy0+dim_iy[0]*dim_iy[1]*dim_iy[2]*2;
 
-    /* Two passes because there are two possible tetrahedral arrangements */
-    for (pass=0; pass<=1; pass++)
+    if (!invdef_block(dim_y, y0, y1, y2, 0, dim_iy, iy0, iy1, iy2, M1, M2, 0, 1))
+        mexErrMsgTxt("Too many voxels inside a tetrahedron");
+}
+
+/*
+ * As invdef, but where the deformation is in the file_array fy.  For each
+ * of the two passes, the deformation is read a slab of planes at a time
+ * (along with one more plane, as each cube spans two planes).  Returns 1
+ * if reading fails, and 2 if a tetrahedron contains too many voxels.
+ */
+int invdef_stream(mwSize dim_y[3], FARRAY *fy,
+                  mwSize dim_iy[3], float iy0[], REAL M1[4][3], REAL M2[4][3])
+{
+    mwSignedIndex m = dim_y[0]*dim_y[1], ns, z0;
+    float *buf, *iy1, *iy2;
+    int pass, st = 0;
+
+    setup_consts(dim_y);
+    setnan(iy0, dim_iy[0]*dim_iy[1]*dim_iy[2]*3);
+
+    iy0 -= 1+dim_iy[0]*(1 + dim_iy[1]);
+    iy1  = iy0+dim_iy[0]*dim_iy[1]*dim_iy[2];
+    iy2  = iy0+dim_iy[0]*dim_iy[1]*dim_iy[2]*2;
+
+    ns = (mwSignedIndex)(STREAM_BYTES/(sizeof(float)*(double)m*3)) - 1;
+    if (ns>(mwSignedIndex)dim_y[2]-1) ns = dim_y[2]-1;
+    if (ns<1) ns = 1;
+    buf = (float *)mxMalloc(sizeof(float)*m*3*(ns+1));
+
+    for(pass=0; pass<=1 && !st; pass++)
     {
-        /* Loop over all cubes in the deformation field. */
-        for(x2=1; x2<dim_y[2]; x2++)
+        for(z0=0; z0<(mwSignedIndex)dim_y[2]-1 && !st; z0+=ns)
         {
-            for(x1=1; x1<dim_y[1]; x1++)
-            {
-                for(x0=1; x0<dim_y[0]; x0++)
-                {
-                    int o = x0 + dim_y[0]*(x1 + x2*dim_y[1]);
-                    invert_it(x0, x1, x2, y0+o, y1+o, y2+o, dim_iy, iy0, iy1, iy2, M1, M2, pass);
-                }
-            }
+            mwSignedIndex nz = ((mwSignedIndex)dim_y[2]-1-z0<ns) ? (mwSignedIndex)dim_y[2]-1-z0 : ns, q;
+            mwSize dim_b[3];
+            float *y0;
+
+            /* Planes z0 to z0+nz, for cubes z0+1 to z0+nz (numbered from 1) */
+            for(q=0; q<3 && !st; q++)
+                st = farray_read(fy, m*(z0 + dim_y[2]*q), m*(nz+1), buf + m*(nz+1)*q);
+            if (st) break;
+
+            dim_b[0] = dim_y[0];
+            dim_b[1] = dim_y[1];
+            dim_b[2] = nz+1;
+            y0       = buf - (1+dim_y[0]*(1 + dim_y[1]));
+            if (!invdef_block(dim_b, y0, y0+m*(nz+1), y0+m*(nz+1)*2, z0, dim_iy, iy0, iy1, iy2,
+                              M1, M2, pass, pass))
+                st = 2;
         }
     }
+    mxFree((void *)buf);
+    return(st);
 }
-
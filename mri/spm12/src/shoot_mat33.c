@@ -0,0 +1,200 @@
+/* $Id$ */
+
+/*
+ * Kernels for the per-voxel 3x3 matrix operations of the deformation
+ * code, which work on blocks of MAT33_BLOCK voxels at a time.
+ *
+ * Each block is stored as a structure of arrays, such that J[k][p] is
+ * element k of the matrix of voxel p.  This is the same layout as the
+ * fields themselves, so that loading and storing blocks is a matter of
+ * copying contiguous runs of values.  The elements of a general 3x3 matrix
+ * are in column-major order (j00 j10 j20 j01 j11 j21 j02 j12 j22), and
+ * those of a symmetric one are (a00 a11 a22 a01 a02 a12).  Blocks that
+ * are only partly filled should be padded (eg with eye33_blk) so that
+ * the unused elements do not produce floating point exceptions.
+ *
+ * Operations that do not need the values to be gathered first (chol3 and
+ * chol3recon) work directly on the fields, which already have this layout.
+ *
+ * The arithmetic for each voxel is exactly as it was when the matrices
+ * were dealt with one at a time, so the results are unchanged.
+ */
+
+#include <mex.h>
+#include <math.h>
+#include "shoot_mat33.h"
+#include "spm_openmp.h"
+
+/* Smallest number of voxels for which operations are multithreaded */
+#ifndef PAR_MIN
+#define PAR_MIN 32768
+#endif
+
+/* Set elements n0 onwards to the identity */
+void eye33_blk(mwSize n0, double J[9][MAT33_BLOCK])
+{
+    mwSize k, p;
+    for(k=0; k<9; k++)
+        for(p=n0; p<MAT33_BLOCK; p++)
+            J[k][p] = (k%4==0) ? 1.0 : 0.0;
+}
+
+void eye33f_blk(mwSize n0, float J[9][MAT33_BLOCK])
+{
+    mwSize k, p;
+    for(k=0; k<9; k++)
+        for(p=n0; p<MAT33_BLOCK; p++)
+            J[k][p] = (k%4==0) ? 1.0f : 0.0f;
+}
+
+/* r = inv(J)'*f */
+void invt33_blk(float J[9][MAT33_BLOCK], float f[3][MAT33_BLOCK], float r[3][MAT33_BLOCK])
+{
+    int p;
+    #pragma omp simd
+    for(p=0; p<MAT33_BLOCK; p++)
+    {
+        float j11 = J[0][p], j21 = J[1][p], j31 = J[2][p];
+        float j12 = J[3][p], j22 = J[4][p], j32 = J[5][p];
+        float j13 = J[6][p], j23 = J[7][p], j33 = J[8][p];
+        float ij11, ij12, ij13, ij21, ij22, ij23, ij31, ij32, ij33, dj;
+
+        ij11 = j22*j33-j23*j32;
+        ij12 = j13*j32-j12*j33;
+        ij13 = j12*j23-j13*j22;
+        dj   = j11*ij11 + j21*ij12 + j31*ij13;
+        dj   = 1.0/dj;
+
+        ij11*= dj;
+        ij12*= dj;
+        ij13*= dj;
+        ij21 = (j23*j31-j21*j33)*dj;
+        ij22 = (j11*j33-j13*j31)*dj;
+        ij23 = (j13*j21-j11*j23)*dj;
+        ij31 = (j21*j32-j22*j31)*dj;
+        ij32 = (j12*j31-j11*j32)*dj;
+        ij33 = (j11*j22-j12*j21)*dj;
+
+        r[0][p] = ij11*f[0][p] + ij21*f[1][p] + ij31*f[2][p];
+        r[1][p] = ij12*f[0][p] + ij22*f[1][p] + ij32*f[2][p];
+        r[2][p] = ij13*f[0][p] + ij23*f[1][p] + ij33*f[2][p];
+    }
+}
+
+/*
+ * In place b = det(J)*J'*b and A = det(J)*J'*A*J, where A is symmetric.
+ *
+ * syms j00 j01 j02 j10 j11 j12 j20 j21 j22
+ * syms a00 a11 a22 a01 a02 a12
+ * syms b0 b1 b2
+ * J = [j00 j01 j02; j10 j11 j12; j20 j21 j22];
+ * A = [a00 a01 a02; a01 a11 a12; a02 a12 a22];
+ * b = [b0; b1; b2];
+ * J.'*b
+ * J.'*A*J
+ */
+void jtaj33_blk(double J[9][MAT33_BLOCK], double A[6][MAT33_BLOCK], double b[3][MAT33_BLOCK])
+{
+    int p;
+    #pragma omp simd
+    for(p=0; p<MAT33_BLOCK; p++)
+    {
+        double j00 = J[0][p], j10 = J[1][p], j20 = J[2][p];
+        double j01 = J[3][p], j11 = J[4][p], j21 = J[5][p];
+        double j02 = J[6][p], j12 = J[7][p], j22 = J[8][p];
+        double a00 = A[0][p], a11 = A[1][p], a22 = A[2][p];
+        double a01 = A[3][p], a02 = A[4][p], a12 = A[5][p];
+        double b0  = b[0][p], b1  = b[1][p], b2  = b[2][p];
+        double dt, tmp0, tmp1, tmp2;
+
+        dt      = j00*(j11*j22-j12*j21)+j10*(j02*j21-j01*j22)+j20*(j01*j12-j02*j11);
+
+        b[0][p] = dt*(b0*j00+b1*j10+b2*j20);
+        b[1][p] = dt*(b0*j01+b1*j11+b2*j21);
+        b[2][p] = dt*(b0*j02+b1*j12+b2*j22);
+
+        /* rearranged for speed */
+        tmp0    = j00*a00+j10*a01+j20*a02;
+        tmp1    = j00*a01+j10*a11+j20*a12;
+        tmp2    = j00*a02+j10*a12+j20*a22;
+        A[0][p] = dt*(tmp0*j00+tmp1*j10+tmp2*j20);
+        A[3][p] = dt*(tmp0*j01+tmp1*j11+tmp2*j21);
+        A[4][p] = dt*(tmp0*j02+tmp1*j12+tmp2*j22);
+
+        tmp0    = j01*a00+j11*a01+j21*a02;
+        tmp1    = j01*a01+j11*a11+j21*a12;
+        tmp2    = j01*a02+j11*a12+j21*a22;
+        A[1][p] = dt*(tmp0*j01+tmp1*j11+tmp2*j21);
+        A[5][p] = dt*(tmp0*j02+tmp1*j12+tmp2*j22);
+
+        A[2][p] = dt*((j02*a00+j12*a01+j22*a02)*j02+(j02*a01+j12*a11+j22*a12)*j12+(j02*a02+j12*a12+j22*a22)*j22);
+    }
+}
+
+/* Chunks of voxels for chol3 and chol3recon, one per thread */
+static mwSignedIndex num_chunks(mwSize m)
+{
+    return((m>=PAR_MIN) ? omp_get_max_threads() : 1);
+}
+
+/*
+ * In place Cholesky decomposition of a field of symmetric matrices
+ */
+void chol3(mwSize m, float A[])
+{
+    mwSignedIndex t, nt = num_chunks(m);
+
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+    {
+        mwSignedIndex i, i0 = (t*m)/nt, i1 = ((t+1)*m)/nt;
+        #pragma omp simd
+        for(i=i0; i<i1; i++)
+        {
+            double a00, a11, a22, a01, a02, a12, s;
+            a00      = A[i    ]+1e-6;
+            a11      = A[i+m  ]+1e-6;
+            a22      = A[i+m*2]+1e-6;
+            a01      = A[i+m*3];
+            a02      = A[i+m*4];
+            a12      = A[i+m*5];
+            s        = sqrt(a00);
+            A[i    ] = s;
+            A[i+m*3] = a01/s;
+            A[i+m*4] = a02/s;
+            s        = a11 - a01*a01/a00;
+            s        = sqrt(s);
+            A[i+m  ] = s;
+            s        = (a12 - a01*a02/a00)/s;
+            A[i+m*5] = s;
+            s        = a22 - a02*a02/a00 - s*s;
+            A[i+m*2] = sqrt(s);
+        }
+    }
+}
+
+/*
+ * In place reconstruction from Cholesky decomposition
+ */
+void chol3recon(mwSize m, float A[])
+{
+    mwSignedIndex t, nt = num_chunks(m);
+
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+    {
+        mwSignedIndex i, i0 = (t*m)/nt, i1 = ((t+1)*m)/nt;
+        #pragma omp simd
+        for(i=i0; i<i1; i++)
+        {
+            double a00 = A[i    ], a11 = A[i+m  ], a22 = A[i+m*2];
+            double a01 = A[i+m*3], a02 = A[i+m*4], a12 = A[i+m*5];
+            A[i    ] = a00*a00+a01*a01+a02*a02;
+            A[i+m*3] = a00*a01+a01*a11+a02*a12;
+            A[i+m*4] = a02*a00+a12*a01+a02*a22;
+            A[i+m  ] = a01*a01+a11*a11+a12*a12;
+            A[i+m*5] = a01*a02+a11*a12+a12*a22;
+            A[i+m*2] = a02*a02+a12*a12+a22*a22;
+        }
+    }
+}
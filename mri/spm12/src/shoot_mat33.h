@@ -0,0 +1,16 @@
+/* $Id$ */
+
+/* Number of 3x3 matrices handled together by the block kernels.  The
+   blocks are of fixed size, so that the loops over them (which are marked
+   "omp simd") can be vectorised without having to deal with left-over
+   elements. */
+#ifndef MAT33_BLOCK
+#define MAT33_BLOCK 16
+#endif
+
+extern void eye33_blk(mwSize n0, double J[9][MAT33_BLOCK]);
+extern void eye33f_blk(mwSize n0, float J[9][MAT33_BLOCK]);
+extern void invt33_blk(float J[9][MAT33_BLOCK], float f[3][MAT33_BLOCK], float r[3][MAT33_BLOCK]);
+extern void jtaj33_blk(double J[9][MAT33_BLOCK], double A[6][MAT33_BLOCK], double b[3][MAT33_BLOCK]);
+extern void chol3(mwSize m, float A[]);
+extern void chol3recon(mwSize m, float A[]);
@@ -4,6 +4,8 @@
 #include<mex.h>
 #include<math.h>
 #include "shoot_boundary.h"
+#include "shoot_multiscale.h"
+#include "spm_openmp.h"
 
 /* 2nd degree B-spline basis */
 static double wt2(double x)
@@ -28,15 +30,132 @@ static double wt1(double x)
     return(0.0);
 }
 
+/* Offsets (multiplied by st) and weights of the taps used for each of
+   the nc output elements along one dimension.  These are computed once
+   per call, rather than for every row or column of every plane.
+   Tap t of output element i is o[t][i] and w[t][i]. */
+typedef struct
+{
+    mwSignedIndex *o[4];
+    double        *w[4];
+} TAPS;
+
+/* Workspace of the calling thread for the tap tables (see
+   multiscale_workspace).  Threads that call restrict_vol and resize_vol
+   from within a parallel region can not use mxMalloc. */
+static double *taps_ws = 0;
+static mwSize  taps_wsn = 0, taps_used = 0;
+#pragma omp threadprivate(taps_ws, taps_wsn, taps_used)
+
+void multiscale_workspace(double *ws, mwSize n)
+{
+    taps_ws   = ws;
+    taps_wsn  = (ws!=0) ? n : 0;
+    taps_used = 0;
+}
+
+/* Number of doubles of workspace needed for volumes no bigger than dm */
+mwSize multiscale_workspace_size(mwSize dm[])
+{
+    return(8*(dm[0]+dm[1]));
+}
+
+static void taps_alloc(TAPS *tp, int nt, mwSize nc)
+{
+    int t;
+    if (taps_used+2*nt*nc <= taps_wsn)
+    {
+        tp->o[0]   = (mwSignedIndex *)(taps_ws+taps_used);
+        tp->w[0]   = taps_ws+taps_used+nt*nc;
+        taps_used += 2*nt*nc;
+    }
+    else
+    {
+        tp->o[0] = (mwSignedIndex *)mxMalloc(sizeof(mwSignedIndex)*nt*nc);
+        tp->w[0] = (double *)mxMalloc(sizeof(double)*nt*nc);
+    }
+    for(t=1; t<nt; t++)
+    {
+        tp->o[t] = tp->o[0] + t*nc;
+        tp->w[t] = tp->w[0] + t*nc;
+    }
+}
+
+/* Tables must be freed in the opposite order to their allocation */
+static void taps_free(TAPS *tp)
+{
+    double *p = (double *)tp->o[0];
+    if (p>=taps_ws && p<taps_ws+taps_wsn)
+        taps_used = p-taps_ws;
+    else
+    {
+        (void)mxFree(tp->o[0]);
+        (void)mxFree(tp->w[0]);
+    }
+}
+
+static void restrict_taps(mwSize na, mwSize nc, mwSignedIndex st, TAPS *tp)
+{
+    mwSignedIndex i, o;
+    double loc, s = (double)na/(double)nc;
+
+    taps_alloc(tp, 4, nc);
+    for(i=0; i<nc; i++)
+    {
+        /* loc = s*i; */
+        loc = (i+0.5)*s-0.5;
+        o   = floor(loc);
+        tp->o[0][i] = bound(o-1,na)*st;
+        tp->o[1][i] = bound(o  ,na)*st;
+        tp->o[2][i] = bound(o+1,na)*st;
+        tp->o[3][i] = bound(o+2,na)*st;
+        tp->w[0][i] = wt1(((o-1)-loc)/2.0)/2.0;
+        tp->w[1][i] = wt1(((o  )-loc)/2.0)/2.0;
+        tp->w[2][i] = wt1(((o+1)-loc)/2.0)/2.0;
+        tp->w[3][i] = wt1(((o+2)-loc)/2.0)/2.0;
+    }
+}
+
+static void resize_taps(mwSize na, mwSize nc, mwSignedIndex st, TAPS *tp)
+{
+    mwSignedIndex i, o;
+    double loc, s = (double)na/(double)nc;
+
+    taps_alloc(tp, 3, nc);
+    for(i=0; i<nc; i++)
+    {
+        /* loc = i*s; */
+        loc = (i+0.5)*s-0.5;
+        o   = floor(loc+0.5);
+        tp->o[0][i] = bound(o-1,na)*st;
+        tp->o[1][i] = bound(o  ,na)*st;
+        tp->o[2][i] = bound(o+1,na)*st;
+        tp->w[0][i] = wt2((o-1)-loc);
+        tp->w[1][i] = wt2( o   -loc);
+        tp->w[2][i] = wt2((o+1)-loc);
+    }
+}
+
+/* Number of slabs of output planes that restrict_vol and resize_vol process
+   in parallel.  Each slab has its own set of buffered planes, so planes
+   at the edges of slabs are computed more than once.  There is only one
+   slab when already within a parallel region. */
+static int num_slabs(mwSize nc[])
+{
+    int nt = omp_get_max_threads();
+    if ((double)nc[0]*nc[1]*nc[2] < MULTISCALE_PAR_MIN || omp_in_parallel()) nt = 1;
+    if (nt>nc[2]) nt = nc[2];
+    return(nt);
+}
+
 /* Note that restriction uses linear interpolation, whereas prolongation
    uses 2nd degree B-spline. For "bending energy", the restriction and
    prolongation operators need to be at least this degree.  See Numerical
    Recipes for further details. */
-static void restrict_plane(mwSize na[], float *a,  mwSize nc[], float *c, float *b)
+static void restrict_plane(mwSize na[], float *a,  mwSize nc[], float *c, float *b,
+                           TAPS *tx, TAPS *ty, int par)
 {
-    mwSignedIndex i, j, o;
-    double loc, s;
-    float *ap, *bp, *cp;
+    mwSignedIndex j;
     /* a - na[0]*na[1]
      * c - nc[0]*nc[1]
      * b - na[0]*nc[1]
@@ -46,41 +165,16 @@ static void restrict_plane(mwSize na[], float *a,  mwSize nc[], float *c, float
         for(j=0; j<nc[1]*na[0]; j++)
             b[j] = a[j];
     }
-    /*
-    else if (!(na[1]%2))
-    {
-        for(j=0; j<nc[1]; j++)
-        {
-            mwSignedIndex oo,om,op;
-            o   = 2*j;
-            oo  = o*na[0];
-            om  = bound(o-1,na[1])*na[0];
-            op  = bound(o+1,na[1])*na[0];
-            for(ap=a, bp=b+j*na[0], cp=ap+na[0]; ap<cp; ap++, bp++)
-                *bp = 0.25*(ap[om]+ap[op])+0.5*ap[oo];
-        }
-    }
-    */
     else
     {
-        s = (double)na[1]/(double)nc[1];
+        #pragma omp parallel for schedule(static) if(par)
         for(j=0; j<nc[1]; j++)
         {
-            double w0, w1, w2, w3;
-            mwSignedIndex o0, o1, o2, o3;
-            /* loc = s*j; */
-            loc = (j+0.5)*s-0.5;
-            o   = floor(loc);
-            o0  = bound(o-1,na[1])*na[0];
-            o1  = bound(o  ,na[1])*na[0];
-            o2  = bound(o+1,na[1])*na[0];
-            o3  = bound(o+2,na[1])*na[0];
-            w0  = wt1(((o-1)-loc)/2.0)/2.0;
-            w1  = wt1(((o  )-loc)/2.0)/2.0;
-            w2  = wt1(((o+1)-loc)/2.0)/2.0;
-            w3  = wt1(((o+2)-loc)/2.0)/2.0;
-            for(ap=a, bp=b+j*na[0], cp=ap+na[0]; ap<cp; ap++, bp++)
-                *bp = w0*ap[o0]+w1*ap[o1]+w2*ap[o2]+w3*ap[o3];
+            mwSignedIndex i, o0 = ty->o[0][j], o1 = ty->o[1][j], o2 = ty->o[2][j], o3 = ty->o[3][j];
+            double        w0 = ty->w[0][j], w1 = ty->w[1][j], w2 = ty->w[2][j], w3 = ty->w[3][j];
+            float        *bp = b+j*na[0];
+            for(i=0; i<na[0]; i++)
+                bp[i] = w0*a[o0+i]+w1*a[o1+i]+w2*a[o2+i]+w3*a[o3+i];
         }
     }
 
@@ -89,55 +183,30 @@ static void restrict_plane(mwSize na[], float *a,  mwSize nc[], float *c, float
         for(j=0; j<nc[0]*nc[1]; j++)
             c[j] = b[j];
     }
-    /*
-    else if (!(na[0]%2))
-    {
-        for(i=0; i<nc[0]; i++)
-        {
-            mwSignedIndex om,op;
-            o   = 2*i;
-            om  = bound(o-1,na[0]);
-            op  = bound(o+1,na[0]);
-            for(bp=b, cp=c+i, ap=bp+na[0]*nc[1]; bp<ap; bp+=na[0], cp+=nc[0])
-                *cp = 0.25*(bp[om]+bp[op])+0.5*bp[o];
-        }
-    }
-    */
     else
     {
-        s = (double)na[0]/(double)nc[0];
-        for(i=0; i<nc[0]; i++)
+        /* Done a row at a time, so that the output is written contiguously */
+        #pragma omp parallel for schedule(static) if(par)
+        for(j=0; j<nc[1]; j++)
         {
-            double w0, w1, w2, w3;
-            mwSignedIndex o0, o1, o2, o3;
-            /* loc = s*i; */
-            loc = (i+0.5)*s-0.5;
-            o   = floor(loc);
-            o0  = bound(o-1,na[0]); 
-            o1  = bound(o  ,na[0]); 
-            o2  = bound(o+1,na[0]); 
-            o3  = bound(o+2,na[0]); 
-            w0  = wt1(((o-1)-loc)/2.0)/2.0;
-            w1  = wt1(((o  )-loc)/2.0)/2.0;
-            w2  = wt1(((o+1)-loc)/2.0)/2.0;
-            w3  = wt1(((o+2)-loc)/2.0)/2.0;
-            for(bp=b, cp=c+i, ap=bp+na[0]*nc[1]; bp<ap; bp+=na[0], cp+=nc[0])
-                *cp = w0*bp[o0]+w1*bp[o1]+w2*bp[o2]+w3*bp[o3];
+            mwSignedIndex i, *o0 = tx->o[0], *o1 = tx->o[1], *o2 = tx->o[2], *o3 = tx->o[3];
+            double        *w0 = tx->w[0], *w1 = tx->w[1], *w2 = tx->w[2], *w3 = tx->w[3];
+            float         *bp = b+j*na[0], *cp = c+j*nc[0];
+            for(i=0; i<nc[0]; i++)
+                cp[i] = w0[i]*bp[o0[i]]+w1[i]*bp[o1[i]]+w2[i]*bp[o2[i]]+w3[i]*bp[o3[i]];
         }
     }
 }
 
-void restrict_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
+/* Restrict output planes k0 to k1-1.  The restricted input planes are
+   buffered in b, so that each is only computed once within the slab. */
+static void restrict_slab(mwSize na[], float *a, mwSize nc[], float *c, float *b,
+                          TAPS *tx, TAPS *ty, mwSignedIndex k0, mwSignedIndex k1)
 {
     mwSignedIndex j, k, o=-999999, m, oo;
     double loc, s;
     float *bp, *cp, *pl[4];
 
-    if (na[2]==1)
-    {
-        restrict_plane(na,a,nc,c,b);
-        return;
-    }
     m     = nc[0]*nc[1];
     pl[0] = b;
     pl[1] = b + m;
@@ -145,165 +214,153 @@ void restrict_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
     pl[3] = b + m*3;
     bp    = b + m*4;
 
-    /* This would work if loc = s*k and would be faster
-    if (!(na[2]%2))
+    s      = (double)na[2]/(double)nc[2];
+    for(k=k0; k<k1; k++)
     {
-        restrict_plane(na, a+na[0]*na[1]*2,nc,pl[2],bp);
-        for(k=0; k<nc[2]; k++)
-        {
-            mwSignedIndex om, op;
-            float *tp;
-            o   = 2*k;
-            om  = bound(o-1,na[2]);
-            op  = bound(o+1,na[2]);
+        double w0, w1, w2, w3;
+        mwSignedIndex o0, o1, o2, o3;
+        /* loc = s*k; */
+        loc = (k+0.5)*s-0.5;
+        oo  = o;
+        o   = floor(loc);
+
+        o0  = bound(o-1,na[2]);
+        o1  = bound(o  ,na[2]);
+        o2  = bound(o+1,na[2]);
+        o3  = bound(o+2,na[2]);
+        w0  = wt1(((o-1)-loc)/2.0)/2.0;
+        w1  = wt1(((o  )-loc)/2.0)/2.0;
+        w2  = wt1(((o+1)-loc)/2.0)/2.0;
+        w3  = wt1(((o+2)-loc)/2.0)/2.0;
 
+        if (o==oo)
+        {   /* do nothing */
+        }
+        else if (o==oo+1)
+        {   /* Shift by 1 */
+            float *tp;
+            tp    = pl[0];
+            pl[0] = pl[1];
+            pl[1] = pl[2];
+            pl[2] = pl[3];
+            pl[3] = tp;
+            restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp,tx,ty,0);
+        }
+        else if (o==oo+2)
+        {   /* Shift by 2 */
+            float *tp;
             tp    = pl[0];
             pl[0] = pl[2];
             pl[2] = tp;
-            restrict_plane(na, a+na[0]*na[1]*o ,nc,pl[1],bp);
-            restrict_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp);
-
-            cp  = c+nc[0]*nc[1]*k;
-            for(j=0; j<nc[0]*nc[1]; j++)
-            {
-                cp[j] = 0.25*(pl[0][j]+pl[2][j])+0.5*pl[1][j];
-            }
+            tp    = pl[1];
+            pl[1] = pl[3];
+            pl[3] = tp;
+            restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp,tx,ty,0);
         }
-    }
-    else
-    */
-    {
-        s      = (double)na[2]/(double)nc[2];
-        for(k=0; k<nc[2]; k++)
+        else if (o==oo+3)
+        {   /* Shift by 2 */
+            float *tp;
+            tp    = pl[0];
+            pl[0] = pl[3];
+            pl[3] = tp;
+            restrict_plane(na, a+na[0]*na[1]*o1,nc,pl[1],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp,tx,ty,0);
+        }
+        else
+        {   /* Read everything */
+            restrict_plane(na, a+na[0]*na[1]*o0,nc,pl[0],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o1,nc,pl[1],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp,tx,ty,0);
+            restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp,tx,ty,0);
+        }
+        cp  = c+nc[0]*nc[1]*k;
+        for(j=0; j<nc[0]*nc[1]; j++)
         {
-            double w0, w1, w2, w3;
-            mwSignedIndex o0, o1, o2, o3;
-            /* loc = s*k; */
-            loc = (k+0.5)*s-0.5;
-            oo  = o;
-            o   = floor(loc);
-
-            o0  = bound(o-1,na[2]);
-            o1  = bound(o  ,na[2]);
-            o2  = bound(o+1,na[2]);
-            o3  = bound(o+2,na[2]);
-            w0  = wt1(((o-1)-loc)/2.0)/2.0;
-            w1  = wt1(((o  )-loc)/2.0)/2.0;
-            w2  = wt1(((o+1)-loc)/2.0)/2.0;
-            w3  = wt1(((o+2)-loc)/2.0)/2.0;
-
-            if (o==oo)
-            {   /* do nothing */
-            }
-            else if (o==oo+1)
-            {   /* Shift by 1 */
-                float *tp;
-                tp    = pl[0];
-                pl[0] = pl[1];
-                pl[1] = pl[2];
-                pl[2] = pl[3];
-                pl[3] = tp;
-                restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp);
-            }
-            else if (o==oo+2)
-            {   /* Shift by 2 */
-                float *tp;
-                tp    = pl[0];
-                pl[0] = pl[2];
-                pl[2] = tp;
-                tp    = pl[1];
-                pl[1] = pl[3];
-                pl[3] = tp;
-                restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp);
-                restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp);
-            }
-            else if (o==oo+3)
-            {   /* Shift by 2 */
-                float *tp;
-                tp    = pl[0];
-                pl[0] = pl[3];
-                pl[3] = tp;
-                restrict_plane(na, a+na[0]*na[1]*o1,nc,pl[1],bp);
-                restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp);
-                restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp);
-            }
-            else
-            {   /* Read everything */
-                restrict_plane(na, a+na[0]*na[1]*o0,nc,pl[0],bp);
-                restrict_plane(na, a+na[0]*na[1]*o1,nc,pl[1],bp);
-                restrict_plane(na, a+na[0]*na[1]*o2,nc,pl[2],bp);
-                restrict_plane(na, a+na[0]*na[1]*o3,nc,pl[3],bp);
-            }
-            cp  = c+nc[0]*nc[1]*k;
-            for(j=0; j<nc[0]*nc[1]; j++)
-            {
-                cp[j] = w0*pl[0][j]+w1*pl[1][j]+w2*pl[2][j]+w3*pl[3][j];
-            }
+            cp[j] = w0*pl[0][j]+w1*pl[1][j]+w2*pl[2][j]+w3*pl[3][j];
         }
     }
 }
 
-static void resized_plane(mwSize na[], float *a,  mwSize nc[], float *c, float *b)
+/* b must have room for 4*nc[0]*nc[1]+na[0]*nc[1] elements.  When
+   multithreaded, additional buffers are allocated for the other slabs. */
+void restrict_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
 {
-    mwSignedIndex i, j, o,oc,om,op;
-    double loc, s, w, wm, wp;
-    float *ap, *bp, *cp;
+    TAPS tx, ty;
+    mwSignedIndex t, nt, bsz;
+    float *buf = 0;
+
+    restrict_taps(na[0], nc[0], 1,     &tx);
+    restrict_taps(na[1], nc[1], na[0], &ty);
+
+    if (na[2]==1)
+    {
+        restrict_plane(na,a,nc,c,b,&tx,&ty,(double)nc[0]*nc[1]>=MULTISCALE_PAR_MIN);
+        taps_free(&ty);
+        taps_free(&tx);
+        return;
+    }
+
+    nt  = num_slabs(nc);
+    bsz = 4*nc[0]*nc[1]+na[0]*nc[1];
+    if (nt>1) buf = (float *)mxMalloc(sizeof(float)*bsz*(nt-1));
+
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+        restrict_slab(na, a, nc, c, t ? buf+(t-1)*bsz : b, &tx, &ty, (t*nc[2])/nt, ((t+1)*nc[2])/nt);
+
+    if (buf) (void)mxFree(buf);
+    taps_free(&ty);
+    taps_free(&tx);
+}
+
+static void resized_plane(mwSize na[], float *a,  mwSize nc[], float *c, float *b,
+                          TAPS *tx, TAPS *ty, int par)
+{
+    mwSignedIndex j;
     /* a - na[0]*na[1]
      * c - nc[0]*nc[1]
      * b - na[0]*nc[1]
      */
 
-    s = (double)na[1]/(double)nc[1];
+    #pragma omp parallel for schedule(static) if(par)
     for(j=0; j<nc[1]; j++)
     {
-        /* loc = j*s; */
-        loc = (j+0.5)*s-0.5;
-        o   = floor(loc+0.5);
-        oc  = bound(o  ,na[1])*na[0];
-        om  = bound(o-1,na[1])*na[0];
-        op  = bound(o+1,na[1])*na[0];
-        w   = wt2( o   -loc);
-        wp  = wt2((o+1)-loc);
-        wm  = wt2((o-1)-loc);
-        for(ap=a, bp=b+j*na[0], cp=ap+na[0]; ap<cp; ap++, bp++)
-            *bp = wm*ap[om]+w*ap[oc]+wp*ap[op];
+        mwSignedIndex i, om = ty->o[0][j], oc = ty->o[1][j], op = ty->o[2][j];
+        double        wm = ty->w[0][j], w  = ty->w[1][j], wp = ty->w[2][j];
+        float        *bp = b+j*na[0];
+        for(i=0; i<na[0]; i++)
+            bp[i] = wm*a[om+i]+w*a[oc+i]+wp*a[op+i];
     }
-    s = (double)na[0]/(double)nc[0];
-    for(i=0; i<nc[0]; i++)
+
+    /* Done a row at a time, so that the output is written contiguously */
+    #pragma omp parallel for schedule(static) if(par)
+    for(j=0; j<nc[1]; j++)
     {
-        /* loc = i*s; */
-        loc = (i+0.5)*s-0.5;
-        o   = floor(loc+0.5);
-        oc  = bound(o  ,na[0]);
-        om  = bound(o-1,na[0]);
-        op  = bound(o+1,na[0]);
-        w   = wt2( o   -loc);
-        wp  = wt2((o+1)-loc);
-        wm  = wt2((o-1)-loc);
-        for(bp=b, cp=c+i, ap=bp+na[0]*nc[1]; bp<ap; bp+=na[0], cp+=nc[0])
-            *cp = wm*bp[om]+w*bp[oc]+wp*bp[op];
+        mwSignedIndex i, *om = tx->o[0], *oc = tx->o[1], *op = tx->o[2];
+        double        *wm = tx->w[0], *w  = tx->w[1], *wp = tx->w[2];
+        float         *bp = b+j*na[0], *cp = c+j*nc[0];
+        for(i=0; i<nc[0]; i++)
+            cp[i] = wm[i]*bp[om[i]]+w[i]*bp[oc[i]]+wp[i]*bp[op[i]];
     }
 }
 
-void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
+/* Resize output planes k0 to k1-1 (see restrict_slab) */
+static void resize_slab(mwSize na[], float *a, mwSize nc[], float *c, float *b,
+                        TAPS *tx, TAPS *ty, mwSignedIndex k0, mwSignedIndex k1)
 {
     mwSignedIndex j, k, o=-999999,oc,om,op, m, oo;
     double loc, s, w, wm, wp;
     float *bp, *cp, *pl[3];
 
-    if (na[2]==1 && nc[2]==1)
-    {
-        resized_plane(na,a,nc,c,b);
-        return;
-    }
-
     m     = nc[0]*nc[1];
     pl[0] = b;
     pl[1] = b + m;
     pl[2] = b + m*2;
     bp    = b + m*3;
 
-    for(k=0; k<nc[2]; k++)
+    for(k=k0; k<k1; k++)
     {
         s   = (double)na[2]/(double)nc[2];
         /* loc = k*s; */
@@ -324,7 +381,7 @@ void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
             pl[0] = pl[1];
             pl[1] = pl[2];
             pl[2] = tp;
-            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp);
+            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp,tx,ty,0);
         }
         else if (o==oo+2)
         {   /* Shift by 2 */
@@ -332,14 +389,14 @@ void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
             tp    = pl[0];
             pl[0] = pl[2];
             pl[2] = tp;
-            resized_plane(na, a+na[0]*na[1]*oc,nc,pl[1],bp);
-            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp);
+            resized_plane(na, a+na[0]*na[1]*oc,nc,pl[1],bp,tx,ty,0);
+            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp,tx,ty,0);
         }
         else
         {   /* Read everything */
-            resized_plane(na, a+na[0]*na[1]*om,nc,pl[0],bp);
-            resized_plane(na, a+na[0]*na[1]*oc,nc,pl[1],bp);
-            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp);
+            resized_plane(na, a+na[0]*na[1]*om,nc,pl[0],bp,tx,ty,0);
+            resized_plane(na, a+na[0]*na[1]*oc,nc,pl[1],bp,tx,ty,0);
+            resized_plane(na, a+na[0]*na[1]*op,nc,pl[2],bp,tx,ty,0);
         }
         w   = wt2( o   -loc);
         wp  = wt2((o+1)-loc);
@@ -352,3 +409,34 @@ void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
     }
 }
 
+/* b must have room for 3*nc[0]*nc[1]+na[0]*nc[1] elements.  When
+   multithreaded, additional buffers are allocated for the other slabs. */
+void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b)
+{
+    TAPS tx, ty;
+    mwSignedIndex t, nt, bsz;
+    float *buf = 0;
+
+    resize_taps(na[0], nc[0], 1,     &tx);
+    resize_taps(na[1], nc[1], na[0], &ty);
+
+    if (na[2]==1 && nc[2]==1)
+    {
+        resized_plane(na,a,nc,c,b,&tx,&ty,(double)nc[0]*nc[1]>=MULTISCALE_PAR_MIN);
+        taps_free(&ty);
+        taps_free(&tx);
+        return;
+    }
+
+    nt  = num_slabs(nc);
+    bsz = 3*nc[0]*nc[1]+na[0]*nc[1];
+    if (nt>1) buf = (float *)mxMalloc(sizeof(float)*bsz*(nt-1));
+
+    #pragma omp parallel for schedule(static) if(nt>1)
+    for(t=0; t<nt; t++)
+        resize_slab(na, a, nc, c, t ? buf+(t-1)*bsz : b, &tx, &ty, (t*nc[2])/nt, ((t+1)*nc[2])/nt);
+
+    if (buf) (void)mxFree(buf);
+    taps_free(&ty);
+    taps_free(&tx);
+}
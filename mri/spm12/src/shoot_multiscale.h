@@ -1,5 +1,13 @@
 /* $Id: shoot_multiscale.h 4875 2012-08-30 20:04:30Z john $ */
 /* (c) John Ashburner (2011) */
+
+/* Smallest number of output voxels for which the restriction and
+   prolongation operators are multithreaded */
+#ifndef MULTISCALE_PAR_MIN
+#define MULTISCALE_PAR_MIN 32768
+#endif
+
 extern void resize_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b);
 extern void restrict_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b);
-
+extern void multiscale_workspace(double *ws, mwSize n);
+extern mwSize multiscale_workspace_size(mwSize dm[]);
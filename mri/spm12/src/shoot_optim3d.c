@@ -8,30 +8,135 @@ extern double log(double x);
 #include "shoot_optim3d.h"
 #include "shoot_multiscale.h"
 #include "shoot_regularisers.h"
+#include "shoot_telemetry.h"
+#include "spm_openmp.h"
+
+/* Dot products are summed over a fixed number of chunks, so that the
+   results do not depend on the number of threads */
+#define DOT_CHUNKS 64
 
 static double dotprod(mwSize m, float a[], float b[])
 {
-    mwSize i;
-    double dp = 0.0;
-    for(i=0; i<m; i++)
-        dp += a[i]*b[i];
+    mwSignedIndex t;
+    double dp = 0.0, s[DOT_CHUNKS];
+
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
+    for(t=0; t<DOT_CHUNKS; t++)
+    {
+        mwSignedIndex i, i0 = (t*m)/DOT_CHUNKS, i1 = ((t+1)*m)/DOT_CHUNKS;
+        double st = 0.0;
+        for(i=i0; i<i1; i++)
+            st += a[i]*b[i];
+        s[t] = st;
+    }
+    for(t=0; t<DOT_CHUNKS; t++)
+        dp += s[t];
     return(dp);
 }
 
-static void addscaled(mwSize m, float a[], float b[], double s)
+float norm(mwSize m, float a[])
 {
-    mwSize i;
+    return(sqrt(dotprod(m, a, a)));
+}
+
+/*
+ * x = x + s*p
+ * r = r - s*Ap
+ * returns r'*r
+ */
+static double update_xr(mwSize m, float x[], float r[], float p[], float Ap[], double s)
+{
+    mwSignedIndex t;
+    double rtr = 0.0, ss[DOT_CHUNKS];
+
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
+    for(t=0; t<DOT_CHUNKS; t++)
+    {
+        mwSignedIndex i, i0 = (t*m)/DOT_CHUNKS, i1 = ((t+1)*m)/DOT_CHUNKS;
+        double st = 0.0;
+        for(i=i0; i<i1; i++)
+        {
+            x[i] += s*p[i];
+            r[i] -= s*Ap[i];
+            st   += r[i]*r[i];
+        }
+        ss[t] = st;
+    }
+    for(t=0; t<DOT_CHUNKS; t++)
+        rtr += ss[t];
+    return(rtr);
+}
+
+/*
+ * Both z'*r and z'*Ap in one pass
+ */
+static void dotprod2(mwSize m, float z[], float r[], float Ap[], double *ztr, double *ztAp)
+{
+    mwSignedIndex t;
+    double s1[DOT_CHUNKS], s2[DOT_CHUNKS];
+
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
+    for(t=0; t<DOT_CHUNKS; t++)
+    {
+        mwSignedIndex i, i0 = (t*m)/DOT_CHUNKS, i1 = ((t+1)*m)/DOT_CHUNKS;
+        double st1 = 0.0, st2 = 0.0;
+        for(i=i0; i<i1; i++)
+        {
+            st1 += z[i]*r[i];
+            st2 += z[i]*Ap[i];
+        }
+        s1[t] = st1;
+        s2[t] = st2;
+    }
+    *ztr  = 0.0;
+    *ztAp = 0.0;
+    for(t=0; t<DOT_CHUNKS; t++)
+    {
+        *ztr  += s1[t];
+        *ztAp += s2[t];
+    }
+}
+
+/* p = z + beta*p */
+static void update_p(mwSize m, float p[], float z[], double beta)
+{
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
     for(i=0; i<m; i++)
-        a[i] += s*b[i];
+        p[i] = z[i] + beta*p[i];
 }
 
-float norm(mwSize m, float a[])
+/* r = b - Ap */
+static void residual(mwSize m, float b[], float Ap[], float r[])
 {
-    mwSize i;
-    double dp = 0.0;
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
     for(i=0; i<m; i++)
-        dp += a[i]*a[i];
-    return(sqrt(dp));
+        r[i] = b[i] - Ap[i];
+}
+
+static void zeros(mwSize n, float *a)
+{
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
+    for(i=0; i<n; i++)
+        a[i] = 0.0;
+}
+
+static void copy(mwSize n, float *a, float *b)
+{
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
+    for(i=0; i<n; i++)
+        b[i] = a[i];
+}
+
+static void addto(mwSize n, float *a, float *b)
+{
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
+    for(i=0; i<n; i++)
+        a[i] += b[i];
 }
 
 /*
@@ -68,7 +173,7 @@ end;
 void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit,
              float x[], float r[], float p[], float Ap[])
 {
-    mwSize i, m = dm[0]*dm[1]*dm[2]*3, it;
+    mwSize m = dm[0]*dm[1]*dm[2]*3, it;
     double rtr, nb, rtrold, alpha, beta;
 
     /* printf("\n **** %dx%d ****\n",dm[0],dm[1]); */
@@ -78,26 +183,22 @@ void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit
 #   ifdef NEVER
         /* Assuming starting estimates of zeros */
         /* x    = zeros(size(b)); */
-        for(i=0; i<m;i++)
-            x[i] = 0.0;
+        zeros(m, x);
 
         /* r    = b; */
-        for(i=0; i<m;i++)
-            r[i] = b[i];
+        copy(m, b, r);
 #   else
         /* Assume starting estimates are passed as arguments */
         /* r    = b-A*x; */
         Atimesp(dm, A, param, x, Ap);
-        for(i=0; i<m;i++)
-            r[i] = b[i]-Ap[i];
+        residual(m, b, Ap, r);
 #   endif
 
     /* rtr  = r'*r; */
     rtr     = dotprod(m, r, r);
 
     /* p    = zeros(size(b)); */
-    for(i=0; i<m;i++)
-        p[i] = 0.0;
+    zeros(m, p);
 
     /* beta = 0; */
     beta    = 0.0;
@@ -106,12 +207,11 @@ void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit
     for(it=0; it<nit; it++)
     {
         /* if norm(r) < tol*norm(b), break; end; */
-        if (norm(m,r) < nb)
+        if (sqrt(rtr) < nb)
             break;
 
         /* p      = r + beta*p; */
-        for(i=0; i<m; i++)
-            p[i]  = r[i] + beta*p[i];
+        update_p(m, p, r, beta);
 
         /* Ap     = A*p; */
         Atimesp(dm, A, param, p, Ap);
@@ -119,17 +219,14 @@ void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit
         /* alpha  = rtr/(p'*Ap); */
         alpha     = rtr/dotprod(m, p, Ap);
 
-        /* x      = x + alpha*p; */
-        addscaled(m, x, p, alpha);
-
-        /* r      = r - alpha*Ap; */
-        addscaled(m, r, Ap, -alpha);
-
         /* rtrold = rtr; */
         rtrold = rtr;
 
+        /* x      = x + alpha*p; */
+        /* r      = r - alpha*Ap; */
         /* rtr    = r'*r; */
-        rtr       = dotprod(m, r, r);
+        rtr       = update_xr(m, x, r, p, Ap, alpha);
+        if (tele_active()) tele_cg(sqrt(rtr));
 
         /* beta   = rtr/rtrold; */
         beta      = rtr/rtrold;
@@ -142,7 +239,8 @@ void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit
 
 static void rescale(mwSize n, float *a, double s)
 {
-    mwSize i;
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
     for(i=0; i<n; i++)
         a[i] *= s;
 }
@@ -191,27 +289,6 @@ static void prolong(mwSize na[], float *a, mwSize nc[], float *c, float *b)
     }
 }
 
-static void zeros(mwSize n, float *a)
-{
-    mwSize i;
-    for(i=0; i<n; i++)
-        a[i] = 0.0;
-}
-
-static void copy(mwSize n, float *a, float *b)
-{
-    mwSize i;
-    for(i=0; i<n; i++)
-        b[i] = a[i];
-}
-
-static void addto(mwSize n, float *a, float *b)
-{
-    mwSize i;
-    for(i=0; i<n; i++)
-        a[i] += b[i];
-}
-
 mwSize fmg3_scratchsize(mwSize n0[], int use_hessian)
 {
     mwSize n[64][3], m[64], bs, j, num_blocks;
@@ -239,150 +316,318 @@ mwSize fmg3_scratchsize(mwSize n0[], int use_hessian)
     return((3*n0[0]*n0[1]*n0[2] + n[0][0]*n[1][1]+4*n[0][0]*n[0][1] + num_blocks*bs));
 }
 
-/*
-    Full Multigrid solver.  See Numerical Recipes (second edition) for more
-    information
-*/
-void fmg3(mwSize n0[], float *a0, float *b0, double param0[], int c, int nit,
-          float *u0, float *scratch)
+/* Grids of the multigrid solver */
+typedef struct
 {
-    mwSignedIndex i, j, ng, bs;
+    mwSignedIndex ng;
     mwSize n[64][3], m[64];
     float *bo[64], *a[64], *b[64], *u[64], *res, *rbuf;
     double param[64][8];
+} MGGRID;
+
+/*
+    Set up the grids for fmg3 or for preconditioning.  The Hessians
+    (and the gradients, if b0 is not NULL) are restricted to the lower
+    resolution grids.
+*/
+static void mg3_grids(mwSize n0[], float *a0, float *b0, double param0[], float *u0,
+                      float *scratch, MGGRID *g)
+{
+    mwSignedIndex j, ng, bs;
 
     /* Dimensions of native resolution grids */
-    n[0][0] = n0[0];
-    n[0][1] = n0[1];
-    n[0][2] = n0[2];
-    m[0]    = n0[0]*n0[1]*n0[2];
+    g->n[0][0] = n0[0];
+    g->n[0][1] = n0[1];
+    g->n[0][2] = n0[2];
+    g->m[0]    = n0[0]*n0[1]*n0[2];
 
     /* Dimensions of lower resolution grids */
     ng = 1;
     bs = 0;
     for(j=1; j<16; j++)
     {
-        n[j][0] = ceil(n[j-1][0]/2.0);
-        n[j][1] = ceil(n[j-1][1]/2.0);
-        n[j][2] = ceil(n[j-1][2]/2.0);
-        m[j]    = n[j][0]*n[j][1]*n[j][2];
+        g->n[j][0] = ceil(g->n[j-1][0]/2.0);
+        g->n[j][1] = ceil(g->n[j-1][1]/2.0);
+        g->n[j][2] = ceil(g->n[j-1][2]/2.0);
+        g->m[j]    = g->n[j][0]*g->n[j][1]*g->n[j][2];
         ng ++;
-        bs += m[j];
-        if ((n[j][0]<2) && (n[j][1]<2) && (n[j][2]<2))
+        bs += g->m[j];
+        if ((g->n[j][0]<2) && (g->n[j][1]<2) && (g->n[j][2]<2))
             break;
     }
+    g->ng = ng;
 
     /* Set up pointers to native data */
-    bo[0]   = b0;
-    b[0]    = b0;
-    u[0]    = u0;
-    a[0]    = a0;
+    g->bo[0]   = b0;
+    g->b[0]    = b0;
+    g->u[0]    = u0;
+    g->a[0]    = a0;
 
     /* Set up pointers to scratch space */
-    res          = scratch;           /* Residuals (defect) */
-    rbuf         = scratch + 3*m[0];  /* Additional memory needed for restriction/prolongation */
-
-    bo[1]        = scratch + 3*m[0] + n[0][0]*n[1][1]+4*n[0][0]*n[0][1];
-    b[1]         = scratch + 3*m[0] + n[0][0]*n[1][1]+4*n[0][0]*n[0][1] + 3*bs;
-    u[1]         = scratch + 3*m[0] + n[0][0]*n[1][1]+4*n[0][0]*n[0][1] + 6*bs;
-    if (a0) a[1] = scratch + 3*m[0] + n[0][0]*n[1][1]+4*n[0][0]*n[0][1] + 9*bs;
-    else    a[1] = 0;
+    g->res     = scratch;              /* Residuals (defect) */
+    g->rbuf    = scratch + 3*g->m[0];  /* Additional memory needed for restriction/prolongation */
+
+    g->bo[1]        = scratch + 3*g->m[0] + g->n[0][0]*g->n[1][1]+4*g->n[0][0]*g->n[0][1];
+    g->b[1]         = scratch + 3*g->m[0] + g->n[0][0]*g->n[1][1]+4*g->n[0][0]*g->n[0][1] + 3*bs;
+    g->u[1]         = scratch + 3*g->m[0] + g->n[0][0]*g->n[1][1]+4*g->n[0][0]*g->n[0][1] + 6*bs;
+    if (a0) g->a[1] = scratch + 3*g->m[0] + g->n[0][0]*g->n[1][1]+4*g->n[0][0]*g->n[0][1] + 9*bs;
+    else    g->a[1] = 0;
     for(j=2; j<ng; j++)
     {
-        bo[j]    = bo[j-1]+3*m[j-1];
-        b[j]     =  b[j-1]+3*m[j-1];
-        u[j]     =  u[j-1]+3*m[j-1];
+        g->bo[j]    = g->bo[j-1]+3*g->m[j-1];
+        g->b[j]     =  g->b[j-1]+3*g->m[j-1];
+        g->u[j]     =  g->u[j-1]+3*g->m[j-1];
         if (a0)
-            a[j] =  a[j-1]+6*m[j-1];
+            g->a[j] =  g->a[j-1]+6*g->m[j-1];
         else
-            a[j] = 0;
+            g->a[j] = 0;
     }
 
     /* Create grids of gradients and hessians, as well as adjusting
        the (reciprocals of the) voxel sizes used for defining the
        regularisation operators */
-    param[0][0] = param0[0]; /* 1/vox_x */
-    param[0][1] = param0[1]; /* 1/vox_y */
-    param[0][2] = param0[2]; /* 1/vox_z */
-    param[0][3] = param0[3]; /* 1st regularisation parameter */
-    param[0][4] = param0[4]; /* 2nd regularisation parameter */
-    param[0][5] = param0[5]; /* 3rd regularisation parameter */
-    param[0][6] = param0[6]; /* 4th regularisation parameter */
-    param[0][7] = param0[7]; /* 5th regularisation parameter */
-
+    g->param[0][0] = param0[0]; /* 1/vox_x */
+    g->param[0][1] = param0[1]; /* 1/vox_y */
+    g->param[0][2] = param0[2]; /* 1/vox_z */
+    g->param[0][3] = param0[3]; /* 1st regularisation parameter */
+    g->param[0][4] = param0[4]; /* 2nd regularisation parameter */
+    g->param[0][5] = param0[5]; /* 3rd regularisation parameter */
+    g->param[0][6] = param0[6]; /* 4th regularisation parameter */
+    g->param[0][7] = param0[7]; /* 5th regularisation parameter */
+
+    if (tele_active()) tele_grid(0, g->n[0]);
     for(j=1; j<ng; j++)
     {
-        restrict_g(n[j-1],bo[j-1],bo[j],rbuf);
+        double t = tele_active() ? tele_clock() : 0.0;
+        if (b0)
+            restrict_g(g->n[j-1],g->bo[j-1],g->bo[j],g->rbuf);
         if (a0)
-            restrict_h(n[j-1],a[j-1],a[j],rbuf);
-
-        param[j][0] = param0[0]*(double)n[j][0]/n0[0];
-        param[j][1] = param0[1]*(double)n[j][1]/n0[1];
-        param[j][2] = param0[2]*(double)n[j][2]/n0[2];
-        param[j][3] = param[0][3];
-        param[j][4] = param[0][4];
-        param[j][5] = param[0][5];
-        param[j][6] = param[0][6];
-        param[j][7] = param[0][7];
+            restrict_h(g->n[j-1],g->a[j-1],g->a[j],g->rbuf);
+        if (tele_active())
+        {
+            tele_transfer(j-1, TELE_RESTRICT, tele_clock()-t);
+            tele_grid(j, g->n[j]);
+        }
+
+        g->param[j][0] = param0[0]*(double)g->n[j][0]/n0[0];
+        g->param[j][1] = param0[1]*(double)g->n[j][1]/n0[1];
+        g->param[j][2] = param0[2]*(double)g->n[j][2]/n0[2];
+        g->param[j][3] = g->param[0][3];
+        g->param[j][4] = g->param[0][4];
+        g->param[j][5] = g->param[0][5];
+        g->param[j][6] = g->param[0][6];
+        g->param[j][7] = g->param[0][7];
+    }
+}
+
+/* Relaxation iterations at grid j */
+static void mg3_relax(MGGRID *g, mwSignedIndex j, int nit)
+{
+    double t = tele_active() ? tele_clock() : 0.0;
+    relax(g->n[j], g->a[j], g->b[j], g->param[j], nit, g->u[j]);
+    if (tele_active()) tele_sweeps(j, nit, tele_clock()-t);
+}
+
+/* Correction from grid j+1, prolonged to grid j and put in c */
+static void mg3_prolong(MGGRID *g, mwSignedIndex j, float *c)
+{
+    double t = tele_active() ? tele_clock() : 0.0;
+    prolong(g->n[j+1],g->u[j+1],g->n[j],c,g->rbuf);
+    if (tele_active()) tele_transfer(j, TELE_PROLONG, tele_clock()-t);
+}
+
+/* Residuals at grid jj, restricted to grid jj+1 */
+static void mg3_down(MGGRID *g, mwSignedIndex jj, int nit)
+{
+    double t;
+    mg3_relax(g, jj, nit);
+    Atimesp(g->n[jj], g->a[jj], g->param[jj], g->u[jj], g->res);
+    residual(3*g->m[jj], g->b[jj], g->res, g->res);
+    if (tele_active()) tele_residual(jj, tele_norm(3*g->m[jj], g->res));
+    t = tele_active() ? tele_clock() : 0.0;
+    restrict_g(g->n[jj],g->res,g->b[jj+1],g->rbuf);
+    if (tele_active()) tele_transfer(jj, TELE_RESTRICT, tele_clock()-t);
+    zeros(3*g->m[jj+1],g->u[jj+1]);
+}
+
+/* Correction from grid jj+1 added to grid jj */
+static void mg3_up(MGGRID *g, mwSignedIndex jj, int nit)
+{
+    mg3_prolong(g, jj, g->res);
+    addto(3*g->m[jj], g->u[jj], g->res);
+    mg3_relax(g, jj, nit);
+}
+
+/* One V-cycle, from grid j0 down to the coarsest and back */
+static void mg3_vcycle(MGGRID *g, mwSignedIndex j0, int nit)
+{
+    mwSignedIndex jj, ng = g->ng;
+    double t = tele_active() ? tele_clock() : 0.0;
+    for(jj=j0; jj<ng-1; jj++) /* From high res to lowest res */
+        mg3_down(g, jj, nit);
+    mg3_relax(g, ng-1, nit);
+    for(jj=ng-2; jj>=j0; jj--) /* From lowest res to high res */
+        mg3_up(g, jj, nit);
+    if (tele_active())
+    {
+        t = tele_clock()-t;
+        Atimesp(g->n[j0], g->a[j0], g->param[j0], g->u[j0], g->res);
+        residual(3*g->m[j0], g->b[j0], g->res, g->res);
+        tele_cycle(j0, t, tele_norm(3*g->m[j0], g->res));
     }
+}
+
+/*
+    Full Multigrid solver.  See Numerical Recipes (second edition) for more
+    information
+*/
+void fmg3(mwSize n0[], float *a0, float *b0, double param0[], int c, int nit,
+          float *u0, float *scratch)
+{
+    mwSignedIndex j, ng, jc;
+    MGGRID g;
 
-    if (u[0][0]==0) /* No starting estimate so do Full Multigrid */
+    mg3_grids(n0, a0, b0, param0, u0, scratch, &g);
+    ng = g.ng;
+
+    if (u0[0]==0) /* No starting estimate so do Full Multigrid */
     {
-        relax(n[ng-1], a[ng-1], b[ng-1], param[ng-1], nit, u[ng-1]); 
+        mg3_relax(&g, ng-1, nit);
         for(j=ng-2; j>=0; j--)
         {
-            mwSignedIndex jc;
-            prolong(n[j+1],u[j+1],n[j],u[j],rbuf);
-            if(j>0) copy(3*m[j],bo[j],b[j]);
+            mg3_prolong(&g, j, g.u[j]);
+            if(j>0) copy(3*g.m[j],g.bo[j],g.b[j]);
             for(jc=0; jc<c; jc++)
-            {
-                mwSignedIndex jj;
-                for(jj=j; jj<ng-1; jj++) /* From high res to lowest res */
-                {
-                    relax(n[jj], a[jj], b[jj], param[jj], nit, u[jj]);
-                    Atimesp(n[jj], a[jj], param[jj], u[jj], res);
-                    for(i=0; i<3*m[jj]; i++)
-                        res[i] = b[jj][i] - res[i];
-                    restrict_g(n[jj],res,b[jj+1],rbuf);
-                    zeros(3*m[jj+1],u[jj+1]);
-                }
-                relax(n[ng-1], a[ng-1], b[ng-1], param[ng-1], nit, u[ng-1]); 
-                for(jj=ng-2; jj>=j; jj--) /* From lowest res to high res */
-                {
-                    prolong(n[jj+1],u[jj+1],n[jj],res,rbuf);
-                    addto(3*m[jj], u[jj], res);
-                    relax(n[jj], a[jj], b[jj], param[jj], nit, u[jj]);
-                }
-            }
+                mg3_vcycle(&g, j, nit);
         }
     }
     else /* Use starting estimate and just run some V-cycles */
     {
-        mwSignedIndex jc;
 /*        for(j=1; j<ng; j++)
-            restrict_g(n[j-1],u[j-1],u[j],rbuf); */
+            restrict_g(g.n[j-1],g.u[j-1],g.u[j],g.rbuf); */
 
         for(jc=0; jc<c; jc++) /* Loop over V-cycles */
+            mg3_vcycle(&g, 0, nit);
+    }
+}
+
+/*
+ * Inverse of the 3x3 blocks on the diagonal of A plus the regularisation,
+ * applied to r.  The blocks of the regularisation are the same everywhere
+ * (ignoring the boundaries), and are diagonal.
+ */
+static void block_jacobi(mwSize dm[], float A[], double s[], float r[], float z[])
+{
+    mwSignedIndex i, m = dm[0]*dm[1]*dm[2];
+    double v0 = s[0]*s[0], v1 = s[1]*s[1], v2 = s[2]*s[2];
+    double lam0 = s[3], lam1 = s[4], lam2 = s[5], mu = s[6], lam = s[7];
+    double w000, d0, d1, d2;
+
+    w000 = lam2*(6*(v0*v0+v1*v1+v2*v2) +8*(v0*v1+v0*v2+v1*v2)) +lam1*2*(v0+v1+v2) + lam0;
+    d0   = (w000 + 2*mu*(2*v0+v1+v2))/v0 + 2*lam;
+    d1   = (w000 + 2*mu*(v0+2*v1+v2))/v1 + 2*lam;
+    d2   = (w000 + 2*mu*(v0+v1+2*v2))/v2 + 2*lam;
+
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN)
+    for(i=0; i<m; i++)
+    {
+        double a00 = d0, a11 = d1, a22 = d2, a01 = 0.0, a02 = 0.0, a12 = 0.0;
+        double c00, c11, c22, c01, c02, c12, dt, r0 = r[i], r1 = r[i+m], r2 = r[i+2*m];
+        if (A)
         {
-            mwSignedIndex jj;
-            for(jj=0; jj<ng-1; jj++) /* From highest res to lowest res */
-            {
-                relax(n[jj], a[jj], b[jj], param[jj], nit, u[jj]);
-                Atimesp(n[jj], a[jj], param[jj], u[jj], res);
-                for(i=0; i<3*m[jj]; i++)
-                    res[i] = b[jj][i] - res[i];
-                restrict_g(n[jj],res,b[jj+1],rbuf);
-                zeros(3*m[jj+1],u[jj+1]);
-            }
-            relax(n[ng-1], a[ng-1], b[ng-1], param[ng-1], nit, u[ng-1]); 
-            for(jj=ng-2; jj>=0; jj--) /* From lowest res to highest res */
-            {
-                prolong(n[jj+1],u[jj+1],n[jj],res,rbuf);
-                addto(3*m[jj], u[jj], res);
-                relax(n[jj], a[jj], b[jj], param[jj], nit, u[jj]);
-
-            }
+            a00 += A[i    ]; a11 += A[i+m  ]; a22 += A[i+m*2];
+            a01  = A[i+m*3]; a02  = A[i+m*4]; a12  = A[i+m*5];
+        }
+        c00 = a11*a22-a12*a12;
+        c11 = a00*a22-a02*a02;
+        c22 = a00*a11-a01*a01;
+        c01 = a02*a12-a01*a22;
+        c02 = a01*a12-a02*a11;
+        c12 = a01*a02-a00*a12;
+        dt  = a00*c00 + a01*c01 + a02*c02;
+        if (dt>0.0)
+        {
+            dt       = 1.0/dt;
+            z[i    ] = (c00*r0 + c01*r1 + c02*r2)*dt;
+            z[i+m  ] = (c01*r0 + c11*r1 + c12*r2)*dt;
+            z[i+m*2] = (c02*r0 + c12*r1 + c22*r2)*dt;
+        }
+        else
+        {
+            z[i    ] = r0/(a00+1e-6);
+            z[i+m  ] = r1/(a11+1e-6);
+            z[i+m*2] = r2/(a22+1e-6);
         }
     }
 }
 
+mwSize pcgs3_scratchsize(mwSize dm[], int pc)
+{
+    mwSize m = dm[0]*dm[1]*dm[2]*3;
+    return(4*m + ((pc==2) ? fmg3_scratchsize(dm,1) : 0));
+}
+
+/*
+ * Solve (A+L)*x = b by preconditioned conjugate gradients, starting from x.
+ * The preconditioner is either block Jacobi (pc==1) or one V-cycle of the
+ * multigrid solver, with its relaxation iterations at each grid (pc==2).
+ * The V-cycle is not a symmetric operator, so beta is computed by the
+ * Polak-Ribiere formula
+ *     beta = z'*(r - rold)/rtzold = -alpha*z'*Ap/rtzold
+ * which is the same as the usual one for symmetric preconditioners.
+ * Returns the number of iterations.
+ */
+int pcgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit,
+          int pc, int its, float x[], float *scratch)
+{
+    mwSize m = dm[0]*dm[1]*dm[2]*3;
+    float *r = scratch, *p = scratch+m, *Ap = scratch+2*m, *z = scratch+3*m;
+    double nb, rtr, rtz, alpha, beta, ztr, ztAp;
+    int it;
+    MGGRID g;
+
+    if (pc==2)
+    {
+        mg3_grids(dm, A, (float *)0, param, z, scratch+4*m, &g);
+        g.b[0] = r;
+    }
+
+    nb  = tol*norm(m,b);
+    Atimesp(dm, A, param, x, Ap);
+    residual(m, b, Ap, r);
+    rtr = dotprod(m, r, r);
+    zeros(m, p);
+    beta = 0.0;
+    rtz  = 0.0;
+
+    for(it=0; it<nit; it++)
+    {
+        if (sqrt(rtr) < nb)
+            break;
+
+        /* z = M\r */
+        if (pc==2)
+        {
+            zeros(m, z);
+            mg3_vcycle(&g, 0, its);
+        }
+        else
+            block_jacobi(dm, A, param, r, z);
+
+        if (it)
+        {
+            dotprod2(m, z, r, Ap, &ztr, &ztAp);
+            beta = -alpha*ztAp/rtz;
+        }
+        else
+            ztr  = dotprod(m, z, r);
+        rtz = ztr;
+
+        update_p(m, p, z, beta);
+        Atimesp(dm, A, param, p, Ap);
+        alpha = rtz/dotprod(m, p, Ap);
+        rtr   = update_xr(m, x, r, p, Ap, alpha);
+        if (tele_active()) tele_cg(sqrt(rtr));
+    }
+    return(it);
+}
@@ -4,6 +4,9 @@ extern void fmg3(mwSize n0[], float *a0, float *b0, double param[], int c, int n
                  float *u0, float *scratch);
 extern void cgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit,
                  float x[], float r[], float p[], float Ap[]);
+extern int  pcgs3(mwSize dm[], float A[], float b[], double param[], double tol, int nit,
+                  int pc, int its, float x[], float *scratch);
+extern mwSize pcgs3_scratchsize(mwSize dm[], int pc);
 extern void resize(mwSize na[], float *a, mwSize nc[], float *c, float *b);
 extern void restrict_vol(mwSize na[], float *a, mwSize nc[], float *c, float *b);
 extern float norm(mwSize m, float a[]);
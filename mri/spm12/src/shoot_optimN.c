@@ -8,6 +8,9 @@ extern double log(double x);
 
 #include "shoot_boundary.h"
 #include "shoot_multiscale.h"
+#include "shoot_relax.h"
+#include "shoot_telemetry.h"
+#include "spm_openmp.h"
 
 static void choldc(int n, double a[], double p[])
 {
@@ -60,7 +63,8 @@ static void cholls(int n, double a[], double p[], double b[], double x[])
 
 static void Atimesp1(mwSize dm[], float A[], float p[], float Ap[])
 {
-    mwSize i,j, m = dm[0]*dm[1]*dm[2];
+    mwSize i, m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex j;
     float *pp[MAXD3], *pap[MAXD3], *pA[(MAXD3*(MAXD3+1))/2];
 
     for(i=0; i<dm[3]; i++)
@@ -71,7 +75,8 @@ static void Atimesp1(mwSize dm[], float A[], float p[], float Ap[])
     for(i=0; i<(dm[3]*(dm[3]+1))/2; i++)
         pA[i] = &A[m*i];
 
-    for(j=0; j<m; j++)
+    #pragma omp parallel for schedule(static) if(m>=MULTISCALE_PAR_MIN) private(i)
+    for(j=0; j<(mwSignedIndex)m; j++)
     {
         mwSize k, o;
         for(i=0; i<dm[3]; i++)
@@ -111,8 +116,8 @@ static double sumsq(mwSize dm[], float a[], float b[], double s[], double scal[]
            w002;
     double v0 = s[0]*s[0], v1 = s[1]*s[1], v2 = s[2]*s[2];
     double lam0 = s[3], lam1 = s[4], lam2 = s[5];
-    double ss = 0.0;
-    mwSignedIndex k;
+    double sst = 0.0, *sr;
+    mwSignedIndex r, nr = dm[1]*dm[2];
 
     w000 = lam2*(6*(v0*v0+v1*v1+v2*v2) +8*(v0*v1+v0*v2+v1*v2)) +lam1*2*(v0+v1+v2);
     w000 = w000 + lam0;
@@ -126,99 +131,105 @@ static double sumsq(mwSize dm[], float a[], float b[], double s[], double scal[]
     w101 = lam2*2*v0*v2;
     w011 = lam2*2*v1*v2;
 
-    for(k=0; k<dm[2]; k++)
+    sr = (double *)mxMalloc(sizeof(double)*nr);
+
+    /* Rows are summed separately, and then added together, so the result
+       does not depend on the number of threads */
+    #pragma omp parallel for schedule(static) if(dm[0]*nr>=MULTISCALE_PAR_MIN)
+    for(r=0; r<nr; r++)
     {
-        mwSignedIndex j, km2,km1,kp1,kp2;
+        mwSignedIndex i, m, j = r%dm[1], k = r/dm[1];
+        mwSignedIndex km2,km1,kp1,kp2, jm2,jm1,jp1,jp2;
+        float *p[MAXD3], *pu[MAXD3], *pb[MAXD3], *pa[(MAXD3*(MAXD3+1))/2];
+        double a1[MAXD3*MAXD3], ss = 0.0;
+
         km2 = (bound(k-2,dm[2])-k)*dm[0]*dm[1];
         km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
         kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
         kp2 = (bound(k+2,dm[2])-k)*dm[0]*dm[1];
 
-        for(j=0; j<dm[1]; j++)
+        for(m=0; m<dm[3]; m++)
         {
-            mwSignedIndex i,m, jm2,jm1,jp1,jp2;
-            float *p[MAXD3], *pu[MAXD3], *pb[MAXD3], *pa[(MAXD3*(MAXD3+1))/2];
-            double a1[MAXD3*MAXD3];
-
-            for(m=0; m<dm[3]; m++)
-            {
-                pu[m]  = u+dm[0]*(j+dm[1]*(k+dm[2]*m));
-                pb[m]  = b+dm[0]*(j+dm[1]*(k+dm[2]*m));
-            }
+            pu[m]  = u+dm[0]*(j+dm[1]*(k+dm[2]*m));
+            pb[m]  = b+dm[0]*(j+dm[1]*(k+dm[2]*m));
+        }
 
-            if (a)
-            {
-                for(m=0; m<(dm[3]*(dm[3]+1))/2; m++)
-                    pa[m]  = a+dm[0]*(j+dm[1]*(k+dm[2]*m));
-            }
+        if (a)
+        {
+            for(m=0; m<(dm[3]*(dm[3]+1))/2; m++)
+                pa[m]  = a+dm[0]*(j+dm[1]*(k+dm[2]*m));
+        }
 
-            jm2 = (bound(j-2,dm[1])-j)*dm[0];
-            jm1 = (bound(j-1,dm[1])-j)*dm[0];
-            jp1 = (bound(j+1,dm[1])-j)*dm[0];
-            jp2 = (bound(j+2,dm[1])-j)*dm[0];
+        jm2 = (bound(j-2,dm[1])-j)*dm[0];
+        jm1 = (bound(j-1,dm[1])-j)*dm[0];
+        jp1 = (bound(j+1,dm[1])-j)*dm[0];
+        jp2 = (bound(j+2,dm[1])-j)*dm[0];
 
-            for(i=0; i<dm[0]; i++)
-            {
-                mwSignedIndex m, im2,im1,ip1,ip2;
-                double tmp;
+        for(i=0; i<dm[0]; i++)
+        {
+            mwSignedIndex m, im2,im1,ip1,ip2;
+            double tmp;
 
-                im2 = bound(i-2,dm[0])-i;
-                im1 = bound(i-1,dm[0])-i;
-                ip1 = bound(i+1,dm[0])-i;
-                ip2 = bound(i+2,dm[0])-i;
+            im2 = bound(i-2,dm[0])-i;
+            im1 = bound(i-1,dm[0])-i;
+            ip1 = bound(i+1,dm[0])-i;
+            ip2 = bound(i+2,dm[0])-i;
 
-                for(m=0; m<dm[3]; m++) p[m] = &(pu[m][i]);
+            for(m=0; m<dm[3]; m++) p[m] = &(pu[m][i]);
 
-                if (a) get_a(dm[3], i, pa, a1);
+            if (a) get_a(dm[3], i, pa, a1);
 
-                for(m=0; m<dm[3]; m++)
-                {
-                    mwSignedIndex n;
-                    float *pm =  p[m];
-                    double pm0 = pm[0];
-                    tmp =  (lam0*  pm0 +
-                          + w100*((pm[im1        ]-pm0) + (pm[ip1        ]-pm0))
-                          + w010*((pm[    jm1    ]-pm0) + (pm[    jp1    ]-pm0))
-                          + w001*((pm[        km1]-pm0) + (pm[        kp1]-pm0))
-                          + w200*((pm[im2        ]-pm0) + (pm[ip2        ]-pm0))
-                          + w020*((pm[    jm2    ]-pm0) + (pm[    jp2    ]-pm0))
-                          + w002*((pm[        km2]-pm0) + (pm[        kp2]-pm0))
-                          + w110*((pm[im1+jm1    ]-pm0) + (pm[ip1+jm1    ]-pm0) + (pm[im1+jp1    ]-pm0) + (pm[ip1+jp1    ]-pm0))
-                          + w101*((pm[im1    +km1]-pm0) + (pm[ip1    +km1]-pm0) + (pm[im1    +kp1]-pm0) + (pm[ip1    +kp1]-pm0))
-                          + w011*((pm[    jm1+km1]-pm0) + (pm[    jp1+km1]-pm0) + (pm[    jm1+kp1]-pm0) + (pm[    jp1+kp1]-pm0)))*scal[m]
-                          - pb[m][i];
+            for(m=0; m<dm[3]; m++)
+            {
+                mwSignedIndex n;
+                float *pm =  p[m];
+                double pm0 = pm[0];
+                tmp =  (lam0*  pm0 +
+                      + w100*((pm[im1        ]-pm0) + (pm[ip1        ]-pm0))
+                      + w010*((pm[    jm1    ]-pm0) + (pm[    jp1    ]-pm0))
+                      + w001*((pm[        km1]-pm0) + (pm[        kp1]-pm0))
+                      + w200*((pm[im2        ]-pm0) + (pm[ip2        ]-pm0))
+                      + w020*((pm[    jm2    ]-pm0) + (pm[    jp2    ]-pm0))
+                      + w002*((pm[        km2]-pm0) + (pm[        kp2]-pm0))
+                      + w110*((pm[im1+jm1    ]-pm0) + (pm[ip1+jm1    ]-pm0) + (pm[im1+jp1    ]-pm0) + (pm[ip1+jp1    ]-pm0))
+                      + w101*((pm[im1    +km1]-pm0) + (pm[ip1    +km1]-pm0) + (pm[im1    +kp1]-pm0) + (pm[ip1    +kp1]-pm0))
+                      + w011*((pm[    jm1+km1]-pm0) + (pm[    jp1+km1]-pm0) + (pm[    jm1+kp1]-pm0) + (pm[    jp1+kp1]-pm0)))*scal[m]
+                      - pb[m][i];
 
 /*
 Note that there are numerical precision problems with this.
-                    tmp =  (w000* pm[0] +
-                          + w010*(pm[    jm1    ] + pm[    jp1    ])
-                          + w020*(pm[    jm2    ] + pm[    jp2    ])
-                          + w100*(pm[im1        ] + pm[ip1        ])
-                          + w110*(pm[im1+jm1    ] + pm[ip1+jm1    ] + pm[im1+jp1    ] + pm[ip1+jp1    ])
-                          + w200*(pm[im2        ] + pm[ip2        ])
-                          + w001*(pm[        km1] + pm[        kp1])
-                          + w101*(pm[im1    +km1] + pm[ip1    +km1] + pm[im1    +kp1] + pm[ip1    +kp1])
-                          + w011*(pm[    jm1+km1] + pm[    jp1+km1] + pm[    jm1+kp1] + pm[    jp1+kp1])
-                          + w002*(pm[        km2] + pm[        kp2]))*scal[m]
-                          - pb[m][i];
+                tmp =  (w000* pm[0] +
+                      + w010*(pm[    jm1    ] + pm[    jp1    ])
+                      + w020*(pm[    jm2    ] + pm[    jp2    ])
+                      + w100*(pm[im1        ] + pm[ip1        ])
+                      + w110*(pm[im1+jm1    ] + pm[ip1+jm1    ] + pm[im1+jp1    ] + pm[ip1+jp1    ])
+                      + w200*(pm[im2        ] + pm[ip2        ])
+                      + w001*(pm[        km1] + pm[        kp1])
+                      + w101*(pm[im1    +km1] + pm[ip1    +km1] + pm[im1    +kp1] + pm[ip1    +kp1])
+                      + w011*(pm[    jm1+km1] + pm[    jp1+km1] + pm[    jm1+kp1] + pm[    jp1+kp1])
+                      + w002*(pm[        km2] + pm[        kp2]))*scal[m]
+                      - pb[m][i];
 */
 
-                    if (a)
-                    {
-                        double *a11 = a1 + dm[3]*m;
-                        for(n=0; n<dm[3]; n++) tmp += a11[n]*p[n][0];
-                    }
-                    ss += tmp*tmp;
+                if (a)
+                {
+                    double *a11 = a1 + dm[3]*m;
+                    for(n=0; n<dm[3]; n++) tmp += a11[n]*p[n][0];
                 }
+                ss += tmp*tmp;
             }
         }
+        sr[r] = ss;
     }
-    return(ss);
+    for(r=0; r<nr; r++)
+        sst += sr[r];
+    mxFree(sr);
+    return(sst);
 }
 
 void LtLf(mwSize dm[], float f[], double s[], double scal[], float g[])
 {
-    mwSignedIndex k;
+    mwSignedIndex r, nr = dm[1]*dm[2];
     double w000,w100,w200,
            w010,w110,
            w020,
@@ -240,54 +251,53 @@ void LtLf(mwSize dm[], float f[], double s[], double scal[], float g[])
     w101 = lam2*2*v0*v2;
     w011 = lam2*2*v1*v2;
 
-    for(k=0; k<dm[2]; k++)
+    /* Rows are independent */
+    #pragma omp parallel for schedule(static) if(dm[0]*nr>=MULTISCALE_PAR_MIN)
+    for(r=0; r<nr; r++)
     {
-        mwSignedIndex j, km2,km1,kp1,kp2;
+        mwSignedIndex i, m, j = r%dm[1], k = r/dm[1];
+        mwSignedIndex km2,km1,kp1,kp2, jm2,jm1,jp1,jp2;
+        float *pf[MAXD3], *pg[MAXD3];
+
         km2 = (bound(k-2,dm[2])-k)*dm[0]*dm[1];
         km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
         kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
         kp2 = (bound(k+2,dm[2])-k)*dm[0]*dm[1];
 
-        for(j=0; j<dm[1]; j++)
+        for(m=0; m<dm[3]; m++)
         {
-            mwSignedIndex i,m, jm2,jm1,jp1,jp2;
-            float *pf[MAXD3], *pg[MAXD3];
-
-            for(m=0; m<dm[3]; m++)
-            {
-                pf[m]  = f+dm[0]*(j+dm[1]*(k+dm[2]*m));
-                pg[m]  = g+dm[0]*(j+dm[1]*(k+dm[2]*m));
-            }
+            pf[m]  = f+dm[0]*(j+dm[1]*(k+dm[2]*m));
+            pg[m]  = g+dm[0]*(j+dm[1]*(k+dm[2]*m));
+        }
 
-            jm2 = (bound(j-2,dm[1])-j)*dm[0];
-            jm1 = (bound(j-1,dm[1])-j)*dm[0];
-            jp1 = (bound(j+1,dm[1])-j)*dm[0];
-            jp2 = (bound(j+2,dm[1])-j)*dm[0];
+        jm2 = (bound(j-2,dm[1])-j)*dm[0];
+        jm1 = (bound(j-1,dm[1])-j)*dm[0];
+        jp1 = (bound(j+1,dm[1])-j)*dm[0];
+        jp2 = (bound(j+2,dm[1])-j)*dm[0];
 
-            for(m=0; m<dm[3]; m++)
+        for(m=0; m<dm[3]; m++)
+        {
+            mwSignedIndex im2,im1,ip1,ip2;
+            float *pf1 = pf[m], *pg1 = pg[m];
+            for(i=0; i<dm[0]; i++)
             {
-                mwSignedIndex im2,im1,ip1,ip2;
-                float *pf1 = pf[m], *pg1 = pg[m];
-                for(i=0; i<dm[0]; i++)
-                {
-                    float *p = &pf1[i];
-                    double p0 = p[0];
+                float *p = &pf1[i];
+                double p0 = p[0];
 
-                    im2 = bound(i-2,dm[0])-i;
-                    im1 = bound(i-1,dm[0])-i;
-                    ip1 = bound(i+1,dm[0])-i;
-                    ip2 = bound(i+2,dm[0])-i;
-                    pg1[i] =(lam0*  p0 +
-                           + w100*((p[im1        ]-p0) + (p[ip1        ]-p0))
-                           + w010*((p[    jm1    ]-p0) + (p[    jp1    ]-p0))
-                           + w001*((p[        km1]-p0) + (p[        kp1]-p0))
-                           + w200*((p[im2        ]-p0) + (p[ip2        ]-p0))
-                           + w020*((p[    jm2    ]-p0) + (p[    jp2    ]-p0))
-                           + w002*((p[        km2]-p0) + (p[        kp2]-p0))
-                           + w110*((p[im1+jm1    ]-p0) + (p[ip1+jm1    ]-p0) + (p[im1+jp1    ]-p0) + (p[ip1+jp1    ]-p0))
-                           + w101*((p[im1    +km1]-p0) + (p[ip1    +km1]-p0) + (p[im1    +kp1]-p0) + (p[ip1    +kp1]-p0))
-                           + w011*((p[    jm1+km1]-p0) + (p[    jp1+km1]-p0) + (p[    jm1+kp1]-p0) + (p[    jp1+kp1]-p0)))*scal[m];
-                }
+                im2 = bound(i-2,dm[0])-i;
+                im1 = bound(i-1,dm[0])-i;
+                ip1 = bound(i+1,dm[0])-i;
+                ip2 = bound(i+2,dm[0])-i;
+                pg1[i] =(lam0*  p0 +
+                       + w100*((p[im1        ]-p0) + (p[ip1        ]-p0))
+                       + w010*((p[    jm1    ]-p0) + (p[    jp1    ]-p0))
+                       + w001*((p[        km1]-p0) + (p[        kp1]-p0))
+                       + w200*((p[im2        ]-p0) + (p[ip2        ]-p0))
+                       + w020*((p[    jm2    ]-p0) + (p[    jp2    ]-p0))
+                       + w002*((p[        km2]-p0) + (p[        kp2]-p0))
+                       + w110*((p[im1+jm1    ]-p0) + (p[ip1+jm1    ]-p0) + (p[im1+jp1    ]-p0) + (p[ip1+jp1    ]-p0))
+                       + w101*((p[im1    +km1]-p0) + (p[ip1    +km1]-p0) + (p[im1    +kp1]-p0) + (p[ip1    +kp1]-p0))
+                       + w011*((p[    jm1+km1]-p0) + (p[    jp1+km1]-p0) + (p[    jm1+kp1]-p0) + (p[    jp1+kp1]-p0)))*scal[m];
             }
         }
     }
@@ -296,6 +306,8 @@ void LtLf(mwSize dm[], float f[], double s[], double scal[], float g[])
 static void relax(mwSize dm[], float a[], float b[], double s[], double scal[], int nit, float u[])
 {
     int it;
+    RELAX_SCHED sc;
+    mwSignedIndex stage;
     double w000,w100,w200,
            w010,w110,
            w020,
@@ -369,12 +381,19 @@ static void relax(mwSize dm[], float a[], float b[], double s[], double scal[],
         printf("B%dx%dx%d: %g ", dm[0],dm[1],dm[2],sumsq(dm, a, b, s, scal, u));
 #   endif
 
-    for(it=0; it<27*nit; it++)
+    relax_sched_init(&sc, dm[2], 3, 9, 2, 27*nit, (double)dm[0]*dm[1]*sizeof(float)*(2*dm[3] + (a ? (dm[3]*(dm[3]+1))/2 : 0)));
+    for(stage=0; stage<sc.nstages; stage++)
     {
-        mwSignedIndex i, j, k;
-        for(k=(it/9)%3; k<dm[2]; k+=3)
+        mwSignedIndex n, nn = relax_sched_size(&sc, stage);
+
+        /* Updates within a stage are independent (see shoot_relax.c) */
+        #pragma omp parallel for schedule(static) if(nn>1) private(it)
+        for(n=0; n<nn; n++)
         {
+            mwSignedIndex i, j, k;
             mwSignedIndex km2, km1, kp1, kp2;
+            if (!relax_sched_item(&sc, stage, n, &it, &k)) continue;
+
             km2 = (bound(k-2,dm[2])-k)*dm[0]*dm[1];
             km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
             kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
@@ -484,11 +503,10 @@ static void relax(mwSize dm[], float a[], float b[], double s[], double scal[],
                 }
             }
         }
-#       ifdef VERBOSE
-        if ((it%27) == 26)
-            printf(" %g", sumsq(dm, a, b, s, scal, u));
-#       endif
     }
+#   ifdef VERBOSE
+        printf(" %g", sumsq(dm, a, b, s, scal, u));
+#   endif
 #   ifdef VERBOSE
         printf("\n");
 #   endif
@@ -502,27 +520,82 @@ static void Atimesp(mwSize dm[], float A[], double param[], double scal[], float
 }
 
 
+/* Relaxation iterations at grid j of fmg */
+static void relax_grid(mwSignedIndex j, mwSize dm[], float a[], float b[], double s[], double scal[], int nit, float u[])
+{
+    double t = tele_active() ? tele_clock() : 0.0;
+    relax(dm, a, b, s, scal, nit, u);
+    if (tele_active()) tele_sweeps(j, nit, tele_clock()-t);
+}
+
 /*******************************************************/
 
-static void restrictfcn(mwSize n,  mwSize na[], float *a,  mwSize nc[], float *c, float *b)
+/* Number of threads among which the n channels of a transfer to a grid
+   of dimensions nc are shared.  This is only done when the grid is too
+   small for restrict_vol and resize_vol to be multithreaded themselves. */
+static int transfer_threads(mwSize n, mwSize nc[])
+{
+    double mc = (double)nc[0]*nc[1]*nc[2];
+    int nt = omp_get_max_threads();
+    if (mc>=MULTISCALE_PAR_MIN || n*mc<MULTISCALE_PAR_MIN || omp_in_parallel()) nt = 1;
+    if (nt>(int)n) nt = (int)n;
+    return(nt);
+}
+
+/* Size (in floats) of the buffer used by each thread for transfers when
+   the channels are done in parallel.  It begins with the workspace for the
+   tables of the transfer operators, followed by the buffer of planes. */
+static mwSize transfer_bufsize(mwSize n0[])
+{
+    return(2*multiscale_workspace_size(n0) + 2*((5*n0[0]*n0[1]+1)/2));
+}
+
+/* Buffers for transfers between grids.  b is used if the channels are
+   done one at a time, or the per-thread buffers in tb (each of tsz floats,
+   beginning with wsz doubles of workspace) if they are done in parallel. */
+typedef struct
+{
+    float *b, *tb;
+    mwSize wsz, tsz;
+} TBUF;
+
+static void transfer(int rs, mwSize n, mwSize na[], float *a, mwSize nc[], float *c, TBUF *tb)
 {
     mwSignedIndex i;
+    int nt = transfer_threads(n, nc);
+
+    #pragma omp parallel for schedule(static) num_threads(nt) if(nt>1)
     for(i=0; i<n; i++)
     {
-        restrict_vol(na, a+i*na[0]*na[1]*na[2], nc, c+i*nc[0]*nc[1]*nc[2], b);
+        float *bt = tb->b;
+        if (nt>1)
+        {
+            bt = tb->tb + omp_get_thread_num()*tb->tsz;
+            multiscale_workspace((double *)bt, tb->wsz);
+            bt += 2*tb->wsz;
+        }
+        if (rs)
+            restrict_vol(na, a+i*na[0]*na[1]*na[2], nc, c+i*nc[0]*nc[1]*nc[2], bt);
+        else
+            resize_vol(na, a+i*na[0]*na[1]*na[2], nc, c+i*nc[0]*nc[1]*nc[2], bt);
+        if (nt>1) multiscale_workspace((double *)0, 0);
     }
 }
 
-static void prolong(mwSize n,  mwSize na[], float *a,  mwSize nc[], float *c, float *b)
+static void restrictfcn(mwSize n,  mwSize na[], float *a,  mwSize nc[], float *c, TBUF *tb)
 {
-    mwSignedIndex i;
-    for(i=0; i<n; i++)
-        resize_vol(na, a+i*na[0]*na[1]*na[2], nc, c+i*nc[0]*nc[1]*nc[2], b);
+    transfer(1, n, na, a, nc, c, tb);
+}
+
+static void prolong(mwSize n,  mwSize na[], float *a,  mwSize nc[], float *c, TBUF *tb)
+{
+    transfer(0, n, na, a, nc, c, tb);
 }
 
 static void zeros(mwSize n, float *a)
 {
     mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
     for(i=0; i<n; i++)
         a[i] = 0.0;
 }
@@ -530,6 +603,7 @@ static void zeros(mwSize n, float *a)
 static void copy(mwSize n, float *a, float *b)
 {
     mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
     for(i=0; i<n; i++)
         b[i] = a[i];
 }
@@ -537,13 +611,24 @@ static void copy(mwSize n, float *a, float *b)
 static void addto(mwSize n, float *a, float *b)
 {
     mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
     for(i=0; i<n; i++)
         a[i] += b[i];
 }
 
+/* r = b - r */
+static void residual(mwSize n, float *b, float *r)
+{
+    mwSignedIndex i;
+    #pragma omp parallel for schedule(static) if(n>=MULTISCALE_PAR_MIN)
+    for(i=0; i<n; i++)
+        r[i] = b[i] - r[i];
+}
+
 mwSignedIndex fmg_scratchsize(mwSize n0[])
 {
     mwSignedIndex    n[32][3], m[32], bs, j;
+    int nt = omp_get_max_threads();
     bs = 0;
     n[0][0] = n0[0];
     n[0][1] = n0[1];
@@ -559,7 +644,8 @@ mwSignedIndex fmg_scratchsize(mwSize n0[])
         if ((n[j][0]<2) && (n[j][1]<2) && (n[j][2]<2))
             break;
     }
-    return((n0[3]*n0[0]*n0[1]*n0[2] + n[0][0]*n[1][1]+3*n[0][0]*n[0][1] + (n0[3]*3+(n0[3]*(n0[3]+1))/2)*bs));
+    return((n0[3]*n0[0]*n0[1]*n0[2] + n[0][0]*n[1][1]+3*n[0][0]*n[0][1] + (n0[3]*3+(n0[3]*(n0[3]+1))/2)*bs)
+           + (nt>1 ? 1+nt*transfer_bufsize(n0) : 0));
 }
 
 /*
@@ -569,9 +655,10 @@ mwSignedIndex fmg_scratchsize(mwSize n0[])
 void fmg(mwSize n0[], float *a0, float *b0, double param0[], double scal[], int c, int nit,
           float *u0, float *scratch)
 {
-    mwSignedIndex i, j, ng, bs;
+    mwSignedIndex j, ng, bs;
     mwSize n[32][4], m[32];
     float *bo[32], *a[32], *b[32], *u[32], *res, *rbuf;
+    TBUF tb;
     double param[32][6];
 
 #   ifdef VERBOSE
@@ -623,10 +710,24 @@ void fmg(mwSize n0[], float *a0, float *b0, double param0[], double scal[], int
         u[j]  =  u[j-1]+m[j-1]*n0[3];
         a[j]  =  a[j-1]+m[j-1]*(n0[3]*(n0[3]+1))/2;
     }
+
+    /* Per-thread transfer buffers follow, aligned for the workspace */
+    tb.b   = rbuf;
+    tb.wsz = multiscale_workspace_size(n0);
+    tb.tsz = transfer_bufsize(n0);
+    tb.tb  = a[1] + ((n0[3]*(n0[3]+1))/2)*bs;
+    tb.tb += (tb.tb-scratch)%2;
+    if (tele_active()) tele_grid(0, n[0]);
     for(j=1; j<ng; j++)
     {
-        restrictfcn(n0[3],n[j-1],bo[j-1],n[j],bo[j],rbuf);
-        restrictfcn((n0[3]*(n0[3]+1))/2,n[j-1],a[j-1],n[j],a[j],rbuf);
+        double t = tele_active() ? tele_clock() : 0.0;
+        restrictfcn(n0[3],n[j-1],bo[j-1],n[j],bo[j],&tb);
+        restrictfcn((n0[3]*(n0[3]+1))/2,n[j-1],a[j-1],n[j],a[j],&tb);
+        if (tele_active())
+        {
+            tele_transfer(j-1, TELE_RESTRICT, tele_clock()-t);
+            tele_grid(j, n[j]);
+        }
 
         param[j][0] = param0[0]*(double)n[j][0]/n0[0];
         param[j][1] = param0[1]*(double)n[j][1]/n0[1];
@@ -635,33 +736,50 @@ void fmg(mwSize n0[], float *a0, float *b0, double param0[], double scal[], int
         param[j][4] = param[0][4];
         param[j][5] = param[0][5];
     }
-    relax(n[ng-1], a[ng-1], b[ng-1], param[ng-1], scal, nit, u[ng-1]);
+    relax_grid(ng-1, n[ng-1], a[ng-1], b[ng-1], param[ng-1], scal, nit, u[ng-1]);
 
     for(j=ng-2; j>=0; j--)
     {
         int jc;
-        prolong(n0[3],n[j+1],u[j+1],n[j],u[j],rbuf);
+        double t = tele_active() ? tele_clock() : 0.0;
+        prolong(n0[3],n[j+1],u[j+1],n[j],u[j],&tb);
+        if (tele_active()) tele_transfer(j, TELE_PROLONG, tele_clock()-t);
         if(j>0) copy(n0[3]*m[j],bo[j],b[j]);
         for(jc=0; jc<c; jc++)
         {
             int jj;
+            double tc = tele_active() ? tele_clock() : 0.0;
             for(jj=j; jj<ng-1; jj++)
             {
-                relax(n[jj], a[jj], b[jj], param[jj], scal, nit, u[jj]);
+                relax_grid(jj, n[jj], a[jj], b[jj], param[jj], scal, nit, u[jj]);
                 Atimesp(n[jj], a[jj], param[jj], scal, u[jj], res);
-                for(i=0; i<n0[3]*m[jj]; i++)
-                    res[i] = b[jj][i] - res[i];
+                residual(n0[3]*m[jj], b[jj], res);
+                if (tele_active())
+                {
+                    tele_residual(jj, tele_norm(n0[3]*m[jj], res));
+                    t = tele_clock();
+                }
 
-                restrictfcn(n0[3],n[jj],res,n[jj+1],b[jj+1],rbuf);
+                restrictfcn(n0[3],n[jj],res,n[jj+1],b[jj+1],&tb);
+                if (tele_active()) tele_transfer(jj, TELE_RESTRICT, tele_clock()-t);
                 zeros(n0[3]*m[jj+1],u[jj+1]);
             }
-            relax(n[ng-1], a[ng-1], b[ng-1], param[ng-1], scal, nit, u[ng-1]);
+            relax_grid(ng-1, n[ng-1], a[ng-1], b[ng-1], param[ng-1], scal, nit, u[ng-1]);
 
             for(jj=ng-2; jj>=j; jj--)
             {
-                prolong(n0[3],n[jj+1],u[jj+1],n[jj],res,rbuf);
+                if (tele_active()) t = tele_clock();
+                prolong(n0[3],n[jj+1],u[jj+1],n[jj],res,&tb);
+                if (tele_active()) tele_transfer(jj, TELE_PROLONG, tele_clock()-t);
                 addto(n0[3]*m[jj], u[jj], res);
-                relax(n[jj], a[jj], b[jj], param[jj], scal, nit, u[jj]);
+                relax_grid(jj, n[jj], a[jj], b[jj], param[jj], scal, nit, u[jj]);
+            }
+            if (tele_active())
+            {
+                tc = tele_clock()-tc;
+                Atimesp(n[j], a[j], param[j], scal, u[j], res);
+                residual(n0[3]*m[j], b[j], res);
+                tele_cycle(j, tc, tele_norm(n0[3]*m[j], res));
             }
         }
     }
@@ -6,6 +6,8 @@
 extern double log(double x);
 
 #include "shoot_boundary.h"
+#include "shoot_relax.h"
+#include "spm_openmp.h"
 /*
 % MATLAB code (requiring Symbolic Toolbox) for computing the
 % regulariser for linear elasticity.
@@ -454,6 +456,8 @@ void vel2mom_le(mwSize dm[], float f[], double s[], float g[])
 void relax_le(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
 {
     int it;
+    RELAX_SCHED sc;
+    mwSignedIndex stage;
     double wx000, wx100, wx010, wx001, wy000, wy100, wy010, wy001, wz000, wz100, wz010, wz001, w2;
     double v0 = s[0]*s[0], v1 = s[1]*s[1], v2 = s[2]*s[2];
     double lam0 = s[3], mu = s[6], lam = s[7];
@@ -503,12 +507,18 @@ void relax_le(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
         printf("L%dx%dx%d: %g ", dm[0],dm[1],dm[2], sumsq(dm, a, b, s, u));
 #   endif
 
-    for(it=0; it<8*nit; it++)
+    relax_sched_init(&sc, dm[2], 2, 1, 1, 8*nit, (double)dm[0]*dm[1]*sizeof(float)*(a ? 12 : 6));
+    for(stage=0; stage<sc.nstages; stage++)
     {
-        mwSignedIndex k;
-        for(k=it&1; k<dm[2]; k+=2)
+        mwSignedIndex n, nn = relax_sched_size(&sc, stage);
+
+        /* Updates within a stage are independent (see shoot_relax.c) */
+        #pragma omp parallel for schedule(static) if(nn>1) private(it)
+        for(n=0; n<nn; n++)
         {
-            mwSignedIndex j, km1, kp1;
+            mwSignedIndex j, k, km1, kp1;
+            if (!relax_sched_item(&sc, stage, n, &it, &k)) continue;
+
             km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
             kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
 
@@ -585,11 +595,11 @@ void relax_le(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
                     }
                 }
             }
-        } 
-#       ifdef VERBOSE
-            if ((it%8)==7) printf(" %g", sumsq(dm, a, b, s, u));
-#       endif
+        }
     }
+#   ifdef VERBOSE
+        printf(" %g", sumsq(dm, a, b, s, u));
+#   endif
 #   ifdef VERBOSE
         printf("\n");
 #   endif
@@ -650,6 +660,8 @@ void vel2mom_me(mwSize dm[], float f[], double s[], float g[])
 void relax_me(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
 {
     int it;
+    RELAX_SCHED sc;
+    mwSignedIndex stage;
     double w000,w001,w010,w100;
     double lam0 = s[3], lam1 = s[4];
 
@@ -681,16 +693,22 @@ void relax_me(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
         printf("M%dx%dx%d: %g ", dm[0],dm[1],dm[2], sumsq(dm, a, b, s, u));
 #   endif
 
-    for(it=0; it<2*nit; it++)
+    relax_sched_init(&sc, dm[2], 1, 1, 1, 2*nit, (double)dm[0]*dm[1]*sizeof(float)*(a ? 12 : 6));
+    for(stage=0; stage<sc.nstages; stage++)
     {
-        mwSignedIndex k, kstart;
-        mwSignedIndex j, jstart;
-        mwSignedIndex i, istart;
+        mwSignedIndex n, nn = relax_sched_size(&sc, stage);
 
-        kstart = it%2;
-        for(k=0; k<dm[2]; k++)
+        /* Updates within a stage are independent (see shoot_relax.c) */
+        #pragma omp parallel for schedule(static) if(nn>1) private(it)
+        for(n=0; n<nn; n++)
         {
+            mwSignedIndex k, kstart;
+            mwSignedIndex j, jstart;
+            mwSignedIndex i, istart;
             mwSignedIndex km1, kp1;
+            if (!relax_sched_item(&sc, stage, n, &it, &k)) continue;
+            kstart = it%2;
+
             km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
             kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
 
@@ -763,10 +781,10 @@ void relax_me(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
                 }
             }
         }
+    }
 #   ifdef VERBOSE
-        if ((it%2)==1) printf(" %g", sumsq(dm, a, b, s, u));
+        printf(" %g", sumsq(dm, a, b, s, u));
 #   endif
-    }
 #ifdef VERBOSE
     printf("\n");
 #endif
@@ -912,6 +930,8 @@ void vel2mom_be(mwSize dm[], float f[], double s[], float g[])
 void relax_be(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
 {
     int it;
+    RELAX_SCHED sc;
+    mwSignedIndex stage;
     double w000,w100,w200,
            w010,w110,
            w020,
@@ -986,12 +1006,19 @@ void relax_be(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
         printf("B%dx%dx%d: %g ", dm[0],dm[1],dm[2],sumsq(dm, a, b, s, u));
 #   endif
 
-    for(it=0; it<27*nit; it++)
+    relax_sched_init(&sc, dm[2], 3, 9, 2, 27*nit, (double)dm[0]*dm[1]*sizeof(float)*(a ? 12 : 6));
+    for(stage=0; stage<sc.nstages; stage++)
     {
-        mwSignedIndex i, j, k;
-        for(k=(it/9)%3; k<dm[2]; k+=3)
+        mwSignedIndex n, nn = relax_sched_size(&sc, stage);
+
+        /* Updates within a stage are independent (see shoot_relax.c) */
+        #pragma omp parallel for schedule(static) if(nn>1) private(it)
+        for(n=0; n<nn; n++)
         {
+            mwSignedIndex i, j, k;
             mwSignedIndex km2, km1, kp1, kp2;
+            if (!relax_sched_item(&sc, stage, n, &it, &k)) continue;
+
             km2 = (bound(k-2,dm[2])-k)*dm[0]*dm[1];
             km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
             kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
@@ -1101,11 +1128,10 @@ void relax_be(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
                 }
             }
         }
-#       ifdef VERBOSE
-        if ((it%27) == 26)
-            printf(" %g", sumsq(dm, a, b, s, u));
-#       endif
     }
+#   ifdef VERBOSE
+        printf(" %g", sumsq(dm, a, b, s, u));
+#   endif
 #   ifdef VERBOSE
         printf("\n");
 #   endif
@@ -1249,6 +1275,8 @@ void vel2mom_all(mwSize dm[], float f[], double s[], float g[])
 void relax_all(mwSize dm[], float a[], float b[], double s[], int nit, float u[])
 {
     int it;
+    RELAX_SCHED sc;
+    mwSignedIndex stage;
     double w000,w100,w200,
            w010,w110,
            w020,
@@ -1356,12 +1384,19 @@ void relax_all(mwSize dm[], float a[], float b[], double s[], int nit, float u[]
         printf("A%dx%dx%d: %g ", dm[0],dm[1],dm[2],sumsq(dm, a, b, s, u));
 #   endif
 
-    for(it=0; it<27*nit; it++)
+    relax_sched_init(&sc, dm[2], 3, 9, 2, 27*nit, (double)dm[0]*dm[1]*sizeof(float)*(a ? 12 : 6));
+    for(stage=0; stage<sc.nstages; stage++)
     {
-        mwSignedIndex i, j, k;
-        for(k=(it/9)%3; k<dm[2]; k+=3)
+        mwSignedIndex n, nn = relax_sched_size(&sc, stage);
+
+        /* Updates within a stage are independent (see shoot_relax.c) */
+        #pragma omp parallel for schedule(static) if(nn>1) private(it)
+        for(n=0; n<nn; n++)
         {
+            mwSignedIndex i, j, k;
             mwSignedIndex km2, km1, kp1, kp2;
+            if (!relax_sched_item(&sc, stage, n, &it, &k)) continue;
+
             km2 = (bound(k-2,dm[2])-k)*dm[0]*dm[1];
             km1 = (bound(k-1,dm[2])-k)*dm[0]*dm[1];
             kp1 = (bound(k+1,dm[2])-k)*dm[0]*dm[1];
@@ -1477,11 +1512,10 @@ void relax_all(mwSize dm[], float a[], float b[], double s[], int nit, float u[]
                 }
             }
         }
-#       ifdef VERBOSE
-        if ((it%27) == 26)
-            printf(" %g", sumsq(dm, a, b, s, u));
-#       endif
     }
+#   ifdef VERBOSE
+        printf(" %g", sumsq(dm, a, b, s, u));
+#   endif
 #   ifdef VERBOSE
         printf("\n");
 #   endif
@@ -0,0 +1,116 @@
+/* $Id$ */
+
+/*
+ * Scheduling of the multi-colour relaxation sweeps (relax_le etc).
+ *
+ * Each sweep consists of a number of colour passes, where pass "it" updates
+ * some of the points in planes (it/kdiv)%st, +st, +2*st, ... of the volume.
+ * The updates are divided into stages, where the (pass,plane) updates within
+ * a stage do not depend on each other, and can be done in parallel.  The
+ * results are identical to those of doing the passes one after the other,
+ * with planes updated in increasing order.
+ *
+ * For small volumes, each pass has two stages.  The first updates all the
+ * planes that do not depend on each other, and the second updates the plane
+ * (if any) that can depend on planes at the start of the volume through the
+ * circulant boundary (see bound_tail).
+ *
+ * For volumes that are too big to fit in cache, the passes are done in
+ * blocks of nb, as a wavefront.  Plane k of pass it (counted from the start
+ * of the block) is updated at time f(k) + (2*r+2)*it, where
+ *     f(k) = 2*k             for k <= h
+ *     f(k) = 2*(m-k)+1       for k >  h,    h = (m-1)/2
+ * so that the wave starts from the first plane and moves outwards in both
+ * directions (which deals with circulant boundaries).  Planes within r of
+ * each other differ in time by at most 2*r+1, so a pass only updates a plane
+ * after the previous pass has updated all planes that it depends on, and
+ * before the next pass updates any of them.  The data for each plane are
+ * therefore used by a number of passes while they are still in cache, rather
+ * than being read from memory by each pass.
+ */
+
+#include "mex.h"
+#include "shoot_boundary.h"
+#include "shoot_relax.h"
+
+void relax_sched_init(RELAX_SCHED *s, mwSize m, int st, int kdiv, int r, int npass,
+                      double plane_bytes)
+{
+    double nb;
+
+    s->m     = m;
+    s->npass = npass;
+    s->st    = st;
+    s->kdiv  = kdiv;
+    s->r     = r;
+    s->nb    = 0;
+
+    nb = 1.0 + RELAX_CACHE_BYTES/(2.0*(r+1)*plane_bytes);
+    if (npass>1 && m>=4*(r+1) && plane_bytes*m>RELAX_CACHE_BYTES && nb>=2.0)
+    {
+        mwSignedIndex h = (m-1)/2, nlast;
+        s->nb      = (nb<npass) ? (int)nb : npass;
+        s->fmax    = (2*h > 2*(s->m-h-1)+1) ? 2*h : 2*(s->m-h-1)+1;
+        s->nsb     = s->fmax + (2*r+2)*(s->nb-1) + 1;
+        nlast      = npass - ((npass-1)/s->nb)*s->nb;
+        s->nstages = ((npass-1)/s->nb)*s->nsb + s->fmax + (2*r+2)*(nlast-1) + 1;
+    }
+    else
+        s->nstages = 2*(mwSignedIndex)npass;
+}
+
+/* Number of (pass,plane) updates in a stage, some of which may be empty */
+mwSignedIndex relax_sched_size(const RELAX_SCHED *s, mwSignedIndex stage)
+{
+    if (s->nb)
+    {
+        mwSignedIndex b = stage/s->nsb;
+        return((s->npass - b*s->nb < s->nb) ? s->npass - b*s->nb : s->nb);
+    }
+    else
+    {
+        int it = (int)(stage/2);
+        mwSignedIndex k0 = (it/s->kdiv)%s->st, kt;
+        kt = bound_tail(k0, s->st, s->r, s->m);
+        if (stage&1)
+            return((kt<s->m) ? 1 : 0);
+        else
+            return((kt-k0+s->st-1)/s->st);
+    }
+}
+
+/* The n'th update of a stage.  Returns 0 if it is empty. */
+int relax_sched_item(const RELAX_SCHED *s, mwSignedIndex stage, mwSignedIndex n,
+                     int *it, mwSignedIndex *k)
+{
+    mwSignedIndex k0;
+    if (s->nb)
+    {
+        mwSignedIndex b = stage/s->nsb, g = stage%s->nsb - (2*s->r+2)*n, h = (s->m-1)/2;
+
+        if (g<0 || g>s->fmax) return(0);
+        if (g&1)
+        {
+            *k = s->m-(g-1)/2;
+            if (*k<=h || *k>=s->m) return(0);
+        }
+        else
+        {
+            *k = g/2;
+            if (*k>h) return(0);
+        }
+        *it = (int)(b*s->nb + n);
+        k0  = (*it/s->kdiv)%s->st;
+        return((*k%s->st)==k0);
+    }
+    else
+    {
+        *it = (int)(stage/2);
+        k0  = (*it/s->kdiv)%s->st;
+        if (stage&1)
+            *k = bound_tail(k0, s->st, s->r, s->m);
+        else
+            *k = k0 + n*s->st;
+        return(1);
+    }
+}
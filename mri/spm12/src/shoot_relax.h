@@ -0,0 +1,26 @@
+/* $Id$ */
+
+/* Approximate amount of data that a wavefront of relaxation sweeps should
+   keep in cache */
+#ifndef RELAX_CACHE_BYTES
+#define RELAX_CACHE_BYTES (8*1024*1024)
+#endif
+
+typedef struct
+{
+    mwSignedIndex m;     /* Number of planes */
+    int npass;           /* Total number of colour passes */
+    int st;              /* Planes of pass it are (it/kdiv)%st, +st, +2*st, ... */
+    int kdiv;
+    int r;               /* Radius of stencil (r<=st) */
+    int nb;              /* Passes per wavefront block (0 for no wavefront) */
+    mwSignedIndex fmax;  /* Largest time of a plane within a wavefront */
+    mwSignedIndex nsb;   /* Number of stages per (full) wavefront block */
+    mwSignedIndex nstages;
+} RELAX_SCHED;
+
+extern void relax_sched_init(RELAX_SCHED *s, mwSize m, int st, int kdiv, int r, int npass,
+                             double plane_bytes);
+extern mwSignedIndex relax_sched_size(const RELAX_SCHED *s, mwSignedIndex stage);
+extern int relax_sched_item(const RELAX_SCHED *s, mwSignedIndex stage, mwSignedIndex n,
+                            int *it, mwSignedIndex *k);
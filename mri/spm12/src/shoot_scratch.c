@@ -0,0 +1,166 @@
+/* $Id$ */
+
+/*
+ * Scratch memory that persists between calls of a MEX file.
+ *
+ * The multigrid solvers etc need large amounts of scratch space, which used
+ * to be allocated and freed again by every call.  When the same routines are
+ * called many times with data of the same size (e.g. the Gauss-Newton
+ * iterations of a template building procedure), this repeatedly faults in
+ * hundreds of MB of fresh pages.  Instead, the buffers are kept after they
+ * are returned by scratch_put, and are handed out again by scratch_get to
+ * any later request that they are big enough for.
+ *
+ * The buffers that are not in use are freed by scratch_release (e.g. via
+ * spm_diffeo('release') or spm_field('release')).  All of them, whether in
+ * use or not, are freed by scratch_free_all.  A MEX file can only have one
+ * exit handler, so this module does not register one itself.  Instead, the
+ * handler that each MEX file registers with mexAtExit must call
+ * scratch_free_all, so that the buffers are freed when the MEX file is
+ * cleared from memory.
+ *
+ * If compiled with -DSCRATCH_HUGEPAGES on Linux, the buffers are aligned
+ * to 2MB and the kernel is advised to back them with transparent huge pages,
+ * which reduces TLB misses when sweeping through large volumes.
+ */
+
+#include "mex.h"
+#include <string.h>
+#include "shoot_scratch.h"
+
+#if defined(SCRATCH_HUGEPAGES) && defined(__linux__)
+#include <stdlib.h>
+#include <sys/mman.h>
+#define HUGEPAGE_BYTES (2*1024*1024)
+#endif
+
+typedef struct
+{
+    float *p;
+    mwSize n;   /* Capacity (number of floats) */
+    int inuse;
+} SCRATCH_BLOCK;
+
+static SCRATCH_BLOCK blocks[SCRATCH_MAXBLOCKS];
+
+static float *block_alloc(mwSize n)
+{
+    float *p;
+#if defined(SCRATCH_HUGEPAGES) && defined(__linux__)
+    size_t nbytes = ((n*sizeof(float)+HUGEPAGE_BYTES-1)/HUGEPAGE_BYTES)*HUGEPAGE_BYTES;
+    void *vp = 0;
+    if (posix_memalign(&vp, HUGEPAGE_BYTES, nbytes))
+        mexErrMsgTxt("Out of memory.");
+#ifdef MADV_HUGEPAGE
+    (void)madvise(vp, nbytes, MADV_HUGEPAGE);
+#endif
+    p = (float *)vp;
+#else
+    p = (float *)mxMalloc(n*sizeof(float));
+    mexMakeMemoryPersistent((void *)p);
+#endif
+    return(p);
+}
+
+static void block_free(float *p)
+{
+#if defined(SCRATCH_HUGEPAGES) && defined(__linux__)
+    free((void *)p);
+#else
+    mxFree((void *)p);
+#endif
+}
+
+/* Free all the buffers, including any left marked as in use by an error.
+   To be called by the exit handler of the MEX file. */
+void scratch_free_all(void)
+{
+    int i;
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+    {
+        if (blocks[i].p) block_free(blocks[i].p);
+        blocks[i].p     = 0;
+        blocks[i].n     = 0;
+        blocks[i].inuse = 0;
+    }
+}
+
+/* Zero filled scratch space for n floats (as mxCalloc).  The smallest free
+   buffer that is big enough is used.  If there is none, the largest free
+   buffer (if any) is replaced by a new one of the required size. */
+float *scratch_get(mwSize n)
+{
+    int i, j = -1, k = -1;
+
+    if (n==0) n = 1;
+
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+    {
+        if (blocks[i].inuse) continue;
+        if (blocks[i].n>=n && (j<0 || blocks[i].n<blocks[j].n)) j = i;
+        if (k<0 || blocks[i].n>blocks[k].n) k = i;
+    }
+    if (j<0)
+    {
+        if (k<0)
+            mexErrMsgTxt("Too many scratch buffers in use.");
+        if (blocks[k].p) block_free(blocks[k].p);
+        blocks[k].p = 0;
+        blocks[k].n = 0;
+        blocks[k].p = block_alloc(n);
+        blocks[k].n = n;
+        j = k;
+    }
+    blocks[j].inuse = 1;
+    memset((void *)blocks[j].p, 0, n*sizeof(float));
+    return(blocks[j].p);
+}
+
+/* Return a buffer obtained from scratch_get, so that it can be reused */
+void scratch_put(float *p)
+{
+    int i;
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+        if (blocks[i].p==p)
+        {
+            blocks[i].inuse = 0;
+            return;
+        }
+}
+
+/* Mark all buffers as free.  This is called at the start of each call of
+   the MEX file, in case an error in the previous call prevented some from
+   being returned. */
+void scratch_reset(void)
+{
+    int i;
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+        blocks[i].inuse = 0;
+}
+
+/* Free all the buffers that are not in use */
+void scratch_release(void)
+{
+    int i;
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+    {
+        if (blocks[i].inuse || !blocks[i].p) continue;
+        block_free(blocks[i].p);
+        blocks[i].p = 0;
+        blocks[i].n = 0;
+    }
+}
+
+/* Number of buffers currently held, and their total size in bytes */
+void scratch_usage(mwSize *nblocks, double *bytes)
+{
+    int i;
+    *nblocks = 0;
+    *bytes   = 0.0;
+    for(i=0; i<SCRATCH_MAXBLOCKS; i++)
+    {
+        if (!blocks[i].p) continue;
+        (*nblocks)++;
+        *bytes += (double)blocks[i].n*sizeof(float);
+    }
+}
@@ -0,0 +1,13 @@
+/* $Id$ */
+
+/* Maximum number of scratch buffers held at any one time */
+#ifndef SCRATCH_MAXBLOCKS
+#define SCRATCH_MAXBLOCKS 8
+#endif
+
+extern float *scratch_get(mwSize n);
+extern void   scratch_put(float *p);
+extern void   scratch_reset(void);
+extern void   scratch_release(void);
+extern void   scratch_free_all(void);
+extern void   scratch_usage(mwSize *nblocks, double *bytes);
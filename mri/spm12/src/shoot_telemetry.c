@@ -0,0 +1,202 @@
+/* $Id$ */
+
+/*
+ * Telemetry of the solvers.
+ *
+ * When enabled (e.g. by spm_diffeo('telemetry',1)), the multigrid and
+ * conjugate gradient solvers and the Dartel iterations record what they
+ * did during each call of the MEX file: the number of relaxation sweeps
+ * and the time spent at each grid, the time taken by the restriction and
+ * prolongation operations, the residual norms at each grid of every
+ * V-cycle, the time of each V-cycle, the residual norms of conjugate
+ * gradient iterations, and the terms of the objective function.  The
+ * records of the most recent call are returned by tele_struct.
+ *
+ * Calls made from within parallel regions (e.g. the subjects of
+ * 'dartel_batch') are not recorded.  The solvers test tele_active before
+ * doing any extra work for the records, so when telemetry is disabled, or
+ * nothing would be recorded, that test is the only cost.
+ */
+
+/* For clock_gettime, when compiled as strict ISO C */
+#if !defined(_OPENMP) && defined(__linux__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include "mex.h"
+#include <math.h>
+#include <time.h>
+#if !defined(_OPENMP) && defined(SPM_WIN32)
+#include <windows.h>
+#endif
+#include "shoot_telemetry.h"
+#include "spm_openmp.h"
+
+int tele_on = 0;
+
+static double t_start, t_total;
+static mwSignedIndex ngrids;
+static double grids[TELEMETRY_MAXGRIDS][3];
+static double sweeps[TELEMETRY_MAXGRIDS], ttrans[3][TELEMETRY_MAXGRIDS];
+static double resid[TELEMETRY_MAXREC][3], cycles[TELEMETRY_MAXREC][3];
+static double cg[TELEMETRY_MAXREC], objective[TELEMETRY_MAXREC][3];
+static mwSize nresid, ncycles, ncg, nobjective;
+
+/* Wall time (seconds) from some arbitrary starting point */
+double tele_clock(void)
+{
+#if defined(_OPENMP)
+    return(omp_get_wtime());
+#elif defined(SPM_WIN32)
+    LARGE_INTEGER t, f;
+    QueryPerformanceCounter(&t);
+    QueryPerformanceFrequency(&f);
+    return((double)t.QuadPart/(double)f.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return((double)t.tv_sec + 1e-9*t.tv_nsec);
+#else
+    return((double)time(NULL));
+#endif
+}
+
+/* Non-zero if records made now would be kept */
+int tele_active(void)
+{
+    return(tele_on && !omp_in_parallel());
+}
+
+void tele_enable(int on)
+{
+    tele_on = on;
+    tele_reset();
+}
+
+void tele_reset(void)
+{
+    mwSignedIndex j;
+    ngrids  = 0;
+    nresid  = 0;
+    ncycles = 0;
+    ncg     = 0;
+    nobjective = 0;
+    for(j=0; j<TELEMETRY_MAXGRIDS; j++)
+    {
+        sweeps[j]    = 0.0;
+        ttrans[0][j] = 0.0;
+        ttrans[1][j] = 0.0;
+        ttrans[2][j] = 0.0;
+    }
+    t_start = tele_clock();
+    t_total = 0.0;
+}
+
+/* Called at the end of each call of the MEX file */
+void tele_finish(void)
+{
+    t_total = tele_clock()-t_start;
+}
+
+/* Don't record from within parallel regions or beyond the end of the tables */
+#define RECORD(j) (tele_active() && (j)>=0 && (j)<TELEMETRY_MAXGRIDS)
+
+double tele_norm(mwSize n, float a[])
+{
+    mwSize i;
+    double ss = 0.0;
+    for(i=0; i<n; i++)
+        ss += (double)a[i]*a[i];
+    return(sqrt(ss));
+}
+
+void tele_grid(mwSignedIndex j, mwSize dm[])
+{
+    if (!RECORD(j)) return;
+    grids[j][0] = dm[0];
+    grids[j][1] = dm[1];
+    grids[j][2] = dm[2];
+    if (j>=ngrids) ngrids = j+1;
+}
+
+void tele_sweeps(mwSignedIndex j, int nit, double t)
+{
+    if (!RECORD(j)) return;
+    sweeps[j]        += nit;
+    ttrans[TELE_RELAX][j] += t;
+}
+
+void tele_transfer(mwSignedIndex j, int kind, double t)
+{
+    if (!RECORD(j)) return;
+    ttrans[kind][j] += t;
+}
+
+void tele_residual(mwSignedIndex j, double r)
+{
+    if (!RECORD(j) || nresid>=TELEMETRY_MAXREC) return;
+    resid[nresid][0] = ncycles+1;
+    resid[nresid][1] = j+1;
+    resid[nresid][2] = r;
+    nresid++;
+}
+
+void tele_cycle(mwSignedIndex j, double t, double r)
+{
+    if (!RECORD(j) || ncycles>=TELEMETRY_MAXREC) return;
+    cycles[ncycles][0] = j+1;
+    cycles[ncycles][1] = t;
+    cycles[ncycles][2] = r;
+    ncycles++;
+}
+
+void tele_cg(double r)
+{
+    if (!RECORD(0) || ncg>=TELEMETRY_MAXREC) return;
+    cg[ncg++] = r;
+}
+
+void tele_objective(double ll[])
+{
+    if (!RECORD(0) || nobjective>=TELEMETRY_MAXREC) return;
+    objective[nobjective][0] = ll[0];
+    objective[nobjective][1] = ll[1];
+    objective[nobjective][2] = ll[2];
+    nobjective++;
+}
+
+/* Copy n rows of a table with nc columns into a MATLAB array */
+static mxArray *table(mwSize n, mwSize nc, double *t)
+{
+    mxArray *arr = mxCreateDoubleMatrix(n, nc, mxREAL);
+    double *pr = mxGetPr(arr);
+    mwSize i, c;
+    for(i=0; i<n; i++)
+        for(c=0; c<nc; c++)
+            pr[i+n*c] = t[c+nc*i];
+    return(arr);
+}
+
+mxArray *tele_struct(void)
+{
+    const char *fnames[] = {"time", "grids", "sweeps", "relax_time", "restrict_time",
+                            "prolong_time", "cycles", "residuals", "cg", "objective"};
+    mxArray *s = mxCreateStructMatrix(1, 1, 10, fnames);
+    double tt[TELEMETRY_MAXGRIDS];
+    mwSignedIndex j;
+
+    mxSetField(s, 0, "time",   mxCreateDoubleScalar(t_total));
+    mxSetField(s, 0, "grids",  table(ngrids, 3, &grids[0][0]));
+    mxSetField(s, 0, "sweeps", table(ngrids, 1, sweeps));
+    for(j=0; j<ngrids; j++) tt[j] = ttrans[TELE_RELAX][j];
+    mxSetField(s, 0, "relax_time",    table(ngrids, 1, tt));
+    for(j=0; j<ngrids; j++) tt[j] = ttrans[TELE_RESTRICT][j];
+    mxSetField(s, 0, "restrict_time", table(ngrids, 1, tt));
+    for(j=0; j<ngrids; j++) tt[j] = ttrans[TELE_PROLONG][j];
+    mxSetField(s, 0, "prolong_time",  table(ngrids, 1, tt));
+    mxSetField(s, 0, "cycles",    table(ncycles, 3, &cycles[0][0]));
+    mxSetField(s, 0, "residuals", table(nresid, 3, &resid[0][0]));
+    mxSetField(s, 0, "cg",        table(ncg, 1, cg));
+    mxSetField(s, 0, "objective", table(nobjective, 3, &objective[0][0]));
+    return(s);
+}
@@ -0,0 +1,29 @@
+/* $Id$ */
+
+/* Maximum number of records of each kind */
+#ifndef TELEMETRY_MAXREC
+#define TELEMETRY_MAXREC 4096
+#endif
+
+/* Maximum number of grids */
+#define TELEMETRY_MAXGRIDS 32
+
+#define TELE_RESTRICT 0
+#define TELE_PROLONG  1
+#define TELE_RELAX    2
+
+extern int     tele_on;
+extern int     tele_active(void);
+extern void    tele_enable(int on);
+extern void    tele_reset(void);
+extern void    tele_finish(void);
+extern double  tele_clock(void);
+extern double  tele_norm(mwSize n, float a[]);
+extern void    tele_grid(mwSignedIndex j, mwSize dm[]);
+extern void    tele_sweeps(mwSignedIndex j, int nit, double t);
+extern void    tele_transfer(mwSignedIndex j, int kind, double t);
+extern void    tele_residual(mwSignedIndex j, double r);
+extern void    tele_cycle(mwSignedIndex j, double t, double r);
+extern void    tele_cg(double r);
+extern void    tele_objective(double ll[]);
+extern mxArray *tele_struct(void);
@@ -23,35 +23,47 @@
 #include <math.h>
 #include "mex.h"
 #include "bsplines.h"
+#include "spm_openmp.h"
 
 /***************************************************************************************
 Loop through data and resample the points
     c   - Volume of B-spline coefficients
+    single - non-zero if c is single precision (otherwise double)
     m0,m1,m2    - dimensions of c
+    nv  - number of volumes of coefficients
     n   - number of points to resample
     x0,x1,x2    - array of co-ordinate to sample
     d   - degree of spline used
     cond    - code determining boundaries to mask at
     bnd - functions for dealing with edges
-    f   - resampled data
+    f   - resampled data (n*nv)
 */
 #define TINY 5e-2
 
-static void fun(double c[], int m0, int m1, int m2,
+static void fun(void *c, int single, int m0, int m1, int m2, int nv,
     int n, double x0[], double x1[], double x2[], int d[],
     int cond, int (*bnd[])(), double f[])
 {
-    int j;
+    int j, v;
     double NaN = mxGetNaN();
 
+    #pragma omp parallel for schedule(static) private(v)
     for(j=0; j<n; j++)
     {
         if (((cond&1) | (x0[j]>=1-TINY && x0[j]<=m0+TINY)) &&
             ((cond&2) | (x1[j]>=1-TINY && x1[j]<=m1+TINY)) &&
             ((cond&4) | (x2[j]>=1-TINY && x2[j]<=m2+TINY)))
-            f[j] = sample3(c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d, bnd);
+        {
+            if (nv!=1)
+                sample3n(c, single, m0,m1,m2, nv, x0[j]-1,x1[j]-1,x2[j]-1, d, bnd,
+                    &f[j], (mwSize)n);
+            else if (single)
+                f[j] = sample3f((float *)c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d, bnd);
+            else
+                f[j] = sample3((double *)c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d, bnd);
+        }
         else
-            f[j] = NaN;
+            for(v=0; v<nv; v++) f[j+v*(mwSize)n] = NaN;
     }
 }
 
@@ -59,32 +71,44 @@ static void fun(double c[], int m0, int m1, int m2,
 /***************************************************************************************
 Loop through data and resample the points and their derivatives
     c   - Volume of B-spline coefficients
+    single - non-zero if c is single precision (otherwise double)
     m0,m1,m2    - dimensions of c
+    nv  - number of volumes of coefficients
     n   - number of points to resample
     x0,x1,x2    - array of co-ordinate to sample
     d   - degrees of splines used
     cond    - code determining boundaries to mask at
     bnd - functions for dealing with edges
-    f   - resampled data
-    df0, df1, df2   - gradients
+    f   - resampled data (n*nv)
+    df0, df1, df2   - gradients (n*nv)
 */
-static void dfun(double c[], int m0, int m1, int m2,
+static void dfun(void *c, int single, int m0, int m1, int m2, int nv,
     int n, double x0[], double x1[], double x2[],int d[],
     int cond, int (*bnd[])(),
     double f[], double df0[], double df1[], double df2[])
 {
-    int j;
+    int j, v;
     double NaN = mxGetNaN();
 
+    #pragma omp parallel for schedule(static) private(v)
     for(j=0; j<n; j++)
     {
         if (((cond&1) | (x0[j]>=1-TINY && x0[j]<=m0+TINY)) &&
             ((cond&2) | (x1[j]>=1-TINY && x1[j]<=m1+TINY)) &&
             ((cond&4) | (x2[j]>=1-TINY && x2[j]<=m2+TINY)))
-            f[j] = dsample3(c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d,
-                &df0[j],&df1[j],&df2[j], bnd);
+        {
+            if (nv!=1)
+                dsample3n(c, single, m0,m1,m2, nv, x0[j]-1,x1[j]-1,x2[j]-1, d, bnd,
+                    &f[j],&df0[j],&df1[j],&df2[j], (mwSize)n);
+            else if (single)
+                f[j] = dsample3f((float *)c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d,
+                    &df0[j],&df1[j],&df2[j], bnd);
+            else
+                f[j] = dsample3((double *)c, m0,m1,m2, x0[j]-1,x1[j]-1,x2[j]-1, d,
+                    &df0[j],&df1[j],&df2[j], bnd);
+        }
         else
-            f[j] = NaN;
+            for(v=0; v<nv; v++) f[j+v*(mwSize)n] = NaN;
     }
 }
 
@@ -92,16 +116,19 @@ static void dfun(double c[], int m0, int m1, int m2,
 /***************************************************************************************/
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
-    int k, d[3], n, nd;
-    int m0=1, m1=1, m2=1;
-    double *x0, *x1, *x2, *c, *f, *df0, *df1, *df2;
+    int k, d[3], n, nd, single;
+    int m0=1, m1=1, m2=1, nv=1;
+    mwSize odims[32];
+    double *x0, *x1, *x2, *f, *df0, *df1, *df2;
+    void *c;
     const mwSize *dims;
     int (*bnd[3])();
     int cond;
 
     /* Usage:
             f = function(c,x0,x1,x2,d)
-                c - B-spline coefficients
+                c - B-spline coefficients (double or single),
+                    possibly 4D for a batch of volumes
                 x0, x1, x2 - co-ordinates
                 d   - B-spline degree
                 f   - sampled function
@@ -116,7 +143,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     if (nrhs < 5 || nlhs>4)
         mexErrMsgTxt("Incorrect usage.");
 
-    for(k=0; k<5; k++)
+    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) ||
+        mxIsSparse(prhs[0]) || !(mxIsDouble(prhs[0]) || mxIsSingle(prhs[0])))
+        mexErrMsgTxt("Coefficients must be numeric, real, full and double or single precision.");
+    single = mxIsSingle(prhs[0]);
+
+    for(k=1; k<5; k++)
     {
         if (!mxIsNumeric(prhs[k]) || mxIsComplex(prhs[k]) ||
             mxIsSparse(prhs[k]) || !mxIsDouble(prhs[k]))
@@ -151,11 +183,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     /* Dimensions of coefficient volume */
     nd = mxGetNumberOfDimensions(prhs[0]);
-    if (nd>3) mexErrMsgTxt("Too many coefficient dimensions.");
+    if (nd>4) mexErrMsgTxt("Too many coefficient dimensions.");
     dims = mxGetDimensions(prhs[0]);
     if (nd>=1) m0 = dims[0];
     if (nd>=2) m1 = dims[1];
     if (nd>=3) m2 = dims[2];
+    if (nd>=4) nv = dims[3];
 
     /* Dimensions of sampling co-ordinates */
     nd = mxGetNumberOfDimensions(prhs[1]);
@@ -170,18 +203,27 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         n *=dims[k];
     }
 
-    /* Sampled data same size as sampling co-ords */
+    /* Sampled data same size as sampling co-ords, with an extra dimension
+       for each volume when sampling a batch */
+    if (nd>31) mexErrMsgTxt("Too many dimensions.");
+    for(k=0; k<nd; k++) odims[k] = dims[k];
+    if (nv!=1)
+    {
+        while(nd>1 && odims[nd-1]==1) nd--;
+        odims[nd++] = nv;
+    }
+    dims = odims;
     plhs[0] = mxCreateNumericArray(nd,dims, mxDOUBLE_CLASS, mxREAL);
 
-    /* Pointers to double precision data */
-    c  = mxGetPr(prhs[0]);
+    /* Pointers to coefficients and double precision data */
+    c  = mxGetData(prhs[0]);
     x0 = mxGetPr(prhs[1]);
     x1 = mxGetPr(prhs[2]);
     x2 = mxGetPr(prhs[3]);
     f  = mxGetPr(plhs[0]);
 
     if (nlhs<=1)
-        fun(c, m0,m1,m2, n, x0,x1,x2, d, cond,bnd, f);
+        fun(c, single, m0,m1,m2, nv, n, x0,x1,x2, d, cond,bnd, f);
     else
     {
         plhs[1] = mxCreateNumericArray(nd,dims, mxDOUBLE_CLASS, mxREAL);
@@ -190,6 +232,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         df0 = mxGetPr(plhs[1]);
         df1 = mxGetPr(plhs[2]);
         df2 = mxGetPr(plhs[3]);
-        dfun(c, m0,m1,m2, n, x0,x1,x2, d, cond,bnd, f,df0,df1,df2);
+        dfun(c, single, m0,m1,m2, nv, n, x0,x1,x2, d, cond,bnd, f,df0,df1,df2);
     }
 }
@@ -3,13 +3,19 @@
 
 #include "mex.h"
 #include <math.h>
+#include <stdio.h>
 #include "shoot_optim3d.h"
+#include "shoot_farray.h"
+#include "shoot_half.h"
 #include "shoot_diffeo3d.h"
 #include "shoot_multiscale.h"
 #include "shoot_regularisers.h"
 #include "shoot_dartel.h"
 #include "shoot_bsplines.h"
 #include "shoot_boundary.h"
+#include "shoot_scratch.h"
+#include "shoot_greens.h"
+#include "shoot_telemetry.h"
 
 static void boundary_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
@@ -27,10 +33,115 @@ static void boundary_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxAr
     }
 }
 
+static void halfformat_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if ((nlhs<=1) && (nrhs==0))
+        plhs[0] = mxCreateDoubleScalar((double)get_half());
+    else if ((nrhs==1) && (nlhs==0))
+    {
+        if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsDouble(prhs[0]))
+            mexErrMsgTxt("Data must be numeric, real, full and double");
+        set_half((int)mxGetPr(prhs[0])[0]);
+    }
+    else
+        mexErrMsgTxt("Incorrect usage.");
+}
+
+/* Conversion between single and uint16 (half precision) arrays.  If isdef is
+   non-zero, the arrays are deformations, and the uint16 arrays hold
+   displacements from the identity. */
+static void half_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[], int pack)
+{
+    mwSize mm, i, n;
+    const mwSize *dm;
+    int isdef = 0;
+
+    if ((nrhs!=1 && nrhs!=2) || nlhs>1)
+        mexErrMsgTxt("Incorrect usage");
+    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) ||
+        (pack ? !mxIsSingle(prhs[0]) : !mxIsUint16(prhs[0])))
+        mexErrMsgTxt(pack ? "Data must be numeric, real, full and single" :
+                            "Data must be numeric, real, full and uint16");
+    if (nrhs==2) isdef = (mxGetScalar(prhs[1])!=0.0);
+
+    dm = mxGetDimensions(prhs[0]);
+    n  = mxGetNumberOfElements(prhs[0]);
+    plhs[0] = mxCreateNumericArray(mxGetNumberOfDimensions(prhs[0]), dm,
+                                   pack ? mxUINT16_CLASS : mxSINGLE_CLASS, mxREAL);
+    if (isdef)
+    {
+        mwSize d[3];
+        if (mxGetNumberOfDimensions(prhs[0])!=4 || dm[3]!=3)
+            mexErrMsgTxt("Deformations must be 4D, with the 4th dimension 3.");
+        d[0] = dm[0];
+        d[1] = dm[1];
+        d[2] = dm[2];
+        mm   = d[0]*d[1];
+        for(i=0; i<d[2]; i++)
+        {
+            if (pack)
+            {
+                float *y = (float *)mxGetData(prhs[0]);
+                half_encode_def(d, i*mm, mm, y+i*mm, y+(i+d[2])*mm, y+(i+2*d[2])*mm,
+                                (HALF *)mxGetData(plhs[0]));
+            }
+            else
+            {
+                float *y = (float *)mxGetData(plhs[0]);
+                half_decode_def(d, i*mm, mm, (HALF *)mxGetData(prhs[0]), half_lut(),
+                                y+i*mm, y+(i+d[2])*mm, y+(i+2*d[2])*mm);
+            }
+        }
+    }
+    else if (pack)
+        half_encode((float *)mxGetData(prhs[0]), n, (HALF *)mxGetData(plhs[0]));
+    else
+        half_decode((HALF *)mxGetData(prhs[0]), n, half_lut(), (float *)mxGetData(plhs[0]));
+}
+
+static void release_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if ((nrhs!=0) || (nlhs!=0))
+        mexErrMsgTxt("Incorrect usage.");
+    scratch_release();
+    greens_release();
+}
+
+static void telemetry_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if ((nrhs==1) && (nlhs==0))
+    {
+        if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsDouble(prhs[0]))
+            mexErrMsgTxt("Data must be numeric, real, full and double");
+        tele_enable(mxGetPr(prhs[0])[0]!=0.0);
+    }
+    else if ((nrhs==0) && (nlhs<=1))
+        plhs[0] = tele_struct();
+    else
+        mexErrMsgTxt("Incorrect usage.");
+}
+
+static void memory_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    mwSize nblocks;
+    double bytes;
+    if ((nrhs!=0) || (nlhs>2))
+        mexErrMsgTxt("Incorrect usage.");
+    scratch_usage(&nblocks, &bytes);
+    if (greens_bytes()>0)
+    {
+        bytes += greens_bytes();
+        nblocks++;
+    }
+    plhs[0] = mxCreateDoubleScalar(bytes);
+    if (nlhs>1)
+        plhs[1] = mxCreateDoubleScalar((double)nblocks);
+}
+
 static void cgs3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     const mwSize *dm;
-    int          nit=1;
+    int          nit=1, pc=0, its=2;
     double       tol=1e-10;
     float        *A, *b, *x, *scratch1, *scratch2, *scratch3;
     static double param[] = {1.0, 1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0};
@@ -54,13 +165,13 @@ static void cgs3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
         mexErrMsgTxt("Incompatible 1st dimension.");
     if (mxGetDimensions(prhs[0])[1] != dm[1])
         mexErrMsgTxt("Incompatible 2nd dimension.");
-    if (mxGetDimensions(prhs[0])[2] != dm[1])
+    if (mxGetDimensions(prhs[0])[2] != dm[2])
         mexErrMsgTxt("Incompatible 3rd dimension.");
 
     if (!mxIsNumeric(prhs[2]) || mxIsComplex(prhs[2]) || mxIsSparse(prhs[2]) || !mxIsDouble(prhs[2]))
         mexErrMsgTxt("Data must be numeric, real, full and double");
-    if (mxGetNumberOfElements(prhs[2]) != 10)
-        mexErrMsgTxt("Third argument should contain vox1, vox2, vox3, param1, param2, param3, param4, param5, tol and nit.");
+    if (mxGetNumberOfElements(prhs[2]) != 10 && mxGetNumberOfElements(prhs[2]) != 12)
+        mexErrMsgTxt("Third argument should contain vox1, vox2, vox3, param1, param2, param3, param4, param5, tol and nit (and optionally pc and its).");
 
     param[0] = 1/mxGetPr(prhs[2])[0];
     param[1] = 1/mxGetPr(prhs[2])[1];
@@ -73,6 +184,12 @@ static void cgs3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
 
     tol      = mxGetPr(prhs[2])[8];
     nit      = (int)(mxGetPr(prhs[2])[9]);
+    if (mxGetNumberOfElements(prhs[2]) == 12)
+    {
+        pc   = (int)(mxGetPr(prhs[2])[10]);
+        its  = (int)(mxGetPr(prhs[2])[11]);
+        if (pc<0 || pc>2) mexErrMsgTxt("Unknown preconditioner.");
+    }
 
     plhs[0] = mxCreateNumericArray(4,dm, mxSINGLE_CLASS, mxREAL);
 
@@ -80,15 +197,23 @@ static void cgs3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     b       = (float *)mxGetPr(prhs[1]);
     x       = (float *)mxGetPr(plhs[0]);
 
-    scratch1 = (float *)mxCalloc(dm[0]*dm[1]*dm[2]*3,sizeof(float));
-    scratch2 = (float *)mxCalloc(dm[0]*dm[1]*dm[2]*3,sizeof(float));
-    scratch3 = (float *)mxCalloc(dm[0]*dm[1]*dm[2]*3,sizeof(float));
+    if (pc)
+    {
+        scratch1 = scratch_get(pcgs3_scratchsize((mwSize *)dm, pc));
+        (void)pcgs3((mwSize *)dm, A, b, param, tol, nit, pc, its, x, scratch1);
+        scratch_put(scratch1);
+        return;
+    }
+
+    scratch1 = scratch_get(dm[0]*dm[1]*dm[2]*3);
+    scratch2 = scratch_get(dm[0]*dm[1]*dm[2]*3);
+    scratch3 = scratch_get(dm[0]*dm[1]*dm[2]*3);
 
     cgs3((mwSize *)dm, A, b, param, tol, nit, x,scratch1,scratch2,scratch3);
 
-    mxFree((void *)scratch3);
-    mxFree((void *)scratch2);
-    mxFree((void *)scratch1);
+    scratch_put(scratch3);
+    scratch_put(scratch2);
+    scratch_put(scratch1);
 }
 
 static void fmg3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -184,9 +309,9 @@ static void fmg3_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
 
     A       = (float *)mxGetPr(prhs[0]);
     b       = (float *)mxGetPr(prhs[1]);
-    scratch = (float *)mxCalloc(fmg3_scratchsize((mwSize *)dm,1),sizeof(float));
+    scratch = scratch_get(fmg3_scratchsize((mwSize *)dm,1));
     fmg3((mwSize *)dm, A, b, param, cyc, nit, x, scratch);
-    mxFree((void *)scratch);
+    scratch_put(scratch);
 }
 
 static void fmg3_noa_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -251,9 +376,15 @@ static void fmg3_noa_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxAr
     }
 
     b       = (float *)mxGetPr(prhs[0]);
-    scratch = (float *)mxCalloc(fmg3_scratchsize((mwSize *)dm,0),sizeof(float));
+    if (get_bound()==BOUND_CIRCULANT)
+    {
+        /* Exact solution by Fourier methods, so no need for multigrid */
+        greens_mom2vel((mwSize *)dm, param, b, x);
+        return;
+    }
+    scratch = scratch_get(fmg3_scratchsize((mwSize *)dm,0));
     fmg3((mwSize *)dm, 0, b, param, cyc, nit, x, scratch);
-    mxFree((void *)scratch);
+    scratch_put(scratch);
 }
 
 static void kernel_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -375,8 +506,9 @@ static void vel2mom_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArr
 
     if (nrhs!=2 || nlhs>1)
         mexErrMsgTxt("Incorrect usage");
-    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsSingle(prhs[0]))
-        mexErrMsgTxt("Data must be numeric, real, full and single");
+    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) ||
+        !(mxIsSingle(prhs[0]) || mxIsUint16(prhs[0])))
+        mexErrMsgTxt("Data must be numeric, real, full and single (or uint16)");
     nd = mxGetNumberOfDimensions(prhs[0]);
     if (nd!=4) mexErrMsgTxt("Wrong number of dimensions.");
     dm = mxGetDimensions(prhs[0]);
@@ -394,9 +526,112 @@ static void vel2mom_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArr
     param[6] = mxGetPr(prhs[1])[6];
     param[7] = mxGetPr(prhs[1])[7];
 
-    plhs[0] = mxCreateNumericArray(nd,dm, mxSINGLE_CLASS, mxREAL);
+    plhs[0] = mxCreateNumericArray(nd,dm, mxGetClassID(prhs[0]), mxREAL);
 
-    vel2mom((mwSize *)dm, (float *)mxGetPr(prhs[0]), param, (float *)mxGetPr(plhs[0]));
+    if (mxIsUint16(prhs[0]))
+        vel2mom_half((mwSize *)dm, (HALF *)mxGetData(prhs[0]), param, (HALF *)mxGetData(plhs[0]));
+    else
+        vel2mom((mwSize *)dm, (float *)mxGetPr(prhs[0]), param, (float *)mxGetPr(plhs[0]));
+}
+
+/* Composition of two deformations held as uint16 (half precision) displacements */
+static void comp_half(int nlhs, mxArray *plhs[], const mxArray *prhs[])
+{
+    mwSize i, dm[3], dma[3];
+
+    for(i=0; i<2; i++)
+    {
+        if (mxIsComplex(prhs[i]) || mxIsSparse(prhs[i]))
+            mexErrMsgTxt("Data must be numeric, real, full and single (or both uint16)");
+        if (mxGetNumberOfDimensions(prhs[i])!=4 || mxGetDimensions(prhs[i])[3]!=3)
+            mexErrMsgTxt("Incompatible dimensions.");
+    }
+    for(i=0; i<3; i++)
+    {
+        dm[i]  = mxGetDimensions(prhs[0])[i];
+        dma[i] = mxGetDimensions(prhs[1])[i];
+    }
+    plhs[0] = mxCreateNumericArray(4,mxGetDimensions(prhs[1]), mxUINT16_CLASS, mxREAL);
+    composition_half(dm, (HALF *)mxGetData(prhs[0]), dma, (HALF *)mxGetData(prhs[1]),
+                     (HALF *)mxGetData(plhs[0]));
+}
+
+/*
+ * Fields for the out-of-core forms of comp, samp, push and invdef.  Each
+ * is either a single precision array (F set) or a FLOAT32 file_array (F
+ * NULL, and fa filled in).  dm gets the dimensions and number of volumes.
+ */
+static void field_arg(const mxArray *ptr, float **F, FARRAY *fa, mwSize dm[4])
+{
+    mwSize nd, i;
+    if (mxIsNumeric(ptr))
+    {
+        if (mxIsComplex(ptr) || mxIsSparse(ptr) || !mxIsSingle(ptr))
+            mexErrMsgTxt("Data must be numeric, real, full and single (or a file_array)");
+        nd = mxGetNumberOfDimensions(ptr);
+        if (nd>4) mexErrMsgTxt("Wrong number of dimensions.");
+        for(i=0; i<4; i++)
+            dm[i] = (i<nd) ? mxGetDimensions(ptr)[i] : 1;
+        *F = (float *)mxGetPr(ptr);
+    }
+    else
+    {
+        farray_init(ptr, fa);
+        for(i=0; i<3; i++)
+            dm[i] = fa->dim[i];
+        dm[3] = fa->n;
+        *F    = (float *)0;
+    }
+}
+
+/* Open the n fields that are in files, for writing if wr[i] is set */
+static void fields_open(int n, float *F[], FARRAY fa[], const int wr[])
+{
+    int i, j;
+    for(i=0; i<n; i++)
+    {
+        if (F[i]==NULL && farray_open(&fa[i], wr[i]))
+        {
+            for(j=0; j<i; j++)
+                if (F[j]==NULL) farray_close(&fa[j]);
+            if (wr[i])
+                mexErrMsgTxt("Can't open output file for writing.");
+            else
+                mexErrMsgTxt("Can't open file for reading.");
+        }
+    }
+}
+
+static void fields_close(int n, float *F[], FARRAY fa[], int st)
+{
+    int i;
+    for(i=0; i<n; i++)
+        if (F[i]==NULL) farray_close(&fa[i]);
+    if (st) mexErrMsgTxt("Problem reading or writing data (could be a disk space or quota issue).");
+}
+
+/* C = comp(B,A), written to the file_array C */
+static void comp_stream_mex(int nlhs, const mxArray *prhs[])
+{
+    float *F[3];
+    FARRAY fa[3];
+    mwSize dm[4], dma[4], dmc[4];
+    static const int wr[] = {0, 0, 1};
+    int st;
+
+    if (nlhs!=0) mexErrMsgTxt("Incorrect usage.");
+    if (mxIsNumeric(prhs[2])) mexErrMsgTxt("Third argument must be a file_array.");
+    field_arg(prhs[0], &F[0], &fa[0], dm);
+    field_arg(prhs[1], &F[1], &fa[1], dma);
+    field_arg(prhs[2], &F[2], &fa[2], dmc);
+    if (dm[3]!=3 || dma[3]!=3)
+        mexErrMsgTxt("Deformations must have 3 components.");
+    if (dmc[0]!=dma[0] || dmc[1]!=dma[1] || dmc[2]!=dma[2] || dmc[3]!=3)
+        mexErrMsgTxt("Incompatible dimensions of output file_array.");
+
+    fields_open(3, F, fa, wr);
+    st = comp_stream(dm, F[0], &fa[0], dma, F[1], &fa[1], &fa[2]);
+    fields_close(3, F, fa, st);
 }
 
 static void comp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -411,16 +646,27 @@ static void comp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     {
         if (nlhs > 1) mexErrMsgTxt("Only 1 output argument required");
     }
+    else if (nrhs == 3)
+    {
+        comp_stream_mex(nlhs, prhs);
+        return;
+    }
     else if (nrhs == 4)
     {
         if (nlhs > 2) mexErrMsgTxt("Only 2 output argument required");
     }
     else
-        mexErrMsgTxt("Either 2 or 4 input arguments required");
+        mexErrMsgTxt("Either 2, 3 or 4 input arguments required");
+
+    if (nrhs==2 && mxIsUint16(prhs[0]) && mxIsUint16(prhs[1]))
+    {
+        comp_half(nlhs, plhs, prhs);
+        return;
+    }
 
     for(i=0; i<nrhs; i++)
         if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) || mxIsSparse(prhs[i]) || !mxIsSingle(prhs[i]))
-            mexErrMsgTxt("Data must be numeric, real, full and single");
+            mexErrMsgTxt("Data must be numeric, real, full and single (or both uint16)");
 
     nd = mxGetNumberOfDimensions(prhs[0]);
     if (nd!=4) mexErrMsgTxt("Wrong number of dimensions (1).");
@@ -498,11 +744,35 @@ static void comp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     unwrap((mwSize *)dm, C);
 }
 
+/* samp(f,y), written to the file_array w */
+static void samp_stream_mex(int nlhs, const mxArray *prhs[])
+{
+    float *F[3];
+    FARRAY fa[3];
+    mwSize dmf[4], dmy[4], dmw[4];
+    static const int wr[] = {0, 0, 1};
+    int st;
+
+    if (nlhs!=0) mexErrMsgTxt("Incorrect usage.");
+    if (mxIsNumeric(prhs[2])) mexErrMsgTxt("Third argument must be a file_array.");
+    field_arg(prhs[0], &F[0], &fa[0], dmf);
+    field_arg(prhs[1], &F[1], &fa[1], dmy);
+    field_arg(prhs[2], &F[2], &fa[2], dmw);
+    if (dmy[3]!=3)
+        mexErrMsgTxt("Deformation must have 3 components.");
+    if (dmw[0]!=dmy[0] || dmw[1]!=dmy[1] || dmw[2]!=dmy[2] || dmw[3]!=dmf[3])
+        mexErrMsgTxt("Incompatible dimensions of output file_array.");
+
+    fields_open(3, F, fa, wr);
+    st = samp_stream(dmf, F[0], &fa[0], dmf[3], dmy, F[1], &fa[1], &fa[2]);
+    fields_close(3, F, fa, st);
+}
+
 static void samp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     float *f, *Y, *wf;
-    double buf[1024];
-    mwSize nd, i, mm, mm1;
+    HALF  *fh = NULL, *Yh = NULL, *wh = NULL;
+    mwSize nd, i, mm;
     mwSize dmf[4], dmy[4];
     const mwSize *dmyp;
 
@@ -511,12 +781,18 @@ static void samp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     {
         if (nlhs > 1) mexErrMsgTxt("Only 1 output argument required");
     }
+    else if (nrhs == 3)
+    {
+        samp_stream_mex(nlhs, prhs);
+        return;
+    }
     else
-        mexErrMsgTxt("Two input arguments required");
+        mexErrMsgTxt("Two or three input arguments required");
 
     for(i=0; i<nrhs; i++)
-        if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) || mxIsSparse(prhs[i]) || !mxIsSingle(prhs[i]))
-            mexErrMsgTxt("Data must be numeric, real, full and single");
+        if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) || mxIsSparse(prhs[i]) ||
+            !(mxIsSingle(prhs[i]) || mxIsUint16(prhs[i])))
+            mexErrMsgTxt("Data must be numeric, real, full and single (or uint16)");
 
     nd = mxGetNumberOfDimensions(prhs[0]);
     if (nd>4) mexErrMsgTxt("Wrong number of dimensions.");
@@ -534,29 +810,75 @@ static void samp_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray
     dmy[1] = dmyp[1];
     dmy[2] = dmyp[2];
     dmy[3] = dmf[3];
-    plhs[0] = mxCreateNumericArray(4,dmy, mxSINGLE_CLASS, mxREAL);
+    plhs[0] = mxCreateNumericArray(4,dmy, mxGetClassID(prhs[0]), mxREAL);
 
-    f = (float *)mxGetPr(prhs[0]);
-    Y = (float *)mxGetPr(prhs[1]);
-    wf= (float *)mxGetPr(plhs[0]);
+    if (mxIsUint16(prhs[0]))
+    {
+        fh = (HALF *)mxGetData(prhs[0]);
+        wh = (HALF *)mxGetData(plhs[0]);
+    }
+    if (mxIsUint16(prhs[1]))
+        Yh = (HALF *)mxGetData(prhs[1]);
+    f = fh ? (float *)0 : (float *)mxGetPr(prhs[0]);
+    Y = Yh ? (float *)0 : (float *)mxGetPr(prhs[1]);
+    wf= wh ? (float *)0 : (float *)mxGetPr(plhs[0]);
 
     mm  = dmy[0]*dmy[1]*dmy[2];
-    mm1 = dmf[0]*dmf[1]*dmf[2];
-    for (i=0; i<mm; i++)
+    if (fh || Yh)
+        sampn_def_half(dmf, f, fh, dmf[3], dmy, Y, Yh, wf, wh);
+    else
+        sampn_def(dmf, f, dmf[3], mm, Y, wf);
+}
+
+/* push(f,y,d), where f and/or y are file_arrays */
+static void push_stream_mex(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    float *F[2], *so = (float *)0;
+    FARRAY fa[2];
+    mwSize dmf[4], dmy[4], dmo[4];
+    static const int wr[] = {0, 0};
+    int st;
+
+    field_arg(prhs[0], &F[0], &fa[0], dmf);
+    field_arg(prhs[1], &F[1], &fa[1], dmy);
+    if (dmy[0]!=dmf[0] || dmy[1]!=dmf[1] || dmy[2]!=dmf[2] || dmy[3]!=3)
+        mexErrMsgTxt("Incompatible dimensions.");
+    if (nrhs>=3)
     {
-        int j;
-        sampn(dmf, f, dmf[3], mm1,
-            (double)Y[i]-1.0, (double)Y[mm+i]-1.0, (double)Y[2*mm+i]-1.0,
-            buf);
-        for(j=0; j<dmf[3]; j++)
-            wf[i+mm*j] = buf[j];
+        if (!mxIsNumeric(prhs[2]) || mxIsComplex(prhs[2]) ||
+        mxIsSparse( prhs[2]) || !mxIsDouble(prhs[2]))
+            mexErrMsgTxt("Data must be numeric, real, full and double");
+        if (mxGetNumberOfElements(prhs[2])!= 3)
+            mexErrMsgTxt("Output dimensions must have three elements");
+        dmo[0] = (mwSize)floor(mxGetPr(prhs[2])[0]);
+        dmo[1] = (mwSize)floor(mxGetPr(prhs[2])[1]);
+        dmo[2] = (mwSize)floor(mxGetPr(prhs[2])[2]);
     }
+    else
+    {
+        dmo[0] = dmf[0];
+        dmo[1] = dmf[1];
+        dmo[2] = dmf[2];
+    }
+    dmo[3] = dmf[3];
+
+    plhs[0] = mxCreateNumericArray(4,dmo, mxSINGLE_CLASS, mxREAL);
+    if (nlhs>=2)
+    {
+        plhs[1] = mxCreateNumericArray(3,dmo, mxSINGLE_CLASS, mxREAL);
+        so      = (float *)mxGetPr(plhs[1]);
+    }
+
+    fields_open(2, F, fa, wr);
+    st = push_stream(dmo, dmy, dmf[3], F[1], &fa[1], F[0], &fa[0], (float *)mxGetPr(plhs[0]), so);
+    fields_close(2, F, fa, st);
 }
 
 static void push_mexFunction(int nlhs, mxArray *plhs[],
     int nrhs, const mxArray *prhs[])
 {
     float *f, *Y, *so, *po;
+    HALF  *fh = NULL, *Yh = NULL;
     int nd, i, m, n;
     mwSize dmf[4];
     mwSize dmo[4];
@@ -565,11 +887,17 @@ static void push_mexFunction(int nlhs, mxArray *plhs[],
     if ((nrhs != 2) && (nrhs != 3))
         mexErrMsgTxt("Two or three input arguments required");
     if (nlhs  > 2) mexErrMsgTxt("Up to two output arguments required");
+
+    if (!mxIsNumeric(prhs[0]) || !mxIsNumeric(prhs[1]))
+    {
+        push_stream_mex(nlhs, plhs, nrhs, prhs);
+        return;
+    }
     
     for(i=0; i<2; i++)
         if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) ||
-             mxIsSparse( prhs[i]) || !mxIsSingle(prhs[i]))
-            mexErrMsgTxt("Data must be numeric, real, full and single");
+             mxIsSparse( prhs[i]) || !(mxIsSingle(prhs[i]) || mxIsUint16(prhs[i])))
+            mexErrMsgTxt("Data must be numeric, real, full and single (or uint16)");
 
     nd = mxGetNumberOfDimensions(prhs[0]);
     if (nd>4) mexErrMsgTxt("Wrong number of dimensions.");
@@ -603,8 +931,10 @@ static void push_mexFunction(int nlhs, mxArray *plhs[],
     dmo[3] = dmf[3];
 
     plhs[0] = mxCreateNumericArray(4,dmo, mxSINGLE_CLASS, mxREAL);
-    f  = (float *)mxGetPr(prhs[0]);
-    Y  = (float *)mxGetPr(prhs[1]);
+    if (mxIsUint16(prhs[0])) fh = (HALF *)mxGetData(prhs[0]);
+    if (mxIsUint16(prhs[1])) Yh = (HALF *)mxGetData(prhs[1]);
+    f  = fh ? (float *)0 : (float *)mxGetPr(prhs[0]);
+    Y  = Yh ? (float *)0 : (float *)mxGetPr(prhs[1]);
     po = (float *)mxGetPr(plhs[0]);
     if (nlhs>=2)
     {
@@ -617,13 +947,17 @@ static void push_mexFunction(int nlhs, mxArray *plhs[],
     m = dmf[0]*dmf[1]*dmf[2];
     n = dmf[3];
     
-    push(dmo, m, n, Y, f, po, so);
+    if (fh || Yh)
+        push_half(dmo, dmf, n, Y, Yh, f, fh, po, so, 0);
+    else
+        push(dmo, m, n, Y, f, po, so);
 }
 
 static void pushc_mexFunction(int nlhs, mxArray *plhs[],
     int nrhs, const mxArray *prhs[])
 {
     float *f, *Y, *so, *po;
+    HALF  *fh = NULL, *Yh = NULL;
     int nd, i, m, n;
     mwSize dmf[4];
     mwSize dmo[4];
@@ -635,8 +969,8 @@ static void pushc_mexFunction(int nlhs, mxArray *plhs[],
 
     for(i=0; i<2; i++)
         if (!mxIsNumeric(prhs[i]) || mxIsComplex(prhs[i]) ||
-             mxIsSparse( prhs[i]) || !mxIsSingle(prhs[i]))
-            mexErrMsgTxt("Data must be numeric, real, full and single");
+             mxIsSparse( prhs[i]) || !(mxIsSingle(prhs[i]) || mxIsUint16(prhs[i])))
+            mexErrMsgTxt("Data must be numeric, real, full and single (or uint16)");
 
     nd = mxGetNumberOfDimensions(prhs[0]);
     if (nd>4) mexErrMsgTxt("Wrong number of dimensions.");
@@ -670,8 +1004,10 @@ static void pushc_mexFunction(int nlhs, mxArray *plhs[],
     dmo[3] = dmf[3];
 
     plhs[0] = mxCreateNumericArray(4,dmo, mxSINGLE_CLASS, mxREAL);
-    f  = (float *)mxGetPr(prhs[0]);
-    Y  = (float *)mxGetPr(prhs[1]);
+    if (mxIsUint16(prhs[0])) fh = (HALF *)mxGetData(prhs[0]);
+    if (mxIsUint16(prhs[1])) Yh = (HALF *)mxGetData(prhs[1]);
+    f  = fh ? (float *)0 : (float *)mxGetPr(prhs[0]);
+    Y  = Yh ? (float *)0 : (float *)mxGetPr(prhs[1]);
     po = (float *)mxGetPr(plhs[0]);
     if (nlhs>=2)
     {
@@ -684,7 +1020,10 @@ static void pushc_mexFunction(int nlhs, mxArray *plhs[],
     m = dmf[0]*dmf[1]*dmf[2];
     n = dmf[3];
 
-    pushc(dmo, m, n, Y, f, po, so);
+    if (fh || Yh)
+        push_half(dmo, dmf, n, Y, Yh, f, fh, po, so, 1);
+    else
+        pushc(dmo, m, n, Y, f, po, so);
 }
 
 static void pushc_grads_mexFunction(int nlhs, mxArray *plhs[],
@@ -878,53 +1217,58 @@ static void divergence_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mx
     divergence((mwSize *)dm,(float *)mxGetPr(prhs[0]),(float *)mxGetPr(plhs[0]));
 }
 
-static void def2det_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+static void def2jac_common(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[], int code)
 {
     mwSize nd;
-    const mwSize *dm;
-    mwSize dm1[3];
-    int pl = -1;
+    mwSize dm[3], dm1[5];
+    float *Y = NULL;
+    FARRAY fy, fo;
+    int st, pl = 0;
 
     if ((nrhs < 1) || (nrhs>2) || (nlhs>1)) mexErrMsgTxt("Incorrect usage.");
-    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsSingle(prhs[0]))
+    if (mxIsNumeric(prhs[0]))
+    {
+        if (mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsSingle(prhs[0]))
             mexErrMsgTxt("Data must be numeric, real, full and single");
-    nd = mxGetNumberOfDimensions(prhs[0]);
-    if (nd!=4) mexErrMsgTxt("Wrong number of dimensions.");
-    dm = mxGetDimensions(prhs[0]);
-    if (dm[3]!=3) mexErrMsgTxt("4th dimension must be 3.");
-
-    dm1[0] = dm[0];
-    dm1[1] = dm[1];
-    dm1[2] = dm[2];
-
-    if (nrhs==2)
+        nd = mxGetNumberOfDimensions(prhs[0]);
+        if (nd!=4) mexErrMsgTxt("Wrong number of dimensions.");
+        if (mxGetDimensions(prhs[0])[3]!=3) mexErrMsgTxt("4th dimension must be 3.");
+        dm[0] = mxGetDimensions(prhs[0])[0];
+        dm[1] = mxGetDimensions(prhs[0])[1];
+        dm[2] = mxGetDimensions(prhs[0])[2];
+        Y     = (float *)mxGetPr(prhs[0]);
+    }
+    else
     {
-        if (!mxIsNumeric(prhs[1]) || mxIsComplex(prhs[1]) || mxIsSparse(prhs[1]) || !mxIsDouble(prhs[1]) || (mxGetNumberOfElements(prhs[1])!=1))
-            mexErrMsgTxt("Slice number must be a numeric, real, full and double scalar");
-        pl = (int)mxGetPr(prhs[1])[0];
-        if (pl<1 || pl>=dm[2])
-            mexErrMsgTxt("Slice number is out of range");
-        dm1[2] = 1;
+        farray_init(prhs[0], &fy);
+        if (fy.n!=3) mexErrMsgTxt("Deformation must have 3 components.");
+        dm[0] = fy.dim[0];
+        dm[1] = fy.dim[1];
+        dm[2] = fy.dim[2];
     }
 
-    plhs[0] = mxCreateNumericArray(3,dm1, mxSINGLE_CLASS, mxREAL);
-    def2det((mwSize *)dm,(float *)mxGetPr(prhs[0]),(float *)mxGetPr(plhs[0]), pl);
-}
-
-static void def2jac_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{
-    mwSize nd;
-    const mwSize *dm;
-    mwSize dm1[5];
-    int pl = -1;
-
-    if ((nrhs < 1) || (nrhs>2) || (nlhs>1)) mexErrMsgTxt("Incorrect usage.");
-    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsSingle(prhs[0]))
-            mexErrMsgTxt("Data must be numeric, real, full and single");
-    nd = mxGetNumberOfDimensions(prhs[0]);
-    if (nd!=4) mexErrMsgTxt("Wrong number of dimensions.");
-    dm = mxGetDimensions(prhs[0]);
-    if (dm[3]!=3) mexErrMsgTxt("4th dimension must be 3.");
+    if (nrhs==2 && !mxIsNumeric(prhs[1]))
+    {
+        /* Write to a file_array, a slab at a time */
+        if (nlhs!=0) mexErrMsgTxt("Incorrect usage.");
+        farray_init(prhs[1], &fo);
+        if (fo.dim[0]!=dm[0] || fo.dim[1]!=dm[1] || fo.dim[2]!=dm[2] || fo.n!=(code ? 9 : 1))
+            mexErrMsgTxt("Incompatible dimensions of output file_array.");
+
+        if (Y==NULL && farray_open(&fy,0))
+            mexErrMsgTxt("Can't open deformation file for reading.");
+        if (farray_open(&fo,1))
+        {
+            if (Y==NULL) farray_close(&fy);
+            mexErrMsgTxt("Can't open output file for writing.");
+        }
+        st = def2jac_stream(dm, Y, &fy, &fo, code);
+        if (Y==NULL) farray_close(&fy);
+        farray_close(&fo);
+        if (st) mexErrMsgTxt("Problem reading or writing data (could be a disk space or quota issue).");
+        return;
+    }
+    if (Y==NULL) mexErrMsgTxt("An output file_array is needed for deformations in files.");
 
     dm1[0] = dm[0];
     dm1[1] = dm[1];
@@ -936,13 +1280,26 @@ static void def2jac_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArr
         if (!mxIsNumeric(prhs[1]) || mxIsComplex(prhs[1]) || mxIsSparse(prhs[1]) || !mxIsDouble(prhs[1]) || (mxGetNumberOfElements(prhs[1])!=1))
             mexErrMsgTxt("Slice number must be a numeric, real, full and double scalar");
         pl = (int)mxGetPr(prhs[1])[0];
-        if (pl<1 || pl>=dm[2])
+        if (pl<1 || pl>dm[2])
             mexErrMsgTxt("Slice number is out of range");
         dm1[2] = 1;
     }
 
-    plhs[0] = mxCreateNumericArray(5,dm1, mxSINGLE_CLASS, mxREAL);
-    def2jac((mwSize *)dm,(float *)mxGetPr(prhs[0]),(float *)mxGetPr(plhs[0]), pl);
+    plhs[0] = mxCreateNumericArray(code ? 5 : 3, dm1, mxSINGLE_CLASS, mxREAL);
+    if (code)
+        def2jac(dm, Y, (float *)mxGetPr(plhs[0]), pl-1);
+    else
+        def2det(dm, Y, (float *)mxGetPr(plhs[0]), pl-1);
+}
+
+static void def2det_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    def2jac_common(nlhs, plhs, nrhs, prhs, 0);
+}
+
+static void def2jac_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    def2jac_common(nlhs, plhs, nrhs, prhs, 1);
 }
 
 static void brc_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -1014,23 +1371,20 @@ static void id_mat(double M[4][3])
 void invdef_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     float *Y=0, *iY=0;
+    FARRAY fy;
     mwSize dim_y[4], dim_iy[4];
-    int i;
+    int i, st;
     double M1[4][3], M2[4][3];
 
     if (nrhs <1 || nrhs>4 || nlhs > 1) mexErrMsgTxt("Incorrect usage.");
 
-    if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsSingle(prhs[0]))
-        mexErrMsgTxt("Data must be numeric, real, full and single");
-    if (mxGetNumberOfDimensions(prhs[0])!=4) mexErrMsgTxt("Wrong number of dimensions.");
+    if (mxIsNumeric(prhs[0]) && mxGetNumberOfDimensions(prhs[0])!=4)
+        mexErrMsgTxt("Wrong number of dimensions.");
+    field_arg(prhs[0], &Y, &fy, dim_y);
     for(i=0; i<4; i++)
-    {
-        dim_y[i] = dim_iy[i] = mxGetDimensions(prhs[0])[i];
-    }
+        dim_iy[i] = dim_y[i];
     if (dim_y[3]!=3) mexErrMsgTxt("4th dimension of 1st arg must be 3.");
 
-    Y  = (float *)mxGetData(prhs[0]);
-
     if (nrhs>1)
     {
         if (!mxIsNumeric(prhs[1]) || mxIsComplex(prhs[1]) ||
@@ -1049,14 +1403,33 @@ void invdef_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs
     plhs[0] = mxCreateNumericArray(4, dim_iy,mxSINGLE_CLASS,mxREAL);
     iY      = (float *)mxGetData(plhs[0]);
 
-    invdef(dim_y, Y, dim_iy, iY, M1, M2);
+    if (Y==NULL)
+    {
+        /* Deformation in a file, which is read a slab at a time */
+        static const int wr[] = {0};
+        fields_open(1, &Y, &fy, wr);
+        st = invdef_stream(dim_y, &fy, dim_iy, iY, M1, M2);
+        fields_close(1, &Y, &fy, st==1);
+        if (st==2) mexErrMsgTxt("Too many voxels inside a tetrahedron");
+    }
+    else
+        invdef(dim_y, Y, dim_iy, iY, M1, M2);
 }
 
 #include<string.h>
 
+/* The only exit handler of the MEX file, which frees all persistent memory */
+static void diffeo_atexit(void)
+{
+    scratch_free_all();
+    greens_release();
+}
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
+    mexAtExit(diffeo_atexit);
     set_bound(get_bound());
+    scratch_reset();
 
     if ((nrhs>=1) && mxIsChar(prhs[0]))
     {
@@ -1066,6 +1439,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         fnc_str = (char *)mxCalloc(buflen+1,sizeof(mxChar));
         mxGetString(prhs[0],fnc_str,buflen+1);
 
+        if (!strcmp(fnc_str,"telemetry"))
+        {
+            mxFree(fnc_str);
+            telemetry_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+            return;
+        }
+        if (tele_on) tele_reset();
+
         if (!strcmp(fnc_str,"comp"))
         {
             mxFree(fnc_str);
@@ -1152,6 +1533,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             mxFree(fnc_str);
             dartel_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
         }
+        else if (!strcmp(fnc_str,"dartel_batch"))
+        {
+            mxFree(fnc_str);
+            dartel_batch_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
         else if (!strcmp(fnc_str,"Exp")  || !strcmp(fnc_str,"exp"))
         {
             mxFree(fnc_str);
@@ -1162,6 +1548,31 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             mxFree(fnc_str);
             boundary_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
         }
+        else if (!strcmp(fnc_str,"halfformat"))
+        {
+            mxFree(fnc_str);
+            halfformat_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
+        else if (!strcmp(fnc_str,"pack16"))
+        {
+            mxFree(fnc_str);
+            half_mexFunction(nlhs, plhs, nrhs-1, &prhs[1], 1);
+        }
+        else if (!strcmp(fnc_str,"unpack16"))
+        {
+            mxFree(fnc_str);
+            half_mexFunction(nlhs, plhs, nrhs-1, &prhs[1], 0);
+        }
+        else if (!strcmp(fnc_str,"release"))
+        {
+            mxFree(fnc_str);
+            release_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
+        else if (!strcmp(fnc_str,"memory"))
+        {
+            mxFree(fnc_str);
+            memory_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
         else if (!strcmp(fnc_str,"bsplinc"))
         {
             mxFree(fnc_str);
@@ -1200,7 +1611,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
     else
     {
+        if (tele_on) tele_reset();
         fmg3_mexFunction(nlhs, plhs, nrhs, prhs);
     }
+    if (tele_on) tele_finish();
 }
 
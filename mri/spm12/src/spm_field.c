@@ -5,6 +5,8 @@
 #include <math.h>
 #include "shoot_optimN.h"
 #include "shoot_boundary.h"
+#include "shoot_scratch.h"
+#include "shoot_telemetry.h"
 
 static void boundary_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
@@ -22,6 +24,39 @@ static void boundary_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxAr
     }
 }
 
+static void release_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if ((nrhs!=0) || (nlhs!=0))
+        mexErrMsgTxt("Incorrect usage.");
+    scratch_release();
+}
+
+static void telemetry_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if ((nrhs==1) && (nlhs==0))
+    {
+        if (!mxIsNumeric(prhs[0]) || mxIsComplex(prhs[0]) || mxIsSparse(prhs[0]) || !mxIsDouble(prhs[0]))
+            mexErrMsgTxt("Data must be numeric, real, full and double");
+        tele_enable(mxGetPr(prhs[0])[0]!=0.0);
+    }
+    else if ((nrhs==0) && (nlhs<=1))
+        plhs[0] = tele_struct();
+    else
+        mexErrMsgTxt("Incorrect usage.");
+}
+
+static void memory_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    mwSize nblocks;
+    double bytes;
+    if ((nrhs!=0) || (nlhs>2))
+        mexErrMsgTxt("Incorrect usage.");
+    scratch_usage(&nblocks, &bytes);
+    plhs[0] = mxCreateDoubleScalar(bytes);
+    if (nlhs>1)
+        plhs[1] = mxCreateDoubleScalar((double)nblocks);
+}
+
 static void fmg_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
     int nd, i;
@@ -98,9 +133,9 @@ static void fmg_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *
     A       = (float *)mxGetPr(prhs[0]);
     b       = (float *)mxGetPr(prhs[1]);
     x       = (float *)mxGetPr(plhs[0]);
-    scratch = (float *)mxCalloc(fmg_scratchsize(dm),sizeof(float));
+    scratch = scratch_get(fmg_scratchsize(dm));
     fmg(dm, A, b, param, scal, cyc, nit, x, scratch);
-    mxFree((void *)scratch);
+    scratch_put(scratch);
 }
 
 static void vel2mom_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
@@ -155,7 +190,9 @@ static void vel2mom_mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArr
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
+    mexAtExit(scratch_free_all);
     set_bound(get_bound());
+    scratch_reset();
     if ((nrhs>=1) && mxIsChar(prhs[0]))
     {
         int buflen;
@@ -163,6 +200,14 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         buflen = mxGetNumberOfElements(prhs[0]);
         fnc_str = (char *)mxCalloc(buflen+1,sizeof(mxChar));
         mxGetString(prhs[0],fnc_str,buflen+1);
+        if (!strcmp(fnc_str,"telemetry"))
+        {
+            mxFree(fnc_str);
+            telemetry_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+            return;
+        }
+        if (tele_on) tele_reset();
+
         if (!strcmp(fnc_str,"vel2mom"))
         {
             mxFree(fnc_str);
@@ -178,6 +223,16 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             mxFree(fnc_str);
             boundary_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
         }
+        else if (!strcmp(fnc_str,"release"))
+        {
+            mxFree(fnc_str);
+            release_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
+        else if (!strcmp(fnc_str,"memory"))
+        {
+            mxFree(fnc_str);
+            memory_mexFunction(nlhs, plhs, nrhs-1, &prhs[1]);
+        }
         else
         {
             mxFree(fnc_str);
@@ -186,7 +241,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
     else
     {
+        if (tele_on) tele_reset();
         fmg_mexFunction(nlhs, plhs, nrhs, prhs);
     }
+    if (tele_on) tele_finish();
 }
 
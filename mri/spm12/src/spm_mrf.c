@@ -3,17 +3,260 @@
 
 #include "mex.h"
 #include <math.h>
+#include "spm_openmp.h"
 #define MAXCLASSES 1024
 
+/* Number of voxels (of one colour, along a row) that are updated together */
+#ifndef MRF_BLOCK
+#define MRF_BLOCK 64
+#endif
+
+/* Smallest number of voxels for which the updates are multithreaded */
+#ifndef PAR_MIN
+#define PAR_MIN 32768
+#endif
+
+/*
+ * Replace x[j] by exp(x[j]), accurate to a couple of ulps in single
+ * precision, for j=0..n-1.  Unlike calls to exp(), the loop vectorises.
+ * This uses the range reduction and polynomial of the Cephes expf, with
+ * the rounding done by adding and subtracting 1.5*2^23, and the scaling
+ * by 2^i done by building the exponent bits.  Arguments are clamped so
+ * that the results are always normal numbers.
+ */
+static void exp_block(mwSize n, float x[])
+{
+    mwSignedIndex j;
 
-static void mrf1(mwSize dm[], unsigned char q[], float p[], float G[], float w[], int code)
+    /* Clamping in a separate loop stops the compiler from treating the
+       clamped values as special cases, which would prevent the main loop
+       from being vectorised. */
+    #pragma omp simd
+    for(j=0; j<(mwSignedIndex)n; j++)
+    {
+        float t = x[j];
+        t    = (t> 88.0f) ?  88.0f : t;
+        x[j] = (t<-87.0f) ? -87.0f : t;
+    }
+
+    #pragma omp simd
+    for(j=0; j<(mwSignedIndex)n; j++)
+    {
+        union { float f; int i; } s;
+        float t = x[j], r, y;
+
+        r   = t*1.44269504088896341f + 12582912.0f;
+        r  -= 12582912.0f;
+        t   = t - r*0.693359375f + r*2.12194440e-4f;
+        y   = (((((1.9875691500e-4f*t + 1.3981999507e-3f)*t + 8.3334519073e-3f)*t
+              + 4.1665795894e-2f)*t + 1.6666665459e-1f)*t + 5.0000001201e-1f)*t*t + t + 1.0f;
+        s.i = ((int)r+127)<<23;
+        x[j] = y*s.f;
+    }
+}
+
+/*
+ * Update nb voxels of one colour, starting at voxel (i0,i1,i2) and
+ * spaced two apart along the row.  The voxels are done together, with
+ * each loop over classes (or pairs of classes) running over all the
+ * voxels, so the loops over voxels are the ones that vectorise.  The
+ * classes of a voxel are m elements apart, so this gives contiguous
+ * (well, every other element) memory access, which a loop over classes
+ * would not.  Each voxel sees exactly the same sequence of operations as
+ * before, except for the exponentials.
+ * buf has (2*dm[3]+1)*MRF_BLOCK elements.
+ */
+static void mrf_block(mwSize dm[], unsigned char q[], float p[], float G[], float w[], int code,
+                      mwSize i0, mwSize i1, mwSize i2, mwSize nb, float buf[])
 {
-    mwSize i0, i1, i2, k, m, n;
-    float a[MAXCLASSES], e[MAXCLASSES], *p0 = NULL, *p1 = NULL;
-    unsigned char *q0 = NULL, *q1 = NULL;
-    int it;
+    mwSize m = dm[0]*dm[1]*dm[2], o = i0+dm[0]*(i1+dm[1]*i2), k, n;
+    mwSignedIndex j, jl, jr;
+    float *a = buf, *e = buf + dm[3]*MRF_BLOCK, *se = buf + 2*dm[3]*MRF_BLOCK;
 
-    m = dm[0]*dm[1]*dm[2];
+    /* Voxels at the ends of the row have no left or right neighbour */
+    jl = (i0==0) ? 1 : 0;
+    jr = (i0+2*(nb-1)==dm[0]-1) ? nb-1 : nb;
+
+    /* Count neighbours of each class */
+    for(k=0; k<dm[3]; k++)
+    {
+        float *ak = a + k*MRF_BLOCK;
+        unsigned char *qk = q + o + k*m;
+
+        for(j=0; j<nb; j++) ak[j] = 0.0;
+
+        if(i2>0)       /* Inferior */
+        {
+            unsigned char *qq = qk - dm[0]*dm[1];
+            #pragma omp simd
+            for(j=0; j<nb; j++) ak[j] += qq[2*j]*w[2];
+        }
+        if(i2<dm[2]-1) /* Superior */
+        {
+            unsigned char *qq = qk + dm[0]*dm[1];
+            #pragma omp simd
+            for(j=0; j<nb; j++) ak[j] += qq[2*j]*w[2];
+        }
+        if(i1>0)       /* Posterior */
+        {
+            unsigned char *qq = qk - dm[0];
+            #pragma omp simd
+            for(j=0; j<nb; j++) ak[j] += qq[2*j]*w[1];
+        }
+        if(i1<dm[1]-1) /* Anterior */
+        {
+            unsigned char *qq = qk + dm[0];
+            #pragma omp simd
+            for(j=0; j<nb; j++) ak[j] += qq[2*j]*w[1];
+        }
+        #pragma omp simd
+        for(j=jl; j<nb; j++) ak[j] += qk[2*j-1]*w[0]; /* Left */
+        #pragma omp simd
+        for(j=0; j<jr; j++) ak[j] += qk[2*j+1]*w[0];  /* Right */
+
+        /* Responsibility data is uint8, so correct scaling.
+           Note also that data is divided by 6 (the number
+           of neighbours examined). */
+        #pragma omp simd
+        for(j=0; j<nb; j++) ak[j] /= (255.0*6.0);
+    }
+
+    /* Arguments of the exponentials */
+    if (code == 1)
+    {
+        /* Weights are in the form of a matrix,
+           shared among all voxels. */
+        float *g = G;
+        for(k=0; k<dm[3]; k++)
+        {
+            float *ek = e + k*MRF_BLOCK;
+            for(j=0; j<nb; j++) ek[j] = 0.0;
+            for(n=0; n<dm[3]; n++, g++)
+            {
+                float gn = *g, *an = a + n*MRF_BLOCK;
+                #pragma omp simd
+                for(j=0; j<nb; j++) ek[j] += gn*an[j];
+            }
+        }
+    }
+    else if (code == 2)
+    {
+        /* Weights are assumed to be a diagonal matrix,
+           so only the diagonal elements are passed. */
+        for(k=0; k<dm[3]; k++)
+        {
+            float gk = G[k], *ak = a + k*MRF_BLOCK, *ek = e + k*MRF_BLOCK;
+            #pragma omp simd
+            for(j=0; j<nb; j++) ek[j] = gk*ak[j];
+        }
+    }
+    else if (code == 3)
+    {
+        /* Separate weights for each voxel, in the form of
+           the full matrix (loads of memory). */
+        float *g = G + o;
+        for(k=0; k<dm[3]; k++)
+        {
+            float *ek = e + k*MRF_BLOCK;
+            for(j=0; j<nb; j++) ek[j] = 0.0;
+            for(n=0; n<dm[3]; n++, g+=m)
+            {
+                float *an = a + n*MRF_BLOCK;
+                #pragma omp simd
+                for(j=0; j<nb; j++) ek[j] += g[2*j]*an[j];
+            }
+        }
+    }
+    else if (code == 4)
+    {
+        /* Separate weight matrices for each voxel,
+           where the matrices are assumed to be symmetric
+           with zeros on the diagonal. For a 4x4
+           matrix, the elements are ordered as
+           (2,1), (3,1), (4,1), (3,2), (4,2), (4,3).
+         */
+        float *g = G + o;
+        for(j=0; j<dm[3]*MRF_BLOCK; j++) e[j] = 0.0;
+        for(k=0; k<dm[3]; k++)
+        {
+            float *ak = a + k*MRF_BLOCK, *ek = e + k*MRF_BLOCK;
+            for(n=k+1; n<dm[3]; n++, g+=m)
+            {
+                float *an = a + n*MRF_BLOCK, *en = e + n*MRF_BLOCK;
+                #pragma omp simd
+                for(j=0; j<nb; j++)
+                {
+                    ek[j] += g[2*j]*an[j];
+                    en[j] += g[2*j]*ak[j];
+                }
+            }
+        }
+    }
+    else if (code == 5)
+    {
+        /* Separate weight matrices for each voxel,
+           where the matrices are assumed to be symmetric
+           with zeros on the diagonal. For a 4x4
+           matrix, the elements are ordered as
+           (2,1), (3,1), (4,1), (3,2), (4,2), (4,3).
+
+           The weight matrices are encoded as uint8, and
+           their values need to be scaled by -0.0625 to
+           bring them into a reasonable range.
+         */
+        unsigned char *g = (unsigned char *)G + o;
+        for(j=0; j<dm[3]*MRF_BLOCK; j++) e[j] = 0.0;
+        for(k=0; k<dm[3]; k++)
+        {
+            float *ak = a + k*MRF_BLOCK, *ek = e + k*MRF_BLOCK;
+            for(n=k+1; n<dm[3]; n++, g+=m)
+            {
+                float *an = a + n*MRF_BLOCK, *en = e + n*MRF_BLOCK;
+                #pragma omp simd
+                for(j=0; j<nb; j++)
+                {
+                    ek[j] += ((float)g[2*j])*an[j];
+                    en[j] += ((float)g[2*j])*ak[j];
+                }
+            }
+        }
+        #pragma omp simd
+        for(j=0; j<dm[3]*MRF_BLOCK; j++) e[j] *= -0.0625f;
+    }
+
+    /* q = (p.*exp(e))/sum(p.*exp(e)) */
+    for(j=0; j<nb; j++) se[j] = 0.0;
+    for(k=0; k<dm[3]; k++)
+    {
+        float *ek = e + k*MRF_BLOCK, *pk = p + o + k*m;
+        exp_block(nb, ek);
+        #pragma omp simd
+        for(j=0; j<nb; j++)
+        {
+            ek[j] *= pk[2*j];
+            se[j] += ek[j];
+        }
+    }
+
+    /* Normalise responsibilities to sum to 1
+       and rescale for saving as uint8 data. */
+    #pragma omp simd
+    for(j=0; j<nb; j++) se[j] = 255.0/se[j];
+    for(k=0; k<dm[3]; k++)
+    {
+        float *ek = e + k*MRF_BLOCK;
+        unsigned char *qk = q + o + k*m;
+        #pragma omp simd
+        for(j=0; j<nb; j++) qk[2*j] = (unsigned char)(ek[j]*se[j]+0.5);
+    }
+}
+
+static void mrf1(mwSize dm[], unsigned char q[], float p[], float G[], float w[], int code)
+{
+    mwSize m = dm[0]*dm[1]*dm[2];
+    mwSignedIndex r, nr = dm[1]*dm[2];
+    int it, nt = (m>=PAR_MIN) ? omp_get_max_threads() : 1;
+    float *buf;
 
     /* Use a red-black scheme, so the updates are for
        alternating voxels.  Then do another pass to
@@ -27,187 +270,30 @@ static void mrf1(mwSize dm[], unsigned char q[], float p[], float G[], float w[]
        of each type (stored in vector a), and using the
        connectivity matrix (G) to update with:
            q = (p.*exp(G'*a))/sum((p.*exp(G'*a))
+
+       All the neighbours of a voxel are of the other colour,
+       so the voxels of one colour can be updated in any order.
+       The rows are shared among threads, and the results do
+       not depend on the number of threads.
     */
-    for(it=0; it<2; it++) 
+    buf = (float *)mxMalloc(sizeof(float)*(2*dm[3]+1)*MRF_BLOCK*nt);
+    for(it=0; it<2; it++)
     {
-        mwSize i2start = it%2;
-        for(i2=0; i2<dm[2]; i2++) /* Inferior -> Superior */
+        #pragma omp parallel for schedule(static) num_threads(nt) if(nt>1)
+        for(r=0; r<nr; r++)
         {
-            mwSize i1start = (i2start == (i2%2));
-            for(i1=0; i1<dm[1]; i1++) /* Posterior -> Anterior */
-            {
-                mwSize i0start = (i1start == (i1%2));
-                p1 = p + dm[0]*(i1+dm[1]*i2);
-                q1 = q + dm[0]*(i1+dm[1]*i2);
+            mwSize i1 = r%dm[1], i2 = r/dm[1], i0, nb;
+            float *tb = buf + (2*dm[3]+1)*MRF_BLOCK*omp_get_thread_num();
 
-                for(i0=i0start; i0<dm[0]; i0+=2) /* Left -> Right */
-                {
-                    float se;
-                    unsigned char *qq = NULL;
-
-                    /* Pointers to current voxel in first volume */
-                    p0 = p1 + i0;
-                    q0 = q1 + i0;
-
-                    /* Initialise neighbour counts to zero */
-                    for(k=0; k<dm[3]; k++) a[k] = 0.0;
-
-                    /* Count neighbours of each class */
-                    if(i2>0)       /* Inferior */
-                    {
-
-                        qq = q0 - dm[0]*dm[1];
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[2];
-                    }
-
-                    if(i2<dm[2]-1) /* Superior */
-                    {
-                        qq = q0 + dm[0]*dm[1];
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[2];
-                    }
-
-                    if(i1>0)       /* Posterior */
-                    {
-                        qq = q0 - dm[0];
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[1];
-                    }
-
-                    if(i1<dm[1]-1) /* Anterior */
-                    {
-                        qq = q0 + dm[0];
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[1];
-                    }
-
-                    if(i0>0)       /* Left */
-                    {
-                        qq = q0 - 1;
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[0];
-                    }
-
-                    if(i0<dm[0]-1) /* Right */
-                    {
-                        qq = q0 + 1;
-                        for(k=0; k<dm[3]; k++) a[k] += qq[k*m]*w[0];
-                    }
-
-                    /* Responsibility data is uint8, so correct scaling.
-                       Note also that data is divided by 6 (the number
-                       of neighbours examined). */
-                    for(k=0; k<dm[3]; k++)
-                        a[k]/=(255.0*6.0);
-
-                    if (code == 1) 
-                    {
-                        /* Weights are in the form of a matrix,
-                           shared among all voxels. */
-                        float *g;
-                        se = 0.0;
-                        for(k=0, g=G; k<dm[3]; k++)
-                        {
-                            e[k] = 0;
-                            for(n=0; n<dm[3]; n++, g++)
-                                e[k] += (*g)*a[n];
-                            e[k] = exp((double)e[k])*p0[k*m];
-                            se  += e[k];
-                        }
-                    }
-                    else if (code == 2)
-                    {
-                        /* Weights are assumed to be a diagonal matrix,
-                           so only the diagonal elements are passed. */
-                        se = 0.0;
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            e[k] = exp((double)(G[k]*a[k]))*p0[k*m];
-                            se  += e[k];
-                        }
-                    }
-                    else if (code == 3)
-                    {
-                        /* Separate weights for each voxel, in the form of
-                           the full matrix (loads of memory). */
-                        float *g;
-                        se = 0.0;
-                        g = G + i0+dm[0]*(i1+dm[1]*i2);
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            e[k] = 0.0;
-                            for(n=0; n<dm[3]; n++, g+=m)
-                                e[k] += (*g)*a[n];
-                            e[k] = exp((double)e[k])*p0[k*m];
-                            se  += e[k];
-                        }
-                    }
-                    else if (code == 4)
-                    {
-                        /* Separate weight matrices for each voxel,
-                           where the matrices are assumed to be symmetric
-                           with zeros on the diagonal. For a 4x4
-                           matrix, the elements are ordered as
-                           (2,1), (3,1), (4,1), (3,2), (4,2), (4,3).
-                         */
-                        float *g;
-                        g = G + i0+dm[0]*(i1+dm[1]*i2);
-                        for(k=0; k<dm[3]; k++) e[k] = 0.0;
-
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            for(n=k+1; n<dm[3]; n++, g+=m)
-                            {
-                                e[k] += (*g)*a[n];
-                                e[n] += (*g)*a[k];
-                            }
-                        }
-                        se = 0.0;
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            e[k] = exp((double)e[k])*p0[k*m];
-                            se  += e[k];
-                        }
-                    }
-                    else if (code == 5)
-                    {
-                        /* Separate weight matrices for each voxel,
-                           where the matrices are assumed to be symmetric
-                           with zeros on the diagonal. For a 4x4
-                           matrix, the elements are ordered as
-                           (2,1), (3,1), (4,1), (3,2), (4,2), (4,3).
-                           
-                           The weight matrices are encoded as uint8, and
-                           their values need to be scaled by -0.0625 to
-                           bring them into a reasonable range.
-                         */
-                        unsigned char *g;
-                        g = (unsigned char *)G + i0+dm[0]*(i1+dm[1]*i2);
-                        for(k=0; k<dm[3]; k++) e[k] = 0.0;
-
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            for(n=k+1; n<dm[3]; n++, g+=m)
-                            {
-                                e[k] += ((float)(*g))*a[n];
-                                e[n] += ((float)(*g))*a[k];
-                            }
-                        }
-                        se = 0.0;
-                        for(k=0; k<dm[3]; k++)
-                        {
-                            e[k] = exp(-0.0625*e[k])*p0[k*m];
-                            se  += e[k];
-                        }
-                    }
-
-
-                    /* Normalise responsibilities to sum to 1
-                       and rescale for saving as uint8 data. */
-                    se = 255.0/se;
-                    for(k=0; k<dm[3]; k++)
-                        q0[k*m] = (unsigned char)(e[k]*se+0.5);
-
-                }
+            for(i0=(it+i1+i2)%2; i0<dm[0]; i0+=2*nb)
+            {
+                nb = (dm[0]-i0+1)/2;
+                if (nb>MRF_BLOCK) nb = MRF_BLOCK;
+                mrf_block(dm, q, p, G, w, code, i0, i1, i2, nb, tb);
             }
         }
     }
+    mxFree(buf);
 }
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
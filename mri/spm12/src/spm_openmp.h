@@ -0,0 +1,20 @@
+/*
+ * $Id$
+ */
+
+/* Allow the same code to be compiled with or without OpenMP support
+   (see USE_OPENMP in Makefile.var). Without it, the omp pragmas are
+   ignored and everything runs in a single thread. */
+
+#ifndef _SPM_OPENMP_H_
+#define _SPM_OPENMP_H_
+
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_max_threads() 1
+#define omp_get_thread_num()  0
+#define omp_in_parallel()     0
+#endif
+
+#endif /* _SPM_OPENMP_H_ */